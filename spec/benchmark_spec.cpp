@@ -0,0 +1,502 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+#include "crystalize.h"
+#include "fixup.h"
+#if !defined(_WIN32)
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Benchmarks are hidden from the default run. Use `test_runner [benchmark]` to run them.
+
+namespace {
+  struct bench_init_t {
+    bench_init_t() {
+      crystalize_config_t config;
+      crystalize_config_init(&config);
+      crystalize_init(&config);
+    }
+    ~bench_init_t() {
+      crystalize_shutdown();
+    }
+  };
+
+  struct node_t {
+    uint32_t value_count;
+    float* values;
+  };
+
+  struct graph_t {
+    uint32_t node_count;
+    node_t* nodes;
+  };
+
+  // A root holding `node_count` nodes, each with a pointer to its own value. That is node_count + 1 pointers to
+  // distinct addresses in the data section.
+  struct graph_fixture_t {
+    crystalize_schema_t node_schema;
+    crystalize_schema_field_t node_fields[2];
+    crystalize_schema_t graph_schema;
+    crystalize_schema_field_t graph_fields[2];
+    std::vector<float> values;
+    std::vector<node_t> nodes;
+    graph_t graph;
+
+    graph_fixture_t(uint32_t node_count)
+        : values(node_count)
+        , nodes(node_count) {
+      crystalize_schema_field_init_scalar(node_fields + 0, "value_count", CRYSTALIZE_UINT32, 1);
+      crystalize_schema_field_init_counted_scalar(node_fields + 1, "values", CRYSTALIZE_FLOAT, "value_count");
+      crystalize_schema_init(&node_schema, "node", 0, node_fields, 2);
+      crystalize_schema_add(&node_schema);
+      crystalize_schema_field_init_scalar(graph_fields + 0, "node_count", CRYSTALIZE_UINT32, 1);
+      crystalize_schema_field_init_counted_struct(graph_fields + 1, "nodes", &node_schema, "node_count");
+      crystalize_schema_init(&graph_schema, "graph", 0, graph_fields, 2);
+      crystalize_schema_add(&graph_schema);
+
+      for (uint32_t index = 0; index < node_count; ++index) {
+        values[index] = (float)index;
+        nodes[index].value_count = 1;
+        nodes[index].values = &values[index];
+      }
+      graph.node_count = node_count;
+      graph.nodes = nodes.data();
+    }
+  };
+} // namespace
+
+TEST_CASE("encode pointer-heavy graphs", "[.][benchmark]") {
+  const uint32_t sizes[] = {1000, 10000, 100000, 500000};
+  for (uint32_t size : sizes) {
+    bench_init_t init;
+    graph_fixture_t fixture(size);
+
+    crystalize_encode_result_t result;
+    BENCHMARK("encode graph with " + std::to_string(size) + " pointers") {
+      crystalize_encode(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, &result);
+      crystalize_encode_result_free(&result);
+    }
+  }
+}
+
+TEST_CASE("encode with threads", "[.][benchmark]") {
+  bench_init_t init;
+  graph_fixture_t fixture(2000000);
+
+  const uint32_t thread_counts[] = {1, 2, 4, 8, 16, 32};
+  for (uint32_t thread_count : thread_counts) {
+    crystalize_encode_options_t options;
+    crystalize_encode_options_init(&options);
+    options.thread_count = thread_count;
+    crystalize_encode_result_t result;
+    BENCHMARK("encode graph with 2M pointers on " + std::to_string(thread_count) + " threads") {
+      crystalize_encode_ex(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, &options, &result);
+      crystalize_encode_result_free(&result);
+    }
+  }
+}
+
+TEST_CASE("encode many small messages", "[.][benchmark]") {
+  bench_init_t init;
+  graph_fixture_t fixture(16);
+
+  // the same number of messages for both, so the timings are directly comparable
+  const uint32_t message_count = 10000;
+  crystalize_encode_result_t result;
+  BENCHMARK("encode 10k small messages one-shot") {
+    for (uint32_t index = 0; index < message_count; ++index) {
+      crystalize_encode(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, &result);
+      crystalize_encode_result_free(&result);
+    }
+  }
+
+  crystalize_encoder_t* encoder = crystalize_encoder_create();
+  BENCHMARK("encode 10k small messages with a reused encoder") {
+    for (uint32_t index = 0; index < message_count; ++index) {
+      crystalize_encoder_encode(encoder, fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, NULL, &result);
+      crystalize_encode_result_free(&result);
+    }
+  }
+  crystalize_encoder_destroy(encoder);
+}
+
+TEST_CASE("schema lookup", "[.][benchmark]") {
+  const uint32_t sizes[] = {10, 1000, 100000};
+  for (uint32_t size : sizes) {
+    bench_init_t init;
+
+    std::vector<uint32_t> name_ids(size);
+    for (uint32_t index = 0; index < size; ++index) {
+      const std::string name = "schema_" + std::to_string(index);
+      crystalize_schema_field_t field;
+      crystalize_schema_t schema;
+      crystalize_schema_field_init_scalar(&field, "value", CRYSTALIZE_UINT32, 1);
+      crystalize_schema_init(&schema, name.c_str(), index % 4, &field, 1);
+      REQUIRE(crystalize_schema_add(&schema) == CRYSTALIZE_ERROR_NONE);
+      name_ids[index] = schema.name_id;
+    }
+
+    // the same number of lookups regardless of the registry size, so the timings are directly comparable
+    const uint32_t lookup_count = 1000000;
+    uint32_t found = 0;
+    BENCHMARK("1M schema lookups with " + std::to_string(size) + " schemas registered") {
+      for (uint32_t index = 0; index < lookup_count; ++index) {
+        const uint32_t schema_index = (index * 2654435761u) % size;
+        found += crystalize_schema_get(name_ids[schema_index], schema_index % 4) != NULL ? 1 : 0;
+      }
+    }
+    CHECK(found % lookup_count == 0);
+  }
+}
+
+TEST_CASE("encode plain struct arrays", "[.][benchmark]") {
+  struct vertex_t {
+    float position[3];
+    float normal[3];
+    float uv[2];
+  };
+  struct mesh_t {
+    uint32_t vertex_count;
+    vertex_t* vertices;
+  };
+
+  bench_init_t init;
+  crystalize_schema_t vertex_schema;
+  crystalize_schema_field_t vertex_fields[3];
+  crystalize_schema_field_init_scalar(vertex_fields + 0, "position", CRYSTALIZE_FLOAT, 3);
+  crystalize_schema_field_init_scalar(vertex_fields + 1, "normal", CRYSTALIZE_FLOAT, 3);
+  crystalize_schema_field_init_scalar(vertex_fields + 2, "uv", CRYSTALIZE_FLOAT, 2);
+  crystalize_schema_init(&vertex_schema, "vertex", 0, vertex_fields, 3);
+  crystalize_schema_add(&vertex_schema);
+  crystalize_schema_t mesh_schema;
+  crystalize_schema_field_t mesh_fields[2];
+  crystalize_schema_field_init_scalar(mesh_fields + 0, "vertex_count", CRYSTALIZE_UINT32, 1);
+  crystalize_schema_field_init_counted_struct(mesh_fields + 1, "vertices", &vertex_schema, "vertex_count");
+  crystalize_schema_init(&mesh_schema, "mesh", 0, mesh_fields, 2);
+  crystalize_schema_add(&mesh_schema);
+
+  const uint32_t vertex_count = 4000000;
+  std::vector<vertex_t> vertices(vertex_count);
+  for (uint32_t index = 0; index < vertex_count; ++index) {
+    vertices[index].position[0] = (float)index;
+  }
+  mesh_t mesh;
+  mesh.vertex_count = vertex_count;
+  mesh.vertices = vertices.data();
+
+  crystalize_encode_result_t result;
+  BENCHMARK("encode 4M vertices (128 MB)") {
+    crystalize_encode(mesh_schema.name_id, mesh_schema.version, &mesh, &result);
+    crystalize_encode_result_free(&result);
+  }
+
+  crystalize_encode_options_t options;
+  crystalize_encode_options_init(&options);
+  options.exact_size = true;
+  BENCHMARK("encode 4M vertices (128 MB) with an exact-size pre-pass") {
+    crystalize_encode_ex(mesh_schema.name_id, mesh_schema.version, &mesh, &options, &result);
+    crystalize_encode_result_free(&result);
+  }
+
+  // only the largest single object is ever buffered, here the vertex array itself
+  auto discard = [](void*, const void*, uint32_t) -> bool { return true; };
+  BENCHMARK("stream 4M vertices (128 MB) to a write handler") {
+    crystalize_encode_to_handler(mesh_schema.name_id, mesh_schema.version, &mesh, discard, NULL, &result);
+  }
+}
+
+TEST_CASE("fix up pointers", "[.][benchmark]") {
+  bench_init_t init;
+
+  struct bench_size_t {
+    const char* name;
+    uint32_t count;
+    int runs;
+  };
+  // one that stays in cache and one (128 MB of slots) that's bound by memory
+  const bench_size_t sizes[] = {
+      {"64K", 64 * 1024, 200},
+      {"16M", 16 * 1024 * 1024, 5},
+  };
+  std::printf("\n");
+  for (const bench_size_t& size : sizes) {
+    // slots pointing all over the buffer, listed in order like the encoder writes them
+    const uint32_t count = size.count;
+    std::vector<int64_t> original(count);
+    std::vector<uint32_t> table(count);
+    for (uint32_t index = 0; index < count; ++index) {
+      const uint32_t dest = (uint32_t)(((uint64_t)index * 2654435761u) % count);
+      original[index] = ((int64_t)dest - (int64_t)index) * 8;
+      table[index] = index * 8;
+    }
+
+    // the slots have to be reset between runs, so time them by hand
+    std::vector<int64_t> slots(count);
+    for (int impl = 0; impl < FIXUP_IMPL_COUNT; ++impl) {
+      if (!fixup_impl_supported((fixup_impl_t)impl)) {
+        continue;
+      }
+      double best_s = 1e9;
+      for (int run = 0; run < size.runs; ++run) {
+        std::memcpy(slots.data(), original.data(), count * sizeof(int64_t));
+        const auto start = std::chrono::steady_clock::now();
+        const crystalize_error_t error = fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), count * 8, table.data(), count, 0);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        REQUIRE(error == CRYSTALIZE_ERROR_NONE);
+        best_s = elapsed.count() < best_s ? elapsed.count() : best_s;
+      }
+      std::printf("fix up %s pointers %-8s %8.3f ms  %8.1f M pointers/s\n", size.name, fixup_impl_name((fixup_impl_t)impl), best_s * 1e3, count / best_s / 1e6);
+    }
+  }
+}
+
+TEST_CASE("fix up pointers on threads", "[.][benchmark]") {
+  bench_init_t init;
+
+  // 64M slots (512 MB)
+  const uint32_t count = 64 * 1024 * 1024;
+  std::vector<int64_t> original(count);
+  std::vector<uint32_t> table(count);
+  for (uint32_t index = 0; index < count; ++index) {
+    const uint32_t dest = (uint32_t)(((uint64_t)index * 2654435761u) % count);
+    original[index] = ((int64_t)dest - (int64_t)index) * 8;
+    table[index] = index * 8;
+  }
+
+  std::vector<int64_t> slots(count);
+  std::printf("\n");
+  const uint32_t thread_counts[] = {1, 2, 4, 8, 16};
+  for (uint32_t thread_count : thread_counts) {
+    double best_s = 1e9;
+    for (int run = 0; run < 3; ++run) {
+      std::memcpy(slots.data(), original.data(), (size_t)count * sizeof(int64_t));
+      const auto start = std::chrono::steady_clock::now();
+      const crystalize_error_t error = fixup_apply_parallel((char*)slots.data(), count * 8, table.data(), count, 0, thread_count, NULL, NULL);
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      REQUIRE(error == CRYSTALIZE_ERROR_NONE);
+      best_s = elapsed.count() < best_s ? elapsed.count() : best_s;
+    }
+    std::printf("fix up 64M pointers on %2u threads %8.3f ms  %8.1f M pointers/s\n", thread_count, best_s * 1e3, count / best_s / 1e6);
+  }
+}
+
+TEST_CASE("decode with a compact pointer table", "[.][benchmark]") {
+  bench_init_t init;
+  graph_fixture_t fixture(2000000);
+
+  crystalize_encode_result_t plain;
+  crystalize_encode(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, &plain);
+  REQUIRE(plain.error == CRYSTALIZE_ERROR_NONE);
+  crystalize_encode_options_t options;
+  crystalize_encode_options_init(&options);
+  options.compact_pointer_table = true;
+  crystalize_encode_result_t compact;
+  crystalize_encode_ex(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, &options, &compact);
+  REQUIRE(compact.error == CRYSTALIZE_ERROR_NONE);
+
+  // each decode needs a fresh copy, which costs about the same either way
+  std::vector<char> buf(plain.buf_size);
+  BENCHMARK("copy and decode 2M nodes") {
+    std::memcpy(buf.data(), plain.buf, plain.buf_size);
+    crystalize_decode_result_t decode_result;
+    crystalize_decode(fixture.graph_schema.name_id, fixture.graph_schema.version, buf.data(), plain.buf_size, &decode_result);
+  }
+  BENCHMARK("copy and decode 2M nodes with a compact pointer table") {
+    std::memcpy(buf.data(), compact.buf, compact.buf_size);
+    crystalize_decode_result_t decode_result;
+    crystalize_decode(fixture.graph_schema.name_id, fixture.graph_schema.version, buf.data(), compact.buf_size, &decode_result);
+  }
+  std::printf("\n%u bytes with a plain pointer table, %u bytes with a compact one\n", plain.buf_size, compact.buf_size);
+
+  crystalize_encode_result_free(&compact);
+  crystalize_encode_result_free(&plain);
+}
+
+TEST_CASE("decode a copy of a read-only buffer", "[.][benchmark]") {
+  bench_init_t init;
+  graph_fixture_t fixture(2000000);
+  crystalize_encode_result_t result;
+  crystalize_encode(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, &result);
+  REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+
+  std::vector<char> buf(result.buf_size + 16);
+  BENCHMARK("copy 2M nodes, then decode in place") {
+    std::memcpy(buf.data(), result.buf, result.buf_size);
+    crystalize_decode_result_t decode_result;
+    crystalize_decode(fixture.graph_schema.name_id, fixture.graph_schema.version, buf.data(), result.buf_size, &decode_result);
+  }
+  BENCHMARK("decode a copy of 2M nodes into an arena") {
+    crystalize_arena_t arena;
+    crystalize_arena_init(&arena, buf.data(), buf.size());
+    crystalize_decode_result_t decode_result;
+    crystalize_decode_copy(fixture.graph_schema.name_id, fixture.graph_schema.version, result.buf, result.buf_size, &arena, &decode_result);
+  }
+
+  crystalize_encode_result_free(&result);
+}
+
+TEST_CASE("verify a buffer", "[.][benchmark]") {
+  bench_init_t init;
+  graph_fixture_t fixture(2000000);
+  crystalize_encode_result_t result;
+  crystalize_encode(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, &result);
+  REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+
+  // nothing is written, so the same buffer can be verified over and over
+  double best_s = 1e9;
+  for (int run = 0; run < 10; ++run) {
+    const auto start = std::chrono::steady_clock::now();
+    crystalize_decode_result_t verify_result;
+    const bool valid = crystalize_verify(fixture.graph_schema.name_id, fixture.graph_schema.version, result.buf, result.buf_size, NULL, &verify_result);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(valid);
+    best_s = elapsed.count() < best_s ? elapsed.count() : best_s;
+  }
+  std::printf("\nverify 2M nodes (%u bytes) %8.3f ms  %6.2f GB/s\n", result.buf_size, best_s * 1e3, result.buf_size / best_s / 1e9);
+
+  std::vector<char> buf(result.buf_size);
+  BENCHMARK("copy and decode 2M nodes, for comparison") {
+    std::memcpy(buf.data(), result.buf, result.buf_size);
+    crystalize_decode_result_t decode_result;
+    crystalize_decode(fixture.graph_schema.name_id, fixture.graph_schema.version, buf.data(), result.buf_size, &decode_result);
+  }
+
+  crystalize_encode_result_free(&result);
+}
+
+#if !defined(_WIN32)
+TEST_CASE("load a file", "[.][benchmark]") {
+  bench_init_t init;
+  graph_fixture_t fixture(2000000);
+
+  char path[] = "/tmp/crystalize_bench_XXXXXX";
+  const int fd = mkstemp(path);
+  REQUIRE(fd >= 0);
+  unlink(path);
+  crystalize_encode_result_t result;
+  crystalize_encode_to_file(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, fd, NULL, &result);
+  REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+
+  BENCHMARK("read() 2M nodes and decode") {
+    std::vector<char> buf(result.buf_size);
+    pread(fd, buf.data(), buf.size(), 0);
+    crystalize_decode_result_t decode_result;
+    crystalize_decode(fixture.graph_schema.name_id, fixture.graph_schema.version, buf.data(), result.buf_size, &decode_result);
+  }
+
+  struct variant_t {
+    const char* name;
+    bool populate;
+    bool advise;
+  };
+  const variant_t variants[] = {
+      {"map 2M nodes", false, false},
+      {"map 2M nodes with madvise", false, true},
+      {"map 2M nodes with MAP_POPULATE", true, false},
+  };
+  crystalize_map_stats_t stats[3];
+  for (int index = 0; index < 3; ++index) {
+    const variant_t& variant = variants[index];
+    crystalize_map_options_t options;
+    crystalize_map_options_init(&options);
+    options.populate = variant.populate;
+    options.advise = variant.advise;
+    crystalize_mapped_file_t file;
+    BENCHMARK(variant.name) {
+      crystalize_map_file(fixture.graph_schema.name_id, fixture.graph_schema.version, fd, &options, &file);
+      crystalize_unmap(&file);
+    }
+
+    // the page cache is warm by now, so the faults are all minor
+    crystalize_map_file(fixture.graph_schema.name_id, fixture.graph_schema.version, fd, &options, &file);
+    stats[index] = file.stats;
+    crystalize_unmap(&file);
+  }
+  // the same graph encoded for a base address, so mapping it there leaves nothing to decode
+  char based_path[] = "/tmp/crystalize_bench_XXXXXX";
+  const int based_fd = mkstemp(based_path);
+  REQUIRE(based_fd >= 0);
+  unlink(based_path);
+  crystalize_encode_options_t encode_options;
+  crystalize_encode_options_init(&encode_options);
+  encode_options.base_address = 0x200000000000ull;
+  crystalize_encode_to_file(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, based_fd, &encode_options, &result);
+  REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+  crystalize_map_options_t based_options;
+  crystalize_map_options_init(&based_options);
+  based_options.use_base_address = true;
+  crystalize_mapped_file_t based_file;
+  BENCHMARK("map 2M nodes at their base address") {
+    crystalize_map_file(fixture.graph_schema.name_id, fixture.graph_schema.version, based_fd, &based_options, &based_file);
+    crystalize_unmap(&based_file);
+  }
+  crystalize_map_file(fixture.graph_schema.name_id, fixture.graph_schema.version, based_fd, &based_options, &based_file);
+  const crystalize_map_stats_t based_stats = based_file.stats;
+  const bool at_base_address = based_file.at_base_address;
+  crystalize_unmap(&based_file);
+  close(based_fd);
+
+  std::printf("\n");
+  for (int index = 0; index < 3; ++index) {
+    std::printf("%-32s map %8.3f ms  decode %8.3f ms  %8llu minor faults  %4llu major faults\n",
+                variants[index].name,
+                stats[index].map_ns / 1e6,
+                stats[index].decode_ns / 1e6,
+                (unsigned long long)stats[index].minor_faults,
+                (unsigned long long)stats[index].major_faults);
+  }
+  std::printf("%-32s map %8.3f ms  decode %8.3f ms  %8llu minor faults  %4llu major faults%s\n",
+              "map 2M nodes at a base address",
+              based_stats.map_ns / 1e6,
+              based_stats.decode_ns / 1e6,
+              (unsigned long long)based_stats.minor_faults,
+              (unsigned long long)based_stats.major_faults,
+              at_base_address ? "" : " (relocated)");
+  close(fd);
+}
+
+TEST_CASE("first access to a lazily decoded file", "[.][benchmark]") {
+  bench_init_t init;
+
+  // the time to the first value shouldn't depend on how big the file is
+  const uint32_t node_counts[] = {200000, 4000000};
+  for (uint32_t node_count : node_counts) {
+    graph_fixture_t fixture(node_count);
+    char path[] = "/tmp/crystalize_bench_XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    unlink(path);
+    crystalize_encode_options_t options;
+    crystalize_encode_options_init(&options);
+    options.paged_pointer_table = true;
+    crystalize_encode_result_t result;
+    crystalize_encode_to_file(fixture.graph_schema.name_id, fixture.graph_schema.version, &fixture.graph, fd, &options, &result);
+    REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+
+    const std::string name = std::to_string(node_count / 1000) + "K nodes";
+    BENCHMARK("map " + name + " and read the last value") {
+      crystalize_mapped_file_t file;
+      const graph_t* graph = (const graph_t*)crystalize_map_file(fixture.graph_schema.name_id, fixture.graph_schema.version, fd, NULL, &file);
+      volatile float value = graph->nodes[node_count - 1].values[0];
+      (void)value;
+      crystalize_unmap(&file);
+    }
+    BENCHMARK("map " + name + " lazily and read the last value") {
+      char* buf = (char*)mmap(NULL, result.buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      crystalize_lazy_t lazy;
+      crystalize_decode_result_t decode_result;
+      graph_t* graph = (graph_t*)crystalize_decode_lazy(fixture.graph_schema.name_id, fixture.graph_schema.version, buf, result.buf_size, &lazy, &decode_result);
+      node_t* nodes = CRYSTALIZE_LAZY(&lazy, graph->nodes);
+      volatile float value = CRYSTALIZE_LAZY(&lazy, nodes[node_count - 1].values)[0];
+      (void)value;
+      munmap(buf, result.buf_size);
+    }
+    close(fd);
+  }
+}
+#endif
@@ -1,7 +1,15 @@
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <vector>
 #include "catch.hpp"
 #include "crystalize.h"
+#include "fixup.h"
+#if !defined(_WIN32)
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 // init/shutdown helper if an exception gets thrown
 struct init_t {
@@ -132,7 +140,7 @@ TEST_CASE("encoding") {
       // crystalize_schema_t
       0x20, 0x00, 0x00, 0x00, // name pointer relative offset (8 bytes)
       0x00, 0x00, 0x00, 0x00, // (more pointer)
-      0x1f, 0x00, 0x00, 0x00, // fields pointer relative offset (8 bytes)
+      0x20, 0x00, 0x00, 0x00, // fields pointer relative offset (8 bytes)
       0x00, 0x00, 0x00, 0x00, // (more pointer)
       0x07, 0x00, 0x00, 0x00, // name_size
       0x02, 0x00, 0x00, 0x00, // field_count
@@ -289,4 +297,1907 @@ TEST_CASE("encoding") {
 
     crystalize_encode_result_free(&buf_result);
   }
+
+  SECTION("it encodes a counted pointer whose count follows a struct array field") {
+    struct inner_t {
+      uint8_t a;
+      uint64_t b;
+    };
+    struct root_t {
+      inner_t inner[2];
+      uint16_t values_count;
+      int32_t* values;
+    };
+    crystalize_schema_t schema_inner;
+    crystalize_schema_field_t schema_inner_fields[2];
+    crystalize_schema_field_init_scalar(schema_inner_fields + 0, "a", CRYSTALIZE_UINT8, 1);
+    crystalize_schema_field_init_scalar(schema_inner_fields + 1, "b", CRYSTALIZE_UINT64, 1);
+    crystalize_schema_init(&schema_inner, "inner", 0, schema_inner_fields, 2);
+    crystalize_schema_add(&schema_inner);
+    crystalize_schema_t schema_root;
+    crystalize_schema_field_t schema_root_fields[3];
+    crystalize_schema_field_init_struct(schema_root_fields + 0, "inner", &schema_inner, 2);
+    crystalize_schema_field_init_scalar(schema_root_fields + 1, "values_count", CRYSTALIZE_UINT16, 1);
+    crystalize_schema_field_init_counted_scalar(schema_root_fields + 2, "values", CRYSTALIZE_INT32, "values_count");
+    crystalize_schema_init(&schema_root, "root", 0, schema_root_fields, 3);
+    crystalize_schema_add(&schema_root);
+
+    int32_t values[3] = {-1, 0, 1};
+    root_t data;
+    data.inner[0].a = 1;
+    data.inner[0].b = 2;
+    data.inner[1].a = 3;
+    data.inner[1].b = 4;
+    data.values_count = 3;
+    data.values = values;
+
+    // encode it
+    crystalize_encode_result_t buf_result;
+    crystalize_encode(schema_root.name_id, schema_root.version, &data, &buf_result);
+    CHECK(buf_result.error == CRYSTALIZE_ERROR_NONE);
+
+    // decode it back
+    crystalize_decode_result_t decode_result;
+    root_t* decoded = (root_t*)crystalize_decode(schema_root.name_id, schema_root.version, buf_result.buf, buf_result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    CHECK(decoded->inner[0].a == 1);
+    CHECK(decoded->inner[0].b == 2);
+    CHECK(decoded->inner[1].a == 3);
+    CHECK(decoded->inner[1].b == 4);
+    REQUIRE(decoded->values_count == 3);
+    CHECK(decoded->values[0] == -1);
+    CHECK(decoded->values[1] == 0);
+    CHECK(decoded->values[2] == 1);
+
+    crystalize_encode_result_free(&buf_result);
+  }
+
+  SECTION("it computes the exact encoded size up front") {
+    struct root_t {
+      char a;
+      int16_t b_count;
+      float* b;
+    };
+    crystalize_schema_t schema;
+    crystalize_schema_field_t fields[3];
+    crystalize_schema_field_init_scalar(fields + 0, "a", CRYSTALIZE_CHAR, 1);
+    crystalize_schema_field_init_scalar(fields + 1, "b_count", CRYSTALIZE_INT16, 1);
+    crystalize_schema_field_init_counted_scalar(fields + 2, "b", CRYSTALIZE_FLOAT, "b_count");
+    crystalize_schema_init(&schema, "root", 0, fields, 3);
+    crystalize_schema_add(&schema);
+
+    float values[5] = {1.0f, 2.0f, 3.0f, 4.0f, 5.0f};
+    root_t data;
+    data.a = 'a';
+    data.b_count = 5;
+    data.b = values;
+
+    crystalize_encode_result_t size_result;
+    crystalize_encode_size(schema.name_id, schema.version, &data, &size_result);
+    CHECK(size_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(size_result.buf == NULL);
+
+    crystalize_encode_result_t buf_result;
+    crystalize_encode(schema.name_id, schema.version, &data, &buf_result);
+    CHECK(buf_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(size_result.buf_size == buf_result.buf_size);
+
+    // the two-pass mode produces the same bytes
+    crystalize_encode_options_t options;
+    crystalize_encode_options_init(&options);
+    options.exact_size = true;
+    crystalize_encode_result_t exact_result;
+    crystalize_encode_ex(schema.name_id, schema.version, &data, &options, &exact_result);
+    CHECK(exact_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(exact_result == buf_result);
+
+    crystalize_encode_result_free(&size_result);
+    crystalize_encode_result_free(&exact_result);
+    crystalize_encode_result_free(&buf_result);
+  }
+
+  SECTION("it encodes into a caller buffer using only scratch memory") {
+    struct root_t {
+      uint32_t values_count;
+      int32_t* values;
+    };
+    crystalize_schema_t schema;
+    crystalize_schema_field_t fields[2];
+    crystalize_schema_field_init_scalar(fields + 0, "values_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(fields + 1, "values", CRYSTALIZE_INT32, "values_count");
+    crystalize_schema_init(&schema, "root", 0, fields, 2);
+    crystalize_schema_add(&schema);
+
+    int32_t values[4] = {1, -2, 3, -4};
+    root_t data;
+    data.values_count = 4;
+    data.values = values;
+
+    crystalize_encode_result_t expected;
+    crystalize_encode(schema.name_id, schema.version, &data, &expected);
+    CHECK(expected.error == CRYSTALIZE_ERROR_NONE);
+
+    std::vector<char> scratch_buf(64 * 1024);
+    crystalize_arena_t scratch;
+    crystalize_arena_init(&scratch, scratch_buf.data(), scratch_buf.size());
+
+    // a buffer that's big enough gets the same bytes and the scratch is handed back
+    std::vector<char> buf(expected.buf_size + 64);
+    crystalize_encode_result_t result;
+    crystalize_encode_into(schema.name_id, schema.version, &data, buf.data(), (uint32_t)buf.size(), &scratch, &result);
+    CHECK(result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(result.buf == NULL);
+    REQUIRE(result.buf_size == expected.buf_size);
+    CHECK(memcmp(buf.data(), expected.buf, expected.buf_size) == 0);
+    CHECK(scratch.used == 0);
+
+    // a buffer that's too small reports the size that's needed
+    crystalize_encode_into(schema.name_id, schema.version, &data, buf.data(), 16, &scratch, &result);
+    CHECK(result.error == CRYSTALIZE_ERROR_BUFFER_TOO_SMALL);
+    CHECK(result.buf_size == expected.buf_size);
+
+    // not enough scratch memory is an error rather than a fallback to the alloc handler
+    crystalize_arena_init(&scratch, scratch_buf.data(), 64);
+    crystalize_encode_into(schema.name_id, schema.version, &data, buf.data(), (uint32_t)buf.size(), &scratch, &result);
+    CHECK(result.error == CRYSTALIZE_ERROR_SCRATCH_EXHAUSTED);
+
+    crystalize_encode_result_free(&expected);
+  }
+
+  SECTION("it reuses an encoder across encodes and root schemas") {
+    struct child_t {
+      uint8_t value;
+    };
+    struct root_t {
+      uint32_t children_count;
+      child_t* children;
+    };
+    crystalize_schema_t child_schema;
+    crystalize_schema_field_t child_fields[1];
+    crystalize_schema_field_init_scalar(child_fields + 0, "value", CRYSTALIZE_UINT8, 1);
+    crystalize_schema_init(&child_schema, "child", 0, child_fields, 1);
+    crystalize_schema_add(&child_schema);
+    crystalize_schema_t root_schema;
+    crystalize_schema_field_t root_fields[2];
+    crystalize_schema_field_init_scalar(root_fields + 0, "children_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(root_fields + 1, "children", &child_schema, "children_count");
+    crystalize_schema_init(&root_schema, "root", 0, root_fields, 2);
+    crystalize_schema_add(&root_schema);
+
+    child_t children[3] = {{1}, {2}, {3}};
+    root_t root;
+    root.children_count = 3;
+    root.children = children;
+
+    crystalize_encode_result_t expected_root;
+    crystalize_encode(root_schema.name_id, root_schema.version, &root, &expected_root);
+    crystalize_encode_result_t expected_child;
+    crystalize_encode(child_schema.name_id, child_schema.version, children, &expected_child);
+
+    crystalize_encoder_t* encoder = crystalize_encoder_create();
+    for (int pass = 0; pass < 3; ++pass) {
+      crystalize_encode_result_t result;
+      crystalize_encoder_encode(encoder, root_schema.name_id, root_schema.version, &root, NULL, &result);
+      CHECK(result == expected_root);
+      crystalize_encode_result_free(&result);
+
+      crystalize_encoder_encode(encoder, child_schema.name_id, child_schema.version, children, NULL, &result);
+      CHECK(result == expected_child);
+      crystalize_encode_result_free(&result);
+
+      if (pass == 1) {
+        crystalize_encoder_reset(encoder);
+      }
+    }
+    crystalize_encoder_destroy(encoder);
+
+    crystalize_encode_result_free(&expected_root);
+    crystalize_encode_result_free(&expected_child);
+  }
+
+  SECTION("it encodes arrays of plain structs with zeroed padding") {
+    struct vertex_t {
+      float position[3];
+      uint8_t flags;
+      double weight;
+    };
+    struct mesh_t {
+      uint32_t vertex_count;
+      vertex_t* vertices;
+    };
+    crystalize_schema_t schema_vertex;
+    crystalize_schema_field_t schema_vertex_fields[3];
+    crystalize_schema_field_init_scalar(schema_vertex_fields + 0, "position", CRYSTALIZE_FLOAT, 3);
+    crystalize_schema_field_init_scalar(schema_vertex_fields + 1, "flags", CRYSTALIZE_UINT8, 1);
+    crystalize_schema_field_init_scalar(schema_vertex_fields + 2, "weight", CRYSTALIZE_DOUBLE, 1);
+    crystalize_schema_init(&schema_vertex, "vertex", 0, schema_vertex_fields, 3);
+    crystalize_schema_add(&schema_vertex);
+    crystalize_schema_t schema_mesh;
+    crystalize_schema_field_t schema_mesh_fields[2];
+    crystalize_schema_field_init_scalar(schema_mesh_fields + 0, "vertex_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(schema_mesh_fields + 1, "vertices", &schema_vertex, "vertex_count");
+    crystalize_schema_init(&schema_mesh, "mesh", 0, schema_mesh_fields, 2);
+    crystalize_schema_add(&schema_mesh);
+
+    // fill the padding with different garbage each time; the output must not change
+    crystalize_encode_result_t buf_results[2];
+    for (int pass = 0; pass < 2; ++pass) {
+      vertex_t vertices[16];
+      memset(vertices, pass == 0 ? 0xcc : 0x5a, sizeof(vertices));
+      for (uint32_t index = 0; index < 16; ++index) {
+        vertices[index].position[0] = (float)index;
+        vertices[index].position[1] = (float)index * 2.0f;
+        vertices[index].position[2] = (float)index * 3.0f;
+        vertices[index].flags = (uint8_t)index;
+        vertices[index].weight = index * 0.5;
+      }
+      mesh_t data;
+      memset(&data, pass == 0 ? 0xcc : 0x5a, sizeof(data));
+      data.vertex_count = 16;
+      data.vertices = vertices;
+      crystalize_encode(schema_mesh.name_id, schema_mesh.version, &data, buf_results + pass);
+      CHECK(buf_results[pass].error == CRYSTALIZE_ERROR_NONE);
+    }
+    CHECK(buf_results[0] == buf_results[1]);
+
+    // decode it back
+    crystalize_decode_result_t decode_result;
+    mesh_t* decoded = (mesh_t*)crystalize_decode(schema_mesh.name_id, schema_mesh.version, buf_results[0].buf, buf_results[0].buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    REQUIRE(decoded->vertex_count == 16);
+    for (uint32_t index = 0; index < 16; ++index) {
+      CHECK(decoded->vertices[index].position[0] == (float)index);
+      CHECK(decoded->vertices[index].position[2] == (float)index * 3.0f);
+      CHECK(decoded->vertices[index].flags == index);
+      CHECK(decoded->vertices[index].weight == index * 0.5);
+    }
+
+    crystalize_encode_result_free(buf_results + 0);
+    crystalize_encode_result_free(buf_results + 1);
+  }
+
+  SECTION("it encodes a struct with many pointed-to children") {
+    struct child_t {
+      uint32_t value_count;
+      uint32_t* values;
+    };
+    struct root_t {
+      uint32_t child_count;
+      child_t* children;
+    };
+    crystalize_schema_t schema_child;
+    crystalize_schema_field_t schema_child_fields[2];
+    crystalize_schema_field_init_scalar(schema_child_fields + 0, "value_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(schema_child_fields + 1, "values", CRYSTALIZE_UINT32, "value_count");
+    crystalize_schema_init(&schema_child, "child", 0, schema_child_fields, 2);
+    crystalize_schema_add(&schema_child);
+    crystalize_schema_t schema_root;
+    crystalize_schema_field_t schema_root_fields[2];
+    crystalize_schema_field_init_scalar(schema_root_fields + 0, "child_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(schema_root_fields + 1, "children", &schema_child, "child_count");
+    crystalize_schema_init(&schema_root, "root", 0, schema_root_fields, 2);
+    crystalize_schema_add(&schema_root);
+
+    const uint32_t child_count = 1000;
+    std::vector<uint32_t> values(child_count * 2);
+    std::vector<child_t> children(child_count);
+    for (uint32_t index = 0; index < child_count; ++index) {
+      values[index * 2 + 0] = index;
+      values[index * 2 + 1] = ~index;
+      children[index].value_count = 2;
+      children[index].values = &values[index * 2];
+    }
+    root_t data;
+    data.child_count = child_count;
+    data.children = children.data();
+
+    // encode it
+    crystalize_encode_result_t buf_result;
+    crystalize_encode(schema_root.name_id, schema_root.version, &data, &buf_result);
+    CHECK(buf_result.error == CRYSTALIZE_ERROR_NONE);
+
+    // decode it back
+    crystalize_decode_result_t decode_result;
+    root_t* decoded = (root_t*)crystalize_decode(schema_root.name_id, schema_root.version, buf_result.buf, buf_result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    REQUIRE(decoded->child_count == child_count);
+    for (uint32_t index = 0; index < child_count; ++index) {
+      REQUIRE(decoded->children[index].value_count == 2);
+      CHECK(decoded->children[index].values[0] == index);
+      CHECK(decoded->children[index].values[1] == ~index);
+    }
+
+    crystalize_encode_result_free(&buf_result);
+  }
+
+  SECTION("it writes a compact pointer table that decodes the same") {
+    struct child_t {
+      uint32_t value_count;
+      uint32_t* values;
+    };
+    struct root_t {
+      uint32_t child_count;
+      child_t* children;
+    };
+    crystalize_schema_t schema_child;
+    crystalize_schema_field_t schema_child_fields[2];
+    crystalize_schema_field_init_scalar(schema_child_fields + 0, "value_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(schema_child_fields + 1, "values", CRYSTALIZE_UINT32, "value_count");
+    crystalize_schema_init(&schema_child, "child", 0, schema_child_fields, 2);
+    crystalize_schema_add(&schema_child);
+    crystalize_schema_t schema_root;
+    crystalize_schema_field_t schema_root_fields[2];
+    crystalize_schema_field_init_scalar(schema_root_fields + 0, "child_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(schema_root_fields + 1, "children", &schema_child, "child_count");
+    crystalize_schema_init(&schema_root, "root", 0, schema_root_fields, 2);
+    crystalize_schema_add(&schema_root);
+
+    // every child points at a single value, some of them far apart
+    const uint32_t child_count = 1000;
+    std::vector<uint32_t> values(child_count);
+    std::vector<child_t> children(child_count);
+    for (uint32_t index = 0; index < child_count; ++index) {
+      values[index] = index;
+      children[index].value_count = 1;
+      children[index].values = &values[index];
+    }
+    root_t data;
+    data.child_count = child_count;
+    data.children = children.data();
+
+    crystalize_encode_result_t plain;
+    crystalize_encode(schema_root.name_id, schema_root.version, &data, &plain);
+    CHECK(plain.error == CRYSTALIZE_ERROR_NONE);
+    crystalize_encode_options_t options;
+    crystalize_encode_options_init(&options);
+    options.compact_pointer_table = true;
+    crystalize_encode_result_t compact;
+    crystalize_encode_ex(schema_root.name_id, schema_root.version, &data, &options, &compact);
+    CHECK(compact.error == CRYSTALIZE_ERROR_NONE);
+
+    // over a thousand pointers that now take a byte or two each
+    CHECK(compact.buf_size + child_count * 2 < plain.buf_size);
+
+    // a truncated table is caught
+    std::vector<char> truncated(compact.buf, compact.buf + compact.buf_size - 1);
+    crystalize_decode_result_t decode_result;
+    CHECK(crystalize_decode(schema_root.name_id, schema_root.version, truncated.data(), (uint32_t)truncated.size(), &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_UNEXPECTED_EOF);
+
+    root_t* decoded = (root_t*)crystalize_decode(schema_root.name_id, schema_root.version, compact.buf, compact.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    REQUIRE(decoded->child_count == child_count);
+    for (uint32_t index = 0; index < child_count; ++index) {
+      REQUIRE(decoded->children[index].value_count == 1);
+      CHECK(decoded->children[index].values[0] == index);
+    }
+
+    // decoding again finds the addresses already in place, but the decoded flag isn't trusted on its own
+    CHECK(crystalize_decode(schema_root.name_id, schema_root.version, compact.buf, compact.buf_size, &decode_result) == decoded);
+    std::vector<char> moved(compact.buf, compact.buf + compact.buf_size);
+    CHECK(crystalize_decode(schema_root.name_id, schema_root.version, moved.data(), (uint32_t)moved.size(), &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_IS_DECODED);
+    std::vector<char> forged(plain.buf, plain.buf + plain.buf_size);
+    forged[13] |= 0x02;
+    CHECK(crystalize_decode(schema_root.name_id, schema_root.version, forged.data(), (uint32_t)forged.size(), &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_IS_DECODED);
+
+    // the same with a base address and an exact size
+    options.base_address = 0x200000000000ull;
+    options.exact_size = true;
+    crystalize_encode_result_t based;
+    crystalize_encode_ex(schema_root.name_id, schema_root.version, &data, &options, &based);
+    CHECK(based.error == CRYSTALIZE_ERROR_NONE);
+    decoded = (root_t*)crystalize_decode(schema_root.name_id, schema_root.version, based.buf, based.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    CHECK(decoded->children[child_count - 1].values[0] == child_count - 1);
+
+    crystalize_encode_result_free(&based);
+    crystalize_encode_result_free(&compact);
+    crystalize_encode_result_free(&plain);
+  }
+
+  SECTION("it fixes up only the pages that are used when decoding lazily") {
+    struct child_t {
+      uint32_t value_count;
+      uint32_t* values;
+    };
+    struct root_t {
+      uint32_t child_count;
+      child_t* children;
+    };
+    crystalize_schema_t schema_child;
+    crystalize_schema_field_t schema_child_fields[2];
+    crystalize_schema_field_init_scalar(schema_child_fields + 0, "value_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(schema_child_fields + 1, "values", CRYSTALIZE_UINT32, "value_count");
+    crystalize_schema_init(&schema_child, "child", 0, schema_child_fields, 2);
+    crystalize_schema_add(&schema_child);
+    crystalize_schema_t schema_root;
+    crystalize_schema_field_t schema_root_fields[2];
+    crystalize_schema_field_init_scalar(schema_root_fields + 0, "child_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(schema_root_fields + 1, "children", &schema_child, "child_count");
+    crystalize_schema_init(&schema_root, "root", 0, schema_root_fields, 2);
+    crystalize_schema_add(&schema_root);
+
+    // the children take up a few dozen pages
+    const uint32_t child_count = 10000;
+    std::vector<uint32_t> values(child_count);
+    std::vector<child_t> children(child_count);
+    for (uint32_t index = 0; index < child_count; ++index) {
+      values[index] = index;
+      children[index].value_count = 1;
+      children[index].values = &values[index];
+    }
+    root_t data;
+    data.child_count = child_count;
+    data.children = children.data();
+
+    crystalize_encode_options_t options;
+    crystalize_encode_options_init(&options);
+    options.paged_pointer_table = true;
+    crystalize_encode_result_t buf_result;
+    crystalize_encode_ex(schema_root.name_id, schema_root.version, &data, &options, &buf_result);
+    CHECK(buf_result.error == CRYSTALIZE_ERROR_NONE);
+    std::vector<char> original(buf_result.buf, buf_result.buf + buf_result.buf_size);
+
+    auto fixed_page_count = [](const crystalize_lazy_t& lazy) {
+      uint32_t count = 0;
+      for (uint32_t page = 0; page < lazy.page_count; ++page) {
+        count += (lazy.fixed_pages[page / 32] >> (page % 32)) & 1;
+      }
+      return count;
+    };
+
+    crystalize_lazy_t lazy;
+    crystalize_decode_result_t decode_result;
+    root_t* root = (root_t*)crystalize_decode_lazy(schema_root.name_id, schema_root.version, buf_result.buf, buf_result.buf_size, &lazy, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(root != NULL);
+    CHECK(lazy.page_count > 20);
+    const uint32_t schema_page_count = fixed_page_count(lazy);
+    CHECK(schema_page_count < 3);
+
+    // reading the last child's value fixes up the root's page and the child's page
+    child_t* lazy_children = CRYSTALIZE_LAZY(&lazy, root->children);
+    CHECK((char*)lazy_children > buf_result.buf);
+    CHECK((char*)lazy_children < buf_result.buf + buf_result.buf_size);
+    CHECK(lazy_children[child_count - 1].value_count == 1);
+    CHECK(CRYSTALIZE_LAZY(&lazy, lazy_children[child_count - 1].values)[0] == child_count - 1);
+    CHECK(fixed_page_count(lazy) <= schema_page_count + 2);
+    CHECK(lazy.error == CRYSTALIZE_ERROR_NONE);
+
+    // decoding the rest afterwards skips what's already done
+    root = (root_t*)crystalize_decode(schema_root.name_id, schema_root.version, buf_result.buf, buf_result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(root != NULL);
+    uint32_t wrong_count = 0;
+    for (uint32_t index = 0; index < child_count; ++index) {
+      wrong_count += root->children[index].values[0] != index;
+    }
+    CHECK(wrong_count == 0);
+
+    // a bad pointer only clears its own page
+    std::vector<char> bad = original;
+    crystalize_lazy_t bad_lazy;
+    root = (root_t*)crystalize_decode_lazy(schema_root.name_id, schema_root.version, bad.data(), (uint32_t)bad.size(), &bad_lazy, &decode_result);
+    REQUIRE(root != NULL);
+    child_t* bad_children = CRYSTALIZE_LAZY(&bad_lazy, root->children);
+    *(int64_t*)&bad_children[child_count - 1].values = (int64_t)bad.size();
+    CHECK(CRYSTALIZE_LAZY(&bad_lazy, bad_children[child_count - 1].values) == NULL);
+    CHECK(bad_lazy.error == CRYSTALIZE_ERROR_POINTER_INVALID);
+    CHECK(CRYSTALIZE_LAZY(&bad_lazy, bad_children[0].values)[0] == 0);
+
+    // a page marked done in the file still has to hold addresses
+    std::vector<char> forged = original;
+    uint32_t table_offset;
+    memcpy(&table_offset, forged.data() + 20, sizeof(uint32_t));
+    forged[table_offset + 4] |= 0x02;
+    CHECK(crystalize_decode_lazy(schema_root.name_id, schema_root.version, forged.data(), (uint32_t)forged.size(), &lazy, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_IS_DECODED);
+    CHECK(crystalize_decode(schema_root.name_id, schema_root.version, forged.data(), (uint32_t)forged.size(), &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_IS_DECODED);
+
+    // pages done by a lazy decode of the same buffer are taken as read, but not those in a copy of it
+    std::vector<char> partly = original;
+    crystalize_lazy_t partly_lazy;
+    root = (root_t*)crystalize_decode_lazy(schema_root.name_id, schema_root.version, partly.data(), (uint32_t)partly.size(), &partly_lazy, &decode_result);
+    REQUIRE(root != NULL);
+    child_t* partly_children = CRYSTALIZE_LAZY(&partly_lazy, root->children);
+    CHECK(CRYSTALIZE_LAZY(&partly_lazy, partly_children[child_count - 1].values)[0] == child_count - 1);
+    CHECK(crystalize_decode_lazy(schema_root.name_id, schema_root.version, partly.data(), (uint32_t)partly.size(), &partly_lazy, &decode_result) == root);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    std::vector<char> partly_copy = partly;
+    CHECK(crystalize_decode_lazy(schema_root.name_id, schema_root.version, partly_copy.data(), (uint32_t)partly_copy.size(), &lazy, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_IS_DECODED);
+
+    // files without a paged table can't be decoded lazily
+    crystalize_encode_result_t plain;
+    crystalize_encode(schema_root.name_id, schema_root.version, &data, &plain);
+    CHECK(crystalize_decode_lazy(schema_root.name_id, schema_root.version, plain.buf, plain.buf_size, &lazy, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_POINTER_TABLE_NOT_PAGED);
+
+    crystalize_encode_result_free(&plain);
+    crystalize_encode_result_free(&buf_result);
+  }
+
+  SECTION("it decodes a copy of a read-only buffer into an arena") {
+    struct child_t {
+      uint32_t value_count;
+      uint32_t* values;
+    };
+    struct root_t {
+      uint32_t child_count;
+      child_t* children;
+    };
+    crystalize_schema_t schema_child;
+    crystalize_schema_field_t schema_child_fields[2];
+    crystalize_schema_field_init_scalar(schema_child_fields + 0, "value_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(schema_child_fields + 1, "values", CRYSTALIZE_UINT32, "value_count");
+    crystalize_schema_init(&schema_child, "child", 0, schema_child_fields, 2);
+    crystalize_schema_add(&schema_child);
+    crystalize_schema_t schema_root;
+    crystalize_schema_field_t schema_root_fields[2];
+    crystalize_schema_field_init_scalar(schema_root_fields + 0, "child_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(schema_root_fields + 1, "children", &schema_child, "child_count");
+    crystalize_schema_init(&schema_root, "root", 0, schema_root_fields, 2);
+    crystalize_schema_add(&schema_root);
+
+    const uint32_t child_count = 10000;
+    std::vector<uint32_t> values(child_count);
+    std::vector<child_t> children(child_count);
+    for (uint32_t index = 0; index < child_count; ++index) {
+      values[index] = index;
+      children[index].value_count = 1;
+      children[index].values = &values[index];
+    }
+    root_t data;
+    data.child_count = child_count;
+    data.children = children.data();
+
+    // every pointer in the copy has to land inside the copy
+    const auto wrong_count = [&](const root_t* root, const char* begin, size_t size) {
+      uint32_t count = 0;
+      for (uint32_t index = 0; index < child_count; ++index) {
+        const char* value = (const char*)root->children[index].values;
+        count += value < begin || value >= begin + size || *(const uint32_t*)value != index;
+      }
+      return count;
+    };
+
+    crystalize_encode_result_t result;
+    crystalize_encode(schema_root.name_id, schema_root.version, &data, &result);
+    REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+    const uint32_t size = result.buf_size;
+
+#if !defined(_WIN32)
+    // any write to the source would fault
+    char* buf = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    REQUIRE(buf != MAP_FAILED);
+    memcpy(buf, result.buf, size);
+    REQUIRE(mprotect(buf, size, PROT_READ) == 0);
+#else
+    const char* buf = result.buf;
+#endif
+
+    // two copies of the same source fit side by side
+    std::vector<char> memory(2 * size + 64);
+    crystalize_arena_t arena;
+    crystalize_arena_init(&arena, memory.data(), memory.size());
+    crystalize_decode_result_t decode_result;
+    const root_t* first = (const root_t*)crystalize_decode_copy(schema_root.name_id, schema_root.version, buf, size, &arena, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(decode_result.buf == NULL);
+    REQUIRE(first != NULL);
+    CHECK(wrong_count(first, memory.data(), memory.size()) == 0);
+    const root_t* second = (const root_t*)crystalize_decode_copy(schema_root.name_id, schema_root.version, buf, size, &arena, &decode_result);
+    REQUIRE(second != NULL);
+    CHECK(second != first);
+    CHECK(wrong_count(second, memory.data() + arena.used - size, size) == 0);
+    CHECK(wrong_count(first, memory.data(), arena.used - size) == 0);
+    CHECK(memcmp(buf, result.buf, size) == 0);
+
+    // a full arena is left as it was
+    const size_t used = arena.used;
+    CHECK(crystalize_decode_copy(schema_root.name_id, schema_root.version, buf, size, &arena, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_BUFFER_TOO_SMALL);
+    CHECK(arena.used == used);
+
+    // without an arena the copy belongs to the result
+    const root_t* owned = (const root_t*)crystalize_decode_copy(schema_root.name_id, schema_root.version, buf, size, NULL, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(owned != NULL);
+    CHECK(wrong_count(owned, decode_result.buf, size) == 0);
+    crystalize_decode_result_free(&decode_result);
+#if !defined(_WIN32)
+    munmap(buf, size);
+#endif
+
+    // the other table formats, a base address, and a source that's already been decoded, fully or lazily
+    crystalize_encode_options_t options;
+    crystalize_encode_options_init(&options);
+    options.compact_pointer_table = true;
+    crystalize_encode_result_t compact;
+    crystalize_encode_ex(schema_root.name_id, schema_root.version, &data, &options, &compact);
+    options.compact_pointer_table = false;
+    options.paged_pointer_table = true;
+    crystalize_encode_result_t paged;
+    crystalize_encode_ex(schema_root.name_id, schema_root.version, &data, &options, &paged);
+    crystalize_lazy_t lazy;
+    root_t* lazy_root = (root_t*)crystalize_decode_lazy(schema_root.name_id, schema_root.version, paged.buf, paged.buf_size, &lazy, &decode_result);
+    REQUIRE(lazy_root != NULL);
+    CHECK(CRYSTALIZE_LAZY(&lazy, CRYSTALIZE_LAZY(&lazy, lazy_root->children)[child_count - 1].values)[0] == child_count - 1);
+    options.paged_pointer_table = false;
+    options.base_address = 0x200000000000ull;
+    crystalize_encode_result_t based;
+    crystalize_encode_ex(schema_root.name_id, schema_root.version, &data, &options, &based);
+    crystalize_encode_result_t decoded;
+    crystalize_encode(schema_root.name_id, schema_root.version, &data, &decoded);
+    REQUIRE(crystalize_decode(schema_root.name_id, schema_root.version, decoded.buf, decoded.buf_size, &decode_result) != NULL);
+    for (const crystalize_encode_result_t* source : {&compact, &paged, &based, &decoded}) {
+      REQUIRE(source->error == CRYSTALIZE_ERROR_NONE);
+      std::vector<char> before(source->buf, source->buf + source->buf_size);
+      const root_t* copy = (const root_t*)crystalize_decode_copy(schema_root.name_id, schema_root.version, source->buf, source->buf_size, NULL, &decode_result);
+      CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+      REQUIRE(copy != NULL);
+      CHECK(wrong_count(copy, decode_result.buf, source->buf_size) == 0);
+      CHECK(memcmp(source->buf, before.data(), before.size()) == 0);
+
+      // the copy is marked decoded, so decoding it again leaves it alone
+      crystalize_decode_result_t again_result;
+      CHECK(crystalize_decode(schema_root.name_id, schema_root.version, decode_result.buf, source->buf_size, &again_result) == copy);
+      CHECK(wrong_count(copy, decode_result.buf, source->buf_size) == 0);
+      crystalize_decode_result_free(&decode_result);
+    }
+
+    // a bad pointer hands the arena's memory back
+    std::vector<char> bad(result.buf, result.buf + size);
+    uint32_t data_offset;
+    memcpy(&data_offset, bad.data() + 16, sizeof(uint32_t));
+    const int64_t out_of_range = (int64_t)size;
+    memcpy(bad.data() + data_offset + offsetof(root_t, children), &out_of_range, sizeof(int64_t));
+    crystalize_arena_init(&arena, memory.data(), memory.size());
+    CHECK(crystalize_decode_copy(schema_root.name_id, schema_root.version, bad.data(), size, &arena, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_POINTER_INVALID);
+    CHECK(arena.used == 0);
+
+    crystalize_encode_result_free(&decoded);
+    crystalize_encode_result_free(&based);
+    crystalize_encode_result_free(&paged);
+    crystalize_encode_result_free(&compact);
+    crystalize_encode_result_free(&result);
+  }
+
+  SECTION("it writes shared objects once and terminates on cycles") {
+    struct node_t {
+      uint32_t value;
+      node_t* next;
+      node_t* parent;
+    };
+    crystalize_schema_t schema;
+    crystalize_schema_field_t fields[3];
+    crystalize_schema_init(&schema, "node", 0, fields, 3);
+    crystalize_schema_field_init_scalar(fields + 0, "value", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_struct_pointer(fields + 1, "next", &schema);
+    crystalize_schema_field_init_struct_pointer(fields + 2, "parent", &schema);
+    REQUIRE(crystalize_schema_add(&schema) == CRYSTALIZE_ERROR_NONE);
+
+    // a ring of three nodes that all share the first one as their parent
+    node_t nodes[3];
+    for (uint32_t index = 0; index < 3; ++index) {
+      nodes[index].value = index;
+      nodes[index].next = &nodes[(index + 1) % 3];
+      nodes[index].parent = &nodes[0];
+    }
+
+    crystalize_encode_result_t buf_result;
+    crystalize_encode(schema.name_id, schema.version, nodes, &buf_result);
+    CHECK(buf_result.error == CRYSTALIZE_ERROR_NONE);
+
+    // one copy of the ring goes out no matter how many ways it can be reached
+    crystalize_encode_result_t single_result;
+    node_t single = {7, NULL, NULL};
+    crystalize_encode(schema.name_id, schema.version, &single, &single_result);
+    CHECK(buf_result.buf_size - single_result.buf_size == 2 * sizeof(node_t) + 6 * sizeof(uint32_t));
+
+    crystalize_decode_result_t decode_result;
+    node_t* decoded = (node_t*)crystalize_decode(schema.name_id, schema.version, buf_result.buf, buf_result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    CHECK(decoded->value == 0);
+    CHECK(decoded->next->value == 1);
+    CHECK(decoded->next->next->value == 2);
+    CHECK(decoded->next->next->next == decoded);
+    CHECK(decoded->parent == decoded);
+    CHECK(decoded->next->parent == decoded);
+    CHECK(decoded->next->next->parent == decoded);
+
+    crystalize_encode_result_free(&single_result);
+    crystalize_encode_result_free(&buf_result);
+  }
+
+  SECTION("it encodes several roots with a directory to look them up by key") {
+    struct mesh_t {
+      uint32_t vertex_count;
+      float* vertices;
+    };
+    struct material_t {
+      uint32_t shader;
+    };
+    crystalize_schema_t schema_mesh;
+    crystalize_schema_field_t schema_mesh_fields[2];
+    crystalize_schema_field_init_scalar(schema_mesh_fields + 0, "vertex_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(schema_mesh_fields + 1, "vertices", CRYSTALIZE_FLOAT, "vertex_count");
+    crystalize_schema_init(&schema_mesh, "mesh", 0, schema_mesh_fields, 2);
+    REQUIRE(crystalize_schema_add(&schema_mesh) == CRYSTALIZE_ERROR_NONE);
+    crystalize_schema_t schema_material;
+    crystalize_schema_field_t schema_material_fields[1];
+    crystalize_schema_field_init_scalar(schema_material_fields + 0, "shader", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_init(&schema_material, "material", 0, schema_material_fields, 1);
+    REQUIRE(crystalize_schema_add(&schema_material) == CRYSTALIZE_ERROR_NONE);
+
+    // both meshes share the same vertices
+    float vertices[64];
+    for (uint32_t index = 0; index < 64; ++index) {
+      vertices[index] = (float)index;
+    }
+    mesh_t mesh_a = {64, vertices};
+    mesh_t mesh_b = {64, vertices};
+    material_t material = {42};
+
+    crystalize_root_t roots[3];
+    roots[0] = {crystalize_root_key("mesh_b"), schema_mesh.name_id, schema_mesh.version, &mesh_b};
+    roots[1] = {7, schema_material.name_id, schema_material.version, &material};
+    roots[2] = {crystalize_root_key("mesh_a"), schema_mesh.name_id, schema_mesh.version, &mesh_a};
+    crystalize_encode_result_t result;
+    crystalize_encode_roots(roots, 3, NULL, &result);
+    CHECK(result.error == CRYSTALIZE_ERROR_NONE);
+
+    // the vertices only go out once
+    crystalize_encode_result_t single_result;
+    crystalize_encode_roots(roots, 1, NULL, &single_result);
+    CHECK(single_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(result.buf_size < single_result.buf_size + sizeof(vertices));
+
+    // the directory changes the layout, so the file gets a version that older readers reject, and a version 0 file with
+    // the flag or a flag this reader doesn't know is malformed
+    uint32_t file_version;
+    memcpy(&file_version, result.buf + 4, sizeof(uint32_t));
+    CHECK(file_version == 1);
+    crystalize_decode_result_t decode_result;
+    std::vector<char> old_version(result.buf, result.buf + result.buf_size);
+    memset(old_version.data() + 4, 0, sizeof(uint32_t));
+    CHECK(crystalize_decode_root(7, schema_material.name_id, schema_material.version, old_version.data(), result.buf_size, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_HEADER_MALFORMED);
+    std::vector<char> unknown_flag(result.buf, result.buf + result.buf_size);
+    unknown_flag[13] |= 0x80;
+    CHECK(crystalize_decode_root(7, schema_material.name_id, schema_material.version, unknown_flag.data(), result.buf_size, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_HEADER_MALFORMED);
+
+    // it's verified by key, and every root is walked since the pointer table covers them all
+    CHECK(crystalize_verify_root(7, schema_material.name_id, schema_material.version, result.buf, result.buf_size, NULL, &decode_result));
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(!crystalize_verify(schema_material.name_id, schema_material.version, result.buf, result.buf_size, NULL, &decode_result));
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_HAS_MULTIPLE_ROOTS);
+    CHECK(!crystalize_verify_root(8, schema_material.name_id, schema_material.version, result.buf, result.buf_size, NULL, &decode_result));
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_ROOT_NOT_FOUND);
+    uint32_t data_offset;
+    uint32_t root_count;
+    memcpy(&data_offset, result.buf + 16, sizeof(uint32_t));
+    memcpy(&root_count, result.buf + data_offset, sizeof(uint32_t));
+    REQUIRE(root_count == 3);
+    std::vector<char> bad_mesh_b(result.buf, result.buf + result.buf_size);
+    for (uint32_t index = 0; index < root_count; ++index) {
+      const char* entry = result.buf + data_offset + 8 + index * 24;
+      uint64_t key;
+      uint32_t offset;
+      memcpy(&key, entry, sizeof(uint64_t));
+      memcpy(&offset, entry + 16, sizeof(uint32_t));
+      if (key == crystalize_root_key("mesh_b")) {
+        const int64_t vertices_offset = (int64_t)result.buf_size;
+        memcpy(bad_mesh_b.data() + offset + offsetof(mesh_t, vertices), &vertices_offset, sizeof(int64_t));
+      }
+    }
+    CHECK(!crystalize_verify_root(7, schema_material.name_id, schema_material.version, bad_mesh_b.data(), result.buf_size, NULL, &decode_result));
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_POINTER_INVALID);
+
+    // the file can only be decoded by key
+    CHECK(crystalize_decode(schema_mesh.name_id, schema_mesh.version, result.buf, result.buf_size, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_HAS_MULTIPLE_ROOTS);
+
+    mesh_t* decoded_a = (mesh_t*)crystalize_decode_root(crystalize_root_key("mesh_a"), schema_mesh.name_id, schema_mesh.version, result.buf, result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded_a != NULL);
+    mesh_t* decoded_b = (mesh_t*)crystalize_decode_root(crystalize_root_key("mesh_b"), schema_mesh.name_id, schema_mesh.version, result.buf, result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded_b != NULL);
+    material_t* decoded_material = (material_t*)crystalize_decode_root(7, schema_material.name_id, schema_material.version, result.buf, result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded_material != NULL);
+    CHECK(decoded_a != decoded_b);
+    CHECK(decoded_a->vertices == decoded_b->vertices);
+    CHECK(decoded_b->vertex_count == 64);
+    CHECK(decoded_b->vertices[63] == 63.0f);
+    CHECK(decoded_material->shader == 42);
+
+    CHECK(crystalize_decode_root(8, schema_material.name_id, schema_material.version, result.buf, result.buf_size, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_ROOT_NOT_FOUND);
+    CHECK(crystalize_decode_root(7, schema_mesh.name_id, schema_mesh.version, result.buf, result.buf_size, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_ROOT_SCHEMA_MISMATCH);
+
+    // the first lookup checked the pointers and stamped the buffer with where it is, so later ones don't look at them
+    float* vertices_a = decoded_a->vertices;
+    decoded_a->vertices = (float*)(uintptr_t)0x4141414141414140ull;
+    CHECK(crystalize_decode_root(7, schema_material.name_id, schema_material.version, result.buf, result.buf_size, &decode_result) == decoded_material);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    decoded_a->vertices = vertices_a;
+    // but a copy carries a stamp for somewhere else, so it's checked and its pointers are into the original
+    std::vector<char> moved(result.buf, result.buf + result.buf_size);
+    CHECK(crystalize_decode_root(7, schema_material.name_id, schema_material.version, moved.data(), result.buf_size, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_FILE_IS_DECODED);
+
+    // keys must be unique
+    crystalize_encode_result_t duplicate_result;
+    roots[1].key = roots[0].key;
+    crystalize_encode_roots(roots, 3, NULL, &duplicate_result);
+    CHECK(duplicate_result.error == CRYSTALIZE_ERROR_ROOT_KEY_DUPLICATED);
+
+    crystalize_encode_result_free(&duplicate_result);
+    crystalize_encode_result_free(&single_result);
+    crystalize_encode_result_free(&result);
+  }
+
+  SECTION("it converts data written with an older version of the schemas") {
+    struct point_v0_t {
+      int32_t x;
+      int32_t y;
+    };
+    struct shape_v0_t {
+      uint32_t id;
+      float scale;
+      uint32_t point_count;
+      point_v0_t* points;
+      shape_v0_t* next;
+    };
+    struct point_v1_t {
+      double y;
+      double x;
+      uint32_t color;
+    };
+    struct shape_v1_t {
+      shape_v1_t* next;
+      double scale;
+      point_v1_t* points;
+      uint32_t point_count;
+      uint64_t flags;
+    };
+
+    crystalize_schema_t schema_point_v0;
+    crystalize_schema_field_t schema_point_v0_fields[2];
+    crystalize_schema_field_init_scalar(schema_point_v0_fields + 0, "x", CRYSTALIZE_INT32, 1);
+    crystalize_schema_field_init_scalar(schema_point_v0_fields + 1, "y", CRYSTALIZE_INT32, 1);
+    crystalize_schema_init(&schema_point_v0, "point", 0, schema_point_v0_fields, 2);
+    REQUIRE(crystalize_schema_add(&schema_point_v0) == CRYSTALIZE_ERROR_NONE);
+    crystalize_schema_t schema_shape_v0;
+    crystalize_schema_field_t schema_shape_v0_fields[5];
+    crystalize_schema_init(&schema_shape_v0, "shape", 0, schema_shape_v0_fields, 5);
+    crystalize_schema_field_init_scalar(schema_shape_v0_fields + 0, "id", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_scalar(schema_shape_v0_fields + 1, "scale", CRYSTALIZE_FLOAT, 1);
+    crystalize_schema_field_init_scalar(schema_shape_v0_fields + 2, "point_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(schema_shape_v0_fields + 3, "points", &schema_point_v0, "point_count");
+    crystalize_schema_field_init_struct_pointer(schema_shape_v0_fields + 4, "next", &schema_shape_v0);
+    REQUIRE(crystalize_schema_add(&schema_shape_v0) == CRYSTALIZE_ERROR_NONE);
+
+    // fields get reordered, dropped, added and change type
+    crystalize_schema_t schema_point_v1;
+    crystalize_schema_field_t schema_point_v1_fields[3];
+    crystalize_schema_field_init_scalar(schema_point_v1_fields + 0, "y", CRYSTALIZE_DOUBLE, 1);
+    crystalize_schema_field_init_scalar(schema_point_v1_fields + 1, "x", CRYSTALIZE_DOUBLE, 1);
+    crystalize_schema_field_init_scalar(schema_point_v1_fields + 2, "color", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_init(&schema_point_v1, "point", 1, schema_point_v1_fields, 3);
+    REQUIRE(crystalize_schema_add(&schema_point_v1) == CRYSTALIZE_ERROR_NONE);
+    crystalize_schema_t schema_shape_v1;
+    crystalize_schema_field_t schema_shape_v1_fields[5];
+    crystalize_schema_init(&schema_shape_v1, "shape", 1, schema_shape_v1_fields, 5);
+    crystalize_schema_field_init_struct_pointer(schema_shape_v1_fields + 0, "next", &schema_shape_v1);
+    crystalize_schema_field_init_scalar(schema_shape_v1_fields + 1, "scale", CRYSTALIZE_DOUBLE, 1);
+    crystalize_schema_field_init_counted_struct(schema_shape_v1_fields + 2, "points", &schema_point_v1, "point_count");
+    crystalize_schema_field_init_scalar(schema_shape_v1_fields + 3, "point_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_scalar(schema_shape_v1_fields + 4, "flags", CRYSTALIZE_UINT64, 1);
+    REQUIRE(crystalize_schema_add(&schema_shape_v1) == CRYSTALIZE_ERROR_NONE);
+
+    // two shapes that point at each other and share their points
+    point_v0_t points[3] = {{1, -2}, {3, -4}, {5, -6}};
+    shape_v0_t shapes[2];
+    shapes[0] = {10, 0.5f, 3, points, &shapes[1]};
+    shapes[1] = {11, 2.0f, 2, points, &shapes[0]};
+
+    for (int pass = 0; pass < 2; ++pass) {
+      // the second file reuses the plan from the first
+      crystalize_encode_result_t result;
+      crystalize_encode(schema_shape_v0.name_id, schema_shape_v0.version, shapes, &result);
+      REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+
+      crystalize_decode_result_t decode_result;
+      shape_v1_t* decoded =
+          (shape_v1_t*)crystalize_decode(schema_shape_v1.name_id, schema_shape_v1.version, result.buf, result.buf_size, &decode_result);
+      CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+      REQUIRE(decoded != NULL);
+      CHECK(decode_result.buf == (char*)decoded);
+      CHECK(decoded->scale == 0.5);
+      CHECK(decoded->flags == 0);
+      REQUIRE(decoded->point_count == 3);
+      CHECK(decoded->points[0].x == 1.0);
+      CHECK(decoded->points[0].y == -2.0);
+      CHECK(decoded->points[2].x == 5.0);
+      CHECK(decoded->points[2].y == -6.0);
+      CHECK(decoded->points[2].color == 0);
+      REQUIRE(decoded->next != NULL);
+      CHECK(decoded->next->scale == 2.0);
+      CHECK(decoded->next->point_count == 2);
+      CHECK(decoded->next->points == decoded->points);
+      CHECK(decoded->next->next == decoded);
+
+      // the data can still be decoded in place with the schema it was written with
+      crystalize_decode_result_t same_result;
+      shape_v0_t* same =
+          (shape_v0_t*)crystalize_decode(schema_shape_v0.name_id, schema_shape_v0.version, result.buf, result.buf_size, &same_result);
+      CHECK(same_result.error == CRYSTALIZE_ERROR_NONE);
+      CHECK(same_result.buf == NULL);
+      REQUIRE(same != NULL);
+      CHECK(same->next->id == 11);
+
+      crystalize_decode_result_free(&decode_result);
+      crystalize_encode_result_free(&result);
+    }
+
+    // a file whose point schema has no fields can't make the converter allocate for a huge point count
+    crystalize_encode_result_t result;
+    crystalize_encode(schema_shape_v0.name_id, schema_shape_v0.version, shapes, &result);
+    REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+    uint32_t data_offset;
+    uint32_t schema_count;
+    memcpy(&data_offset, result.buf + 16, sizeof(data_offset));
+    memcpy(&schema_count, result.buf + 28, sizeof(schema_count));
+    crystalize_schema_t* file_schemas = (crystalize_schema_t*)(result.buf + 32);
+    for (uint32_t index = 0; index < schema_count; ++index) {
+      if (file_schemas[index].name_id == schema_point_v0.name_id) {
+        file_schemas[index].field_count = 0;
+      }
+    }
+    const uint32_t point_count = 0x40000000u;
+    memcpy(result.buf + data_offset + offsetof(shape_v0_t, point_count), &point_count, sizeof(point_count));
+    crystalize_decode_result_t decode_result;
+    CHECK(crystalize_decode(schema_shape_v1.name_id, schema_shape_v1.version, result.buf, result.buf_size, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_SCHEMA_TABLE_INVALID);
+    crystalize_decode_result_free(&decode_result);
+    crystalize_encode_result_free(&result);
+  }
+
+  SECTION("it keeps converting once the plan cache is full") {
+    struct sample_t {
+      double value;
+    };
+    crystalize_schema_t target;
+    crystalize_schema_field_t target_fields[1];
+    crystalize_schema_field_init_scalar(target_fields + 0, "value", CRYSTALIZE_DOUBLE, 1);
+    crystalize_schema_init(&target, "sample", 1000, target_fields, 1);
+    REQUIRE(crystalize_schema_add(&target) == CRYSTALIZE_ERROR_NONE);
+
+    // every version is its own file schema table and so needs its own plan
+    const uint32_t version_count = 600;
+    for (uint32_t version = 0; version < version_count; ++version) {
+      crystalize_schema_t schema;
+      crystalize_schema_field_t fields[1];
+      crystalize_schema_field_init_scalar(fields + 0, "value", CRYSTALIZE_INT32, 1);
+      crystalize_schema_init(&schema, "sample", version, fields, 1);
+      REQUIRE(crystalize_schema_add(&schema) == CRYSTALIZE_ERROR_NONE);
+    }
+
+    uint32_t wrong_count = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+      for (uint32_t version = 0; version < version_count; ++version) {
+        const int32_t value = (int32_t)version * 3;
+        crystalize_encode_result_t result;
+        crystalize_encode(target.name_id, version, &value, &result);
+        REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+        crystalize_decode_result_t decode_result;
+        const sample_t* decoded = (const sample_t*)crystalize_decode(target.name_id, target.version, result.buf, result.buf_size, &decode_result);
+        wrong_count += decoded == NULL || decoded->value != value;
+        crystalize_decode_result_free(&decode_result);
+        crystalize_encode_result_free(&result);
+      }
+    }
+    CHECK(wrong_count == 0);
+  }
+
+  SECTION("it views data in a read-only buffer without fixing up pointers") {
+    struct node_t {
+      uint32_t value;
+      node_t* next;
+      uint32_t* values;
+    };
+    struct node_view_t {
+      uint32_t value;
+      crystalize::offset_ptr<node_view_t> next;
+      crystalize::offset_ptr<uint32_t> values;
+    };
+    crystalize_schema_t schema;
+    crystalize_schema_field_t fields[3];
+    crystalize_schema_init(&schema, "node", 0, fields, 3);
+    crystalize_schema_field_init_scalar(fields + 0, "value", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_struct_pointer(fields + 1, "next", &schema);
+    crystalize_schema_field_init_counted_scalar(fields + 2, "values", CRYSTALIZE_UINT32, "value");
+    REQUIRE(crystalize_schema_add(&schema) == CRYSTALIZE_ERROR_NONE);
+
+    uint32_t values[3] = {5, 6, 7};
+    node_t nodes[2];
+    nodes[0] = {3, &nodes[1], values};
+    nodes[1] = {0, NULL, NULL};
+    crystalize_encode_result_t result;
+    crystalize_encode(schema.name_id, schema.version, nodes, &result);
+    REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+    std::vector<char> original(result.buf, result.buf + result.buf_size);
+
+#if !defined(_WIN32)
+    // view it through a read-only mapping, any write would fault
+    char* buf = (char*)mmap(NULL, result.buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    REQUIRE(buf != MAP_FAILED);
+    memcpy(buf, result.buf, result.buf_size);
+    REQUIRE(mprotect(buf, result.buf_size, PROT_READ) == 0);
+#else
+    const char* buf = result.buf;
+#endif
+
+    crystalize_decode_result_t view_result;
+    const node_t* root = (const node_t*)crystalize_view(schema.name_id, schema.version, buf, result.buf_size, &view_result);
+    CHECK(view_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(root != NULL);
+    CHECK(root->value == 3);
+    CHECK(CRYSTALIZE_VIEW(uint32_t, root->values)[2] == 7);
+    const node_t* next = crystalize::view(root->next);
+    REQUIRE(next != NULL);
+    CHECK(next->value == 0);
+    CHECK(CRYSTALIZE_VIEW(node_t, next->next) == NULL);
+    CHECK(CRYSTALIZE_VIEW(uint32_t, next->values) == NULL);
+
+    const node_view_t* root_view = (const node_view_t*)root;
+    CHECK(root_view->values[0] == 5);
+    REQUIRE(root_view->next);
+    CHECK(root_view->next->value == 0);
+    CHECK(!root_view->next->next);
+    CHECK(memcmp(buf, original.data(), result.buf_size) == 0);
+#if !defined(_WIN32)
+    munmap(buf, result.buf_size);
+#endif
+
+    // the data has to lay out exactly like the expected schema
+    crystalize_schema_t schema_v1;
+    crystalize_schema_field_t fields_v1[2];
+    crystalize_schema_init(&schema_v1, "node", 1, fields_v1, 2);
+    crystalize_schema_field_init_scalar(fields_v1 + 0, "value", CRYSTALIZE_UINT64, 1);
+    crystalize_schema_field_init_struct_pointer(fields_v1 + 1, "next", &schema_v1);
+    REQUIRE(crystalize_schema_add(&schema_v1) == CRYSTALIZE_ERROR_NONE);
+    CHECK(crystalize_view(schema_v1.name_id, schema_v1.version, result.buf, result.buf_size, &view_result) == NULL);
+    CHECK(view_result.error == CRYSTALIZE_ERROR_SCHEMA_MISMATCH);
+
+    // the schema table's fields are followed in place, so they have to stay inside the buffer
+    std::vector<char> bad_fields = original;
+    const int64_t fields_offset = 0x10000000;
+    memcpy(bad_fields.data() + 32 + offsetof(crystalize_schema_t, fields), &fields_offset, sizeof(fields_offset));
+    CHECK(crystalize_view(schema.name_id, schema.version, bad_fields.data(), result.buf_size, &view_result) == NULL);
+    CHECK(view_result.error == CRYSTALIZE_ERROR_SCHEMA_TABLE_INVALID);
+
+    // once decoded in place the offsets are gone
+    crystalize_decode_result_t decode_result;
+    CHECK(crystalize_decode(schema.name_id, schema.version, result.buf, result.buf_size, &decode_result) != NULL);
+    CHECK(crystalize_view(schema.name_id, schema.version, result.buf, result.buf_size, &view_result) == NULL);
+    CHECK(view_result.error == CRYSTALIZE_ERROR_FILE_IS_DECODED);
+
+    crystalize_encode_result_free(&result);
+  }
+
+  SECTION("it verifies untrusted buffers against the schema without modifying them") {
+    struct node_t {
+      uint32_t value;
+      node_t* next;
+      uint32_t* values;
+    };
+    crystalize_schema_t schema;
+    crystalize_schema_field_t fields[3];
+    crystalize_schema_init(&schema, "node", 0, fields, 3);
+    crystalize_schema_field_init_scalar(fields + 0, "value", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_struct_pointer(fields + 1, "next", &schema);
+    crystalize_schema_field_init_counted_scalar(fields + 2, "values", CRYSTALIZE_UINT32, "value");
+    REQUIRE(crystalize_schema_add(&schema) == CRYSTALIZE_ERROR_NONE);
+
+    // a list of ten nodes that loops back to the start
+    uint32_t values[3] = {5, 6, 7};
+    node_t nodes[10];
+    for (uint32_t index = 0; index < 10; ++index) {
+      nodes[index] = {index % 4, &nodes[(index + 1) % 10], index % 4 != 0 ? values : NULL};
+    }
+    crystalize_encode_result_t result;
+    crystalize_encode(schema.name_id, schema.version, nodes, &result);
+    REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+    std::vector<char> original(result.buf, result.buf + result.buf_size);
+
+    crystalize_decode_result_t verify_result;
+    CHECK(crystalize_verify(schema.name_id, schema.version, result.buf, result.buf_size, NULL, &verify_result));
+    CHECK(verify_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(memcmp(result.buf, original.data(), result.buf_size) == 0);
+
+    // the other pointer table formats are checked too
+    crystalize_encode_options_t encode_options;
+    crystalize_encode_options_init(&encode_options);
+    encode_options.compact_pointer_table = true;
+    crystalize_encode_result_t compact;
+    crystalize_encode_ex(schema.name_id, schema.version, nodes, &encode_options, &compact);
+    REQUIRE(compact.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(crystalize_verify(schema.name_id, schema.version, compact.buf, compact.buf_size, NULL, &verify_result));
+    encode_options.paged_pointer_table = true;
+    crystalize_encode_result_t paged;
+    crystalize_encode_ex(schema.name_id, schema.version, nodes, &encode_options, &paged);
+    REQUIRE(paged.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(crystalize_verify(schema.name_id, schema.version, paged.buf, paged.buf_size, NULL, &verify_result));
+
+    // corrupt the root's fields one at a time
+    uint32_t data_offset;
+    memcpy(&data_offset, result.buf + 16, sizeof(uint32_t));
+    char* root = result.buf + data_offset;
+    const auto verify_corrupt = [&](size_t field_offset, int64_t value) {
+      std::vector<char> corrupt(original);
+      memcpy(corrupt.data() + data_offset + field_offset, &value, sizeof(int64_t));
+      crystalize_decode_result_t corrupt_result;
+      CHECK(!crystalize_verify(schema.name_id, schema.version, corrupt.data(), (uint32_t)corrupt.size(), NULL, &corrupt_result));
+      return corrupt_result.error;
+    };
+    int64_t next_offset;
+    memcpy(&next_offset, root + offsetof(node_t, next), sizeof(int64_t));
+    CHECK(verify_corrupt(offsetof(node_t, next), next_offset + 4) == CRYSTALIZE_ERROR_POINTER_INVALID);
+    CHECK(verify_corrupt(offsetof(node_t, next), -(int64_t)data_offset) == CRYSTALIZE_ERROR_POINTER_INVALID);
+    CHECK(verify_corrupt(offsetof(node_t, next), (int64_t)result.buf_size) == CRYSTALIZE_ERROR_POINTER_INVALID);
+    CHECK(verify_corrupt(offsetof(node_t, next), INT64_MIN) == CRYSTALIZE_ERROR_POINTER_INVALID);
+    // the second node's count runs its values off the end of the data
+    CHECK(verify_corrupt(next_offset + offsetof(node_t, value), 0x40000000) == CRYSTALIZE_ERROR_POINTER_INVALID);
+    // a pointer that's in the table but was NULLed out
+    CHECK(verify_corrupt(offsetof(node_t, next), 0) == CRYSTALIZE_ERROR_POINTER_INVALID);
+
+    // a slot in the pointer table that isn't a pointer
+    uint32_t pointer_table_offset;
+    memcpy(&pointer_table_offset, result.buf + 20, sizeof(uint32_t));
+    std::vector<char> bad_table(original);
+    const uint32_t value_pos = data_offset + (uint32_t)offsetof(node_t, value);
+    memcpy(bad_table.data() + pointer_table_offset, &value_pos, sizeof(uint32_t));
+    CHECK(!crystalize_verify(schema.name_id, schema.version, bad_table.data(), (uint32_t)bad_table.size(), NULL, &verify_result));
+    CHECK(verify_result.error == CRYSTALIZE_ERROR_POINTER_INVALID);
+
+    // the limits stop the walk, the last node's values are ten pointers from the root
+    crystalize_verify_options_t options;
+    crystalize_verify_options_init(&options);
+    options.max_depth = 10;
+    CHECK(crystalize_verify(schema.name_id, schema.version, result.buf, result.buf_size, &options, &verify_result));
+    options.max_depth = 9;
+    CHECK(!crystalize_verify(schema.name_id, schema.version, result.buf, result.buf_size, &options, &verify_result));
+    CHECK(verify_result.error == CRYSTALIZE_ERROR_VERIFY_LIMIT_EXCEEDED);
+    crystalize_verify_options_init(&options);
+    options.max_count = 2;
+    CHECK(!crystalize_verify(schema.name_id, schema.version, result.buf, result.buf_size, &options, &verify_result));
+    CHECK(verify_result.error == CRYSTALIZE_ERROR_VERIFY_LIMIT_EXCEEDED);
+    crystalize_verify_options_init(&options);
+    options.max_visit_bytes = 5 * sizeof(node_t);
+    CHECK(!crystalize_verify(schema.name_id, schema.version, result.buf, result.buf_size, &options, &verify_result));
+    CHECK(verify_result.error == CRYSTALIZE_ERROR_VERIFY_LIMIT_EXCEEDED);
+    CHECK(memcmp(result.buf, original.data(), result.buf_size) == 0);
+
+    // decoded buffers hold addresses, which can't be verified
+    crystalize_decode_result_t decode_result;
+    CHECK(crystalize_decode(schema.name_id, schema.version, result.buf, result.buf_size, &decode_result) != NULL);
+    CHECK(!crystalize_verify(schema.name_id, schema.version, result.buf, result.buf_size, NULL, &verify_result));
+    CHECK(verify_result.error == CRYSTALIZE_ERROR_FILE_IS_DECODED);
+
+    crystalize_encode_result_free(&paged);
+    crystalize_encode_result_free(&compact);
+    crystalize_encode_result_free(&result);
+  }
+
+  SECTION("it resolves pointers into the middle of other objects") {
+    struct submesh_t {
+      uint32_t index_count;
+      uint32_t* indices;
+    };
+    struct mesh_t {
+      uint32_t submesh_count;
+      submesh_t* submeshes;
+      uint32_t index_count;
+      uint32_t* indices;
+    };
+    crystalize_schema_t submesh_schema;
+    crystalize_schema_field_t submesh_fields[2];
+    crystalize_schema_field_init_scalar(submesh_fields + 0, "index_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(submesh_fields + 1, "indices", CRYSTALIZE_UINT32, "index_count");
+    crystalize_schema_init(&submesh_schema, "submesh", 0, submesh_fields, 2);
+    crystalize_schema_add(&submesh_schema);
+    crystalize_schema_t mesh_schema;
+    crystalize_schema_field_t mesh_fields[4];
+    crystalize_schema_field_init_scalar(mesh_fields + 0, "submesh_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(mesh_fields + 1, "submeshes", &submesh_schema, "submesh_count");
+    crystalize_schema_field_init_scalar(mesh_fields + 2, "index_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(mesh_fields + 3, "indices", CRYSTALIZE_UINT32, "index_count");
+    crystalize_schema_init(&mesh_schema, "mesh", 0, mesh_fields, 4);
+    crystalize_schema_add(&mesh_schema);
+
+    uint32_t indices[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+    submesh_t submeshes[2] = {{6, indices + 0}, {6, indices + 6}};
+    mesh_t mesh;
+    mesh.submesh_count = 2;
+    mesh.submeshes = submeshes;
+    mesh.index_count = 12;
+    mesh.indices = indices;
+
+    crystalize_encode_result_t buf_result;
+    crystalize_encode(mesh_schema.name_id, mesh_schema.version, &mesh, &buf_result);
+    CHECK(buf_result.error == CRYSTALIZE_ERROR_NONE);
+
+    crystalize_decode_result_t decode_result;
+    mesh_t* decoded = (mesh_t*)crystalize_decode(mesh_schema.name_id, mesh_schema.version, buf_result.buf, buf_result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    CHECK(decoded->submeshes[0].indices == decoded->indices + 0);
+    CHECK(decoded->submeshes[1].indices == decoded->indices + 6);
+    CHECK(decoded->submeshes[1].indices[5] == 11);
+
+    // the submesh ranges cost two pointers and no index data
+    submesh_t empty_submeshes[2] = {{0, NULL}, {0, NULL}};
+    mesh.submeshes = empty_submeshes;
+    crystalize_encode_result_t empty_result;
+    crystalize_encode(mesh_schema.name_id, mesh_schema.version, &mesh, &empty_result);
+    CHECK(buf_result.buf_size - empty_result.buf_size == 2 * sizeof(uint32_t));
+
+    // a range queued before the buffer it's part of gets written on its own, but still resolves into the buffer
+    struct view_t {
+      uint32_t first_count;
+      uint32_t* first;
+      uint32_t index_count;
+      uint32_t* indices;
+    };
+    crystalize_schema_t view_schema;
+    crystalize_schema_field_t view_fields[4];
+    crystalize_schema_field_init_scalar(view_fields + 0, "first_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(view_fields + 1, "first", CRYSTALIZE_UINT32, "first_count");
+    crystalize_schema_field_init_scalar(view_fields + 2, "index_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(view_fields + 3, "indices", CRYSTALIZE_UINT32, "index_count");
+    crystalize_schema_init(&view_schema, "view", 0, view_fields, 4);
+    crystalize_schema_add(&view_schema);
+    view_t view = {3, indices + 3, 12, indices};
+    crystalize_encode_result_t view_result;
+    crystalize_encode(view_schema.name_id, view_schema.version, &view, &view_result);
+    CHECK(view_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(crystalize_verify(view_schema.name_id, view_schema.version, view_result.buf, view_result.buf_size, NULL, &decode_result));
+    view_t* decoded_view = (view_t*)crystalize_decode(view_schema.name_id, view_schema.version, view_result.buf, view_result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded_view != NULL);
+    CHECK(decoded_view->first == decoded_view->indices + 3);
+
+    crystalize_encode_result_free(&view_result);
+    crystalize_encode_result_free(&empty_result);
+    crystalize_encode_result_free(&buf_result);
+  }
+
+  SECTION("it writes identical arrays once when deduplicating content") {
+    struct root_t {
+      uint32_t first_count;
+      float* first;
+      uint32_t second_count;
+      float* second;
+      uint32_t other_count;
+      float* other;
+    };
+    crystalize_schema_t schema;
+    crystalize_schema_field_t fields[6];
+    crystalize_schema_field_init_scalar(fields + 0, "first_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(fields + 1, "first", CRYSTALIZE_FLOAT, "first_count");
+    crystalize_schema_field_init_scalar(fields + 2, "second_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(fields + 3, "second", CRYSTALIZE_FLOAT, "second_count");
+    crystalize_schema_field_init_scalar(fields + 4, "other_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(fields + 5, "other", CRYSTALIZE_FLOAT, "other_count");
+    crystalize_schema_init(&schema, "root", 0, fields, 6);
+    crystalize_schema_add(&schema);
+
+    // the same curve twice at different addresses, and one that differs
+    float first[8] = {0.0f, 0.5f, 1.0f, 0.5f, 0.0f, -0.5f, -1.0f, -0.5f};
+    float second[8];
+    memcpy(second, first, sizeof(first));
+    float other[8];
+    memcpy(other, first, sizeof(first));
+    other[7] = 0.0f;
+    root_t data = {8, first, 8, second, 8, other};
+
+    crystalize_encode_result_t plain_result;
+    crystalize_encode(schema.name_id, schema.version, &data, &plain_result);
+    CHECK(plain_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(plain_result.dedup_bytes_saved == 0);
+
+    crystalize_encode_options_t options;
+    crystalize_encode_options_init(&options);
+    options.dedup_content = true;
+    crystalize_encode_result_t dedup_result;
+    crystalize_encode_ex(schema.name_id, schema.version, &data, &options, &dedup_result);
+    CHECK(dedup_result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(dedup_result.dedup_bytes_saved == sizeof(second));
+    CHECK(plain_result.buf_size - dedup_result.buf_size == sizeof(second));
+
+    crystalize_decode_result_t decode_result;
+    root_t* decoded = (root_t*)crystalize_decode(schema.name_id, schema.version, dedup_result.buf, dedup_result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    CHECK(decoded->first == decoded->second);
+    CHECK(decoded->other != decoded->first);
+    CHECK(decoded->other[7] == 0.0f);
+    CHECK(decoded->second[7] == -0.5f);
+
+    // the sizing pass makes the same decisions
+    options.exact_size = true;
+    crystalize_encode_result_t exact_result;
+    crystalize_encode_ex(schema.name_id, schema.version, &data, &options, &exact_result);
+    CHECK(exact_result.dedup_bytes_saved == sizeof(second));
+
+    crystalize_encode_result_free(&exact_result);
+    crystalize_encode_result_free(&dedup_result);
+    crystalize_encode_result_free(&plain_result);
+  }
+
+  SECTION("it produces the same bytes whatever the thread count") {
+    struct vertex_t {
+      float position[3];
+      uint8_t flags;
+    };
+    struct child_t {
+      uint32_t value_count;
+      uint32_t* values;
+      uint32_t vertex_count;
+      vertex_t* vertices;
+    };
+    struct root_t {
+      uint32_t child_count;
+      child_t* children;
+    };
+    crystalize_schema_t vertex_schema;
+    crystalize_schema_field_t vertex_fields[2];
+    crystalize_schema_field_init_scalar(vertex_fields + 0, "position", CRYSTALIZE_FLOAT, 3);
+    crystalize_schema_field_init_scalar(vertex_fields + 1, "flags", CRYSTALIZE_UINT8, 1);
+    crystalize_schema_init(&vertex_schema, "vertex", 0, vertex_fields, 2);
+    crystalize_schema_add(&vertex_schema);
+    crystalize_schema_t child_schema;
+    crystalize_schema_field_t child_fields[4];
+    crystalize_schema_field_init_scalar(child_fields + 0, "value_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(child_fields + 1, "values", CRYSTALIZE_UINT32, "value_count");
+    crystalize_schema_field_init_scalar(child_fields + 2, "vertex_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(child_fields + 3, "vertices", &vertex_schema, "vertex_count");
+    crystalize_schema_init(&child_schema, "child", 0, child_fields, 4);
+    crystalize_schema_add(&child_schema);
+    crystalize_schema_t root_schema;
+    crystalize_schema_field_t root_fields[2];
+    crystalize_schema_field_init_scalar(root_fields + 0, "child_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(root_fields + 1, "children", &child_schema, "child_count");
+    crystalize_schema_init(&root_schema, "root", 0, root_fields, 2);
+    crystalize_schema_add(&root_schema);
+
+    // big enough levels that they get split between threads, with some values shared between children
+    const uint32_t child_count = 50000;
+    std::vector<uint32_t> values(child_count);
+    std::vector<vertex_t> vertices(child_count * 2);
+    std::vector<child_t> children(child_count);
+    for (uint32_t index = 0; index < child_count; ++index) {
+      values[index] = index;
+      vertices[index * 2 + 0] = {{(float)index, 0.0f, 0.0f}, 1};
+      vertices[index * 2 + 1] = {{0.0f, (float)index, 0.0f}, 2};
+      children[index].value_count = 1;
+      children[index].values = &values[index - index % 3];
+      children[index].vertex_count = 2;
+      children[index].vertices = &vertices[index * 2];
+    }
+    root_t root = {child_count, children.data()};
+
+    crystalize_encode_result_t expected;
+    crystalize_encode(root_schema.name_id, root_schema.version, &root, &expected);
+    CHECK(expected.error == CRYSTALIZE_ERROR_NONE);
+
+    const uint32_t thread_counts[] = {2, 3, 8};
+    for (uint32_t thread_count : thread_counts) {
+      crystalize_encode_options_t options;
+      crystalize_encode_options_init(&options);
+      options.thread_count = thread_count;
+      crystalize_encode_result_t result;
+      crystalize_encode_ex(root_schema.name_id, root_schema.version, &root, &options, &result);
+      CHECK(result.error == CRYSTALIZE_ERROR_NONE);
+      REQUIRE(result.buf_size == expected.buf_size);
+      CHECK(memcmp(result.buf, expected.buf, expected.buf_size) == 0);
+      crystalize_encode_result_free(&result);
+    }
+
+    // and decodes the same on threads
+    crystalize_decode_options_t decode_options;
+    crystalize_decode_options_init(&decode_options);
+    decode_options.thread_count = 4;
+    crystalize_decode_result_t decode_result;
+    const root_t* decoded = (const root_t*)crystalize_decode_ex(root_schema.name_id, root_schema.version, expected.buf, expected.buf_size, &decode_options, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    CHECK(decoded->children[child_count - 1].values[0] == child_count - 1 - (child_count - 1) % 3);
+    CHECK(decoded->children[child_count - 1].vertices[1].position[1] == (float)(child_count - 1));
+
+    crystalize_encode_result_free(&expected);
+  }
+
+  SECTION("it streams the same bytes to a write handler") {
+    struct child_t {
+      uint32_t value_count;
+      uint32_t* values;
+    };
+    struct root_t {
+      uint32_t child_count;
+      child_t* children;
+    };
+    crystalize_schema_t schema_child;
+    crystalize_schema_field_t schema_child_fields[2];
+    crystalize_schema_field_init_scalar(schema_child_fields + 0, "value_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(schema_child_fields + 1, "values", CRYSTALIZE_UINT32, "value_count");
+    crystalize_schema_init(&schema_child, "child", 0, schema_child_fields, 2);
+    crystalize_schema_add(&schema_child);
+    crystalize_schema_t schema_root;
+    crystalize_schema_field_t schema_root_fields[2];
+    crystalize_schema_field_init_scalar(schema_root_fields + 0, "child_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(schema_root_fields + 1, "children", &schema_child, "child_count");
+    crystalize_schema_init(&schema_root, "root", 0, schema_root_fields, 2);
+    crystalize_schema_add(&schema_root);
+
+    // enough pointed-to arrays that the output goes out in several chunks
+    const uint32_t child_count = 10000;
+    std::vector<uint32_t> values(child_count * 2);
+    std::vector<child_t> children(child_count);
+    for (uint32_t index = 0; index < child_count; ++index) {
+      values[index * 2 + 0] = index;
+      values[index * 2 + 1] = ~index;
+      children[index].value_count = 2;
+      children[index].values = &values[index * 2];
+    }
+    root_t data;
+    data.child_count = child_count;
+    data.children = children.data();
+
+    crystalize_encode_result_t expected;
+    crystalize_encode(schema_root.name_id, schema_root.version, &data, &expected);
+    CHECK(expected.error == CRYSTALIZE_ERROR_NONE);
+
+    struct stream_t {
+      std::vector<char> bytes;
+      uint32_t chunk_count;
+    };
+    stream_t stream;
+    stream.chunk_count = 0;
+    auto append = [](void* ctx, const void* chunk, uint32_t size) -> bool {
+      stream_t* stream = (stream_t*)ctx;
+      stream->bytes.insert(stream->bytes.end(), (const char*)chunk, (const char*)chunk + size);
+      ++stream->chunk_count;
+      return true;
+    };
+    crystalize_encode_result_t result;
+    crystalize_encode_to_handler(schema_root.name_id, schema_root.version, &data, append, &stream, &result);
+    CHECK(result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(result.buf == NULL);
+    CHECK(result.buf_size == expected.buf_size);
+    CHECK(stream.chunk_count > 1);
+    REQUIRE(stream.bytes.size() == expected.buf_size);
+    CHECK(memcmp(stream.bytes.data(), expected.buf, expected.buf_size) == 0);
+
+    // a failing handler is reported
+    auto fail = [](void*, const void*, uint32_t) -> bool { return false; };
+    crystalize_encode_to_handler(schema_root.name_id, schema_root.version, &data, fail, NULL, &result);
+    CHECK(result.error == CRYSTALIZE_ERROR_WRITE_FAILED);
+
+    crystalize_encode_result_free(&expected);
+  }
+
+#if !defined(_WIN32)
+  SECTION("it encodes into a memory-mapped file that decodes in place") {
+    struct child_t {
+      uint32_t value_count;
+      uint32_t* values;
+    };
+    struct root_t {
+      uint32_t child_count;
+      child_t* children;
+    };
+    crystalize_schema_t schema_child;
+    crystalize_schema_field_t schema_child_fields[2];
+    crystalize_schema_field_init_scalar(schema_child_fields + 0, "value_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(schema_child_fields + 1, "values", CRYSTALIZE_UINT32, "value_count");
+    crystalize_schema_init(&schema_child, "child", 0, schema_child_fields, 2);
+    crystalize_schema_add(&schema_child);
+    crystalize_schema_t schema_root;
+    crystalize_schema_field_t schema_root_fields[2];
+    crystalize_schema_field_init_scalar(schema_root_fields + 0, "child_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_struct(schema_root_fields + 1, "children", &schema_child, "child_count");
+    crystalize_schema_init(&schema_root, "root", 0, schema_root_fields, 2);
+    crystalize_schema_add(&schema_root);
+
+    // enough data that the mapping has to grow a few times
+    const uint32_t child_count = 10000;
+    std::vector<uint32_t> values(child_count);
+    std::vector<child_t> children(child_count);
+    for (uint32_t index = 0; index < child_count; ++index) {
+      values[index] = index;
+      children[index].value_count = 1;
+      children[index].values = &values[index];
+    }
+    root_t data;
+    data.child_count = child_count;
+    data.children = children.data();
+
+    crystalize_encode_result_t expected;
+    crystalize_encode(schema_root.name_id, schema_root.version, &data, &expected);
+    CHECK(expected.error == CRYSTALIZE_ERROR_NONE);
+
+    char path[] = "/tmp/crystalize_spec_XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    unlink(path);
+
+    crystalize_encode_result_t result;
+    crystalize_encode_to_file(schema_root.name_id, schema_root.version, &data, fd, NULL, &result);
+    CHECK(result.error == CRYSTALIZE_ERROR_NONE);
+    CHECK(result.buf == NULL);
+    REQUIRE(result.buf_size == expected.buf_size);
+    REQUIRE(lseek(fd, 0, SEEK_END) == (off_t)expected.buf_size);
+
+    // a private mapping lets the decode fix up pointers without touching the file
+    char* mapping = (char*)mmap(NULL, result.buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    REQUIRE(mapping != MAP_FAILED);
+    CHECK(memcmp(mapping, expected.buf, expected.buf_size) == 0);
+    crystalize_decode_result_t decode_result;
+    root_t* decoded = (root_t*)crystalize_decode(schema_root.name_id, schema_root.version, mapping, result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    REQUIRE(decoded->child_count == child_count);
+    CHECK(decoded->children[child_count - 1].values[0] == child_count - 1);
+
+    munmap(mapping, result.buf_size);
+    close(fd);
+    crystalize_encode_result_free(&expected);
+  }
+
+  SECTION("it maps a file and decodes it without modifying the file") {
+    struct root_t {
+      uint32_t value_count;
+      uint32_t* values;
+    };
+    crystalize_schema_t schema_root;
+    crystalize_schema_field_t schema_root_fields[2];
+    crystalize_schema_field_init_scalar(schema_root_fields + 0, "value_count", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_counted_scalar(schema_root_fields + 1, "values", CRYSTALIZE_UINT32, "value_count");
+    crystalize_schema_init(&schema_root, "root", 0, schema_root_fields, 2);
+    crystalize_schema_add(&schema_root);
+
+    std::vector<uint32_t> values(10000);
+    for (uint32_t index = 0; index < values.size(); ++index) {
+      values[index] = index * 3;
+    }
+    root_t data;
+    data.value_count = (uint32_t)values.size();
+    data.values = values.data();
+
+    char path[] = "/tmp/crystalize_spec_XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    unlink(path);
+    crystalize_encode_result_t result;
+    crystalize_encode_to_file(schema_root.name_id, schema_root.version, &data, fd, NULL, &result);
+    REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+
+    for (int populate = 0; populate < 2; ++populate) {
+      crystalize_map_options_t options;
+      crystalize_map_options_init(&options);
+      options.populate = populate != 0;
+      crystalize_mapped_file_t file;
+      root_t* decoded = (root_t*)crystalize_map_file(schema_root.name_id, schema_root.version, fd, &options, &file);
+      CHECK(file.result.error == CRYSTALIZE_ERROR_NONE);
+      REQUIRE(decoded != NULL);
+      CHECK(file.data == decoded);
+      CHECK(file.buf_size == result.buf_size);
+      REQUIRE(decoded->value_count == 10000);
+      CHECK(decoded->values[9999] == 9999 * 3);
+      crystalize_unmap(&file);
+      CHECK(file.buf == NULL);
+    }
+
+    // the decode only touched private copies of the pages
+    std::vector<char> contents(result.buf_size);
+    REQUIRE(pread(fd, contents.data(), contents.size(), 0) == (ssize_t)contents.size());
+    crystalize_decode_result_t view_result;
+    CHECK(crystalize_view(schema_root.name_id, schema_root.version, contents.data(), result.buf_size, &view_result) != NULL);
+    CHECK(view_result.error == CRYSTALIZE_ERROR_NONE);
+
+    // an empty file can't be mapped
+    REQUIRE(ftruncate(fd, 0) == 0);
+    crystalize_mapped_file_t file;
+    CHECK(crystalize_map_file(schema_root.name_id, schema_root.version, fd, NULL, &file) == NULL);
+    CHECK(file.result.error == CRYSTALIZE_ERROR_MAP_FAILED);
+    crystalize_unmap(&file);
+    close(fd);
+  }
+
+  SECTION("it loads files encoded for a base address without fixups when mapped there") {
+    struct node_t {
+      uint32_t value;
+      node_t* next;
+    };
+    crystalize_schema_t schema;
+    crystalize_schema_field_t fields[2];
+    crystalize_schema_init(&schema, "node", 0, fields, 2);
+    crystalize_schema_field_init_scalar(fields + 0, "value", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_struct_pointer(fields + 1, "next", &schema);
+    REQUIRE(crystalize_schema_add(&schema) == CRYSTALIZE_ERROR_NONE);
+    node_t nodes[3];
+    for (uint32_t index = 0; index < 3; ++index) {
+      nodes[index].value = index + 1;
+      nodes[index].next = &nodes[(index + 1) % 3];
+    }
+
+    char path[] = "/tmp/crystalize_spec_XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    unlink(path);
+    crystalize_encode_options_t options;
+    crystalize_encode_options_init(&options);
+    options.base_address = 0x200000000000ull;
+    crystalize_encode_result_t result;
+    crystalize_encode_to_file(schema.name_id, schema.version, nodes, fd, &options, &result);
+    REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+
+    // the first mapping lands on the base address, so nothing gets written
+    crystalize_map_options_t map_options;
+    crystalize_map_options_init(&map_options);
+    map_options.use_base_address = true;
+    crystalize_mapped_file_t file;
+    node_t* decoded = (node_t*)crystalize_map_file(schema.name_id, schema.version, fd, &map_options, &file);
+    CHECK(file.result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    CHECK(file.at_base_address);
+    CHECK((uintptr_t)file.buf == 0x200000000000ull);
+    CHECK(decoded->next->next->value == 3);
+    CHECK(decoded->next->next->next == decoded);
+
+    // the base address is taken now, so the second gets relocated
+    crystalize_mapped_file_t other_file;
+    node_t* other = (node_t*)crystalize_map_file(schema.name_id, schema.version, fd, &map_options, &other_file);
+    CHECK(other_file.result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(other != NULL);
+    CHECK(!other_file.at_base_address);
+    CHECK(other->next->next->value == 3);
+    CHECK(other->next->next->next == other);
+
+    // and so does a plain buffer, once
+    std::vector<char> contents(other_file.buf_size);
+    REQUIRE(pread(fd, contents.data(), contents.size(), 0) == (ssize_t)contents.size());
+    crystalize_decode_result_t decode_result;
+    node_t* copy = (node_t*)crystalize_decode(schema.name_id, schema.version, contents.data(), (uint32_t)contents.size(), &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(copy != NULL);
+    CHECK(copy == (node_t*)crystalize_decode(schema.name_id, schema.version, contents.data(), (uint32_t)contents.size(), &decode_result));
+    CHECK(copy->next->value == 2);
+    CHECK(copy->next->next->next == copy);
+
+    crystalize_unmap(&other_file);
+    crystalize_unmap(&file);
+    close(fd);
+  }
+
+  SECTION("it checks the pointers of files encoded for a base address unless they're trusted") {
+    struct node_t {
+      uint32_t value;
+      node_t* next;
+    };
+    crystalize_schema_t schema;
+    crystalize_schema_field_t fields[2];
+    crystalize_schema_init(&schema, "node", 0, fields, 2);
+    crystalize_schema_field_init_scalar(fields + 0, "value", CRYSTALIZE_UINT32, 1);
+    crystalize_schema_field_init_struct_pointer(fields + 1, "next", &schema);
+    REQUIRE(crystalize_schema_add(&schema) == CRYSTALIZE_ERROR_NONE);
+    node_t nodes[3];
+    for (uint32_t index = 0; index < 3; ++index) {
+      nodes[index].value = index + 1;
+      nodes[index].next = &nodes[(index + 1) % 3];
+    }
+
+    // a file encoded for the address of the buffer it's decoded in has nothing to move, but a bad address is still
+    // caught
+    std::vector<char> contents(4096);
+    crystalize_encode_options_t options;
+    crystalize_encode_options_init(&options);
+    options.base_address = (uint64_t)(uintptr_t)contents.data();
+    crystalize_encode_result_t result;
+    crystalize_encode_ex(schema.name_id, schema.version, nodes, &options, &result);
+    REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(result.buf_size <= contents.size());
+    uint32_t pointer_table_offset;
+    uint32_t slot;
+    memcpy(&pointer_table_offset, result.buf + 20, sizeof(pointer_table_offset));
+    memcpy(&slot, result.buf + pointer_table_offset, sizeof(slot));
+    const uint64_t hostile = 0x4141414141414140ull;
+    memcpy(contents.data(), result.buf, result.buf_size);
+    crystalize_decode_result_t decode_result;
+    node_t* decoded = (node_t*)crystalize_decode(schema.name_id, schema.version, contents.data(), result.buf_size, &decode_result);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_NONE);
+    REQUIRE(decoded != NULL);
+    CHECK(decoded->next->next->next == decoded);
+    memcpy(contents.data(), result.buf, result.buf_size);
+    memcpy(contents.data() + slot, &hostile, sizeof(hostile));
+    CHECK(crystalize_decode(schema.name_id, schema.version, contents.data(), result.buf_size, &decode_result) == NULL);
+    CHECK(decode_result.error == CRYSTALIZE_ERROR_POINTER_INVALID);
+    crystalize_encode_result_free(&result);
+
+    // a mapped file is only left unchecked at its base address when the options ask for it
+    char path[] = "/tmp/crystalize_spec_XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    unlink(path);
+    options.base_address = 0x300000000000ull;
+    crystalize_encode_ex(schema.name_id, schema.version, nodes, &options, &result);
+    REQUIRE(result.error == CRYSTALIZE_ERROR_NONE);
+    memcpy(&pointer_table_offset, result.buf + 20, sizeof(pointer_table_offset));
+    memcpy(&slot, result.buf + pointer_table_offset, sizeof(slot));
+    memcpy(result.buf + slot, &hostile, sizeof(hostile));
+    REQUIRE(write(fd, result.buf, result.buf_size) == (ssize_t)result.buf_size);
+    crystalize_encode_result_free(&result);
+    crystalize_mapped_file_t file;
+    CHECK(crystalize_map_file(schema.name_id, schema.version, fd, NULL, &file) == NULL);
+    CHECK(file.result.error == CRYSTALIZE_ERROR_POINTER_INVALID);
+    CHECK(!file.at_base_address);
+    crystalize_unmap(&file);
+    close(fd);
+  }
+#endif
+}
+
+TEST_CASE("pointer fixups") {
+  // slot index points at slot (index * 7 + 3) % count, with a few left over for the scalar tail
+  const uint32_t count = 37;
+  const uint32_t size = count * 8;
+  std::vector<uint32_t> table(count);
+  std::vector<int64_t> relative(count);
+  std::vector<int64_t> based(count);
+  const uint64_t base_address = 0x200000000000ull;
+  for (uint32_t index = 0; index < count; ++index) {
+    const uint32_t dest = (index * 7 + 3) % count;
+    table[index] = index * 8;
+    relative[index] = (int64_t)dest * 8 - (int64_t)index * 8;
+    based[index] = (int64_t)(base_address + dest * 8);
+  }
+
+  SECTION("every implementation fixes up the same addresses") {
+    for (int impl = 0; impl < FIXUP_IMPL_COUNT; ++impl) {
+      if (!fixup_impl_supported((fixup_impl_t)impl)) {
+        continue;
+      }
+      INFO(fixup_impl_name((fixup_impl_t)impl));
+      std::vector<int64_t> slots = relative;
+      CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), size, table.data(), count, 0) == CRYSTALIZE_ERROR_NONE);
+      for (uint32_t index = 0; index < count; ++index) {
+        CHECK(slots[index] == (int64_t)(intptr_t)(slots.data() + (index * 7 + 3) % count));
+      }
+      slots = based;
+      CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), size, table.data(), count, base_address) == CRYSTALIZE_ERROR_NONE);
+      for (uint32_t index = 0; index < count; ++index) {
+        CHECK(slots[index] == (int64_t)(intptr_t)(slots.data() + (index * 7 + 3) % count));
+      }
+    }
+  }
+
+  SECTION("splitting the table over threads gives the same addresses and errors") {
+    const uint32_t big_count = 300000;
+    std::vector<uint32_t> big_table(big_count);
+    std::vector<int64_t> big_relative(big_count);
+    for (uint32_t index = 0; index < big_count; ++index) {
+      big_table[index] = index * 8;
+      big_relative[index] = ((int64_t)((index * 7 + 3) % big_count) - (int64_t)index) * 8;
+    }
+
+    // on threads
+    std::vector<int64_t> slots = big_relative;
+    CHECK(fixup_apply_parallel((char*)slots.data(), big_count * 8, big_table.data(), big_count, 0, 4, NULL, NULL) == CRYSTALIZE_ERROR_NONE);
+    uint32_t wrong_count = 0;
+    for (uint32_t index = 0; index < big_count; ++index) {
+      wrong_count += slots[index] != (int64_t)(intptr_t)(slots.data() + (index * 7 + 3) % big_count);
+    }
+    CHECK(wrong_count == 0);
+
+    // with the caller's handler, which here runs the tasks backwards on the calling thread
+    struct handler_t {
+      static void parallel_for(void* ctx, crystalize_task_func_t func, void* arg, uint32_t task_count) {
+        *(uint32_t*)ctx = task_count;
+        for (uint32_t index = task_count; index > 0; --index) {
+          func(arg, index - 1);
+        }
+      }
+    };
+    uint32_t task_count = 0;
+    slots = big_relative;
+    CHECK(fixup_apply_parallel((char*)slots.data(), big_count * 8, big_table.data(), big_count, 0, 4, &handler_t::parallel_for, &task_count) == CRYSTALIZE_ERROR_NONE);
+    CHECK(task_count == 4);
+    wrong_count = 0;
+    for (uint32_t index = 0; index < big_count; ++index) {
+      wrong_count += slots[index] != (int64_t)(intptr_t)(slots.data() + (index * 7 + 3) % big_count);
+    }
+    CHECK(wrong_count == 0);
+
+    // errors in the first and last ranges are both reported
+    for (uint32_t bad : {10u, big_count - 10}) {
+      slots = big_relative;
+      slots[bad] = -1 - (int64_t)bad * 8;
+      CHECK(fixup_apply_parallel((char*)slots.data(), big_count * 8, big_table.data(), big_count, 0, 4, &handler_t::parallel_for, &task_count) == CRYSTALIZE_ERROR_POINTER_INVALID);
+    }
+
+    // a slot listed in two ranges is fixed up once, the same as on a single thread
+    std::vector<uint32_t> dup_table = big_table;
+    const uint32_t dup = big_count / 4 + 5;
+    dup_table[dup] = dup_table[10];
+    slots = big_relative;
+    const crystalize_error_t serial_error = fixup_apply((char*)slots.data(), big_count * 8, dup_table.data(), big_count, 0);
+    const std::vector<int64_t> serial_slots = slots;
+    for (crystalize_parallel_for_handler_t handler : {(crystalize_parallel_for_handler_t)NULL, &handler_t::parallel_for}) {
+      slots = big_relative;
+      CHECK(fixup_apply_parallel((char*)slots.data(), big_count * 8, dup_table.data(), big_count, 0, 4, handler, &task_count) == serial_error);
+      CHECK(memcmp(slots.data(), serial_slots.data(), big_count * 8) == 0);
+    }
+  }
+
+  SECTION("every implementation rejects slots and addresses outside the buffer") {
+    for (int impl = 0; impl < FIXUP_IMPL_COUNT; ++impl) {
+      if (!fixup_impl_supported((fixup_impl_t)impl)) {
+        continue;
+      }
+      INFO(fixup_impl_name((fixup_impl_t)impl));
+      // in each lane of a batch and in the tail
+      for (uint32_t bad : {0u, 1u, 2u, 3u, 5u, 7u, 34u, 36u}) {
+        INFO(bad);
+        std::vector<uint32_t> bad_table = table;
+        std::vector<int64_t> slots = relative;
+        bad_table[bad] = size - 4;
+        CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), size, bad_table.data(), count, 0) == CRYSTALIZE_ERROR_POINTER_INVALID);
+        bad_table[bad] = 0xfffffff8u;
+        slots = relative;
+        CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), size, bad_table.data(), count, 0) == CRYSTALIZE_ERROR_POINTER_INVALID);
+
+        slots = relative;
+        slots[bad] = -(int64_t)bad * 8 - 1;
+        CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), size, table.data(), count, 0) == CRYSTALIZE_ERROR_POINTER_INVALID);
+        slots = relative;
+        slots[bad] = (int64_t)size - (int64_t)bad * 8;
+        CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), size, table.data(), count, 0) == CRYSTALIZE_ERROR_POINTER_INVALID);
+        slots = relative;
+        slots[bad] = (int64_t)1 << 32;
+        CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), size, table.data(), count, 0) == CRYSTALIZE_ERROR_POINTER_INVALID);
+
+        slots = based;
+        slots[bad] = (int64_t)base_address - 8;
+        CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), size, table.data(), count, base_address) == CRYSTALIZE_ERROR_POINTER_INVALID);
+        slots = based;
+        slots[bad] = (int64_t)(base_address + size);
+        CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), size, table.data(), count, base_address) == CRYSTALIZE_ERROR_POINTER_INVALID);
+      }
+
+      // a slot listed twice gets an address the second time, which isn't an offset within the buffer
+      for (uint32_t duplicates : {2u, 4u, 8u}) {
+        INFO(duplicates);
+        std::vector<uint32_t> duplicate_table(duplicates, 8);
+        std::vector<int64_t> slots(8, 0);
+        CHECK(fixup_apply_with((fixup_impl_t)impl, (char*)slots.data(), 64, duplicate_table.data(), duplicates, 0) == CRYSTALIZE_ERROR_POINTER_INVALID);
+      }
+    }
+  }
 }
@@ -26,11 +26,21 @@ void crystalize_free_ex(void* ptr, const char* file, int line, const char* func)
   s_config.free_handler(ptr, file, line, func);
 }
 
-void* crystalize_realloc_ex(void* ptr, size_t size, const char* file, int line, const char* func) {
+void* crystalize_realloc_ex(void* ptr, size_t old_size, size_t size, const char* file, int line, const char* func) {
+  if (s_config.realloc_handler != NULL) {
+    return s_config.realloc_handler(ptr, old_size, size, file, line, func);
+  }
+  if (s_config.alloc_handler == &default_alloc_handler && s_config.free_handler == &default_free_handler) {
+    // the block came from malloc(), so let the C library grow it in place or remap it when it can
+    void* new_ptr = realloc(ptr, size);
+    crystalize_assert(new_ptr != NULL, "allocation failed");
+    return new_ptr;
+  }
+
   void* new_ptr = crystalize_alloc_ex(size, file, line, func);
   crystalize_assert(new_ptr != NULL, "allocation failed");
   if (ptr != NULL) {
-    memmove(new_ptr, ptr, size);
+    memmove(new_ptr, ptr, old_size < size ? old_size : size);
     crystalize_free_ex(ptr, __FILE__, __LINE__, __func__);
   }
   return new_ptr;
@@ -12,11 +12,11 @@ void crystalize_assert_ex(const char* file, int line, const char* func, const ch
 
 #define crystalize_alloc(size) crystalize_alloc_ex(size, __FILE__, __LINE__, __func__)
 #define crystalize_free(ptr) crystalize_free_ex(ptr, __FILE__, __LINE__, __func__)
-#define crystalize_realloc(ptr, size) crystalize_realloc_ex(ptr, size, __FILE__, __LINE__, __func__)
+#define crystalize_realloc(ptr, old_size, size) crystalize_realloc_ex(ptr, old_size, size, __FILE__, __LINE__, __func__)
 
 void* crystalize_alloc_ex(size_t size, const char* file, int line, const char* func);
 void crystalize_free_ex(void* ptr, const char* file, int line, const char* func);
-void* crystalize_realloc_ex(void* ptr, size_t size, const char* file, int line, const char* func);
+void* crystalize_realloc_ex(void* ptr, size_t old_size, size_t size, const char* file, int line, const char* func);
 
 void default_assert_handler(const char* file, int line, const char* func, const char* expression, const char* message);
 void* default_alloc_handler(size_t size, const char* file, int line, const char* func);
@@ -0,0 +1,999 @@
+#include <stdalign.h>
+#include <string.h>
+#include "config.h"
+#include "convert.h"
+#include "hash.h"
+#include "schema.h"
+#include "thread.h"
+
+#define ALIGN(x, align) (((x) + (align)-1) & (~((align)-1)))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define NOT_FOUND UINT32_MAX
+#define CONVERT_PLAN_SLOTS 256   // a power of two
+#define CONVERT_PLAN_PROBES 8    // slots a plan can be from its home slot before one gets evicted
+#define CONVERT_SAME_MAX_PAIRS 64 // structs compared without a plan before giving up and building one
+
+typedef enum convert_op_t {
+  CONVERT_OP_COPY,    // the same scalar type, copied as bytes
+  CONVERT_OP_SCALAR,  // different scalar types, converted element by element
+  CONVERT_OP_STRUCT,  // embedded structs, converted element by element
+  CONVERT_OP_POINTER, // a pointer to structs or scalars elsewhere in the graph
+} convert_op_t;
+
+// How one field of the target struct is filled in from the file's struct. Target fields without one stay zeroed.
+typedef struct convert_field_t {
+  uint32_t src_offset;
+  uint32_t dst_offset;
+  uint32_t count;            // the element count (byte count if a copy)
+  uint32_t struct_index;     // the plan struct of the elements (if struct or struct pointer)
+  uint32_t src_count_offset; // byte offset of the file field providing the count (if counted pointer)
+  uint8_t op;                // convert_op_t
+  uint8_t src_type;
+  uint8_t dst_type;
+  uint8_t src_count_type; // the type of the file field providing the count (if counted pointer)
+  bool counted;
+} convert_field_t;
+
+// Converts one file struct into one target struct.
+typedef struct convert_struct_t {
+  uint32_t src_size;
+  uint32_t dst_size;
+  uint32_t dst_alignment;
+  uint32_t first_field;
+  uint32_t field_count;
+} convert_struct_t;
+
+// Everything needed to convert data written with one schema table into a target schema. Plans only hold offsets and
+// types so they outlive the buffer they were built from. The root is always struct 0.
+typedef struct convert_plan_t {
+  uint64_t fingerprint; // of the file's whole schema table
+  uint32_t root_name_id;
+  uint32_t root_version;
+  const crystalize_schema_t* target;
+  crystalize_schema_t* file_schemas; // a copy of the file's schema table (without names) to check cache hits against
+  uint32_t file_schema_count;
+  bool identical;     // the file lays out exactly like the target so there's nothing to convert
+  uint32_t ref_count; // one for the cache and one for each caller, freed when the last one is released
+  uint64_t last_used; // when the cache last handed it out
+  convert_struct_t* structs;
+  uint32_t struct_count;
+  uint32_t struct_capacity;
+  convert_field_t* fields;
+  uint32_t field_count;
+  uint32_t field_capacity;
+} convert_plan_t;
+
+// A file schema and the target schema it's being converted into.
+typedef struct planner_pair_t {
+  uint32_t file_index;
+  const crystalize_schema_t* target;
+} planner_pair_t;
+
+typedef struct planner_t {
+  convert_plan_t* plan;
+  schema_entry_t* file_entries; // the file's schemas with their layouts, computed as they're needed
+  uint8_t* file_states;         // PLANNER_LAYOUT_* for each file schema
+  uint32_t file_count;
+  planner_pair_t* pairs; // one per plan struct
+  uint32_t pair_capacity;
+  crystalize_error_t error;
+} planner_t;
+
+enum {
+  PLANNER_LAYOUT_NONE,
+  PLANNER_LAYOUT_BUSY,
+  PLANNER_LAYOUT_DONE,
+};
+
+// A pointed-to array in the file along with where it goes in the converted allocation.
+typedef struct convert_object_t {
+  const char* src;
+  uint32_t count;
+  uint32_t struct_index; // NOT_FOUND for scalars
+  uint8_t src_type;
+  uint8_t dst_type;
+  size_t dst_offset;
+} convert_object_t;
+
+typedef struct converter_t {
+  const convert_plan_t* plan;
+  const char* buf;
+  uint32_t buf_size;
+  convert_object_t* objects;
+  uint32_t object_count;
+  uint32_t object_capacity;
+  uint32_t* slots; // open-addressed map from object key to object index + 1 (0 marks an empty slot)
+  uint32_t slot_capacity;
+  uint32_t* rescans; // objects that grew after they were scanned
+  uint32_t rescan_count;
+  uint32_t rescan_capacity;
+  uint32_t scan_cursor;
+  char* dst;
+  crystalize_error_t error;
+} converter_t;
+
+static mutex_t s_plans_lock;
+static convert_plan_t* s_plans[CONVERT_PLAN_SLOTS]; // open addressed, slots are replaced but never emptied
+static uint64_t s_plans_clock;
+
+static void array_grow_if_needed(void* entries_ptr, uint32_t count, uint32_t* capacity, size_t element_size) {
+  if (count < *capacity) {
+    return;
+  }
+  void** entries = (void**)entries_ptr;
+  const uint32_t new_capacity = *capacity > 0 ? *capacity * 2 : 16;
+  *entries = crystalize_realloc(*entries, *capacity * element_size, new_capacity * element_size);
+  crystalize_assert(*entries != NULL, "allocation failed");
+  *capacity = new_capacity;
+}
+
+static uint32_t count_get_value_as_uint32(crystalize_type_t type, const void* data) {
+  switch (type) {
+    case CRYSTALIZE_INT8:
+      return (uint32_t)(*(const int8_t*)data);
+    case CRYSTALIZE_INT16:
+      return (uint32_t)(*(const int16_t*)data);
+    case CRYSTALIZE_INT32:
+      return (uint32_t)(*(const int32_t*)data);
+    case CRYSTALIZE_UINT8:
+      return (uint32_t)(*(const uint8_t*)data);
+    case CRYSTALIZE_UINT16:
+      return (uint32_t)(*(const uint16_t*)data);
+    case CRYSTALIZE_UINT32:
+      return (uint32_t)(*(const uint32_t*)data);
+    default:
+      // the file's schema table was checked, but not that count fields have a sensible type
+      return 0;
+  }
+}
+
+// Converts a single scalar between any two scalar types the same way a C cast would.
+static void convert_scalar(char* dst, crystalize_type_t dst_type, const char* src, crystalize_type_t src_type) {
+  double real = 0.0;
+  int64_t integer = 0;
+  bool is_real = false;
+  switch (src_type) {
+#define READ_INTEGER(type_enum, ctype) \
+  case type_enum: {                     \
+    ctype value;                        \
+    memcpy(&value, src, sizeof(ctype)); \
+    integer = (int64_t)value;           \
+    break;                              \
+  }
+    READ_INTEGER(CRYSTALIZE_BOOL, bool)
+    READ_INTEGER(CRYSTALIZE_CHAR, char)
+    READ_INTEGER(CRYSTALIZE_INT8, int8_t)
+    READ_INTEGER(CRYSTALIZE_INT16, int16_t)
+    READ_INTEGER(CRYSTALIZE_INT32, int32_t)
+    READ_INTEGER(CRYSTALIZE_INT64, int64_t)
+    READ_INTEGER(CRYSTALIZE_UINT8, uint8_t)
+    READ_INTEGER(CRYSTALIZE_UINT16, uint16_t)
+    READ_INTEGER(CRYSTALIZE_UINT32, uint32_t)
+    READ_INTEGER(CRYSTALIZE_UINT64, uint64_t)
+#undef READ_INTEGER
+    case CRYSTALIZE_FLOAT: {
+      float value;
+      memcpy(&value, src, sizeof(float));
+      real = value;
+      is_real = true;
+      break;
+    }
+    case CRYSTALIZE_DOUBLE:
+      memcpy(&real, src, sizeof(double));
+      is_real = true;
+      break;
+    default:
+      return;
+  }
+
+  switch (dst_type) {
+#define WRITE(type_enum, ctype)                                 \
+  case type_enum: {                                             \
+    const ctype value = is_real ? (ctype)real : (ctype)integer; \
+    memcpy(dst, &value, sizeof(ctype));                         \
+    break;                                                      \
+  }
+    WRITE(CRYSTALIZE_BOOL, bool)
+    WRITE(CRYSTALIZE_CHAR, char)
+    WRITE(CRYSTALIZE_INT8, int8_t)
+    WRITE(CRYSTALIZE_INT16, int16_t)
+    WRITE(CRYSTALIZE_INT32, int32_t)
+    WRITE(CRYSTALIZE_INT64, int64_t)
+    WRITE(CRYSTALIZE_UINT8, uint8_t)
+    WRITE(CRYSTALIZE_UINT16, uint16_t)
+    WRITE(CRYSTALIZE_UINT32, uint32_t)
+    WRITE(CRYSTALIZE_UINT64, uint64_t)
+    WRITE(CRYSTALIZE_FLOAT, float)
+    WRITE(CRYSTALIZE_DOUBLE, double)
+#undef WRITE
+    default:
+      break;
+  }
+}
+
+// Hashes everything in the schema table that affects layout, so files written with the same schemas share a plan.
+static uint64_t convert_fingerprint(const crystalize_schema_t* schemas, uint32_t schema_count) {
+  uint64_t hash = fnv1a64(NULL, 0);
+  for (uint32_t schema_index = 0; schema_index < schema_count; ++schema_index) {
+    const crystalize_schema_t* schema = schemas + schema_index;
+    const uint32_t schema_values[3] = {schema->name_id, schema->version, schema->field_count};
+    hash = fnv1a64_with_seed((const char*)schema_values, sizeof(schema_values), hash);
+    for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
+      const crystalize_schema_field_t* field = schema->fields + field_index;
+      const uint32_t field_values[6] = {
+          field->name_id, field->struct_name_id, field->struct_version, field->count, field->count_field_name_id, field->type};
+      hash = fnv1a64_with_seed((const char*)field_values, sizeof(field_values), hash);
+    }
+  }
+  return hash;
+}
+
+static bool convert_fields_equal(const crystalize_schema_field_t* a, const crystalize_schema_field_t* b) {
+  return a->name_id == b->name_id && a->struct_name_id == b->struct_name_id && a->struct_version == b->struct_version &&
+         a->count == b->count && a->count_field_name_id == b->count_field_name_id && a->type == b->type;
+}
+
+// Returns true if the file's schema table is the one the plan was built from, comparing everything the fingerprint
+// hashes so two tables that happen to share a fingerprint never share a plan.
+static bool convert_plan_matches(const convert_plan_t* plan, const crystalize_schema_t* file_schemas, uint32_t file_schema_count) {
+  if (plan->file_schema_count != file_schema_count) {
+    return false;
+  }
+  for (uint32_t schema_index = 0; schema_index < file_schema_count; ++schema_index) {
+    const crystalize_schema_t* a = plan->file_schemas + schema_index;
+    const crystalize_schema_t* b = file_schemas + schema_index;
+    if (a->name_id != b->name_id || a->version != b->version || a->field_count != b->field_count) {
+      return false;
+    }
+    for (uint32_t field_index = 0; field_index < a->field_count; ++field_index) {
+      if (!convert_fields_equal(a->fields + field_index, b->fields + field_index)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Copies the file's schema table into a single allocation owned by the plan.
+static void convert_plan_copy_schemas(convert_plan_t* plan, const crystalize_schema_t* file_schemas, uint32_t file_schema_count) {
+  uint32_t field_count = 0;
+  for (uint32_t index = 0; index < file_schema_count; ++index) {
+    field_count += file_schemas[index].field_count;
+  }
+  const size_t schemas_size = file_schema_count * sizeof(crystalize_schema_t);
+  char* copy = (char*)crystalize_alloc(MAX(schemas_size + field_count * sizeof(crystalize_schema_field_t), 1));
+  crystalize_assert(copy != NULL, "allocation failed");
+  plan->file_schemas = (crystalize_schema_t*)copy;
+  plan->file_schema_count = file_schema_count;
+  crystalize_schema_field_t* fields = (crystalize_schema_field_t*)(copy + schemas_size);
+  for (uint32_t index = 0; index < file_schema_count; ++index) {
+    const crystalize_schema_t* schema = file_schemas + index;
+    memcpy(fields, schema->fields, schema->field_count * sizeof(crystalize_schema_field_t));
+    for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
+      fields[field_index].name = NULL;
+    }
+    plan->file_schemas[index] = *schema;
+    plan->file_schemas[index].name = NULL;
+    plan->file_schemas[index].fields = fields;
+    fields += schema->field_count;
+  }
+}
+
+static void convert_plan_free(convert_plan_t* plan) {
+  crystalize_free(plan->file_schemas);
+  crystalize_free(plan->structs);
+  crystalize_free(plan->fields);
+  crystalize_free(plan);
+}
+
+static void convert_plan_release(const convert_plan_t* plan) {
+  mutex_lock(&s_plans_lock);
+  convert_plan_t* owned = (convert_plan_t*)plan;
+  --owned->ref_count;
+  const bool unused = owned->ref_count == 0;
+  mutex_unlock(&s_plans_lock);
+  if (unused) {
+    convert_plan_free(owned);
+  }
+}
+
+static uint32_t planner_file_find(const planner_t* planner, uint32_t name_id, uint32_t version) {
+  for (uint32_t index = 0; index < planner->file_count; ++index) {
+    const crystalize_schema_t* schema = &planner->file_entries[index].schema;
+    if (schema->name_id == name_id && schema->version == version) {
+      return index;
+    }
+  }
+  return NOT_FOUND;
+}
+
+static bool planner_layout(planner_t* planner, uint32_t file_index);
+
+static const crystalize_schema_t* planner_resolve(void* ctx, uint32_t name_id, uint32_t version) {
+  planner_t* planner = (planner_t*)ctx;
+  const uint32_t file_index = planner_file_find(planner, name_id, version);
+  if (file_index == NOT_FOUND || !planner_layout(planner, file_index)) {
+    return NULL;
+  }
+  return &planner->file_entries[file_index].schema;
+}
+
+// Computes the layout of a file schema, along with the file schemas it embeds.
+static bool planner_layout(planner_t* planner, uint32_t file_index) {
+  if (planner->file_states[file_index] != PLANNER_LAYOUT_NONE) {
+    // pointers back to a struct that's still being laid out only need the schema
+    return true;
+  }
+  planner->file_states[file_index] = PLANNER_LAYOUT_BUSY;
+  const crystalize_error_t error = schema_layout_init(planner->file_entries + file_index, &planner_resolve, planner);
+  if (error != CRYSTALIZE_ERROR_NONE) {
+    planner->error = error;
+    return false;
+  }
+  planner->file_states[file_index] = PLANNER_LAYOUT_DONE;
+  return true;
+}
+
+static bool planner_field_identical(const crystalize_schema_field_t* a, const crystalize_schema_field_t* b) {
+  // struct versions are left out since the nested structs get compared on their own
+  return a->name_id == b->name_id && a->type == b->type && a->count == b->count && a->count_field_name_id == b->count_field_name_id &&
+         a->struct_name_id == b->struct_name_id;
+}
+
+// Adds the conversion from a file schema into a target schema to the plan and returns its index. Nested structs are
+// planned first so each struct's fields end up next to each other.
+static uint32_t planner_struct(planner_t* planner, uint32_t file_index, const crystalize_schema_t* target) {
+  convert_plan_t* plan = planner->plan;
+  for (uint32_t index = 0; index < plan->struct_count; ++index) {
+    if (planner->pairs[index].file_index == file_index && planner->pairs[index].target == target) {
+      return index;
+    }
+  }
+  if (!planner_layout(planner, file_index)) {
+    return NOT_FOUND;
+  }
+  const crystalize_schema_t* file_schema = &planner->file_entries[file_index].schema;
+  const schema_layout_t* file_layout = schema_get_layout(file_schema);
+  const schema_layout_t* target_layout = schema_get_layout(target);
+  if (file_layout->size == 0) {
+    // zero sized arrays would take up none of the buffer, so their counts couldn't be checked against it
+    planner->error = CRYSTALIZE_ERROR_SCHEMA_TABLE_INVALID;
+    return NOT_FOUND;
+  }
+
+  array_grow_if_needed(&plan->structs, plan->struct_count, &plan->struct_capacity, sizeof(convert_struct_t));
+  array_grow_if_needed(&planner->pairs, plan->struct_count, &planner->pair_capacity, sizeof(planner_pair_t));
+  const uint32_t struct_index = plan->struct_count;
+  ++plan->struct_count;
+  planner->pairs[struct_index].file_index = file_index;
+  planner->pairs[struct_index].target = target;
+  convert_struct_t* convert_struct = plan->structs + struct_index;
+  convert_struct->src_size = file_layout->size;
+  convert_struct->dst_size = target_layout->size;
+  convert_struct->dst_alignment = target_layout->alignment;
+
+  bool identical = file_schema->field_count == target->field_count;
+  convert_field_t* fields = (convert_field_t*)crystalize_alloc(MAX(target->field_count, 1) * sizeof(convert_field_t));
+  crystalize_assert(fields != NULL, "allocation failed");
+  uint32_t field_count = 0;
+  for (uint32_t dst_index = 0; dst_index < target->field_count; ++dst_index) {
+    const crystalize_schema_field_t* dst_field = target->fields + dst_index;
+    if (identical && !planner_field_identical(dst_field, file_schema->fields + dst_index)) {
+      identical = false;
+    }
+
+    // fields are matched up by name
+    uint32_t src_index = 0;
+    while (src_index < file_schema->field_count && file_schema->fields[src_index].name_id != dst_field->name_id) {
+      ++src_index;
+    }
+    if (src_index == file_schema->field_count) {
+      continue;
+    }
+    const crystalize_schema_field_t* src_field = file_schema->fields + src_index;
+    const bool is_pointer = schema_field_is_pointer(dst_field);
+    if (schema_field_is_pointer(src_field) != is_pointer) {
+      continue;
+    }
+    if ((src_field->type == CRYSTALIZE_STRUCT) != (dst_field->type == CRYSTALIZE_STRUCT)) {
+      continue;
+    }
+
+    convert_field_t* field = fields + field_count;
+    memset(field, 0, sizeof(convert_field_t));
+    field->src_offset = file_layout->fields[src_index].offset;
+    field->dst_offset = target_layout->fields[dst_index].offset;
+    field->src_type = src_field->type;
+    field->dst_type = dst_field->type;
+    field->struct_index = NOT_FOUND;
+    if (dst_field->type == CRYSTALIZE_STRUCT) {
+      const uint32_t nested_file_index = planner_file_find(planner, src_field->struct_name_id, src_field->struct_version);
+      if (nested_file_index == NOT_FOUND) {
+        planner->error = CRYSTALIZE_ERROR_SCHEMA_TABLE_INVALID;
+      }
+      else {
+        field->struct_index = planner_struct(planner, nested_file_index, target_layout->fields[dst_index].struct_schema);
+      }
+      if (planner->error != CRYSTALIZE_ERROR_NONE) {
+        crystalize_free(fields);
+        return NOT_FOUND;
+      }
+    }
+
+    if (is_pointer) {
+      field->op = CONVERT_OP_POINTER;
+      field->count = 1;
+      if (schema_field_is_pointer_counted(src_field)) {
+        field->counted = true;
+        field->src_count_offset = file_layout->fields[src_index].count_offset;
+        field->src_count_type = file_layout->fields[src_index].count_type;
+      }
+    }
+    else if (dst_field->type == CRYSTALIZE_STRUCT) {
+      field->op = CONVERT_OP_STRUCT;
+      field->count = MIN(src_field->count, dst_field->count);
+    }
+    else if (src_field->type == dst_field->type) {
+      field->op = CONVERT_OP_COPY;
+      field->count = MIN(src_field->count, dst_field->count) * type_get_size((crystalize_type_t)dst_field->type);
+    }
+    else {
+      field->op = CONVERT_OP_SCALAR;
+      field->count = MIN(src_field->count, dst_field->count);
+    }
+    ++field_count;
+  }
+
+  // the nested structs have been planned, so this struct's fields can go on the end
+  for (uint32_t index = 0; index < field_count; ++index) {
+    array_grow_if_needed(&plan->fields, plan->field_count, &plan->field_capacity, sizeof(convert_field_t));
+    plan->fields[plan->field_count] = fields[index];
+    ++plan->field_count;
+  }
+  plan->structs[struct_index].first_field = plan->field_count - field_count;
+  plan->structs[struct_index].field_count = field_count;
+  plan->identical = plan->identical && identical;
+  crystalize_free(fields);
+  return struct_index;
+}
+
+static convert_plan_t* convert_plan_create(const crystalize_schema_t* file_schemas,
+                                           uint32_t file_schema_count,
+                                           uint64_t fingerprint,
+                                           uint32_t root_name_id,
+                                           uint32_t root_version,
+                                           const crystalize_schema_t* target,
+                                           crystalize_error_t* error) {
+  convert_plan_t* plan = (convert_plan_t*)crystalize_alloc(sizeof(convert_plan_t));
+  crystalize_assert(plan != NULL, "allocation failed");
+  memset(plan, 0, sizeof(convert_plan_t));
+  plan->fingerprint = fingerprint;
+  plan->ref_count = 1;
+  plan->root_name_id = root_name_id;
+  plan->root_version = root_version;
+  plan->target = target;
+  plan->identical = true;
+
+  planner_t planner;
+  memset(&planner, 0, sizeof(planner_t));
+  planner.plan = plan;
+  planner.file_count = file_schema_count;
+  planner.file_entries = (schema_entry_t*)crystalize_alloc(MAX(file_schema_count, 1) * sizeof(schema_entry_t));
+  planner.file_states = (uint8_t*)crystalize_alloc(MAX(file_schema_count, 1));
+  crystalize_assert(planner.file_entries != NULL && planner.file_states != NULL, "allocation failed");
+  memset(planner.file_entries, 0, file_schema_count * sizeof(schema_entry_t));
+  memset(planner.file_states, PLANNER_LAYOUT_NONE, file_schema_count);
+  for (uint32_t index = 0; index < file_schema_count; ++index) {
+    planner.file_entries[index].schema = file_schemas[index];
+  }
+
+  const uint32_t root_file_index = planner_file_find(&planner, root_name_id, root_version);
+  if (root_file_index == NOT_FOUND) {
+    planner.error = CRYSTALIZE_ERROR_SCHEMA_NOT_FOUND;
+  }
+  else {
+    planner_struct(&planner, root_file_index, target);
+  }
+
+  for (uint32_t index = 0; index < file_schema_count; ++index) {
+    if (planner.file_states[index] == PLANNER_LAYOUT_DONE) {
+      schema_layout_free(&planner.file_entries[index].layout);
+    }
+  }
+  crystalize_free(planner.file_entries);
+  crystalize_free(planner.file_states);
+  crystalize_free(planner.pairs);
+
+  if (planner.error != CRYSTALIZE_ERROR_NONE) {
+    *error = planner.error;
+    convert_plan_free(plan);
+    return NULL;
+  }
+  convert_plan_copy_schemas(plan, file_schemas, file_schema_count);
+  return plan;
+}
+static uint32_t convert_plan_home(uint64_t fingerprint, uint32_t root_name_id, uint32_t root_version, const crystalize_schema_t* target) {
+  const uint32_t hash = (uint32_t)fingerprint ^ (uint32_t)(fingerprint >> 32) ^ (root_name_id * 0x9e3779b9u) ^ root_version ^ hash_pointer(target);
+  return hash & (CONVERT_PLAN_SLOTS - 1);
+}
+
+// Looks up the plan in the cache, or builds it and caches it in place of the least recently used plan near its home
+// slot. The plan has to be handed back to convert_plan_release().
+static const convert_plan_t* convert_plan_get(const crystalize_schema_t* file_schemas,
+                                              uint32_t file_schema_count,
+                                              uint32_t root_name_id,
+                                              uint32_t root_version,
+                                              const crystalize_schema_t* target,
+                                              crystalize_error_t* error) {
+  const uint64_t fingerprint = convert_fingerprint(file_schemas, file_schema_count);
+  const uint32_t home = convert_plan_home(fingerprint, root_name_id, root_version, target);
+
+  mutex_lock(&s_plans_lock);
+  ++s_plans_clock;
+  for (uint32_t probe = 0; probe < CONVERT_PLAN_PROBES; ++probe) {
+    convert_plan_t* candidate = s_plans[(home + probe) & (CONVERT_PLAN_SLOTS - 1)];
+    if (candidate == NULL) {
+      break;
+    }
+    if (candidate->fingerprint == fingerprint && candidate->root_name_id == root_name_id && candidate->root_version == root_version &&
+        candidate->target == target && convert_plan_matches(candidate, file_schemas, file_schema_count)) {
+      candidate->last_used = s_plans_clock;
+      ++candidate->ref_count;
+      mutex_unlock(&s_plans_lock);
+      return candidate;
+    }
+  }
+  mutex_unlock(&s_plans_lock);
+
+  // planning can take a while, so it's done without the lock and only the first plan for the key gets cached
+  convert_plan_t* plan = convert_plan_create(file_schemas, file_schema_count, fingerprint, root_name_id, root_version, target, error);
+  if (plan == NULL) {
+    return NULL;
+  }
+
+  mutex_lock(&s_plans_lock);
+  uint32_t victim = home;
+  for (uint32_t probe = 0; probe < CONVERT_PLAN_PROBES; ++probe) {
+    const uint32_t slot = (home + probe) & (CONVERT_PLAN_SLOTS - 1);
+    convert_plan_t* candidate = s_plans[slot];
+    if (candidate == NULL) {
+      victim = slot;
+      break;
+    }
+    if (candidate->fingerprint == fingerprint && candidate->root_name_id == root_name_id && candidate->root_version == root_version &&
+        candidate->target == target && convert_plan_matches(candidate, file_schemas, file_schema_count)) {
+      // another thread cached the same plan in the meantime, so this one is only used for this call
+      mutex_unlock(&s_plans_lock);
+      return plan;
+    }
+    if (candidate->last_used < s_plans[victim]->last_used) {
+      victim = slot;
+    }
+  }
+  convert_plan_t* evicted = s_plans[victim];
+  plan->last_used = s_plans_clock;
+  ++plan->ref_count;
+  s_plans[victim] = plan;
+  if (evicted != NULL) {
+    // callers still using it keep it alive until they release it
+    --evicted->ref_count;
+    if (evicted->ref_count != 0) {
+      evicted = NULL;
+    }
+  }
+  mutex_unlock(&s_plans_lock);
+  if (evicted != NULL) {
+    convert_plan_free(evicted);
+  }
+  return plan;
+}
+
+static uint32_t converter_hash(const char* src, uint32_t struct_index, uint8_t src_type, uint8_t dst_type) {
+  return hash_pointer(src) ^ (struct_index * 0x9e3779b9u) ^ ((uint32_t)src_type << 8) ^ dst_type;
+}
+
+static uint32_t* converter_slot(converter_t* converter, const char* src, uint32_t struct_index, uint8_t src_type, uint8_t dst_type) {
+  const uint32_t mask = converter->slot_capacity - 1;
+  uint32_t slot = converter_hash(src, struct_index, src_type, dst_type) & mask;
+  while (converter->slots[slot] != 0) {
+    const convert_object_t* object = converter->objects + converter->slots[slot] - 1;
+    if (object->src == src && object->struct_index == struct_index && object->src_type == src_type && object->dst_type == dst_type) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return converter->slots + slot;
+}
+
+static void converter_slots_grow(converter_t* converter) {
+  const uint32_t old_capacity = converter->slot_capacity;
+  uint32_t* old_slots = converter->slots;
+  converter->slot_capacity = old_capacity > 0 ? old_capacity * 2 : 64;
+  converter->slots = (uint32_t*)crystalize_alloc(converter->slot_capacity * sizeof(uint32_t));
+  crystalize_assert(converter->slots != NULL, "allocation failed");
+  memset(converter->slots, 0, converter->slot_capacity * sizeof(uint32_t));
+  for (uint32_t index = 0; index < converter->object_count; ++index) {
+    const convert_object_t* object = converter->objects + index;
+    *converter_slot(converter, object->src, object->struct_index, object->src_type, object->dst_type) = index + 1;
+  }
+  crystalize_free(old_slots);
+}
+
+// Records an array the converted data needs, merging it with any earlier array at the same address.
+static void converter_visit(converter_t* converter, const char* src, uint32_t count, uint32_t struct_index, uint8_t src_type, uint8_t dst_type) {
+  // every element takes up at least a byte of the buffer
+  const uint32_t element_size = MAX(
+      struct_index != NOT_FOUND ? converter->plan->structs[struct_index].src_size : type_get_size((crystalize_type_t)src_type), 1);
+  if (src < converter->buf || count > (uint32_t)(converter->buf + converter->buf_size - src) / element_size) {
+    converter->error = CRYSTALIZE_ERROR_POINTER_INVALID;
+    return;
+  }
+
+  if ((converter->object_count + 1) * 2 > converter->slot_capacity) {
+    converter_slots_grow(converter);
+  }
+  uint32_t* slot = converter_slot(converter, src, struct_index, src_type, dst_type);
+  if (*slot != 0) {
+    // a longer array at the same address takes in the shorter one
+    const uint32_t index = *slot - 1;
+    if (count > converter->objects[index].count) {
+      converter->objects[index].count = count;
+      if (index < converter->scan_cursor) {
+        array_grow_if_needed(&converter->rescans, converter->rescan_count, &converter->rescan_capacity, sizeof(uint32_t));
+        converter->rescans[converter->rescan_count] = index;
+        ++converter->rescan_count;
+      }
+    }
+    return;
+  }
+
+  array_grow_if_needed(&converter->objects, converter->object_count, &converter->object_capacity, sizeof(convert_object_t));
+  convert_object_t* object = converter->objects + converter->object_count;
+  object->src = src;
+  object->count = count;
+  object->struct_index = struct_index;
+  object->src_type = src_type;
+  object->dst_type = dst_type;
+  object->dst_offset = 0;
+  ++converter->object_count;
+  *slot = converter->object_count;
+}
+
+static uint32_t converter_pointer_count(const convert_field_t* field, const char* src) {
+  if (field->counted) {
+    return count_get_value_as_uint32((crystalize_type_t)field->src_count_type, src + field->src_count_offset);
+  }
+  return 1;
+}
+
+// Finds the arrays that a file struct points at.
+static void converter_scan_struct(converter_t* converter, uint32_t struct_index, const char* src) {
+  const convert_struct_t* convert_struct = converter->plan->structs + struct_index;
+  for (uint32_t index = 0; index < convert_struct->field_count && converter->error == CRYSTALIZE_ERROR_NONE; ++index) {
+    const convert_field_t* field = converter->plan->fields + convert_struct->first_field + index;
+    if (field->op == CONVERT_OP_STRUCT) {
+      const uint32_t element_size = converter->plan->structs[field->struct_index].src_size;
+      for (uint32_t element = 0; element < field->count; ++element) {
+        converter_scan_struct(converter, field->struct_index, src + field->src_offset + element * element_size);
+      }
+    }
+    else if (field->op == CONVERT_OP_POINTER) {
+      const char* ptr;
+      memcpy(&ptr, src + field->src_offset, sizeof(ptr));
+      const uint32_t count = converter_pointer_count(field, src);
+      if (ptr != NULL && count > 0) {
+        converter_visit(converter, ptr, count, field->struct_index, field->src_type, field->dst_type);
+      }
+    }
+  }
+}
+
+// Converts one file struct into the target struct at dst, which has already been zeroed.
+static void converter_convert_struct(converter_t* converter, uint32_t struct_index, char* dst, const char* src) {
+  const convert_struct_t* convert_struct = converter->plan->structs + struct_index;
+  for (uint32_t index = 0; index < convert_struct->field_count; ++index) {
+    const convert_field_t* field = converter->plan->fields + convert_struct->first_field + index;
+    char* field_dst = dst + field->dst_offset;
+    const char* field_src = src + field->src_offset;
+    switch (field->op) {
+      case CONVERT_OP_COPY:
+        memcpy(field_dst, field_src, field->count);
+        break;
+      case CONVERT_OP_SCALAR: {
+        const uint32_t dst_size = type_get_size((crystalize_type_t)field->dst_type);
+        const uint32_t src_size = type_get_size((crystalize_type_t)field->src_type);
+        for (uint32_t element = 0; element < field->count; ++element) {
+          convert_scalar(field_dst + element * dst_size, (crystalize_type_t)field->dst_type, field_src + element * src_size, (crystalize_type_t)field->src_type);
+        }
+        break;
+      }
+      case CONVERT_OP_STRUCT: {
+        const convert_struct_t* element_struct = converter->plan->structs + field->struct_index;
+        for (uint32_t element = 0; element < field->count; ++element) {
+          converter_convert_struct(converter, field->struct_index, field_dst + element * element_struct->dst_size, field_src + element * element_struct->src_size);
+        }
+        break;
+      }
+      case CONVERT_OP_POINTER: {
+        const char* ptr;
+        memcpy(&ptr, field_src, sizeof(ptr));
+        if (ptr == NULL || converter_pointer_count(field, src) == 0) {
+          break;
+        }
+        const uint32_t object_index = *converter_slot(converter, ptr, field->struct_index, field->src_type, field->dst_type) - 1;
+        char* target = converter->dst + converter->objects[object_index].dst_offset;
+        memcpy(field_dst, &target, sizeof(target));
+        break;
+      }
+    }
+  }
+}
+
+static void converter_free(converter_t* converter) {
+  crystalize_free(converter->objects);
+  crystalize_free(converter->slots);
+  crystalize_free(converter->rescans);
+}
+
+// Copies the graph rooted at root into a single new allocation in the plan's target layout.
+static void* converter_run(converter_t* converter, const char* root) {
+  const convert_plan_t* plan = converter->plan;
+
+  // find every array that's reachable from the root
+  converter_visit(converter, root, 1, 0, CRYSTALIZE_STRUCT, CRYSTALIZE_STRUCT);
+  while (converter->error == CRYSTALIZE_ERROR_NONE && (converter->scan_cursor < converter->object_count || converter->rescan_count > 0)) {
+    uint32_t object_index;
+    if (converter->rescan_count > 0) {
+      --converter->rescan_count;
+      object_index = converter->rescans[converter->rescan_count];
+    }
+    else {
+      object_index = converter->scan_cursor;
+      ++converter->scan_cursor;
+    }
+    const convert_object_t object = converter->objects[object_index];
+    if (object.struct_index == NOT_FOUND) {
+      continue;
+    }
+    const uint32_t element_size = plan->structs[object.struct_index].src_size;
+    for (uint32_t element = 0; element < object.count && converter->error == CRYSTALIZE_ERROR_NONE; ++element) {
+      converter_scan_struct(converter, object.struct_index, object.src + element * element_size);
+    }
+  }
+  if (converter->error != CRYSTALIZE_ERROR_NONE) {
+    return NULL;
+  }
+
+  // lay them out one after the other
+  size_t size = 0;
+  for (uint32_t index = 0; index < converter->object_count; ++index) {
+    convert_object_t* object = converter->objects + index;
+    uint32_t alignment;
+    uint32_t element_size;
+    if (object->struct_index != NOT_FOUND) {
+      alignment = plan->structs[object->struct_index].dst_alignment;
+      element_size = plan->structs[object->struct_index].dst_size;
+    }
+    else {
+      alignment = type_get_alignment((crystalize_type_t)object->dst_type);
+      element_size = type_get_size((crystalize_type_t)object->dst_type);
+    }
+    size = ALIGN(size, (size_t)alignment);
+    object->dst_offset = size;
+    size += (size_t)object->count * element_size;
+  }
+
+  // convert them
+  converter->dst = (char*)crystalize_alloc(size);
+  if (converter->dst == NULL) {
+    converter->error = CRYSTALIZE_ERROR_ALLOCATION_FAILED;
+    return NULL;
+  }
+  memset(converter->dst, 0, size);
+  for (uint32_t index = 0; index < converter->object_count; ++index) {
+    const convert_object_t* object = converter->objects + index;
+    char* dst = converter->dst + object->dst_offset;
+    if (object->struct_index != NOT_FOUND) {
+      const convert_struct_t* convert_struct = plan->structs + object->struct_index;
+      for (uint32_t element = 0; element < object->count; ++element) {
+        converter_convert_struct(converter, object->struct_index, dst + element * convert_struct->dst_size, object->src + element * convert_struct->src_size);
+      }
+    }
+    else if (object->src_type == object->dst_type) {
+      memcpy(dst, object->src, object->count * type_get_size((crystalize_type_t)object->src_type));
+    }
+    else {
+      const uint32_t dst_size = type_get_size((crystalize_type_t)object->dst_type);
+      const uint32_t src_size = type_get_size((crystalize_type_t)object->src_type);
+      for (uint32_t element = 0; element < object->count; ++element) {
+        convert_scalar(dst + element * dst_size, (crystalize_type_t)object->dst_type, object->src + element * src_size, (crystalize_type_t)object->src_type);
+      }
+    }
+  }
+  return converter->dst;
+}
+
+void convert_init(void) {
+  mutex_init(&s_plans_lock);
+  memset(s_plans, 0, sizeof(s_plans));
+  s_plans_clock = 0;
+}
+
+void convert_shutdown(void) {
+  for (uint32_t index = 0; index < CONVERT_PLAN_SLOTS; ++index) {
+    if (s_plans[index] != NULL) {
+      convert_plan_free(s_plans[index]);
+      s_plans[index] = NULL;
+    }
+  }
+  mutex_destroy(&s_plans_lock);
+}
+
+// The fields of a file schema, which are still an offset when the buffer is being viewed.
+static const crystalize_schema_field_t* convert_schema_fields(const crystalize_schema_t* schema, bool fields_are_offsets) {
+  return fields_are_offsets ? (const crystalize_schema_field_t*)crystalize_offset_resolve(&schema->fields) : schema->fields;
+}
+
+static bool convert_schemas_valid(const crystalize_schema_t* file_schemas, uint32_t file_schema_count, bool fields_are_offsets, const char* buf, uint32_t buf_size) {
+  for (uint32_t schema_index = 0; schema_index < file_schema_count; ++schema_index) {
+    const crystalize_schema_t* schema = file_schemas + schema_index;
+    const crystalize_schema_field_t* fields = convert_schema_fields(schema, fields_are_offsets);
+    if (schema->field_count == 0 || (const char*)fields < buf || (const char*)fields > buf + buf_size ||
+        schema->field_count > (uint32_t)(buf + buf_size - (const char*)fields) / sizeof(crystalize_schema_field_t)) {
+      return false;
+    }
+    for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
+      if (fields[field_index].type > CRYSTALIZE_STRUCT) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static const crystalize_schema_t* convert_schema_find(const crystalize_schema_t* file_schemas, uint32_t file_schema_count, uint32_t name_id, uint32_t version) {
+  for (uint32_t index = 0; index < file_schema_count; ++index) {
+    if (file_schemas[index].name_id == name_id && file_schemas[index].version == version) {
+      return file_schemas + index;
+    }
+  }
+  return NULL;
+}
+
+bool convert_is_same(const crystalize_schema_t* file_schemas,
+                     uint32_t file_schema_count,
+                     bool fields_are_offsets,
+                     uint32_t root_name_id,
+                     uint32_t root_version,
+                     const crystalize_schema_t* target,
+                     const char* buf,
+                     uint32_t buf_size) {
+  if (!convert_schemas_valid(file_schemas, file_schema_count, fields_are_offsets, buf, buf_size)) {
+    return false;
+  }
+
+  // the file struct and target struct pairs that have to match, starting with the root, each compared once
+  const crystalize_schema_t* file_structs[CONVERT_SAME_MAX_PAIRS];
+  const crystalize_schema_t* target_structs[CONVERT_SAME_MAX_PAIRS];
+  file_structs[0] = convert_schema_find(file_schemas, file_schema_count, root_name_id, root_version);
+  target_structs[0] = target;
+  uint32_t pair_count = file_structs[0] != NULL ? 1 : 0;
+  for (uint32_t pair = 0; pair < pair_count; ++pair) {
+    const crystalize_schema_t* file_schema = file_structs[pair];
+    const crystalize_schema_t* target_schema = target_structs[pair];
+    if (file_schema->field_count != target_schema->field_count) {
+      return false;
+    }
+    const crystalize_schema_field_t* fields = convert_schema_fields(file_schema, fields_are_offsets);
+    const schema_layout_t* target_layout = schema_get_layout(target_schema);
+    for (uint32_t index = 0; index < target_schema->field_count; ++index) {
+      const crystalize_schema_field_t* field = fields + index;
+      if (!planner_field_identical(target_schema->fields + index, field)) {
+        return false;
+      }
+      if (field->type != CRYSTALIZE_STRUCT) {
+        continue;
+      }
+      const crystalize_schema_t* nested = convert_schema_find(file_schemas, file_schema_count, field->struct_name_id, field->struct_version);
+      const crystalize_schema_t* nested_target = target_layout->fields[index].struct_schema;
+      uint32_t seen = 0;
+      while (seen < pair_count && (file_structs[seen] != nested || target_structs[seen] != nested_target)) {
+        ++seen;
+      }
+      if (seen < pair_count) {
+        continue;
+      }
+      if (nested == NULL || pair_count == CONVERT_SAME_MAX_PAIRS) {
+        return false;
+      }
+      file_structs[pair_count] = nested;
+      target_structs[pair_count] = nested_target;
+      ++pair_count;
+    }
+  }
+  return pair_count > 0;
+}
+
+// Checks the file's schema table is well formed and gets the plan for it.
+static const convert_plan_t* convert_plan_find(const crystalize_schema_t* file_schemas,
+                                               uint32_t file_schema_count,
+                                               uint32_t root_name_id,
+                                               uint32_t root_version,
+                                               const crystalize_schema_t* target,
+                                               const char* buf,
+                                               uint32_t buf_size,
+                                               crystalize_decode_result_t* result) {
+  if (!convert_schemas_valid(file_schemas, file_schema_count, false, buf, buf_size)) {
+    result->error = CRYSTALIZE_ERROR_SCHEMA_TABLE_INVALID;
+    return NULL;
+  }
+
+  crystalize_error_t error = CRYSTALIZE_ERROR_NONE;
+  const convert_plan_t* plan = convert_plan_get(file_schemas, file_schema_count, root_name_id, root_version, target, &error);
+  if (plan == NULL) {
+    result->error = error;
+  }
+  return plan;
+}
+
+void* convert_root(const crystalize_schema_t* file_schemas,
+                   uint32_t file_schema_count,
+                   uint32_t root_name_id,
+                   uint32_t root_version,
+                   const crystalize_schema_t* target,
+                   void* root,
+                   const char* buf,
+                   uint32_t buf_size,
+                   crystalize_decode_result_t* result) {
+  if (convert_is_same(file_schemas, file_schema_count, false, root_name_id, root_version, target, buf, buf_size)) {
+    return root;
+  }
+  const convert_plan_t* plan = convert_plan_find(file_schemas, file_schema_count, root_name_id, root_version, target, buf, buf_size, result);
+  if (plan == NULL) {
+    return NULL;
+  }
+  if (plan->identical) {
+    convert_plan_release(plan);
+    return root;
+  }
+
+  converter_t converter;
+  memset(&converter, 0, sizeof(converter_t));
+  converter.plan = plan;
+  converter.buf = buf;
+  converter.buf_size = buf_size;
+  void* data = converter_run(&converter, (const char*)root);
+  converter_free(&converter);
+  convert_plan_release(plan);
+  if (data == NULL) {
+    result->error = converter.error;
+    return NULL;
+  }
+  result->buf = (char*)data;
+  return data;
+}
+
+bool convert_is_identical(const crystalize_schema_t* file_schemas,
+                          uint32_t file_schema_count,
+                          uint32_t root_name_id,
+                          uint32_t root_version,
+                          const crystalize_schema_t* target,
+                          const char* buf,
+                          uint32_t buf_size,
+                          crystalize_decode_result_t* result) {
+  if (convert_is_same(file_schemas, file_schema_count, false, root_name_id, root_version, target, buf, buf_size)) {
+    return true;
+  }
+  const convert_plan_t* plan = convert_plan_find(file_schemas, file_schema_count, root_name_id, root_version, target, buf, buf_size, result);
+  if (plan == NULL) {
+    return false;
+  }
+  const bool identical = plan->identical;
+  convert_plan_release(plan);
+  if (!identical) {
+    result->error = CRYSTALIZE_ERROR_SCHEMA_MISMATCH;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "crystalize.h"
+
+// Sets up and tears down the cache of conversion plans. Called from crystalize_init() and crystalize_shutdown().
+void convert_init(void);
+void convert_shutdown(void);
+
+// Returns the data rooted at root as the target schema. root is a struct of the file schema with the given name and
+// version and the buffer's pointers must already be fixed up. When the file's schemas lay out the same as the
+// registered ones this is root itself, otherwise the whole graph is converted into a new allocation that's handed back
+// in result->buf. Fields are matched by name, fields the file doesn't have are zeroed and fields the target doesn't
+// have are dropped. Files that lay out exactly like the target are recognized without a plan. Otherwise the plan for
+// a given file schema table and target schema is built once and cached, with the least recently used plans evicted
+// once the cache fills up. The error is CRYSTALIZE_ERROR_ALLOCATION_FAILED if there's no memory for
+// the converted data.
+void* convert_root(const crystalize_schema_t* file_schemas,
+                   uint32_t file_schema_count,
+                   uint32_t root_name_id,
+                   uint32_t root_version,
+                   const crystalize_schema_t* target,
+                   void* root,
+                   const char* buf,
+                   uint32_t buf_size,
+                   crystalize_decode_result_t* result);
+
+// Returns true if the file's schema table is well formed and lays out exactly like the target, comparing the structs
+// reachable from the root in place without a plan, an allocation or a lock. When the table is viewed its fields
+// pointers are still offsets, which fields_are_offsets says. False doesn't say why, and may also mean the structs were
+// too many to compare this way, so convert_is_identical() gives the answer and the error.
+bool convert_is_same(const crystalize_schema_t* file_schemas,
+                     uint32_t file_schema_count,
+                     bool fields_are_offsets,
+                     uint32_t root_name_id,
+                     uint32_t root_version,
+                     const crystalize_schema_t* target,
+                     const char* buf,
+                     uint32_t buf_size);
+
+// Returns true if the file's schemas lay out exactly like the target, so the data can be used without converting. The
+// error is CRYSTALIZE_ERROR_SCHEMA_MISMATCH when they don't.
+bool convert_is_identical(const crystalize_schema_t* file_schemas,
+                          uint32_t file_schema_count,
+                          uint32_t root_name_id,
+                          uint32_t root_version,
+                          const crystalize_schema_t* target,
+                          const char* buf,
+                          uint32_t buf_size,
+                          crystalize_decode_result_t* result);
@@ -4,40 +4,81 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <errno.h>
+#include <unistd.h>
+#endif
 #include "crystalize.h"
 #include "config.h"
+#include "convert.h"
 #include "encoder.h"
+#include "fixup.h"
 #include "hash.h"
+#include "mapped_file.h"
+#include "schema.h"
 
-// typedef struct schema_table_entry_t {
-//   uint32_t name_id;
-// } schema_table_entry_t;
-//
-// static int s_schema_table_capacity;
-// static int s_schema_table_count;
-// static uint32_t* s_schema_table_names;
-// static uint32_t* s_schema_table_versions;
-// static schema_table_entry_t* s_schema_table;
-
-static int s_schemas_capacity;
+// The registry is an open-addressed hash table keyed on (name_id, version). The keys are stored inline so probing
+// doesn't touch the entries, and entries are allocated individually so schema pointers stay valid when the table
+// grows.
+typedef struct schema_slot_t {
+  uint32_t name_id;
+  uint32_t version;
+  schema_entry_t* entry; // NULL marks an empty slot
+} schema_slot_t;
+
+static int s_schemas_capacity; // always a power of two
 static int s_schemas_count;
-static crystalize_schema_t* s_schemas;
+static schema_slot_t* s_schemas;
 
 crystalize_schema_t s_schema_schema;              // the schema for crystalize_schema_t
 static crystalize_schema_t s_schema_schema_field; // the schema for crystalize_schema_field_t
 static crystalize_schema_field_t s_schema_schema_fields[6];
 static crystalize_schema_field_t s_schema_schema_field_fields[8];
 
-static int schema_find(uint32_t name_id, uint32_t version) {
-  for (int index = 0; index < s_schemas_count; ++index) {
-    const crystalize_schema_t* schema = s_schemas + index;
-    if (schema->name_id == name_id) {
-      if (schema->version == version) {
-        return index;
-      }
+static uint32_t schema_hash(uint32_t name_id, uint32_t version) {
+  // name_id is already a hash, so only the version needs mixing in
+  return name_id ^ (version * 0x9e3779b9u);
+}
+
+static schema_slot_t* schema_slot(schema_slot_t* table, int capacity, uint32_t name_id, uint32_t version) {
+  const uint32_t mask = (uint32_t)capacity - 1;
+  uint32_t index = schema_hash(name_id, version) & mask;
+  while (table[index].entry != NULL) {
+    if (table[index].name_id == name_id && table[index].version == version) {
+      break;
+    }
+    index = (index + 1) & mask;
+  }
+  return table + index;
+}
+
+static schema_entry_t* schema_find(uint32_t name_id, uint32_t version) {
+  if (s_schemas_count == 0) {
+    return NULL;
+  }
+  return schema_slot(s_schemas, s_schemas_capacity, name_id, version)->entry;
+}
+
+static void schema_table_grow() {
+  const int new_capacity = s_schemas_capacity > 0 ? s_schemas_capacity * 2 : 256;
+  schema_slot_t* table = (schema_slot_t*)crystalize_alloc(new_capacity * sizeof(schema_slot_t));
+  crystalize_assert(table != NULL, "allocation failed");
+  memset(table, 0, new_capacity * sizeof(schema_slot_t));
+  for (int index = 0; index < s_schemas_capacity; ++index) {
+    const schema_slot_t* slot = s_schemas + index;
+    if (slot->entry != NULL) {
+      *schema_slot(table, new_capacity, slot->name_id, slot->version) = *slot;
     }
   }
-  return -1;
+  crystalize_free(s_schemas);
+  s_schemas = table;
+  s_schemas_capacity = new_capacity;
+}
+
+static const crystalize_schema_t* schema_resolve_registered(void* ctx, uint32_t name_id, uint32_t version) {
+  return crystalize_schema_get(name_id, version);
 }
 
 void crystalize_config_init(crystalize_config_t* config) {
@@ -48,6 +89,35 @@ void crystalize_config_init(crystalize_config_t* config) {
   config->assert_handler = &default_assert_handler;
   config->alloc_handler = &default_alloc_handler;
   config->free_handler = &default_free_handler;
+  config->realloc_handler = NULL;
+}
+
+void crystalize_arena_init(crystalize_arena_t* arena, void* buf, size_t size) {
+  crystalize_assert(arena != NULL, "arena cannot be null");
+  arena->buf = (char*)buf;
+  arena->size = size;
+  arena->used = 0;
+}
+
+static void encode_result_init(crystalize_encode_result_t* result) {
+  result->buf = NULL;
+  result->buf_size = 0;
+  result->error = CRYSTALIZE_ERROR_NONE;
+  result->error_message = NULL;
+  result->dedup_bytes_saved = 0;
+}
+
+void crystalize_encode_options_init(crystalize_encode_options_t* options) {
+  if (options == NULL) {
+    return;
+  }
+
+  options->exact_size = false;
+  options->dedup_content = false;
+  options->thread_count = 0;
+  options->base_address = 0;
+  options->compact_pointer_table = false;
+  options->paged_pointer_table = false;
 }
 
 void crystalize_init(const crystalize_config_t* config) {
@@ -61,6 +131,9 @@ void crystalize_init(const crystalize_config_t* config) {
   s_schemas_capacity = 0;
   s_schemas_count = 0;
   s_schemas = NULL;
+  convert_init();
+  fixup_init();
+  encoder_decode_init();
 
   crystalize_schema_init(&s_schema_schema_field, "__crystalize_schema_field_t", 0, s_schema_schema_field_fields, 8);
   crystalize_schema_field_init_counted_scalar(s_schema_schema_field_fields + 0, "name", CRYSTALIZE_CHAR, "name_size");
@@ -84,13 +157,20 @@ void crystalize_init(const crystalize_config_t* config) {
 }
 
 void crystalize_shutdown() {
-  for (int schema_index = 0; schema_index < s_schemas_count; ++schema_index) {
-    crystalize_schema_t* schema = s_schemas + schema_index;
+  convert_shutdown();
+  for (int schema_index = 0; schema_index < s_schemas_capacity; ++schema_index) {
+    schema_entry_t* entry = s_schemas[schema_index].entry;
+    if (entry == NULL) {
+      continue;
+    }
+    crystalize_schema_t* schema = &entry->schema;
     for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
       crystalize_free((void*)schema->fields[field_index].name);
     }
     crystalize_free((void*)schema->fields);
     crystalize_free((void*)schema->name);
+    schema_layout_free(&entry->layout);
+    crystalize_free(entry);
   }
   crystalize_free(s_schemas);
   s_schemas = NULL;
@@ -172,6 +252,21 @@ void crystalize_schema_field_init_counted_struct(crystalize_schema_field_t* fiel
   field->type = CRYSTALIZE_STRUCT;
 }
 
+void crystalize_schema_field_init_struct_pointer(crystalize_schema_field_t* field, const char* name, const crystalize_schema_t* schema) {
+  crystalize_assert(field != NULL, "field cannot be null");
+  crystalize_assert(name != NULL, "name cannot be null");
+  crystalize_assert(schema != NULL, "schema cannot be null");
+  const uint32_t name_len = strlen(name);
+  field->name = name;
+  field->name_size = name_len + 1;
+  field->name_id = fnv1a(name, name_len);
+  field->struct_name_id = schema->name_id;
+  field->struct_version = schema->version;
+  field->count = 0;
+  field->count_field_name_id = 0;
+  field->type = CRYSTALIZE_STRUCT;
+}
+
 void crystalize_schema_init(crystalize_schema_t* schema,
                             const char* name,
                             uint32_t version,
@@ -196,7 +291,7 @@ crystalize_error_t crystalize_schema_add(const crystalize_schema_t* schema) {
     return CRYSTALIZE_ERROR_SCHEMA_IS_EMPTY;
   }
   // check if the schema is already registered
-  if (-1 != schema_find(schema->name_id, schema->version)) {
+  if (NULL != schema_find(schema->name_id, schema->version)) {
     return CRYSTALIZE_ERROR_SCHEMA_ALREADY_ADDED;
   }
 
@@ -211,7 +306,12 @@ crystalize_error_t crystalize_schema_add(const crystalize_schema_t* schema) {
   for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
     const crystalize_schema_field_t* field = schema->fields + field_index;
     if (field->struct_name_id != 0) {
-      if (-1 == schema_find(field->struct_name_id, field->struct_version)) {
+      // pointers can refer back to the schema being added, which is how recursive structures are described
+      const bool is_self = field->struct_name_id == schema->name_id && field->struct_version == schema->version;
+      if (is_self && schema_field_is_pointer(field)) {
+        continue;
+      }
+      if (NULL == schema_find(field->struct_name_id, field->struct_version)) {
         return CRYSTALIZE_ERROR_SCHEMA_NOT_FOUND;
       }
     }
@@ -258,39 +358,206 @@ crystalize_error_t crystalize_schema_add(const crystalize_schema_t* schema) {
     fields_copy[field_index].name = crystalize_strdup(fields_copy[field_index].name);
   }
 
-  if (s_schemas_count >= s_schemas_capacity) {
-    s_schemas_capacity += 128;
-    s_schemas = (crystalize_schema_t*)crystalize_realloc(s_schemas, s_schemas_capacity * sizeof(crystalize_schema_t*));
+  schema_entry_t* entry = (schema_entry_t*)crystalize_alloc(sizeof(schema_entry_t));
+  crystalize_assert(entry != NULL, "allocation failed");
+  entry->schema = *schema;
+  entry->schema.name = crystalize_strdup(schema->name);
+  entry->schema.fields = fields_copy;
+
+  // compile the layout once so encoding and decoding never have to walk the fields to find offsets
+  const crystalize_error_t layout_error = schema_layout_init(entry, &schema_resolve_registered, NULL);
+  if (layout_error != CRYSTALIZE_ERROR_NONE) {
+    for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
+      crystalize_free((void*)fields_copy[field_index].name);
+    }
+    crystalize_free(fields_copy);
+    crystalize_free((void*)entry->schema.name);
+    crystalize_free(entry);
+    return layout_error;
   }
-  s_schemas[s_schemas_count] = *schema;
-  s_schemas[s_schemas_count].name = crystalize_strdup(s_schemas[s_schemas_count].name);
-  s_schemas[s_schemas_count].fields = fields_copy;
+
+  // keep the load factor at or below 1/2 so probe sequences stay short
+  if ((s_schemas_count + 1) * 2 > s_schemas_capacity) {
+    schema_table_grow();
+  }
+  schema_slot_t* slot = schema_slot(s_schemas, s_schemas_capacity, schema->name_id, schema->version);
+  slot->name_id = schema->name_id;
+  slot->version = schema->version;
+  slot->entry = entry;
   ++s_schemas_count;
 
   return CRYSTALIZE_ERROR_NONE;
 }
 
 const crystalize_schema_t* crystalize_schema_get(uint32_t schema_name_id, uint32_t schema_version) {
-  const int index = schema_find(schema_name_id, schema_version);
-  if (index == -1) {
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  if (entry == NULL) {
     return NULL;
   }
   else {
-    return s_schemas + index;
+    return &entry->schema;
   }
 }
 
 void crystalize_encode(uint32_t schema_name_id, uint32_t schema_version, const void* data, crystalize_encode_result_t* result) {
+  crystalize_encode_ex(schema_name_id, schema_version, data, NULL, result);
+}
+
+void crystalize_encode_ex(uint32_t schema_name_id, uint32_t schema_version, const void* data, const crystalize_encode_options_t* options, crystalize_encode_result_t* result) {
   crystalize_assert(result, "result cannot be null");
-  const int schema_index = schema_find(schema_name_id, schema_version);
-  crystalize_assert(schema_index != -1, "schema not found");
-  const crystalize_schema_t* schema = s_schemas + schema_index;
+  crystalize_encode_options_t options_default;
+  if (options == NULL) {
+    crystalize_encode_options_init(&options_default);
+    options = &options_default;
+  }
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
 
-  result->buf = NULL;
-  result->buf_size = 0;
-  result->error = CRYSTALIZE_ERROR_NONE;
-  result->error_message = NULL;
-  encoder_encode(schema, data, result);
+  encode_result_init(result);
+  encoder_encode(schema, data, options, result);
+}
+
+void crystalize_encode_into(uint32_t schema_name_id,
+                            uint32_t schema_version,
+                            const void* data,
+                            char* buf,
+                            uint32_t buf_size,
+                            crystalize_arena_t* scratch,
+                            crystalize_encode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  crystalize_assert(scratch, "scratch cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  encode_result_init(result);
+  encoder_encode_into(schema, data, buf, buf_size, scratch, result);
+}
+
+void crystalize_encode_to_handler(uint32_t schema_name_id,
+                                  uint32_t schema_version,
+                                  const void* data,
+                                  crystalize_write_handler_t handler,
+                                  void* ctx,
+                                  crystalize_encode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  crystalize_assert(handler, "handler cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  encode_result_init(result);
+  encoder_encode_to_sink(schema, data, handler, ctx, result);
+}
+
+static bool fd_write(void* ctx, const void* data, uint32_t size) {
+  const int fd = *(const int*)ctx;
+  const char* cur = (const char*)data;
+  while (size > 0) {
+#if defined(_WIN32)
+    const int written = _write(fd, cur, size);
+#else
+    const ssize_t written = write(fd, cur, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+#endif
+    if (written <= 0) {
+      return false;
+    }
+    cur += written;
+    size -= (uint32_t)written;
+  }
+  return true;
+}
+
+void crystalize_encode_to_fd(uint32_t schema_name_id, uint32_t schema_version, const void* data, int fd, crystalize_encode_result_t* result) {
+  crystalize_encode_to_handler(schema_name_id, schema_version, data, &fd_write, &fd, result);
+}
+
+void crystalize_encode_to_file(uint32_t schema_name_id,
+                               uint32_t schema_version,
+                               const void* data,
+                               int fd,
+                               const crystalize_encode_options_t* options,
+                               crystalize_encode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  crystalize_encode_options_t options_default;
+  if (options == NULL) {
+    crystalize_encode_options_init(&options_default);
+    options = &options_default;
+  }
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  encode_result_init(result);
+  encoder_encode_to_file(schema, data, fd, options, result);
+}
+
+void crystalize_encode_size(uint32_t schema_name_id, uint32_t schema_version, const void* data, crystalize_encode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  encode_result_init(result);
+  encoder_encode_size(schema, data, result);
+}
+
+crystalize_encoder_t* crystalize_encoder_create(void) {
+  return encoder_context_create();
+}
+
+void crystalize_encoder_destroy(crystalize_encoder_t* encoder) {
+  if (encoder != NULL) {
+    encoder_context_destroy(encoder);
+  }
+}
+
+void crystalize_encoder_reset(crystalize_encoder_t* encoder) {
+  crystalize_assert(encoder, "encoder cannot be null");
+  encoder_context_reset(encoder);
+}
+
+void crystalize_encoder_encode(crystalize_encoder_t* encoder,
+                               uint32_t schema_name_id,
+                               uint32_t schema_version,
+                               const void* data,
+                               const crystalize_encode_options_t* options,
+                               crystalize_encode_result_t* result) {
+  crystalize_assert(encoder, "encoder cannot be null");
+  crystalize_assert(result, "result cannot be null");
+  crystalize_encode_options_t options_default;
+  if (options == NULL) {
+    crystalize_encode_options_init(&options_default);
+    options = &options_default;
+  }
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  encode_result_init(result);
+  encoder_context_encode(encoder, schema, data, options, result);
+}
+
+void crystalize_encode_roots(const crystalize_root_t* roots, uint32_t root_count, const crystalize_encode_options_t* options, crystalize_encode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  crystalize_assert(roots != NULL || root_count == 0, "roots cannot be null");
+  crystalize_encode_options_t options_default;
+  if (options == NULL) {
+    crystalize_encode_options_init(&options_default);
+    options = &options_default;
+  }
+
+  encode_result_init(result);
+  encoder_encode_roots(roots, root_count, options, result);
+}
+
+uint64_t crystalize_root_key(const char* name) {
+  crystalize_assert(name, "name cannot be null");
+  return fnv1a64(name, strlen(name));
 }
 
 void crystalize_encode_result_free(crystalize_encode_result_t* result) {
@@ -305,13 +572,215 @@ void crystalize_encode_result_free(crystalize_encode_result_t* result) {
   }
   result->buf_size = 0;
   result->error = CRYSTALIZE_ERROR_NONE;
+  result->dedup_bytes_saved = 0;
+}
+
+void crystalize_decode_options_init(crystalize_decode_options_t* options) {
+  crystalize_assert(options, "options cannot be null");
+  options->thread_count = 0;
+  options->parallel_for_handler = NULL;
+  options->parallel_for_ctx = NULL;
 }
 
 void* crystalize_decode(uint32_t schema_name_id, uint32_t schema_version, char* buf, uint32_t buf_size, crystalize_decode_result_t* result) {
-  const int schema_index = schema_find(schema_name_id, schema_version);
-  crystalize_assert(schema_index != -1, "schema not found");
-  const crystalize_schema_t* schema = s_schemas + schema_index;
+  return crystalize_decode_ex(schema_name_id, schema_version, buf, buf_size, NULL, result);
+}
+
+void* crystalize_decode_ex(uint32_t schema_name_id,
+                           uint32_t schema_version,
+                           char* buf,
+                           uint32_t buf_size,
+                           const crystalize_decode_options_t* options,
+                           crystalize_decode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  crystalize_decode_options_t options_default;
+  if (options == NULL) {
+    crystalize_decode_options_init(&options_default);
+    options = &options_default;
+  }
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  result->error = CRYSTALIZE_ERROR_NONE;
+  result->buf = NULL;
+  return encoder_decode(schema, buf, buf_size, options, result);
+}
+
+void* crystalize_decode_copy(uint32_t schema_name_id,
+                             uint32_t schema_version,
+                             const char* buf,
+                             uint32_t buf_size,
+                             crystalize_arena_t* arena,
+                             crystalize_decode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  result->error = CRYSTALIZE_ERROR_NONE;
+  result->buf = NULL;
+  return encoder_decode_copy(schema, buf, buf_size, arena, result);
+}
+
+void crystalize_decode_result_free(crystalize_decode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  if (result->buf != NULL) {
+    crystalize_free(result->buf);
+    result->buf = NULL;
+  }
+  result->error = CRYSTALIZE_ERROR_NONE;
+}
+
+void* crystalize_decode_root(uint64_t key,
+                             uint32_t schema_name_id,
+                             uint32_t schema_version,
+                             char* buf,
+                             uint32_t buf_size,
+                             crystalize_decode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  result->error = CRYSTALIZE_ERROR_NONE;
+  result->buf = NULL;
+  return encoder_decode_root(key, schema, buf, buf_size, result);
+}
+
+void* crystalize_decode_lazy(uint32_t schema_name_id,
+                             uint32_t schema_version,
+                             char* buf,
+                             uint32_t buf_size,
+                             crystalize_lazy_t* lazy,
+                             crystalize_decode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  crystalize_assert(lazy, "lazy cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
 
   result->error = CRYSTALIZE_ERROR_NONE;
-  return encoder_decode(schema, buf, buf_size, result);
+  result->buf = NULL;
+  return encoder_decode_lazy(schema, buf, buf_size, lazy, result);
+}
+
+void crystalize_lazy_fix_page(crystalize_lazy_t* lazy, uint32_t page) {
+  encoder_lazy_fix_page(lazy, page);
+}
+
+void crystalize_lazy_ensure_range(crystalize_lazy_t* lazy, const void* ptr, size_t size) {
+  encoder_lazy_ensure_range(lazy, ptr, size);
+}
+
+void crystalize_map_options_init(crystalize_map_options_t* options) {
+  crystalize_assert(options, "options cannot be null");
+  options->populate = false;
+  options->advise = true;
+  options->use_base_address = false;
+}
+
+void* crystalize_map_file(uint32_t schema_name_id,
+                          uint32_t schema_version,
+                          int fd,
+                          const crystalize_map_options_t* options,
+                          crystalize_mapped_file_t* file) {
+  crystalize_assert(file, "file cannot be null");
+  crystalize_map_options_t options_default;
+  if (options == NULL) {
+    crystalize_map_options_init(&options_default);
+    options = &options_default;
+  }
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  memset(file, 0, sizeof(crystalize_mapped_file_t));
+  return encoder_map_file(schema, fd, options, file);
+}
+
+void crystalize_unmap(crystalize_mapped_file_t* file) {
+  crystalize_assert(file, "file cannot be null");
+  crystalize_decode_result_free(&file->result);
+  mapped_file_unmap(file->buf, file->buf_size);
+  memset(file, 0, sizeof(crystalize_mapped_file_t));
+}
+
+const void* crystalize_view(uint32_t schema_name_id, uint32_t schema_version, const char* buf, uint32_t buf_size, crystalize_decode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  result->error = CRYSTALIZE_ERROR_NONE;
+  result->buf = NULL;
+  return encoder_view(schema, buf, buf_size, result);
+}
+
+const void* crystalize_view_root(uint64_t key,
+                                 uint32_t schema_name_id,
+                                 uint32_t schema_version,
+                                 const char* buf,
+                                 uint32_t buf_size,
+                                 crystalize_decode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  result->error = CRYSTALIZE_ERROR_NONE;
+  result->buf = NULL;
+  return encoder_view_root(key, schema, buf, buf_size, result);
+}
+
+void crystalize_verify_options_init(crystalize_verify_options_t* options) {
+  crystalize_assert(options, "options cannot be null");
+  options->max_depth = 256;
+  options->max_count = UINT32_MAX;
+  options->max_visit_bytes = 0;
+}
+
+bool crystalize_verify(uint32_t schema_name_id,
+                       uint32_t schema_version,
+                       const char* buf,
+                       uint32_t buf_size,
+                       const crystalize_verify_options_t* options,
+                       crystalize_decode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  crystalize_verify_options_t options_default;
+  if (options == NULL) {
+    crystalize_verify_options_init(&options_default);
+    options = &options_default;
+  }
+
+  result->error = CRYSTALIZE_ERROR_NONE;
+  result->buf = NULL;
+  return encoder_verify(schema, buf, buf_size, options, result);
+}
+
+bool crystalize_verify_root(uint64_t key,
+                            uint32_t schema_name_id,
+                            uint32_t schema_version,
+                            const char* buf,
+                            uint32_t buf_size,
+                            const crystalize_verify_options_t* options,
+                            crystalize_decode_result_t* result) {
+  crystalize_assert(result, "result cannot be null");
+  const schema_entry_t* entry = schema_find(schema_name_id, schema_version);
+  crystalize_assert(entry != NULL, "schema not found");
+  const crystalize_schema_t* schema = &entry->schema;
+
+  crystalize_verify_options_t options_default;
+  if (options == NULL) {
+    crystalize_verify_options_init(&options_default);
+    options = &options_default;
+  }
+
+  result->error = CRYSTALIZE_ERROR_NONE;
+  result->buf = NULL;
+  return encoder_verify_root(key, schema, buf, buf_size, options, result);
 }
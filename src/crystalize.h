@@ -25,19 +25,33 @@ typedef enum crystalize_type_t {
 
 typedef enum crystalize_error_t {
   CRYSTALIZE_ERROR_NONE,
+  CRYSTALIZE_ERROR_ALLOCATION_FAILED,
+  CRYSTALIZE_ERROR_BUFFER_TOO_SMALL,
   CRYSTALIZE_ERROR_DATA_OFFSET_IS_INVALID,
   CRYSTALIZE_ERROR_ENDIAN_MISMATCH,
+  CRYSTALIZE_ERROR_FILE_HAS_MULTIPLE_ROOTS,
   CRYSTALIZE_ERROR_FILE_HEADER_MALFORMED,
+  CRYSTALIZE_ERROR_FILE_IS_DECODED,
   CRYSTALIZE_ERROR_FILE_VERSION_MISMATCH,
+  CRYSTALIZE_ERROR_MAP_FAILED,
   CRYSTALIZE_ERROR_POINTER_INVALID,
   CRYSTALIZE_ERROR_POINTER_SIZE_MISMATCH,
+  CRYSTALIZE_ERROR_POINTER_TABLE_NOT_PAGED,
   CRYSTALIZE_ERROR_POINTER_TABLE_OFFSET_IS_INVALID,
+  CRYSTALIZE_ERROR_ROOT_KEY_DUPLICATED,
+  CRYSTALIZE_ERROR_ROOT_NOT_FOUND,
+  CRYSTALIZE_ERROR_ROOT_SCHEMA_MISMATCH,
   CRYSTALIZE_ERROR_SCHEMA_ALREADY_ADDED,
   CRYSTALIZE_ERROR_SCHEMA_COUNT_FIELD_INVALID_TYPE,
   CRYSTALIZE_ERROR_SCHEMA_COUNT_FIELD_NOT_FOUND,
   CRYSTALIZE_ERROR_SCHEMA_IS_EMPTY,
+  CRYSTALIZE_ERROR_SCHEMA_MISMATCH,
   CRYSTALIZE_ERROR_SCHEMA_NOT_FOUND,
+  CRYSTALIZE_ERROR_SCHEMA_TABLE_INVALID,
+  CRYSTALIZE_ERROR_SCRATCH_EXHAUSTED,
   CRYSTALIZE_ERROR_UNEXPECTED_EOF,
+  CRYSTALIZE_ERROR_VERIFY_LIMIT_EXCEEDED,
+  CRYSTALIZE_ERROR_WRITE_FAILED,
 } crystalize_error_t;
 
 typedef struct crystalize_schema_field_t {
@@ -65,15 +79,141 @@ typedef struct crystalize_encode_result_t {
   uint32_t buf_size;
   crystalize_error_t error;
   char* error_message;
+  uint32_t dedup_bytes_saved; // bytes that weren't written because identical content was already in the buffer
 } crystalize_encode_result_t;
 
+typedef struct crystalize_encoder_t crystalize_encoder_t;
+
+// One of the data structures in a multi-root file, looked up by key when decoding.
+typedef struct crystalize_root_t {
+  uint64_t key; // an integer chosen by the caller, or crystalize_root_key() of a name
+  uint32_t schema_name_id;
+  uint32_t schema_version;
+  const void* data;
+} crystalize_root_t;
+
+// Receives the encoded output in order when streaming. Returns false if the data couldn't be written.
+typedef bool (*crystalize_write_handler_t)(void* ctx, const void* data, uint32_t size);
+
+// A caller-owned block of memory that allocations are carved out of linearly.
+typedef struct crystalize_arena_t {
+  char* buf;
+  size_t size;
+  size_t used;
+} crystalize_arena_t;
+
+typedef struct crystalize_encode_options_t {
+  // Run a sizing pass over the data before encoding so the output buffer is allocated exactly once.
+  bool exact_size;
+
+  // Write identical scalar arrays and pointer-free struct arrays once, even when they're at different addresses.
+  // Every pointer to a duplicate goes to the first copy. This costs a hash and a compare of every such array.
+  bool dedup_content;
+
+  // Write each level of the data structure with this many threads. 0 or 1 encodes on the calling thread. The output is
+  // the same whatever the thread count. The alloc handlers must be thread-safe when this is more than 1.
+  uint32_t thread_count;
+
+  // Write pointers as absolute addresses for a buffer that's loaded at this address rather than as offsets, so decoding
+  // a buffer that's actually there has nothing to fix up. crystalize_map_file() tries to map the file there. Anywhere
+  // else every pointer is relocated by the difference, which costs the same as a normal decode. Should be a multiple
+  // of the page size, 0 for none.
+  uint64_t base_address;
+
+  // Sort the pointer table and write it as varint deltas between slot positions, which takes a byte or two a pointer
+  // rather than four and has the decode fix up the slots front to back. The table has to be read in order, so it's
+  // always fixed up on a single thread.
+  bool compact_pointer_table;
+
+  // Bucket the pointer table by CRYSTALIZE_LAZY_PAGE_SIZE pages of the file, so crystalize_decode_lazy() can fix up
+  // each page the first time it's used. Takes precedence over compact_pointer_table.
+  bool paged_pointer_table;
+} crystalize_encode_options_t;
+
+// Runs func(arg, index) for every index below task_count, on as many threads as it likes, and returns once they've all
+// finished.
+typedef void (*crystalize_task_func_t)(void* arg, uint32_t task_index);
+typedef void (*crystalize_parallel_for_handler_t)(void* ctx, crystalize_task_func_t func, void* arg, uint32_t task_count);
+
+typedef struct crystalize_decode_options_t {
+  // Split the pointer fixups into this many tasks. Without a handler each decode starts a thread for every task but
+  // the first and joins them before it returns. 0 or 1 fixes everything up on the calling thread. Small buffers aren't
+  // worth splitting, so they're always done on the calling thread.
+  uint32_t thread_count;
+
+  // Run the tasks with the caller's thread pool instead of starting threads for every decode (optional).
+  crystalize_parallel_for_handler_t parallel_for_handler;
+  void* parallel_for_ctx;
+} crystalize_decode_options_t;
+
 typedef struct crystalize_decode_result_t {
   crystalize_error_t error;
+  // holds the converted data when the file's schemas didn't match the expected ones, or the copy made by
+  // crystalize_decode_copy() without an arena (NULL if decoded in place)
+  char* buf;
 } crystalize_decode_result_t;
 
+typedef struct crystalize_verify_options_t {
+  // The most pointers that may be followed to reach anything from the root.
+  uint32_t max_depth;
+
+  // The largest count a counted pointer may have.
+  uint32_t max_count;
+
+  // The most bytes of structs with pointers in them that may be walked, counting each struct array once. 0 allows four
+  // times the buffer size, which is enough for any buffer the encoder writes.
+  uint64_t max_visit_bytes;
+} crystalize_verify_options_t;
+
+typedef struct crystalize_map_options_t {
+  // Prefault the whole file while mapping it (MAP_POPULATE, Linux only) rather than faulting pages in as the decode
+  // touches them.
+  bool populate;
+
+  // Tell the kernel that the pointer table is about to be read front to back and the data is about to be fixed up, so
+  // it reads ahead.
+  bool advise;
+
+  // Try to map a file encoded with a base address at that address, so nothing needs fixing up. A file that lands there
+  // is used without checking its pointers at all, so only set this for files that are trusted. Off by default.
+  bool use_base_address;
+} crystalize_map_options_t;
+
+typedef struct crystalize_map_stats_t {
+  uint64_t map_ns;       // time spent mapping the file (including prefaulting)
+  uint64_t decode_ns;    // time spent decoding, including any page faults it took
+  uint64_t minor_faults; // page faults during the load that didn't need any I/O (counted for the whole process)
+  uint64_t major_faults; // page faults during the load that had to read from the file (counted for the whole process)
+} crystalize_map_stats_t;
+
+typedef struct crystalize_mapped_file_t {
+  char* buf; // the private mapping of the file
+  uint32_t buf_size;
+  void* data; // the decoded root
+  crystalize_decode_result_t result;
+  crystalize_map_stats_t stats;
+  bool at_base_address; // the file was mapped at the base address it was encoded for
+} crystalize_mapped_file_t;
+
+#define CRYSTALIZE_LAZY_PAGE_SIZE 4096u
+
+// A buffer decoded with crystalize_decode_lazy(). Which pages have been fixed up is kept in a bitmap inside the buffer.
+typedef struct crystalize_lazy_t {
+  char* buf;
+  uint32_t buf_size;
+  uint32_t page_count; // pages holding pointers, from the start of the buffer
+  uint32_t* fixed_pages; // a bit per page
+  const uint32_t* page_ends; // the end of each page's run of positions
+  const uint32_t* positions;
+  uint32_t pointer_count;
+  uint64_t base_address; // what the pointers are relative to when they're addresses rather than offsets
+  crystalize_error_t error; // the first bad pointer found while fixing up a page
+} crystalize_lazy_t;
+
 typedef void (*crystalize_assert_handler_t)(const char* file, int line, const char* func, const char* expression, const char* message);
 typedef void* (*crystalize_alloc_handler_t)(size_t size, const char* file, int line, const char* func);
 typedef void (*crystalize_free_handler_t)(void* ptr, const char* file, int line, const char* func);
+typedef void* (*crystalize_realloc_handler_t)(void* ptr, size_t old_size, size_t size, const char* file, int line, const char* func);
 
 typedef struct crystalize_config_t {
   // The handler to use when an assertion fails.
@@ -84,6 +224,10 @@ typedef struct crystalize_config_t {
 
   // The handler to use when freeing memory.
   crystalize_free_handler_t free_handler;
+
+  // The handler to use when growing memory (optional). When NULL, growing allocates a new block, copies and frees
+  // the old one, unless the default alloc and free handlers are in use, in which case realloc() is used.
+  crystalize_realloc_handler_t realloc_handler;
 } crystalize_config_t;
 
 void crystalize_config_init(crystalize_config_t* config);
@@ -106,6 +250,9 @@ void crystalize_schema_field_init_counted_struct(crystalize_schema_field_t* fiel
                                                  const char* name,
                                                  const crystalize_schema_t* schema,
                                                  const char* count_field_name);
+// A pointer to a single struct, which may be NULL. To point at the struct being described (a linked list, or a
+// parent pointer) call crystalize_schema_init() on that schema first and pass it here before adding it.
+void crystalize_schema_field_init_struct_pointer(crystalize_schema_field_t* field, const char* name, const crystalize_schema_t* schema);
 void crystalize_schema_init(crystalize_schema_t* schema,
                             const char* name,
                             uint32_t version,
@@ -115,13 +262,253 @@ void crystalize_schema_init(crystalize_schema_t* schema,
 crystalize_error_t crystalize_schema_add(const crystalize_schema_t* schema);
 const crystalize_schema_t* crystalize_schema_get(uint32_t schema_name_id, uint32_t schema_version);
 
+void crystalize_arena_init(crystalize_arena_t* arena, void* buf, size_t size);
+void crystalize_encode_options_init(crystalize_encode_options_t* options);
+
 // Encodes the given data structure into a buffer using the given schema.
 void crystalize_encode(uint32_t schema_name_id, uint32_t schema_version, const void* data, crystalize_encode_result_t* result);
+void crystalize_encode_ex(uint32_t schema_name_id, uint32_t schema_version, const void* data, const crystalize_encode_options_t* options, crystalize_encode_result_t* result);
+
+// Encodes the given data structure into the caller's buffer without touching the alloc handler. All of the
+// encoder's working memory comes from the scratch arena and is handed back before returning. On success
+// result->buf_size is the number of bytes written. If the buffer is too small the error is
+// CRYSTALIZE_ERROR_BUFFER_TOO_SMALL and result->buf_size is the size that's needed. result->buf is always NULL.
+void crystalize_encode_into(uint32_t schema_name_id,
+                            uint32_t schema_version,
+                            const void* data,
+                            char* buf,
+                            uint32_t buf_size,
+                            crystalize_arena_t* scratch,
+                            crystalize_encode_result_t* result);
+
+// A reusable encoder that keeps its working memory and the schemas it gathered for each root schema between
+// encodes. An encoder must only be used by one thread at a time and must be destroyed before
+// crystalize_shutdown().
+crystalize_encoder_t* crystalize_encoder_create(void);
+void crystalize_encoder_destroy(crystalize_encoder_t* encoder);
+
+// Forgets the cached schemas while keeping the working memory around.
+void crystalize_encoder_reset(crystalize_encoder_t* encoder);
+
+// Same as crystalize_encode_ex() but reuses the encoder's memory and cached schemas.
+void crystalize_encoder_encode(crystalize_encoder_t* encoder,
+                               uint32_t schema_name_id,
+                               uint32_t schema_version,
+                               const void* data,
+                               const crystalize_encode_options_t* options,
+                               crystalize_encode_result_t* result);
+
+// Encodes the given data structure and streams it out in order as it's produced, so the whole output is never held
+// in memory. Everything is laid out by a sizing pass first, which means the header and all of the pointers are final
+// before any bytes go out. result->buf is always NULL and result->buf_size is the number of bytes produced. If the
+// handler fails the error is CRYSTALIZE_ERROR_WRITE_FAILED.
+void crystalize_encode_to_handler(uint32_t schema_name_id,
+                                  uint32_t schema_version,
+                                  const void* data,
+                                  crystalize_write_handler_t handler,
+                                  void* ctx,
+                                  crystalize_encode_result_t* result);
+void crystalize_encode_to_fd(uint32_t schema_name_id, uint32_t schema_version, const void* data, int fd, crystalize_encode_result_t* result);
+
+// Encodes the given data structure straight into a shared memory mapping of the file, which is grown as needed and
+// truncated to the encoded size at the end, so there's no separate copy out of a heap buffer. The fd must be open for
+// reading and writing. The file's contents are identical to crystalize_encode()'s buffer and can be mapped and handed
+// to crystalize_decode() as is. result->buf is always NULL and result->buf_size is the file size. Only available on
+// POSIX systems, elsewhere the error is always CRYSTALIZE_ERROR_WRITE_FAILED.
+void crystalize_encode_to_file(uint32_t schema_name_id,
+                               uint32_t schema_version,
+                               const void* data,
+                               int fd,
+                               const crystalize_encode_options_t* options,
+                               crystalize_encode_result_t* result);
+
+// Computes the exact size in bytes that encoding the given data will produce. The size is returned in
+// result->buf_size and no buffer is allocated.
+void crystalize_encode_size(uint32_t schema_name_id, uint32_t schema_version, const void* data, crystalize_encode_result_t* result);
 void crystalize_encode_result_free(crystalize_encode_result_t* result);
 
-// Decodes the buffer IN PLACE using the given expected schema.
+// Encodes several data structures into one buffer along with a directory of them sorted by key. Anything the roots
+// share is written once. Keys must be unique, otherwise the error is CRYSTALIZE_ERROR_ROOT_KEY_DUPLICATED.
+void crystalize_encode_roots(const crystalize_root_t* roots, uint32_t root_count, const crystalize_encode_options_t* options, crystalize_encode_result_t* result);
+
+// The key for a root with a string name.
+uint64_t crystalize_root_key(const char* name);
+
+// Decodes the buffer IN PLACE using the given expected schema. When the file was written with different versions of the
+// schemas, the data is converted into a new allocation instead: fields are matched by name, scalar fields are converted
+// between types, fields the file doesn't have are zeroed and fields the expected schema doesn't have are dropped. The
+// plan for converting each file schema table is worked out once and reused, and if there's no memory for the converted
+// data the error is CRYSTALIZE_ERROR_ALLOCATION_FAILED. Decoding a buffer that's already been decoded returns the same
+// data. Its pointers are checked to be addresses within it, unless this process decoded it where it is now (files
+// without a multi-root, base address or compact or paged table are always checked), and a decoded buffer that's been
+// copied elsewhere fails with CRYSTALIZE_ERROR_FILE_IS_DECODED. Call crystalize_decode_result_free() once the data is
+// no longer needed.
 void* crystalize_decode(uint32_t schema_name_id, uint32_t schema_version, char* buf, uint32_t buf_size, crystalize_decode_result_t* result);
+void crystalize_decode_options_init(crystalize_decode_options_t* options);
+
+// Same as crystalize_decode() but the pointers can be fixed up on several threads. When more than one pointer is bad the
+// error is the one decoding on a single thread would have stopped at.
+void* crystalize_decode_ex(uint32_t schema_name_id,
+                           uint32_t schema_version,
+                           char* buf,
+                           uint32_t buf_size,
+                           const crystalize_decode_options_t* options,
+                           crystalize_decode_result_t* result);
+
+// Decodes a copy of the buffer, leaving the buffer itself untouched so it can be read-only or shared between threads.
+// The copy and its pointer fixups happen in a single pass. The copy is carved out of the arena, which has to have room
+// for buf_size bytes at 16-byte alignment (otherwise the error is CRYSTALIZE_ERROR_BUFFER_TOO_SMALL and nothing is
+// used), or with no arena it's allocated and owned by result->buf. Data written with older schemas is converted as
+// usual, in which case nothing is left used in the arena.
+void* crystalize_decode_copy(uint32_t schema_name_id,
+                             uint32_t schema_version,
+                             const char* buf,
+                             uint32_t buf_size,
+                             crystalize_arena_t* arena,
+                             crystalize_decode_result_t* result);
+void crystalize_decode_result_free(crystalize_decode_result_t* result);
+
+// Maps the whole file copy-on-write and decodes it in place, so pages are only read in as they're needed and the file
+// itself is never modified. The fd can be closed once this returns. Returns the decoded root, which is also in
+// file->data, or NULL with the error in file->result.error (CRYSTALIZE_ERROR_MAP_FAILED if the file couldn't be
+// mapped). Files encoded with a base address are mapped there if the options ask for it and that range is free.
+// file->stats says how long it took and how many page faults it cost. Only available on POSIX systems, elsewhere mapping
+// always fails. Call crystalize_unmap() once the data is no longer needed.
+void crystalize_map_options_init(crystalize_map_options_t* options);
+void* crystalize_map_file(uint32_t schema_name_id,
+                          uint32_t schema_version,
+                          int fd,
+                          const crystalize_map_options_t* options,
+                          crystalize_mapped_file_t* file);
+void crystalize_unmap(crystalize_mapped_file_t* file);
+
+// Returns the root of the encoded data without modifying the buffer, so it can be used straight off a read-only (and
+// shared) mapping of the file with no load-time work. The pointer fields still hold self-relative offsets and have to
+// be followed with crystalize_offset_resolve(), CRYSTALIZE_VIEW() or crystalize::offset_ptr<T>. Nothing past the header
+// is bounds checked. The file must have been written with schemas that lay out exactly like the expected one, otherwise
+// the error is CRYSTALIZE_ERROR_SCHEMA_MISMATCH. A buffer that has already been decoded in place, or that was encoded
+// for a base address, can't be viewed.
+const void* crystalize_view(uint32_t schema_name_id, uint32_t schema_version, const char* buf, uint32_t buf_size, crystalize_decode_result_t* result);
+const void* crystalize_view_root(uint64_t key,
+                                 uint32_t schema_name_id,
+                                 uint32_t schema_version,
+                                 const char* buf,
+                                 uint32_t buf_size,
+                                 crystalize_decode_result_t* result);
+
+// Checks an untrusted buffer before it's viewed or decoded, without modifying it. Everything reachable from the root is
+// walked with the expected schema, and every pointer has to land inside the data, be aligned for its type and stay
+// within the options' limits (otherwise CRYSTALIZE_ERROR_POINTER_INVALID or CRYSTALIZE_ERROR_VERIFY_LIMIT_EXCEEDED).
+// The pointer table has to list exactly the pointers that were found. The cost is bounded by options->max_visit_bytes
+// no matter how the pointers are arranged. Buffers that crystalize_view() can't view can't be verified either.
+// options may be NULL.
+void crystalize_verify_options_init(crystalize_verify_options_t* options);
+bool crystalize_verify(uint32_t schema_name_id,
+                       uint32_t schema_version,
+                       const char* buf,
+                       uint32_t buf_size,
+                       const crystalize_verify_options_t* options,
+                       crystalize_decode_result_t* result);
+
+// Same as crystalize_verify() for a buffer from crystalize_encode_roots(), checking the root with the given key against
+// the expected schema. The pointer table covers every root, so every root in the directory is walked too, each with the
+// schema registered under its name and version (otherwise CRYSTALIZE_ERROR_SCHEMA_NOT_FOUND), which it has to lay out
+// exactly like.
+bool crystalize_verify_root(uint64_t key,
+                            uint32_t schema_name_id,
+                            uint32_t schema_version,
+                            const char* buf,
+                            uint32_t buf_size,
+                            const crystalize_verify_options_t* options,
+                            crystalize_decode_result_t* result);
+
+// Follows a pointer field of viewed data. A NULL pointer is stored as 0, which means a pointer field can't point at
+// itself.
+static inline const void* crystalize_offset_resolve(const void* field) {
+  const int64_t offset = *(const int64_t*)field;
+  return offset != 0 ? (const char*)field + offset : NULL;
+}
+
+// Follows the pointer field of viewed data, e.g. CRYSTALIZE_VIEW(node_t, root->next)[0].value.
+#define CRYSTALIZE_VIEW(type, field) ((const type*)crystalize_offset_resolve(&(field)))
+
+// Finds the root with the given key in a buffer from crystalize_encode_roots() with a binary search of its directory.
+// The pointers in the whole buffer are fixed up and checked in place by the first call, so any number of roots can be
+// looked up in the same buffer afterwards without touching the others.
+void* crystalize_decode_root(uint64_t key,
+                             uint32_t schema_name_id,
+                             uint32_t schema_version,
+                             char* buf,
+                             uint32_t buf_size,
+                             crystalize_decode_result_t* result);
+
+// Returns the root of a buffer encoded with paged_pointer_table without fixing up its pointers, other than the ones in
+// the schema table. Every pointer field has to be read through CRYSTALIZE_LAZY(), which fixes up the page holding it
+// the first time, so only the pages that are used get touched. Scalars can be read as they are. The file must have been
+// written with schemas that lay out exactly like the expected one, otherwise the error is
+// CRYSTALIZE_ERROR_SCHEMA_MISMATCH, and a file without a paged pointer table is
+// CRYSTALIZE_ERROR_POINTER_TABLE_NOT_PAGED. Only one thread at a time may use the lazy buffer. crystalize_decode() can
+// still be called on the same buffer later to fix up the rest.
+void* crystalize_decode_lazy(uint32_t schema_name_id,
+                             uint32_t schema_version,
+                             char* buf,
+                             uint32_t buf_size,
+                             crystalize_lazy_t* lazy,
+                             crystalize_decode_result_t* result);
+
+// Fixes up one page, or every page overlapping the range. A page with a bad pointer has all its pointers set to NULL
+// and lazy->error set.
+void crystalize_lazy_fix_page(crystalize_lazy_t* lazy, uint32_t page);
+void crystalize_lazy_ensure_range(crystalize_lazy_t* lazy, const void* ptr, size_t size);
+
+// Makes sure the pointer field at field has been fixed up.
+static inline void crystalize_lazy_ensure(crystalize_lazy_t* lazy, const void* field) {
+  const uint32_t page = (uint32_t)((uintptr_t)((const char*)field - lazy->buf) / CRYSTALIZE_LAZY_PAGE_SIZE);
+  if (page < lazy->page_count && (lazy->fixed_pages[page / 32] & (1u << (page % 32))) == 0) {
+    crystalize_lazy_fix_page(lazy, page);
+  }
+}
+
+// Reads a pointer field of lazily decoded data, e.g. CRYSTALIZE_LAZY(&lazy, CRYSTALIZE_LAZY(&lazy, root->next)->next).
+#define CRYSTALIZE_LAZY(lazy, field) (crystalize_lazy_ensure((lazy), &(field)), (field))
 
 #ifdef __cplusplus
 }
+
+namespace crystalize {
+
+// Stands in for a T* field in a C++ mirror of a struct, to follow pointers in viewed data the same way as real ones.
+template <typename T>
+class offset_ptr {
+public:
+  const T* get() const {
+    return static_cast<const T*>(crystalize_offset_resolve(&offset_));
+  }
+  const T* operator->() const {
+    return get();
+  }
+  const T& operator*() const {
+    return *get();
+  }
+  const T& operator[](size_t index) const {
+    return get()[index];
+  }
+  explicit operator bool() const {
+    return offset_ != 0;
+  }
+
+private:
+  offset_ptr(const offset_ptr&) = delete; // the offset is relative to where it lives, so it can't be copied
+  offset_ptr& operator=(const offset_ptr&) = delete;
+
+  int64_t offset_;
+};
+
+// Follows a T* field of viewed data.
+template <typename T>
+const T* view(T* const& field) {
+  return static_cast<const T*>(crystalize_offset_resolve(&field));
+}
+
+} // namespace crystalize
 #endif
@@ -1,11 +1,72 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
+#include "writer.h"
 
-#define CRYSTALIZE_FILE_VERSION 0u
+// Files that use any of the layout flags below are version 1, so readers from before the flags byte reject them rather
+// than taking the pointer table for plain positions. Files without them stay version 0 and load anywhere. A version 1
+// header also has a uint64_t decoded stamp after the schema count, zero in the file, which a decode in place sets to a
+// keyed hash of where the buffer is (see encoder_decode.c). Version 0 buffers have nowhere to keep one.
+#define CRYSTALIZE_FILE_VERSION 1u
+#define CRYSTALIZE_FILE_VERSION_PLAIN 0u
 
+// bits in the file header's flags byte
+#define CRYSTALIZE_FILE_FLAG_MULTI_ROOT 0x01u // data_offset points at a root directory rather than a single root
+#define CRYSTALIZE_FILE_FLAG_DECODED 0x02u    // the pointers have already been fixed up in place
+#define CRYSTALIZE_FILE_FLAG_BASED 0x04u      // the pointers are absolute addresses for the uint64_t base address that follows the header
+#define CRYSTALIZE_FILE_FLAG_COMPACT_POINTERS 0x08u // the pointer table is sorted and holds varint deltas between positions
+#define CRYSTALIZE_FILE_FLAG_PAGED_POINTERS 0x10u   // the pointer table is sorted and bucketed by page, see below
+#define CRYSTALIZE_FILE_FLAGS_LAYOUT                                                                                       \
+  (CRYSTALIZE_FILE_FLAG_MULTI_ROOT | CRYSTALIZE_FILE_FLAG_BASED | CRYSTALIZE_FILE_FLAG_COMPACT_POINTERS | CRYSTALIZE_FILE_FLAG_PAGED_POINTERS)
+
+// A multi-root file's data starts with a uint32_t root count, 4 bytes of padding, then this many entries sorted by key.
+typedef struct file_root_entry_t {
+  uint64_t key;
+  uint32_t schema_name_id;
+  uint32_t schema_version;
+  uint32_t offset; // from the start of the file
+  uint32_t reserved;
+} file_root_entry_t;
+
+// A paged pointer table starts with a uint32_t page count covering everything before the table, a bitmap of that many
+// bits in uint32_t words that's zero in the file, and a uint32_t per page for where its positions end. The sorted
+// uint32_t positions follow.
+
+typedef struct crystalize_arena_t crystalize_arena_t;
 typedef struct crystalize_schema_t crystalize_schema_t;
+typedef struct crystalize_encode_options_t crystalize_encode_options_t;
 typedef struct crystalize_encode_result_t crystalize_encode_result_t;
+typedef struct crystalize_decode_options_t crystalize_decode_options_t;
 typedef struct crystalize_decode_result_t crystalize_decode_result_t;
+typedef struct crystalize_map_options_t crystalize_map_options_t;
+typedef struct crystalize_mapped_file_t crystalize_mapped_file_t;
+typedef struct crystalize_encoder_t crystalize_encoder_t;
+typedef struct crystalize_root_t crystalize_root_t;
+typedef struct crystalize_lazy_t crystalize_lazy_t;
+
+void encoder_encode(const crystalize_schema_t* schema, const void* data, const crystalize_encode_options_t* options, crystalize_encode_result_t* result);
+void encoder_encode_into(const crystalize_schema_t* schema, const void* data, char* buf, uint32_t buf_size, crystalize_arena_t* scratch, crystalize_encode_result_t* result);
+void encoder_encode_to_file(const crystalize_schema_t* schema, const void* data, int fd, const crystalize_encode_options_t* options, crystalize_encode_result_t* result);
+void encoder_encode_to_sink(const crystalize_schema_t* schema, const void* data, writer_sink_t sink, void* sink_ctx, crystalize_encode_result_t* result);
+void encoder_encode_roots(const crystalize_root_t* roots, uint32_t root_count, const crystalize_encode_options_t* options, crystalize_encode_result_t* result);
+void encoder_encode_size(const crystalize_schema_t* schema, const void* data, crystalize_encode_result_t* result);
+
+crystalize_encoder_t* encoder_context_create(void);
+void encoder_context_destroy(crystalize_encoder_t* context);
+void encoder_context_reset(crystalize_encoder_t* context);
+void encoder_context_encode(crystalize_encoder_t* context, const crystalize_schema_t* schema, const void* data, const crystalize_encode_options_t* options, crystalize_encode_result_t* result);
+
+// Picks the key for decoded stamps. Called from crystalize_init().
+void encoder_decode_init(void);
 
-void encoder_encode(const crystalize_schema_t* schema, const void* data, crystalize_encode_result_t* result);
-void* encoder_decode(const crystalize_schema_t* schema, char* buf, uint32_t buf_size, crystalize_decode_result_t* result);
+void* encoder_decode(const crystalize_schema_t* schema, char* buf, uint32_t buf_size, const crystalize_decode_options_t* options, crystalize_decode_result_t* result);
+void* encoder_decode_copy(const crystalize_schema_t* schema, const char* buf, uint32_t buf_size, crystalize_arena_t* arena, crystalize_decode_result_t* result);
+void* encoder_decode_lazy(const crystalize_schema_t* schema, char* buf, uint32_t buf_size, crystalize_lazy_t* lazy, crystalize_decode_result_t* result);
+void encoder_lazy_fix_page(crystalize_lazy_t* lazy, uint32_t page);
+void encoder_lazy_ensure_range(crystalize_lazy_t* lazy, const void* ptr, size_t size);
+void* encoder_decode_root(uint64_t key, const crystalize_schema_t* schema, char* buf, uint32_t buf_size, crystalize_decode_result_t* result);
+void* encoder_map_file(const crystalize_schema_t* schema, int fd, const crystalize_map_options_t* options, crystalize_mapped_file_t* file);
+const void* encoder_view(const crystalize_schema_t* schema, const char* buf, uint32_t buf_size, crystalize_decode_result_t* result);
+bool encoder_verify(const crystalize_schema_t* schema, const char* buf, uint32_t buf_size, const crystalize_verify_options_t* options, crystalize_decode_result_t* result);
+bool encoder_verify_root(uint64_t key, const crystalize_schema_t* schema, const char* buf, uint32_t buf_size, const crystalize_verify_options_t* options, crystalize_decode_result_t* result);
+const void* encoder_view_root(uint64_t key, const crystalize_schema_t* schema, const char* buf, uint32_t buf_size, crystalize_decode_result_t* result);
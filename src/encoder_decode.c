@@ -1,7 +1,23 @@
 #include <stdalign.h>
 #include <string.h>
+#include "config.h"
+#include "convert.h"
 #include "crystalize.h"
 #include "encoder.h"
+#include "fixup.h"
+#include "hash.h"
+#include "mapped_file.h"
+#include "verify.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define DECODE_COPY_ALIGNMENT 16 // where copies start in an arena, enough for any field
+
+// Keys the stamps this process writes into buffers it decodes in place, so a buffer from anywhere else can't carry one
+// that matches.
+static uint64_t s_decoded_stamp_key;
+
+extern crystalize_schema_t s_schema_schema;
 
 typedef struct reader_t {
   char* buf;
@@ -12,6 +28,16 @@ typedef struct reader_t {
 
 typedef struct decoder_t {
   reader_t reader;
+  const crystalize_schema_t* schemas; // the file's schema table
+  uint32_t schema_count;
+  uint32_t data_offset;
+  uint32_t pointer_table_offset;
+  uint32_t pointer_table_count;
+  uint32_t flags_pos;
+  uint8_t flags;
+  uint64_t base_address;   // the address the pointers were written for (if CRYSTALIZE_FILE_FLAG_BASED)
+  bool trust_base_address; // a based file loaded at its base address is used without checking its pointers
+  uint32_t stamp_pos;      // where the decoded stamp is (0 if the file version doesn't have one)
 } decoder_t;
 
 static char* read_pos(reader_t* reader) {
@@ -58,112 +84,820 @@ static void read_u32(reader_t* reader, uint32_t* val) {
   read_bytes(reader, val, 4);
 }
 
-void* encoder_decode(const crystalize_schema_t* schema, char* buf, uint32_t buf_size, crystalize_decode_result_t* result) {
-  decoder_t decoder = {0};
-  decoder.reader.buf = buf;
-  decoder.reader.size = buf_size;
-  decoder.reader.cur = 0;
-  decoder.reader.error = NULL;
+static void read_u64(reader_t* reader, uint64_t* val) {
+  read_align(reader, 8);
+  read_bytes(reader, val, 8);
+}
+
+static void decoder_init(decoder_t* decoder, const char* buf, uint32_t buf_size) {
+  memset(decoder, 0, sizeof(decoder_t));
+  decoder->reader.buf = (char*)buf; // only written to by decoder_fixup()
+  decoder->reader.size = buf_size;
+  decoder->reader.cur = 0;
+  decoder->reader.error = NULL;
+}
 
+// Reads and checks the file header without modifying the buffer.
+static bool decoder_read_header(decoder_t* decoder, crystalize_decode_result_t* result) {
   // read the file header
   uint8_t magic[4];
   uint32_t file_version;
   uint32_t endian;
   uint8_t pointer_size;
+  uint8_t flags;
   uint32_t data_offset;
   uint32_t pointer_table_offset;
   uint32_t pointer_table_count;
   uint32_t schema_count;
-  read_u8(&decoder.reader, magic + 0);
-  read_u8(&decoder.reader, magic + 1);
-  read_u8(&decoder.reader, magic + 2);
-  read_u8(&decoder.reader, magic + 3);
-  read_u32(&decoder.reader, &file_version);
-  read_u32(&decoder.reader, &endian);
-  read_u8(&decoder.reader, &pointer_size);
-  read_u32(&decoder.reader, &data_offset);
-  read_u32(&decoder.reader, &pointer_table_offset);
-  read_u32(&decoder.reader, &pointer_table_count);
-  read_u32(&decoder.reader, &schema_count);
-  if (decoder.reader.error) {
+  read_u8(&decoder->reader, magic + 0);
+  read_u8(&decoder->reader, magic + 1);
+  read_u8(&decoder->reader, magic + 2);
+  read_u8(&decoder->reader, magic + 3);
+  read_u32(&decoder->reader, &file_version);
+  read_u32(&decoder->reader, &endian);
+  read_u8(&decoder->reader, &pointer_size);
+  const uint32_t flags_pos = decoder->reader.cur;
+  read_u8(&decoder->reader, &flags);
+  read_u32(&decoder->reader, &data_offset);
+  read_u32(&decoder->reader, &pointer_table_offset);
+  read_u32(&decoder->reader, &pointer_table_count);
+  read_u32(&decoder->reader, &schema_count);
+  uint32_t stamp_pos = 0;
+  if (file_version == CRYSTALIZE_FILE_VERSION) {
+    uint64_t stamp;
+    read_align(&decoder->reader, alignof(uint64_t));
+    stamp_pos = decoder->reader.cur;
+    read_u64(&decoder->reader, &stamp);
+  }
+  uint64_t base_address = 0;
+  if (flags & CRYSTALIZE_FILE_FLAG_BASED) {
+    read_u64(&decoder->reader, &base_address);
+  }
+  if (decoder->reader.error) {
     result->error = CRYSTALIZE_ERROR_UNEXPECTED_EOF;
-    return NULL;
+    return false;
   }
   if (magic[0] != 0x63 || magic[1] != 0x72 || magic[2] != 0x79 || magic[3] != 0x73) {
     result->error = CRYSTALIZE_ERROR_FILE_HEADER_MALFORMED;
-    return NULL;
+    return false;
   }
-  if (file_version != CRYSTALIZE_FILE_VERSION) {
+  if (file_version != CRYSTALIZE_FILE_VERSION && file_version != CRYSTALIZE_FILE_VERSION_PLAIN) {
     result->error = CRYSTALIZE_ERROR_FILE_VERSION_MISMATCH;
-    return NULL;
+    return false;
+  }
+  if ((flags & ~(CRYSTALIZE_FILE_FLAGS_LAYOUT | CRYSTALIZE_FILE_FLAG_DECODED)) != 0 ||
+      (file_version == CRYSTALIZE_FILE_VERSION_PLAIN && (flags & CRYSTALIZE_FILE_FLAGS_LAYOUT) != 0)) {
+    // a flag this reader doesn't know, or a layout flag in a file that older readers would misread
+    result->error = CRYSTALIZE_ERROR_FILE_HEADER_MALFORMED;
+    return false;
   }
   if (endian != 0x01u) {
     result->error = CRYSTALIZE_ERROR_ENDIAN_MISMATCH;
-    return NULL;
+    return false;
   }
   if (pointer_size != sizeof(void*)) {
     result->error = CRYSTALIZE_ERROR_POINTER_SIZE_MISMATCH;
-    return NULL;
+    return false;
   }
-  if (data_offset >= buf_size) {
+  if (data_offset >= decoder->reader.size) {
     // offset to data start is invalid
     result->error = CRYSTALIZE_ERROR_DATA_OFFSET_IS_INVALID;
-    return NULL;
+    return false;
   }
-  if (pointer_table_offset >= buf_size) {
+  if (pointer_table_offset >= decoder->reader.size) {
     // offset to the pointer tabel is invalid
     result->error = CRYSTALIZE_ERROR_POINTER_TABLE_OFFSET_IS_INVALID;
-    return NULL;
+    return false;
   }
-  if (pointer_table_offset + (pointer_table_count * sizeof(uint32_t)) > buf_size) {
+  const uint32_t pointer_table_min_entry_size = (flags & CRYSTALIZE_FILE_FLAG_COMPACT_POINTERS) ? 1 : sizeof(uint32_t);
+  if (pointer_table_offset + ((uint64_t)pointer_table_count * pointer_table_min_entry_size) > decoder->reader.size) {
     result->error = CRYSTALIZE_ERROR_UNEXPECTED_EOF;
-    return NULL;
+    return false;
   }
 
   // load the schema table
-  read_align(&decoder.reader, alignof(crystalize_schema_t));
-  const crystalize_schema_t* schemas = (const crystalize_schema_t*)read_pos(&decoder.reader);
-  read_consume(&decoder.reader, schema_count * sizeof(crystalize_schema_t));
-  if (decoder.reader.error) {
+  read_align(&decoder->reader, alignof(crystalize_schema_t));
+  const crystalize_schema_t* schemas = (const crystalize_schema_t*)read_pos(&decoder->reader);
+  read_consume(&decoder->reader, schema_count * sizeof(crystalize_schema_t));
+  if (decoder->reader.error) {
     result->error = CRYSTALIZE_ERROR_UNEXPECTED_EOF;
-    return NULL;
+    return false;
   }
 
-  // TODO: check the pointers in the schema table
+  decoder->schemas = schemas;
+  decoder->schema_count = schema_count;
+  decoder->data_offset = data_offset;
+  decoder->pointer_table_offset = pointer_table_offset;
+  decoder->pointer_table_count = pointer_table_count;
+  decoder->flags_pos = flags_pos;
+  decoder->flags = flags;
+  decoder->base_address = base_address;
+  decoder->stamp_pos = stamp_pos;
+  return true;
+}
 
-  // TODO: handle mismatched schemas
-  schemas = NULL;
+// The stamp for a copy of the decoder's buffer at buf. It covers the size and the pointer table's offset too, so the
+// header can't be reused with a different table.
+static uint64_t decoder_stamp_for(const decoder_t* decoder, const char* buf) {
+  const uint64_t values[3] = {(uint64_t)(uintptr_t)buf, decoder->reader.size, decoder->pointer_table_offset};
+  return fnv1a64_with_seed((const char*)values, sizeof(values), s_decoded_stamp_key);
+}
 
-  // get pointer to the root of the data graph
-  void* data = decoder.reader.buf + data_offset;
+// True if this process decoded the buffer in place where it is now, so what its header and page bitmap say has been
+// done can be taken as read.
+static bool decoder_is_stamped(const decoder_t* decoder) {
+  if (decoder->stamp_pos == 0) {
+    return false;
+  }
+  uint64_t stamp;
+  memcpy(&stamp, decoder->reader.buf + decoder->stamp_pos, sizeof(stamp));
+  return stamp == decoder_stamp_for(decoder, decoder->reader.buf);
+}
+
+static void decoder_stamp(const decoder_t* decoder, char* buf) {
+  if (decoder->stamp_pos != 0) {
+    const uint64_t stamp = decoder_stamp_for(decoder, buf);
+    memcpy(buf + decoder->stamp_pos, &stamp, sizeof(stamp));
+  }
+}
+
+void encoder_decode_init(void) {
+  // there's no portable source of randomness, but where the stack and this library are and the time will do to keep
+  // stamps from being forged ahead of time
+  const uint64_t values[3] = {mapped_file_now_ns(), (uint64_t)(uintptr_t)&s_decoded_stamp_key, (uint64_t)(uintptr_t)values};
+  s_decoded_stamp_key = fnv1a64((const char*)values, sizeof(values));
+}
+
+// Reads the start of a paged pointer table into lazy after checking that the whole table fits in the buffer. Nothing is
+// fixed up.
+static bool decoder_lazy_init(decoder_t* decoder, crystalize_lazy_t* lazy, crystalize_decode_result_t* result) {
+  memset(lazy, 0, sizeof(crystalize_lazy_t));
+  const uint32_t table_offset = decoder->pointer_table_offset;
+  const uint32_t page_count = (uint32_t)(((uint64_t)table_offset + CRYSTALIZE_LAZY_PAGE_SIZE - 1) / CRYSTALIZE_LAZY_PAGE_SIZE);
+  const uint32_t word_count = (page_count + 31) / 32;
+  const uint64_t table_size = sizeof(uint32_t) * (1 + (uint64_t)word_count + page_count + decoder->pointer_table_count);
+  if (table_size > decoder->reader.size - table_offset) {
+    result->error = CRYSTALIZE_ERROR_UNEXPECTED_EOF;
+    return false;
+  }
+  uint32_t* table = (uint32_t*)(decoder->reader.buf + table_offset);
+  if (table[0] != page_count) {
+    result->error = CRYSTALIZE_ERROR_FILE_HEADER_MALFORMED;
+    return false;
+  }
+
+  lazy->buf = decoder->reader.buf;
+  lazy->buf_size = decoder->reader.size;
+  lazy->page_count = page_count;
+  lazy->fixed_pages = table + 1;
+  lazy->page_ends = table + 1 + word_count;
+  lazy->positions = lazy->page_ends + page_count;
+  lazy->pointer_count = decoder->pointer_table_count;
+  lazy->error = CRYSTALIZE_ERROR_NONE;
+  const bool based = (decoder->flags & CRYSTALIZE_FILE_FLAG_BASED) != 0;
+  lazy->base_address = based ? decoder->base_address : 0;
+
+  // pages this process fixed up in this buffer can be taken as done
+  if (decoder_is_stamped(decoder)) {
+    return true;
+  }
+
+  // otherwise the bitmap comes from the buffer too, so the pages it says are done have to hold addresses within this
+  // buffer. A file that's never been decoded has no bits set, and that only takes a look at each word.
+  const bool decoded = (decoder->flags & CRYSTALIZE_FILE_FLAG_DECODED) != 0;
+  for (uint32_t word = 0; word < word_count; ++word) {
+    const uint32_t word_pages = MIN(page_count - word * 32, 32);
+    const uint32_t word_mask = word_pages == 32 ? UINT32_MAX : (1u << word_pages) - 1;
+    const uint32_t bits = lazy->fixed_pages[word] & word_mask;
+    if (decoded && bits != word_mask) {
+      result->error = CRYSTALIZE_ERROR_FILE_IS_DECODED;
+      return false;
+    }
+    for (uint32_t bit = 0; bits != 0 && bit < word_pages; ++bit) {
+      if ((bits & (1u << bit)) == 0) {
+        continue;
+      }
+      const uint32_t page = word * 32 + bit;
+      const uint32_t slot_begin = page * CRYSTALIZE_LAZY_PAGE_SIZE;
+      const uint32_t slot_end = (uint32_t)MIN((uint64_t)slot_begin + CRYSTALIZE_LAZY_PAGE_SIZE, table_offset);
+      const uint32_t begin = page == 0 ? 0 : lazy->page_ends[page - 1];
+      const uint32_t end = lazy->page_ends[page];
+      if (begin > end || end > lazy->pointer_count ||
+          fixup_check(lazy->buf, lazy->buf_size, lazy->positions + begin, end - begin, (uint64_t)(uintptr_t)lazy->buf, slot_begin, slot_end) !=
+              CRYSTALIZE_ERROR_NONE) {
+        result->error = CRYSTALIZE_ERROR_FILE_IS_DECODED;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void encoder_lazy_fix_page(crystalize_lazy_t* lazy, uint32_t page) {
+  const uint32_t bit = 1u << (page % 32);
+  if (page >= lazy->page_count || (lazy->fixed_pages[page / 32] & bit)) {
+    return;
+  }
+  lazy->fixed_pages[page / 32] |= bit;
+
+  // slots have to be in the page and before the table itself, which holds the bitmap
+  const uint32_t table_offset = (uint32_t)((const char*)(lazy->fixed_pages - 1) - lazy->buf);
+  const uint32_t slot_begin = page * CRYSTALIZE_LAZY_PAGE_SIZE;
+  const uint32_t slot_end = (uint32_t)MIN((uint64_t)slot_begin + CRYSTALIZE_LAZY_PAGE_SIZE, table_offset);
+  const uint32_t begin = page == 0 ? 0 : lazy->page_ends[page - 1];
+  const uint32_t end = lazy->page_ends[page];
+  if (begin > end || end > lazy->pointer_count) {
+    lazy->error = lazy->error != CRYSTALIZE_ERROR_NONE ? lazy->error : CRYSTALIZE_ERROR_POINTER_INVALID;
+    return;
+  }
+  const uint32_t* positions = lazy->positions + begin;
+  if (fixup_check(lazy->buf, lazy->buf_size, positions, end - begin, lazy->base_address, slot_begin, slot_end) != CRYSTALIZE_ERROR_NONE) {
+    // don't leave anything on the page pointing somewhere it shouldn't
+    for (uint32_t index = 0; index < end - begin; ++index) {
+      if (positions[index] >= slot_begin && positions[index] < slot_end && positions[index] <= lazy->buf_size - sizeof(int64_t)) {
+        memset(lazy->buf + positions[index], 0, sizeof(int64_t));
+      }
+    }
+    lazy->error = lazy->error != CRYSTALIZE_ERROR_NONE ? lazy->error : CRYSTALIZE_ERROR_POINTER_INVALID;
+    return;
+  }
+  fixup_apply(lazy->buf, lazy->buf_size, positions, end - begin, lazy->base_address);
+}
+
+void encoder_lazy_ensure_range(crystalize_lazy_t* lazy, const void* ptr, size_t size) {
+  const uint64_t paged_size = (uint64_t)lazy->page_count * CRYSTALIZE_LAZY_PAGE_SIZE;
+  const uint64_t begin = (uint64_t)(uintptr_t)((const char*)ptr - lazy->buf);
+  if (size == 0 || begin >= paged_size) {
+    return;
+  }
+  const uint64_t last = MIN(begin + size - 1, paged_size - 1);
+  for (uint64_t page = begin / CRYSTALIZE_LAZY_PAGE_SIZE; page <= last / CRYSTALIZE_LAZY_PAGE_SIZE; ++page) {
+    encoder_lazy_fix_page(lazy, (uint32_t)page);
+  }
+}
+
+// Checks that every slot in a plain or compact pointer table holds an address within the buffer, without writing
+// anything.
+static crystalize_error_t decoder_check_addresses(const decoder_t* decoder) {
+  const char* buf = decoder->reader.buf;
+  const uint32_t size = decoder->reader.size;
+  const char* pointer_table = buf + decoder->pointer_table_offset;
+  const uint64_t here = (uint64_t)(uintptr_t)buf;
+  if (decoder->flags & CRYSTALIZE_FILE_FLAG_COMPACT_POINTERS) {
+    const uint32_t table_size = size - decoder->pointer_table_offset;
+    return fixup_check_compact(buf, size, (const uint8_t*)pointer_table, table_size, decoder->pointer_table_count, here);
+  }
+  return fixup_check(buf, size, (const uint32_t*)pointer_table, decoder->pointer_table_count, here, 0, decoder->pointer_table_offset);
+}
+
+// Checks that a buffer marked decoded really holds addresses within itself. The flag comes from the buffer, so it can't
+// be taken on trust: a forged one, or a decoded buffer that's been copied somewhere else, would have every pointer
+// followed unchecked. Only the stamp is written, so the check is done once per buffer rather than on every lookup.
+static bool decoder_check_decoded(decoder_t* decoder, crystalize_decode_result_t* result) {
+  if (decoder_is_stamped(decoder)) {
+    return true;
+  }
+  if (decoder->flags & CRYSTALIZE_FILE_FLAG_PAGED_POINTERS) {
+    // every page has to be marked done, and those are checked as the table is read
+    crystalize_lazy_t lazy;
+    if (!decoder_lazy_init(decoder, &lazy, result)) {
+      return false;
+    }
+  }
+  else if (decoder_check_addresses(decoder) != CRYSTALIZE_ERROR_NONE) {
+    result->error = CRYSTALIZE_ERROR_FILE_IS_DECODED;
+    return false;
+  }
+  decoder_stamp(decoder, decoder->reader.buf);
+  return true;
+}
+
+// Fixes up the pointers in place, unless a previous decode already did. Pointers written for a base address only need
+// relocating when the buffer isn't there.
+static bool decoder_fixup(decoder_t* decoder, const crystalize_decode_options_t* options, crystalize_decode_result_t* result) {
+  if (decoder->flags & CRYSTALIZE_FILE_FLAG_DECODED) {
+    // the pointers should already be real addresses in this buffer
+    return decoder_check_decoded(decoder, result);
+  }
+  const bool based = (decoder->flags & CRYSTALIZE_FILE_FLAG_BASED) != 0;
+  const int64_t delta = (int64_t)((uint64_t)(uintptr_t)decoder->reader.buf - decoder->base_address);
+  if (based && delta == 0 && decoder->trust_base_address) {
+    // loaded where it was written for, so there's nothing to do and no page needs touching
+    return true;
+  }
+  if (based && delta == 0 && !(decoder->flags & CRYSTALIZE_FILE_FLAG_PAGED_POINTERS)) {
+    // nothing needs moving, but the addresses still have to be checked (paged tables check them as the pages are done)
+    const crystalize_error_t error = decoder_check_addresses(decoder);
+    if (error != CRYSTALIZE_ERROR_NONE) {
+      result->error = error;
+      return false;
+    }
+    decoder->flags |= CRYSTALIZE_FILE_FLAG_DECODED;
+    decoder->reader.buf[decoder->flags_pos] = (char)decoder->flags;
+    decoder_stamp(decoder, decoder->reader.buf);
+    return true;
+  }
 
   // fixup pointers
-  const uint32_t* pointer_table = (const uint32_t*)(decoder.reader.buf + pointer_table_offset);
-  if ((const char*)pointer_table >= decoder.reader.buf + decoder.reader.size) {
+  const uint32_t* pointer_table = (const uint32_t*)(decoder->reader.buf + decoder->pointer_table_offset);
+  if ((const char*)pointer_table >= decoder->reader.buf + decoder->reader.size) {
     result->error = CRYSTALIZE_ERROR_UNEXPECTED_EOF;
+    return false;
+  }
+  // add the offset to the slot's position, or move the address by however far the buffer is from the base
+  const uint64_t base_address = based ? decoder->base_address : 0;
+  crystalize_error_t error;
+  if (decoder->flags & CRYSTALIZE_FILE_FLAG_PAGED_POINTERS) {
+    // any pages a lazy decode already did are skipped
+    crystalize_lazy_t lazy;
+    if (!decoder_lazy_init(decoder, &lazy, result)) {
+      return false;
+    }
+    for (uint32_t page = 0; page < lazy.page_count; ++page) {
+      encoder_lazy_fix_page(&lazy, page);
+    }
+    error = lazy.error;
+  }
+  else if (decoder->flags & CRYSTALIZE_FILE_FLAG_COMPACT_POINTERS) {
+    // a compact table runs to the end of the buffer
+    const uint32_t table_size = decoder->reader.size - decoder->pointer_table_offset;
+    error = fixup_apply_compact(decoder->reader.buf, decoder->reader.size, (const uint8_t*)pointer_table, table_size, decoder->pointer_table_count, base_address);
+  }
+  else {
+    error = fixup_apply_parallel(decoder->reader.buf,
+                                 decoder->reader.size,
+                                 pointer_table,
+                                 decoder->pointer_table_count,
+                                 base_address,
+                                 options != NULL ? options->thread_count : 0,
+                                 options != NULL ? options->parallel_for_handler : NULL,
+                                 options != NULL ? options->parallel_for_ctx : NULL);
+  }
+  if (error != CRYSTALIZE_ERROR_NONE) {
+    result->error = error;
+    return false;
+  }
+
+  // mark the buffer so decoding it again (another root, say) doesn't apply the offsets twice, or check them again
+  decoder->flags |= CRYSTALIZE_FILE_FLAG_DECODED;
+  decoder->reader.buf[decoder->flags_pos] = (char)decoder->flags;
+  decoder_stamp(decoder, decoder->reader.buf);
+  return true;
+}
+
+// Copies the whole buffer to dst in one pass, fixing up the pointers as they're copied, and marks the copy decoded. The
+// source isn't written to.
+static bool decoder_copy(decoder_t* decoder, char* dst, crystalize_decode_result_t* result) {
+  const char* src = decoder->reader.buf;
+  const uint32_t size = decoder->reader.size;
+  const char* pointer_table = src + decoder->pointer_table_offset;
+
+  // a decoded buffer holds addresses within itself, which is the same as being based where it is
+  uint64_t base_address = 0;
+  if (decoder->flags & CRYSTALIZE_FILE_FLAG_DECODED) {
+    base_address = (uint64_t)(uintptr_t)src;
+  }
+  else if (decoder->flags & CRYSTALIZE_FILE_FLAG_BASED) {
+    base_address = decoder->base_address;
+  }
+
+  uint32_t copied = 0;
+  crystalize_error_t error = CRYSTALIZE_ERROR_NONE;
+  crystalize_lazy_t lazy;
+  if (decoder->flags & CRYSTALIZE_FILE_FLAG_PAGED_POINTERS) {
+    if (!decoder_lazy_init(decoder, &lazy, result)) {
+      return false;
+    }
+    // pages a lazy decode already fixed up hold addresses within the source
+    for (uint32_t page = 0; page < lazy.page_count && error == CRYSTALIZE_ERROR_NONE; ++page) {
+      const uint32_t slot_begin = page * CRYSTALIZE_LAZY_PAGE_SIZE;
+      const uint32_t slot_end = (uint32_t)MIN((uint64_t)slot_begin + CRYSTALIZE_LAZY_PAGE_SIZE, decoder->pointer_table_offset);
+      const uint32_t begin = page == 0 ? 0 : lazy.page_ends[page - 1];
+      const uint32_t end = lazy.page_ends[page];
+      if (begin > end || end > lazy.pointer_count) {
+        error = CRYSTALIZE_ERROR_POINTER_INVALID;
+        break;
+      }
+      for (uint32_t index = begin; index < end; ++index) {
+        if (lazy.positions[index] < slot_begin || lazy.positions[index] >= slot_end) {
+          error = CRYSTALIZE_ERROR_POINTER_INVALID;
+        }
+      }
+      const bool fixed = (lazy.fixed_pages[page / 32] & (1u << (page % 32))) != 0;
+      if (error == CRYSTALIZE_ERROR_NONE) {
+        error = fixup_copy(dst, src, size, &copied, lazy.positions + begin, end - begin, fixed ? (uint64_t)(uintptr_t)src : base_address);
+      }
+    }
+  }
+  else if (decoder->flags & CRYSTALIZE_FILE_FLAG_COMPACT_POINTERS) {
+    const uint32_t table_size = size - decoder->pointer_table_offset;
+    error = fixup_copy_compact(dst, src, size, &copied, (const uint8_t*)pointer_table, table_size, decoder->pointer_table_count, base_address);
+  }
+  else {
+    error = fixup_copy(dst, src, size, &copied, (const uint32_t*)pointer_table, decoder->pointer_table_count, base_address);
+  }
+  if (error != CRYSTALIZE_ERROR_NONE) {
+    result->error = error;
+    return false;
+  }
+  if (copied < size) {
+    memcpy(dst + copied, src + copied, size - copied);
+  }
+
+  // the copy is decoded, and every page of a paged table is done
+  dst[decoder->flags_pos] = (char)(decoder->flags | CRYSTALIZE_FILE_FLAG_DECODED);
+  decoder_stamp(decoder, dst);
+  if (decoder->flags & CRYSTALIZE_FILE_FLAG_PAGED_POINTERS) {
+    uint32_t* fixed_pages = (uint32_t*)(dst + decoder->pointer_table_offset) + 1;
+    for (uint32_t page = 0; page < lazy.page_count; ++page) {
+      fixed_pages[page / 32] |= 1u << (page % 32);
+    }
+  }
+  return true;
+}
+
+// Finds the root schema of a single-root file. The file has one version of each schema, so it's the one with the
+// expected name.
+static const crystalize_schema_t* decoder_find_root_schema(decoder_t* decoder, const crystalize_schema_t* schema, crystalize_decode_result_t* result) {
+  if (decoder->flags & CRYSTALIZE_FILE_FLAG_MULTI_ROOT) {
+    // the roots have to be looked up by key
+    result->error = CRYSTALIZE_ERROR_FILE_HAS_MULTIPLE_ROOTS;
     return NULL;
   }
-  for (uint32_t index = 0; index < pointer_table_count; ++index) {
-    const uint32_t buf_pos = pointer_table[index];
-    if (buf_pos >= decoder.reader.size) {
-      result->error = CRYSTALIZE_ERROR_POINTER_INVALID;
-      return NULL;
+  for (uint32_t index = 0; index < decoder->schema_count; ++index) {
+    if (decoder->schemas[index].name_id == schema->name_id) {
+      return decoder->schemas + index;
+    }
+  }
+  result->error = CRYSTALIZE_ERROR_SCHEMA_NOT_FOUND;
+  return NULL;
+}
+
+// Reads a multi-root file's directory of roots.
+static const file_root_entry_t* decoder_read_directory(decoder_t* decoder, uint32_t* root_count, crystalize_decode_result_t* result) {
+  if (!(decoder->flags & CRYSTALIZE_FILE_FLAG_MULTI_ROOT)) {
+    result->error = CRYSTALIZE_ERROR_ROOT_NOT_FOUND;
+    return NULL;
+  }
+  decoder->reader.cur = decoder->data_offset;
+  read_u32(&decoder->reader, root_count);
+  read_align(&decoder->reader, alignof(file_root_entry_t));
+  const file_root_entry_t* entries = (const file_root_entry_t*)read_pos(&decoder->reader);
+  if (*root_count > (decoder->reader.size - decoder->reader.cur) / sizeof(file_root_entry_t)) {
+    decoder->reader.error = "unexpected EOF";
+  }
+  if (decoder->reader.error) {
+    result->error = CRYSTALIZE_ERROR_UNEXPECTED_EOF;
+    return NULL;
+  }
+  return entries;
+}
+
+// Binary searches a multi-root file's directory for the key.
+static const file_root_entry_t* decoder_find_root(decoder_t* decoder, uint64_t key, const crystalize_schema_t* schema, crystalize_decode_result_t* result) {
+  uint32_t root_count;
+  const file_root_entry_t* entries = decoder_read_directory(decoder, &root_count, result);
+  if (entries == NULL) {
+    return NULL;
+  }
+
+  // binary search the sorted entries for the key
+  uint32_t lo = 0;
+  uint32_t hi = root_count;
+  while (lo < hi) {
+    const uint32_t mid = lo + (hi - lo) / 2;
+    if (entries[mid].key < key) {
+      lo = mid + 1;
     }
-    int64_t* buf_pos_ptr = (int64_t*)(decoder.reader.buf + buf_pos);
-    const int64_t relative_offset = *buf_pos_ptr;
+    else {
+      hi = mid;
+    }
+  }
+  if (lo == root_count || entries[lo].key != key) {
+    result->error = CRYSTALIZE_ERROR_ROOT_NOT_FOUND;
+    return NULL;
+  }
+
+  const file_root_entry_t* entry = entries + lo;
+  if (entry->schema_name_id != schema->name_id) {
+    result->error = CRYSTALIZE_ERROR_ROOT_SCHEMA_MISMATCH;
+    return NULL;
+  }
+  if (entry->offset >= decoder->reader.size) {
+    result->error = CRYSTALIZE_ERROR_DATA_OFFSET_IS_INVALID;
+    return NULL;
+  }
+  return entry;
+}
+
+// Checks that viewed data lays out exactly like the expected schema. The schema table's pointers are still offsets, so
+// it's compared in place by following them, and only resolved into a temporary copy to find out why it doesn't match.
+static bool decoder_check_view(decoder_t* decoder,
+                               uint32_t root_name_id,
+                               uint32_t root_version,
+                               const crystalize_schema_t* schema,
+                               crystalize_decode_result_t* result) {
+  if (decoder->flags & (CRYSTALIZE_FILE_FLAG_DECODED | CRYSTALIZE_FILE_FLAG_BASED)) {
+    // the pointers are addresses rather than offsets
+    result->error = CRYSTALIZE_ERROR_FILE_IS_DECODED;
+    return false;
+  }
+  if (convert_is_same(decoder->schemas, decoder->schema_count, true, root_name_id, root_version, schema, decoder->reader.buf, decoder->reader.size)) {
+    return true;
+  }
 
-    // add the offset to the buffer pos
-    const intptr_t new_ptr_addr = (intptr_t)(decoder.reader.buf + buf_pos + relative_offset);
-    if ((const char*)new_ptr_addr < decoder.reader.buf) {
-      result->error = CRYSTALIZE_ERROR_POINTER_INVALID;
+  crystalize_schema_t* schemas = (crystalize_schema_t*)crystalize_alloc((decoder->schema_count + 1) * sizeof(crystalize_schema_t));
+  crystalize_assert(schemas != NULL, "allocation failed");
+  for (uint32_t index = 0; index < decoder->schema_count; ++index) {
+    schemas[index] = decoder->schemas[index];
+    schemas[index].name = NULL;
+    schemas[index].fields = (const crystalize_schema_field_t*)crystalize_offset_resolve(&decoder->schemas[index].fields);
+  }
+  const bool identical = convert_is_identical(
+      schemas, decoder->schema_count, root_name_id, root_version, schema, decoder->reader.buf, decoder->reader.size, result);
+  crystalize_free(schemas);
+  return identical;
+}
+
+static void* decoder_decode(decoder_t* decoder, const crystalize_schema_t* schema, const crystalize_decode_options_t* options, crystalize_decode_result_t* result) {
+  if (!decoder_read_header(decoder, result) || !decoder_fixup(decoder, options, result)) {
+    return NULL;
+  }
+  const crystalize_schema_t* root_schema = decoder_find_root_schema(decoder, schema, result);
+  if (root_schema == NULL) {
+    return NULL;
+  }
+
+  // get pointer to the root of the data graph
+  void* data = decoder->reader.buf + decoder->data_offset;
+  return convert_root(
+      decoder->schemas, decoder->schema_count, root_schema->name_id, root_schema->version, schema, data, decoder->reader.buf, decoder->reader.size, result);
+}
+
+void* encoder_decode(const crystalize_schema_t* schema, char* buf, uint32_t buf_size, const crystalize_decode_options_t* options, crystalize_decode_result_t* result) {
+  decoder_t decoder;
+  decoder_init(&decoder, buf, buf_size);
+  return decoder_decode(&decoder, schema, options, result);
+}
+
+void* encoder_decode_copy(const crystalize_schema_t* schema, const char* buf, uint32_t buf_size, crystalize_arena_t* arena, crystalize_decode_result_t* result) {
+  decoder_t source;
+  decoder_init(&source, buf, buf_size);
+  if (!decoder_read_header(&source, result)) {
+    return NULL;
+  }
+
+  // carve the copy out of the arena, or allocate it
+  char* dst;
+  size_t arena_used = 0;
+  if (arena != NULL) {
+    arena_used = arena->used;
+    const size_t start = (arena->used + (DECODE_COPY_ALIGNMENT - 1)) & ~(size_t)(DECODE_COPY_ALIGNMENT - 1);
+    if (start > arena->size || buf_size > arena->size - start) {
+      result->error = CRYSTALIZE_ERROR_BUFFER_TOO_SMALL;
       return NULL;
     }
-    if ((const char*)new_ptr_addr >= decoder.reader.buf + decoder.reader.size) {
-      result->error = CRYSTALIZE_ERROR_POINTER_INVALID;
-      return NULL;
+    dst = arena->buf + start;
+    arena->used = start + buf_size;
+  }
+  else {
+    dst = (char*)crystalize_alloc(buf_size);
+    crystalize_assert(dst != NULL, "allocation failed");
+  }
+
+  void* data = NULL;
+  if (decoder_copy(&source, dst, result)) {
+    decoder_t decoder;
+    decoder_init(&decoder, dst, buf_size);
+    decoder_read_header(&decoder, result);
+    const crystalize_schema_t* root_schema = decoder_find_root_schema(&decoder, schema, result);
+    if (root_schema != NULL) {
+      data = convert_root(decoder.schemas, decoder.schema_count, root_schema->name_id, root_schema->version, schema, dst + decoder.data_offset, dst, buf_size, result);
     }
-    *buf_pos_ptr = new_ptr_addr;
   }
 
+  // keep the copy unless it failed or the data had to be converted out of it
+  if (data != NULL && result->buf == NULL) {
+    if (arena == NULL) {
+      result->buf = dst;
+    }
+    return data;
+  }
+  if (arena != NULL) {
+    arena->used = arena_used;
+  }
+  else {
+    crystalize_free(dst);
+  }
   return data;
 }
+
+void* encoder_decode_lazy(const crystalize_schema_t* schema, char* buf, uint32_t buf_size, crystalize_lazy_t* lazy, crystalize_decode_result_t* result) {
+  decoder_t decoder;
+  decoder_init(&decoder, buf, buf_size);
+  if (!decoder_read_header(&decoder, result)) {
+    return NULL;
+  }
+  if (!(decoder.flags & CRYSTALIZE_FILE_FLAG_PAGED_POINTERS)) {
+    result->error = CRYSTALIZE_ERROR_POINTER_TABLE_NOT_PAGED;
+    return NULL;
+  }
+  if (!decoder_lazy_init(&decoder, lazy, result)) {
+    return NULL;
+  }
+  // the pages marked done from here on are this process's, so the next call doesn't need to check them
+  decoder_stamp(&decoder, buf);
+
+  // the schema table and everything it points at come before the data, so that's all that needs fixing up to check it
+  encoder_lazy_ensure_range(lazy, buf, decoder.data_offset);
+  if (lazy->error != CRYSTALIZE_ERROR_NONE) {
+    result->error = lazy->error;
+    return NULL;
+  }
+  const crystalize_schema_t* root_schema = decoder_find_root_schema(&decoder, schema, result);
+  if (root_schema == NULL ||
+      !convert_is_identical(decoder.schemas, decoder.schema_count, root_schema->name_id, root_schema->version, schema, buf, buf_size, result)) {
+    return NULL;
+  }
+  return buf + decoder.data_offset;
+}
+
+void* encoder_decode_root(uint64_t key, const crystalize_schema_t* schema, char* buf, uint32_t buf_size, crystalize_decode_result_t* result) {
+  decoder_t decoder;
+  decoder_init(&decoder, buf, buf_size);
+  if (!decoder_read_header(&decoder, result) || !decoder_fixup(&decoder, NULL, result)) {
+    return NULL;
+  }
+  const file_root_entry_t* entry = decoder_find_root(&decoder, key, schema, result);
+  if (entry == NULL) {
+    return NULL;
+  }
+  void* data = decoder.reader.buf + entry->offset;
+  return convert_root(decoder.schemas, decoder.schema_count, entry->schema_name_id, entry->schema_version, schema, data, buf, buf_size, result);
+}
+
+const void* encoder_view(const crystalize_schema_t* schema, const char* buf, uint32_t buf_size, crystalize_decode_result_t* result) {
+  decoder_t decoder;
+  decoder_init(&decoder, buf, buf_size);
+  if (!decoder_read_header(&decoder, result)) {
+    return NULL;
+  }
+  const crystalize_schema_t* root_schema = decoder_find_root_schema(&decoder, schema, result);
+  if (root_schema == NULL || !decoder_check_view(&decoder, root_schema->name_id, root_schema->version, schema, result)) {
+    return NULL;
+  }
+  return buf + decoder.data_offset;
+}
+
+// Walks the schema table and the data roots, which roots[0] is left free for. The schema table's fields must already
+// have been bounds checked by decoder_check_view().
+static bool decoder_verify(const decoder_t* decoder, verify_root_t* roots, uint32_t root_count, const crystalize_verify_options_t* options, crystalize_decode_result_t* result) {
+  // walk the schema table along with the data, since its pointers are in the pointer table too
+  const uint32_t schemas_offset = (uint32_t)((const char*)decoder->schemas - decoder->reader.buf);
+  roots[0].schema = crystalize_schema_get(s_schema_schema.name_id, s_schema_schema.version);
+  roots[0].offset = schemas_offset;
+  roots[0].count = decoder->schema_count;
+
+  verify_file_t file;
+  file.buf = decoder->reader.buf;
+  file.buf_size = decoder->reader.size;
+  file.data_begin = schemas_offset;
+  file.data_end = decoder->pointer_table_offset;
+  file.flags = decoder->flags;
+  file.pointer_count = decoder->pointer_table_count;
+  file.roots = roots;
+  file.root_count = root_count;
+  result->error = verify_file(&file, options);
+  return result->error == CRYSTALIZE_ERROR_NONE;
+}
+
+bool encoder_verify(const crystalize_schema_t* schema, const char* buf, uint32_t buf_size, const crystalize_verify_options_t* options, crystalize_decode_result_t* result) {
+  decoder_t decoder;
+  decoder_init(&decoder, buf, buf_size);
+  if (!decoder_read_header(&decoder, result)) {
+    return false;
+  }
+  // the schema table's fields are bounds checked here, before anything else reads them
+  const crystalize_schema_t* root_schema = decoder_find_root_schema(&decoder, schema, result);
+  if (root_schema == NULL || !decoder_check_view(&decoder, root_schema->name_id, root_schema->version, schema, result)) {
+    return false;
+  }
+
+  verify_root_t roots[2];
+  roots[1].schema = schema;
+  roots[1].offset = decoder.data_offset;
+  roots[1].count = 1;
+  return decoder_verify(&decoder, roots, 2, options, result);
+}
+
+bool encoder_verify_root(uint64_t key,
+                         const crystalize_schema_t* schema,
+                         const char* buf,
+                         uint32_t buf_size,
+                         const crystalize_verify_options_t* options,
+                         crystalize_decode_result_t* result) {
+  decoder_t decoder;
+  decoder_init(&decoder, buf, buf_size);
+  if (!decoder_read_header(&decoder, result)) {
+    return false;
+  }
+  const file_root_entry_t* entry = decoder_find_root(&decoder, key, schema, result);
+  if (entry == NULL || !decoder_check_view(&decoder, entry->schema_name_id, entry->schema_version, schema, result)) {
+    return false;
+  }
+
+  // the pointer table covers every root, so they all get walked, each with the schema registered for it
+  uint32_t root_count;
+  const file_root_entry_t* entries = decoder_read_directory(&decoder, &root_count, result);
+  verify_root_t* roots = (verify_root_t*)crystalize_alloc(((size_t)root_count + 1) * sizeof(verify_root_t));
+  if (roots == NULL) {
+    result->error = CRYSTALIZE_ERROR_ALLOCATION_FAILED;
+    return false;
+  }
+  bool ok = true;
+  for (uint32_t index = 0; index < root_count && ok; ++index) {
+    const crystalize_schema_t* root_schema =
+        entries + index == entry ? schema : crystalize_schema_get(entries[index].schema_name_id, entries[index].schema_version);
+    if (root_schema == NULL) {
+      result->error = CRYSTALIZE_ERROR_SCHEMA_NOT_FOUND;
+      ok = false;
+    }
+    else if (root_schema != schema) {
+      ok = decoder_check_view(&decoder, entries[index].schema_name_id, entries[index].schema_version, root_schema, result);
+    }
+    roots[index + 1].schema = root_schema;
+    roots[index + 1].offset = entries[index].offset;
+    roots[index + 1].count = 1;
+  }
+  ok = ok && decoder_verify(&decoder, roots, root_count + 1, options, result);
+  crystalize_free(roots);
+  return ok;
+}
+
+const void* encoder_view_root(uint64_t key, const crystalize_schema_t* schema, const char* buf, uint32_t buf_size, crystalize_decode_result_t* result) {
+  decoder_t decoder;
+  decoder_init(&decoder, buf, buf_size);
+  if (!decoder_read_header(&decoder, result)) {
+    return NULL;
+  }
+  const file_root_entry_t* entry = decoder_find_root(&decoder, key, schema, result);
+  if (entry == NULL || !decoder_check_view(&decoder, entry->schema_name_id, entry->schema_version, schema, result)) {
+    return NULL;
+  }
+  return buf + entry->offset;
+}
+
+void* encoder_map_file(const crystalize_schema_t* schema, int fd, const crystalize_map_options_t* options, crystalize_mapped_file_t* file) {
+  uint64_t minor_faults;
+  uint64_t major_faults;
+  mapped_file_page_faults(&minor_faults, &major_faults);
+  const uint64_t map_start = mapped_file_now_ns();
+  char* base_address = NULL;
+  if (options->use_base_address) {
+    // peek at the header for the base address, which only faults in the first page
+    uint32_t size;
+    char* peek = mapped_file_map(fd, NULL, false, &size);
+    if (peek != NULL) {
+      decoder_t decoder;
+      decoder_init(&decoder, peek, size);
+      crystalize_decode_result_t header_result;
+      if (decoder_read_header(&decoder, &header_result) && (decoder.flags & CRYSTALIZE_FILE_FLAG_BASED)) {
+        base_address = (char*)(uintptr_t)decoder.base_address;
+      }
+      mapped_file_unmap(peek, size);
+    }
+  }
+  file->buf = mapped_file_map(fd, base_address, options->populate, &file->buf_size);
+  file->at_base_address = file->buf != NULL && file->buf == base_address;
+  const uint64_t decode_start = mapped_file_now_ns();
+  file->stats.map_ns = decode_start - map_start;
+  if (file->buf == NULL) {
+    file->result.error = CRYSTALIZE_ERROR_MAP_FAILED;
+    return NULL;
+  }
+
+  if (options->advise) {
+    // the fixups walk the pointer table in order and write all over the data
+    decoder_t decoder;
+    decoder_init(&decoder, file->buf, file->buf_size);
+    crystalize_decode_result_t header_result;
+    if (decoder_read_header(&decoder, &header_result) && !(decoder.flags & CRYSTALIZE_FILE_FLAG_DECODED)) {
+      const uint32_t table_size = (decoder.flags & CRYSTALIZE_FILE_FLAG_COMPACT_POINTERS) ? file->buf_size - decoder.pointer_table_offset
+                                                                                         : decoder.pointer_table_count * sizeof(uint32_t);
+      mapped_file_advise(file->buf, decoder.pointer_table_offset, table_size, MAPPED_FILE_ADVICE_SEQUENTIAL);
+      mapped_file_advise(file->buf, 0, decoder.pointer_table_offset, MAPPED_FILE_ADVICE_WILLNEED);
+    }
+  }
+
+  decoder_t decoder;
+  decoder_init(&decoder, file->buf, file->buf_size);
+  decoder.trust_base_address = options->use_base_address;
+  file->data = decoder_decode(&decoder, schema, NULL, &file->result);
+  file->stats.decode_ns = mapped_file_now_ns() - decode_start;
+  uint64_t minor_faults_end;
+  uint64_t major_faults_end;
+  mapped_file_page_faults(&minor_faults_end, &major_faults_end);
+  file->stats.minor_faults = minor_faults_end - minor_faults;
+  file->stats.major_faults = major_faults_end - major_faults;
+  return file->data;
+}
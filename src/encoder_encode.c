@@ -5,12 +5,14 @@
 #include "config.h"
 #include "crystalize.h"
 #include "encoder.h"
+#include "hash.h"
+#include "mapped_file.h"
+#include "thread.h"
+#include "schema.h"
 #include "writer.h"
 
-#define ALIGN(x, align) (((x) + (align)-1) & (~((align)-1)))
-#define ALIGN_PTR(T, p, align) ((T*)ALIGN((uintptr_t)(p), (uintptr_t)align))
-
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 extern crystalize_schema_t s_schema_schema;
 
@@ -20,8 +22,13 @@ typedef struct schema_list_t {
   int capacity;
 } schema_list_t;
 
+typedef struct pointer_fixup_t {
+  const void* target; // the pointer value in source space
+  uint32_t pos;       // the offset into the buffer of the pointer that needs to be fixed
+} pointer_fixup_t;
+
 typedef struct pointer_fixup_list_t {
-  uint32_t* entries; // list of offsets into the buffer of pointers that need to be fixed
+  pointer_fixup_t* entries;
   int count;
   int capacity;
 } pointer_fixup_list_t;
@@ -29,13 +36,49 @@ typedef struct pointer_fixup_list_t {
 typedef struct pointer_remap_t {
   const void* from; // the pointer address in source space
   uint32_t to;      // the offset into the buffer where the pointer should map
+  uint32_t size;    // the number of bytes queued for the object this pass
+  bool visited;     // the object has been queued this pass
 } pointer_remap_t;
 
-typedef struct pointer_remap_list_t {
-  pointer_remap_t* entries;
+typedef struct pointer_remap_map_t {
+  pointer_remap_t* entries; // open-addressed slots keyed on from (NULL marks an empty slot)
+  int count;
+  int capacity; // always a power of two
+} pointer_remap_map_t;
+
+// The source address ranges that have been queued, as a treap ordered by start address. Each node also tracks the
+// node in its subtree that reaches furthest, which is enough to find a range containing any address in O(log n).
+typedef struct range_node_t {
+  const char* from;
+  const char* end;
+  int left;     // -1 for none
+  int right;    // -1 for none
+  int max_node; // the node in this subtree with the furthest end
+  uint32_t priority;
+} range_node_t;
+
+typedef struct range_tree_t {
+  range_node_t* entries;
   int count;
   int capacity;
-} pointer_remap_list_t;
+  int root;
+  uint32_t seed;
+  bool has_overlaps; // some ranges overlap, so pointers can't be resolved by start address alone
+} range_tree_t;
+
+// Where the contents of pointer-free arrays were written, keyed on a hash of their bytes, for content dedup.
+typedef struct content_entry_t {
+  const void* data; // the source of the first copy (NULL marks an empty slot)
+  uint32_t hash;
+  uint32_t size;
+  uint32_t to;
+} content_entry_t;
+
+typedef struct content_map_t {
+  content_entry_t* entries; // open-addressed slots keyed on hash
+  int count;
+  int capacity; // always a power of two
+} content_map_t;
 
 typedef struct write_queue_entry_t {
   const crystalize_schema_t* schema;
@@ -45,41 +88,172 @@ typedef struct write_queue_entry_t {
 } write_queue_entry_t;
 
 typedef struct write_queue_t {
-  write_queue_entry_t* entries;
+  write_queue_entry_t* entries; // ring buffer of pending writes
+  int head;                     // index of the first pending entry
   int count;
-  int capacity;
+  int capacity; // always a power of two
 } write_queue_t;
 
+// A pointer found by a worker, which gets fixed up and queued once the worker's done.
+typedef struct pointer_child_t {
+  const crystalize_schema_t* schema;
+  const void* target;
+  uint32_t pos;
+  uint32_t count;
+  crystalize_type_t type;
+} pointer_child_t;
+
+typedef struct pointer_child_list_t {
+  pointer_child_t* entries;
+  int count;
+  int capacity;
+} pointer_child_list_t;
+
+typedef struct encoder_root_t {
+  uint64_t key;
+  const crystalize_schema_t* schema;
+  const void* data;
+} encoder_root_t;
+
 typedef struct encoder_t {
+  crystalize_arena_t* scratch; // where all the encoder's memory comes from (NULL for the alloc handler)
+  crystalize_error_t error;    // set when scratch memory runs out
   writer_t writer;
   schema_list_t schemas;
   write_queue_t todo_list;
   pointer_fixup_list_t pointer_fixups;
-  pointer_remap_list_t pointer_remaps;
+  pointer_remap_map_t pointer_remaps;
+  range_tree_t ranges;        // everything queued this pass
+  range_tree_t layout_ranges; // everything queued by the sizing pass, for resolving inline pointers
+  bool inline_pointers; // the remaps are already known, so pointers are written as offsets straight away
+  bool dedup_content;
+  uint32_t thread_count;
+  uint64_t base_address; // when set, pointers are written as absolute addresses for a buffer loaded there
+  bool compact_pointer_table;
+  bool paged_pointer_table;
+  content_map_t contents;
+  uint32_t dedup_bytes_saved;
+  const encoder_root_t* roots; // when set, a directory of these roots is written instead of a single root
+  uint32_t root_count;
+
+  // header fields as of the last pass. a later pass writes them up front and only patches them if they changed
+  uint32_t data_offset;
+  uint32_t pointer_table_offset;
+  uint32_t pointer_count;
 } encoder_t;
 
-static void array_free(void* entries_ptr, int* count_ptr, int* capacity_ptr) {
-  crystalize_free(*(void**)entries_ptr);
+#define SCRATCH_ALIGNMENT 16
+#define WRITER_FLUSH_SIZE (64 * 1024)
+
+static void* encoder_alloc(encoder_t* encoder, size_t size) {
+  crystalize_arena_t* arena = encoder->scratch;
+  if (arena == NULL) {
+    void* ptr = crystalize_alloc(size);
+    crystalize_assert(ptr != NULL, "allocation failed");
+    return ptr;
+  }
+
+  const size_t start = (arena->used + (SCRATCH_ALIGNMENT - 1)) & ~(size_t)(SCRATCH_ALIGNMENT - 1);
+  if (start > arena->size || size > arena->size - start) {
+    encoder->error = CRYSTALIZE_ERROR_SCRATCH_EXHAUSTED;
+    return NULL;
+  }
+  arena->used = start + size;
+  return arena->buf + start;
+}
+
+static void encoder_dealloc(encoder_t* encoder, void* ptr, size_t size) {
+  crystalize_arena_t* arena = encoder->scratch;
+  if (arena == NULL) {
+    crystalize_free(ptr);
+    return;
+  }
+
+  // only the most recent allocation can be handed back to an arena
+  if (ptr != NULL && (char*)ptr + size == arena->buf + arena->used) {
+    arena->used = (size_t)((char*)ptr - arena->buf);
+  }
+}
+
+static void* encoder_realloc(encoder_t* encoder, void* ptr, size_t old_size, size_t size) {
+  crystalize_arena_t* arena = encoder->scratch;
+  if (arena == NULL) {
+    return crystalize_realloc(ptr, old_size, size);
+  }
+
+  // the most recent allocation can grow in place
+  if (ptr != NULL && (char*)ptr + old_size == arena->buf + arena->used) {
+    const size_t start = (size_t)((char*)ptr - arena->buf);
+    if (size > arena->size - start) {
+      encoder->error = CRYSTALIZE_ERROR_SCRATCH_EXHAUSTED;
+      return NULL;
+    }
+    arena->used = start + size;
+    return ptr;
+  }
+
+  void* new_ptr = encoder_alloc(encoder, size);
+  if (new_ptr != NULL && ptr != NULL) {
+    memcpy(new_ptr, ptr, old_size);
+  }
+  return new_ptr;
+}
+
+static void array_free(encoder_t* encoder, void* entries_ptr, int* count_ptr, int* capacity_ptr, int element_size) {
+  encoder_dealloc(encoder, *(void**)entries_ptr, (size_t)*capacity_ptr * element_size);
   *(void**)entries_ptr = NULL;
   *count_ptr = 0;
   *capacity_ptr = 0;
 }
 
-static void array_grow_if_needed(void* entries_ptr, int* count_ptr, int* capacity_ptr, int element_size, int growth_step) {
+static bool array_grow_if_needed(encoder_t* encoder, void* entries_ptr, int* count_ptr, int* capacity_ptr, int element_size, int min_capacity) {
   void* entries = *(void**)entries_ptr;
   int count = *count_ptr;
   int capacity = *capacity_ptr;
   if (count >= capacity) {
-    capacity += growth_step;
-    entries = crystalize_realloc(entries, capacity * element_size);
+    // grow geometrically so the total amount of copying stays linear in the final size
+    const int old_capacity = capacity;
+    capacity = MAX(capacity * 2, min_capacity);
+    entries = encoder_realloc(encoder, entries, (size_t)old_capacity * element_size, (size_t)capacity * element_size);
+    if (entries == NULL) {
+      return false;
+    }
     *capacity_ptr = capacity;
     *(void**)entries_ptr = entries;
   }
+  return true;
+}
+
+static bool write_queue_grow(encoder_t* encoder, write_queue_t* queue) {
+  const int old_capacity = queue->capacity;
+  const int new_capacity = old_capacity > 0 ? old_capacity * 2 : 128;
+  write_queue_entry_t* entries = (write_queue_entry_t*)encoder_alloc(encoder, new_capacity * sizeof(write_queue_entry_t));
+  if (entries == NULL) {
+    return false;
+  }
+
+  // unwrap the pending entries to the front of the new buffer
+  const int first_run = MIN(queue->count, old_capacity - queue->head);
+  if (first_run > 0) {
+    memcpy(entries, queue->entries + queue->head, first_run * sizeof(write_queue_entry_t));
+  }
+  if (queue->count > first_run) {
+    memcpy(entries + first_run, queue->entries, (queue->count - first_run) * sizeof(write_queue_entry_t));
+  }
+
+  encoder_dealloc(encoder, queue->entries, old_capacity * sizeof(write_queue_entry_t));
+  queue->entries = entries;
+  queue->head = 0;
+  queue->capacity = new_capacity;
+  return true;
 }
 
-static void write_queue_push(write_queue_t* queue, crystalize_type_t type, const crystalize_schema_t* schema, uint32_t count, const void* data) {
-  array_grow_if_needed(&queue->entries, &queue->count, &queue->capacity, sizeof(write_queue_entry_t), 128);
-  write_queue_entry_t* entry = queue->entries + queue->count;
+static void write_queue_push(encoder_t* encoder, crystalize_type_t type, const crystalize_schema_t* schema, uint32_t count, const void* data) {
+  write_queue_t* queue = &encoder->todo_list;
+  if (queue->count >= queue->capacity && !write_queue_grow(encoder, queue)) {
+    return;
+  }
+  write_queue_entry_t* entry = queue->entries + ((queue->head + queue->count) & (queue->capacity - 1));
   entry->type = type;
   entry->schema = schema;
   entry->data = data;
@@ -87,118 +261,23 @@ static void write_queue_push(write_queue_t* queue, crystalize_type_t type, const
   ++queue->count;
 }
 
-static write_queue_entry_t* write_queue_first(write_queue_t* queue) {
-  return queue->entries;
-}
-
-static void write_queue_shift(write_queue_t* queue) {
+static write_queue_entry_t write_queue_pop(write_queue_t* queue) {
+  const write_queue_entry_t entry = queue->entries[queue->head];
+  queue->head = (queue->head + 1) & (queue->capacity - 1);
   --queue->count;
-  if (queue->count > 0) {
-    memcpy(queue->entries, queue->entries + 1, queue->count * sizeof(write_queue_entry_t));
-  }
+  return entry;
 }
 
-static uint32_t type_get_alignment(crystalize_type_t type) {
-  switch (type) {
-    case CRYSTALIZE_BOOL:
-      return alignof(bool);
-    case CRYSTALIZE_CHAR:
-      return alignof(char);
-    case CRYSTALIZE_INT8:
-      return alignof(int8_t);
-    case CRYSTALIZE_INT16:
-      return alignof(int16_t);
-    case CRYSTALIZE_INT32:
-      return alignof(int32_t);
-    case CRYSTALIZE_INT64:
-      return alignof(int64_t);
-    case CRYSTALIZE_UINT8:
-      return alignof(uint8_t);
-    case CRYSTALIZE_UINT16:
-      return alignof(uint16_t);
-    case CRYSTALIZE_UINT32:
-      return alignof(uint32_t);
-    case CRYSTALIZE_UINT64:
-      return alignof(uint64_t);
-    case CRYSTALIZE_FLOAT:
-      return alignof(float);
-    case CRYSTALIZE_DOUBLE:
-      return alignof(double);
-    default:
-      crystalize_assert(false, "unknown field type");
-      return 0;
-  }
+static void write_queue_free(encoder_t* encoder, write_queue_t* queue) {
+  encoder_dealloc(encoder, queue->entries, queue->capacity * sizeof(write_queue_entry_t));
+  queue->entries = NULL;
+  queue->head = 0;
+  queue->count = 0;
+  queue->capacity = 0;
 }
 
-static uint32_t type_get_size(crystalize_type_t type) {
+static uint32_t count_get_value_as_uint32(crystalize_type_t type, const void* data) {
   switch (type) {
-    case CRYSTALIZE_BOOL:
-      return sizeof(bool);
-    case CRYSTALIZE_CHAR:
-      return sizeof(char);
-    case CRYSTALIZE_INT8:
-      return sizeof(int8_t);
-    case CRYSTALIZE_INT16:
-      return sizeof(int16_t);
-    case CRYSTALIZE_INT32:
-      return sizeof(int32_t);
-    case CRYSTALIZE_INT64:
-      return sizeof(int64_t);
-    case CRYSTALIZE_UINT8:
-      return sizeof(uint8_t);
-    case CRYSTALIZE_UINT16:
-      return sizeof(uint16_t);
-    case CRYSTALIZE_UINT32:
-      return sizeof(uint32_t);
-    case CRYSTALIZE_UINT64:
-      return sizeof(uint64_t);
-    case CRYSTALIZE_FLOAT:
-      return sizeof(float);
-    case CRYSTALIZE_DOUBLE:
-      return sizeof(double);
-    default:
-      crystalize_assert(false, "unknown field type");
-      return 0;
-  }
-}
-
-static bool field_is_scalar(const crystalize_schema_field_t* field) {
-  return field->type != CRYSTALIZE_STRUCT;
-}
-static bool field_is_pointer(const crystalize_schema_field_t* field) {
-  return field->count == 0;
-}
-static bool field_is_pointer_counted(const crystalize_schema_field_t* field) {
-  return field->count == 0 && field->count_field_name_id != 0;
-}
-
-static uint32_t struct_get_alignment(const crystalize_schema_t* schema);
-static uint32_t field_get_alignment(const crystalize_schema_field_t* field) {
-  if (field_is_pointer(field)) {
-    return alignof(void*);
-  }
-  else {
-    if (field->type == CRYSTALIZE_STRUCT) {
-      const crystalize_schema_t* field_schema = crystalize_schema_get(field->struct_name_id, field->struct_version);
-      return struct_get_alignment(field_schema);
-    }
-    else {
-      return type_get_alignment(field->type);
-    }
-  }
-}
-
-static uint32_t field_get_size(const crystalize_schema_field_t* field) {
-  if (field_is_pointer(field)) {
-    return sizeof(void*);
-  }
-  else {
-    return type_get_size(field->type);
-  }
-}
-
-static uint32_t field_get_value_as_uint32(const crystalize_schema_field_t* field, const void* data) {
-  switch (field->type) {
     case CRYSTALIZE_INT8:
       return (uint32_t)(*(const int8_t*)data);
     case CRYSTALIZE_INT16:
@@ -217,15 +296,6 @@ static uint32_t field_get_value_as_uint32(const crystalize_schema_field_t* field
   }
 }
 
-static uint32_t struct_get_alignment(const crystalize_schema_t* schema) {
-  uint32_t schema_alignment = 1;
-  for (uint32_t index = 0; index < schema->field_count; ++index) {
-    const crystalize_schema_field_t* field = schema->fields + index;
-    schema_alignment = MAX(schema_alignment, field_get_alignment(field));
-  }
-  return schema_alignment;
-}
-
 static int schema_compare(const void* a, const void* b) {
   const crystalize_schema_t* schema_a = (const crystalize_schema_t*)a;
   const crystalize_schema_t* schema_b = (const crystalize_schema_t*)b;
@@ -240,7 +310,7 @@ static int schema_compare(const void* a, const void* b) {
   }
 }
 
-static void gather_schemas_impl(crystalize_encode_result_t* result, schema_list_t* schemas, const crystalize_schema_t* schema) {
+static void gather_schemas_impl(encoder_t* encoder, crystalize_encode_result_t* result, schema_list_t* schemas, const crystalize_schema_t* schema) {
   // check if the schema is already in the list
   for (int index = 0; index < schemas->count; ++index) {
     if (schema->name_id == schemas->entries[index].name_id) {
@@ -249,7 +319,10 @@ static void gather_schemas_impl(crystalize_encode_result_t* result, schema_list_
     }
   }
 
-  array_grow_if_needed(&schemas->entries, &schemas->count, &schemas->capacity, sizeof(crystalize_schema_t), 128);
+  if (!array_grow_if_needed(encoder, &schemas->entries, &schemas->count, &schemas->capacity, sizeof(crystalize_schema_t), 128)) {
+    result->error = encoder->error;
+    return;
+  }
 
   // add the schema to the list
   schemas->entries[schemas->count] = *schema;
@@ -259,7 +332,7 @@ static void gather_schemas_impl(crystalize_encode_result_t* result, schema_list_
   for (uint32_t index = 0; index < schema->field_count; ++index) {
     const crystalize_schema_field_t* field = schema->fields + index;
     if (field->type == CRYSTALIZE_STRUCT) {
-      const crystalize_schema_t* field_schema = crystalize_schema_get(field->struct_name_id, field->struct_version);
+      const crystalize_schema_t* field_schema = schema_get_layout(schema)->fields[index].struct_schema;
       if (field_schema == NULL) {
         int err_msg_len = snprintf(
             NULL,
@@ -281,240 +354,1177 @@ static void gather_schemas_impl(crystalize_encode_result_t* result, schema_list_
         result->error_message = err_msg;
         return;
       }
-      gather_schemas_impl(result, schemas, field_schema);
+      gather_schemas_impl(encoder, result, schemas, field_schema);
+      if (result->error != CRYSTALIZE_ERROR_NONE) {
+        return;
+      }
     }
   }
 }
 
-static void gather_schemas(crystalize_encode_result_t* result, schema_list_t* schemas, const crystalize_schema_t* schema) {
-  gather_schemas_impl(result, schemas, schema);
+static void gather_schemas(encoder_t* encoder, crystalize_encode_result_t* result, schema_list_t* schemas, const crystalize_schema_t* schema) {
+  gather_schemas_impl(encoder, result, schemas, schema);
   if (result->error != CRYSTALIZE_ERROR_NONE) {
     qsort(schemas->entries, schemas->count, sizeof(crystalize_schema_t), &schema_compare);
   }
 }
 
-static void pointer_fixup_add(encoder_t* encoder, uint32_t pos) {
+static void pointer_fixup_add(encoder_t* encoder, uint32_t pos, const void* target) {
   pointer_fixup_list_t* fixups = &encoder->pointer_fixups;
-  array_grow_if_needed(&fixups->entries, &fixups->count, &fixups->capacity, sizeof(void**), 128);
-  fixups->entries[fixups->count] = pos;
+  if (!array_grow_if_needed(encoder, &fixups->entries, &fixups->count, &fixups->capacity, sizeof(pointer_fixup_t), 128)) {
+    return;
+  }
+  fixups->entries[fixups->count].target = target;
+  fixups->entries[fixups->count].pos = pos;
   ++fixups->count;
 }
 
-static void pointer_remap_add(encoder_t* encoder, const void* from, uint32_t pos) {
-  pointer_remap_list_t* remaps = &encoder->pointer_remaps;
-  array_grow_if_needed(&remaps->entries, &remaps->count, &remaps->capacity, sizeof(pointer_remap_t), 128);
-  pointer_remap_t* entry = remaps->entries + remaps->count;
-  entry->from = from;
-  entry->to = pos;
-  ++remaps->count;
+static pointer_remap_t* pointer_remap_slot(pointer_remap_t* entries, int capacity, const void* from) {
+  const uint32_t mask = (uint32_t)capacity - 1;
+  uint32_t index = hash_pointer(from) & mask;
+  while (entries[index].from != NULL && entries[index].from != from) {
+    index = (index + 1) & mask;
+  }
+  return entries + index;
 }
 
-static void convert_pointers_to_offsets(encoder_t* encoder) {
-  writer_t* writer = &encoder->writer;
-  pointer_fixup_list_t* fixups = &encoder->pointer_fixups;
-  pointer_remap_list_t* remaps = &encoder->pointer_remaps;
-  for (int fixup_index = 0; fixup_index < fixups->count; ++fixup_index) {
-    const uint32_t offset_of_fixup = fixups->entries[fixup_index];
-    const void* dest_orig = *(const void**)(writer->buf + offset_of_fixup);
-    uint32_t dest = 0;
-    for (int remap_index = 0; remap_index < remaps->count; ++remap_index) {
-      const pointer_remap_t* remap = remaps->entries + remap_index;
-      if (remap->from == dest_orig) {
-        dest = remap->to;
-        break;
+static bool pointer_remap_grow(encoder_t* encoder, pointer_remap_map_t* remaps) {
+  const int old_capacity = remaps->capacity;
+  pointer_remap_t* old_entries = remaps->entries;
+  const int new_capacity = old_capacity > 0 ? old_capacity * 2 : 256;
+  pointer_remap_t* new_entries = (pointer_remap_t*)encoder_alloc(encoder, new_capacity * sizeof(pointer_remap_t));
+  if (new_entries == NULL) {
+    return false;
+  }
+  memset(new_entries, 0, new_capacity * sizeof(pointer_remap_t));
+  for (int index = 0; index < old_capacity; ++index) {
+    const pointer_remap_t* entry = old_entries + index;
+    if (entry->from != NULL) {
+      *pointer_remap_slot(new_entries, new_capacity, entry->from) = *entry;
+    }
+  }
+  encoder_dealloc(encoder, old_entries, old_capacity * sizeof(pointer_remap_t));
+  remaps->entries = new_entries;
+  remaps->capacity = new_capacity;
+  return true;
+}
+
+// Marks the object at the given address as queued. Returns false if it was already queued this pass with at least as
+// many bytes, in which case it must not be written again.
+static bool pointer_remap_visit(encoder_t* encoder, const void* from, uint32_t size) {
+  pointer_remap_map_t* remaps = &encoder->pointer_remaps;
+  // keep the load factor at or below 1/2 so probe sequences stay short
+  if ((remaps->count + 1) * 2 > remaps->capacity && !pointer_remap_grow(encoder, remaps)) {
+    return false;
+  }
+  pointer_remap_t* entry = pointer_remap_slot(remaps->entries, remaps->capacity, from);
+  if (entry->from == NULL) {
+    entry->from = from;
+    ++remaps->count;
+  }
+  else if (entry->visited && entry->size >= size) {
+    return false;
+  }
+
+  // either it's new or a longer array starts at the same address. a longer one is written again and every pointer
+  // goes to that copy.
+  entry->size = size;
+  entry->visited = true;
+  return true;
+}
+
+static void pointer_remap_set(encoder_t* encoder, const void* from, uint32_t pos) {
+  if (encoder->inline_pointers) {
+    // the sizing pass already settled where everything goes, and pointers have been written against that
+    return;
+  }
+  pointer_remap_map_t* remaps = &encoder->pointer_remaps;
+  pointer_remap_t* entry = pointer_remap_slot(remaps->entries, remaps->capacity, from);
+  if (entry->from != NULL) {
+    entry->to = pos;
+  }
+}
+
+// Forgets which objects were queued while keeping where they went, so another pass can run over the same layout.
+static void pointer_remap_clear_visited(encoder_t* encoder) {
+  pointer_remap_map_t* remaps = &encoder->pointer_remaps;
+  for (int index = 0; index < remaps->capacity; ++index) {
+    remaps->entries[index].visited = false;
+    remaps->entries[index].size = 0;
+  }
+}
+
+static bool pointer_remap_find(const encoder_t* encoder, const void* from, uint32_t* to) {
+  const pointer_remap_map_t* remaps = &encoder->pointer_remaps;
+  if (remaps->count == 0) {
+    return false;
+  }
+  const pointer_remap_t* entry = pointer_remap_slot(remaps->entries, remaps->capacity, from);
+  if (entry->from == NULL) {
+    return false;
+  }
+  *to = entry->to;
+  return true;
+}
+
+static void range_tree_update(range_node_t* nodes, int node) {
+  range_node_t* n = nodes + node;
+  n->max_node = node;
+  if (n->left >= 0 && nodes[nodes[n->left].max_node].end > nodes[n->max_node].end) {
+    n->max_node = nodes[n->left].max_node;
+  }
+  if (n->right >= 0 && nodes[nodes[n->right].max_node].end > nodes[n->max_node].end) {
+    n->max_node = nodes[n->right].max_node;
+  }
+}
+
+static int range_tree_insert_at(range_node_t* nodes, int root, int node) {
+  if (root < 0) {
+    return node;
+  }
+  if (nodes[node].from < nodes[root].from) {
+    nodes[root].left = range_tree_insert_at(nodes, nodes[root].left, node);
+    if (nodes[nodes[root].left].priority > nodes[root].priority) {
+      // rotate right
+      const int left = nodes[root].left;
+      nodes[root].left = nodes[left].right;
+      nodes[left].right = root;
+      range_tree_update(nodes, root);
+      root = left;
+    }
+  }
+  else {
+    nodes[root].right = range_tree_insert_at(nodes, nodes[root].right, node);
+    if (nodes[nodes[root].right].priority > nodes[root].priority) {
+      // rotate left
+      const int right = nodes[root].right;
+      nodes[root].right = nodes[right].left;
+      nodes[right].left = root;
+      range_tree_update(nodes, root);
+      root = right;
+    }
+  }
+  range_tree_update(nodes, root);
+  return root;
+}
+
+// Finds the range that reaches furthest among those starting at or before ptr. Returns -1 if there are none.
+static int range_tree_find(const range_tree_t* ranges, const void* ptr) {
+  const range_node_t* nodes = ranges->entries;
+  int best = -1;
+  int node = ranges->count > 0 ? ranges->root : -1;
+  while (node >= 0) {
+    if (nodes[node].from <= (const char*)ptr) {
+      if (best < 0 || nodes[node].end > nodes[best].end) {
+        best = node;
+      }
+      const int left = nodes[node].left;
+      if (left >= 0 && nodes[nodes[left].max_node].end > nodes[best].end) {
+        best = nodes[left].max_node;
       }
+      node = nodes[node].right;
+    }
+    else {
+      node = nodes[node].left;
     }
-    crystalize_assert(dest != 0, "failed find remap target for fixup pointer");
+  }
+  return best;
+}
 
-    // apply the remap as an offset
-    intptr_t offset = (int32_t)dest - (int32_t)offset_of_fixup;
-    *(int64_t*)(writer->buf + offset_of_fixup) = offset;
+static bool range_tree_contains(const range_tree_t* ranges, const void* ptr, uint32_t size) {
+  const int node = range_tree_find(ranges, ptr);
+  return node >= 0 && ranges->entries[node].end >= (const char*)ptr + size;
+}
 
-    writer_write_u32(&encoder->writer, offset_of_fixup);
+static void range_tree_add(encoder_t* encoder, range_tree_t* ranges, const void* ptr, uint32_t size) {
+  const char* from = (const char*)ptr;
+  const int overlap = range_tree_find(ranges, from + size - 1);
+  if (overlap >= 0 && ranges->entries[overlap].end > from) {
+    ranges->has_overlaps = true;
+  }
+
+  if (!array_grow_if_needed(encoder, &ranges->entries, &ranges->count, &ranges->capacity, sizeof(range_node_t), 128)) {
+    return;
   }
+  if (ranges->count == 0) {
+    ranges->seed = 0x9e3779b9u;
+  }
+  // xorshift keeps the priorities random enough to balance the tree while the output stays deterministic
+  ranges->seed ^= ranges->seed << 13;
+  ranges->seed ^= ranges->seed >> 17;
+  ranges->seed ^= ranges->seed << 5;
+
+  const int node = ranges->count++;
+  range_node_t* n = ranges->entries + node;
+  n->from = from;
+  n->end = from + size;
+  n->left = -1;
+  n->right = -1;
+  n->max_node = node;
+  n->priority = ranges->seed;
+  ranges->root = range_tree_insert_at(ranges->entries, node > 0 ? ranges->root : -1, node);
 }
 
-static void encoder_free(encoder_t* encoder) {
-  array_free(&encoder->pointer_remaps.entries, &encoder->pointer_remaps.count, &encoder->pointer_remaps.capacity);
-  array_free(&encoder->pointer_fixups.entries, &encoder->pointer_fixups.count, &encoder->pointer_fixups.capacity);
-  array_free(&encoder->schemas.entries, &encoder->schemas.count, &encoder->schemas.capacity);
+static void range_tree_free(encoder_t* encoder, range_tree_t* ranges) {
+  array_free(encoder, &ranges->entries, &ranges->count, &ranges->capacity, sizeof(range_node_t));
+  ranges->has_overlaps = false;
 }
 
-static void write_scalars(encoder_t* encoder, crystalize_type_t type, uint32_t count, const void* data_in) {
-  writer_t* writer = &encoder->writer;
-  const uint32_t alignment = type_get_alignment(type);
-  const uint32_t size = type_get_size(type);
-  const char* data = (const char*)data_in;
+// Finds where the given source pointer lands in the output. Pointers into the middle of a queued object land at the
+// same offset into its copy.
+static bool pointer_resolve(const encoder_t* encoder, const range_tree_t* ranges, const void* ptr, uint32_t* to) {
+  if (!ranges->has_overlaps && pointer_remap_find(encoder, ptr, to)) {
+    // nothing overlaps, so a range starting exactly here is the only one that contains it
+    return true;
+  }
+  const int node = range_tree_find(ranges, ptr);
+  if (node >= 0 && ranges->entries[node].end > (const char*)ptr) {
+    const range_node_t* range = ranges->entries + node;
+    uint32_t range_to = 0;
+    if (pointer_remap_find(encoder, range->from, &range_to)) {
+      *to = range_to + (uint32_t)((const char*)ptr - range->from);
+      return true;
+    }
+  }
+  // zero-sized objects only show up by their start address
+  return pointer_remap_find(encoder, ptr, to);
+}
 
-  // align the buffer and the input data
-  writer_align(writer, alignment);
-  data = ALIGN_PTR(const char, data, alignment);
+// Queues the object at the given address unless it's already been queued, either by itself or as part of something
+// bigger, so shared objects are written once and cycles terminate.
+static void encoder_push_object(encoder_t* encoder, crystalize_type_t type, const crystalize_schema_t* schema, uint32_t count, const void* data) {
+  const uint32_t element_size = type == CRYSTALIZE_STRUCT ? schema_get_layout(schema)->size : type_get_size(type);
+  const uint32_t size = count * element_size;
+  if (size > 0 && range_tree_contains(&encoder->ranges, data, size)) {
+    return;
+  }
+  if (!pointer_remap_visit(encoder, data, size)) {
+    return;
+  }
+  if (size > 0) {
+    range_tree_add(encoder, &encoder->ranges, data, size);
+  }
+  write_queue_push(encoder, type, schema, count, data);
+}
 
-  // copy everything as a single block
-  const uint32_t total_bytes = count * size;
-  writer_write(writer, data, total_bytes);
-  data += total_bytes;
+static bool content_map_grow(encoder_t* encoder, content_map_t* contents) {
+  const int old_capacity = contents->capacity;
+  content_entry_t* old_entries = contents->entries;
+  const int new_capacity = old_capacity > 0 ? old_capacity * 2 : 256;
+  content_entry_t* new_entries = (content_entry_t*)encoder_alloc(encoder, new_capacity * sizeof(content_entry_t));
+  if (new_entries == NULL) {
+    return false;
+  }
+  memset(new_entries, 0, new_capacity * sizeof(content_entry_t));
+  const uint32_t mask = (uint32_t)new_capacity - 1;
+  for (int index = 0; index < old_capacity; ++index) {
+    const content_entry_t* entry = old_entries + index;
+    if (entry->data != NULL) {
+      uint32_t slot = entry->hash & mask;
+      while (new_entries[slot].data != NULL) {
+        slot = (slot + 1) & mask;
+      }
+      new_entries[slot] = *entry;
+    }
+  }
+  encoder_dealloc(encoder, old_entries, old_capacity * sizeof(content_entry_t));
+  contents->entries = new_entries;
+  contents->capacity = new_capacity;
+  return true;
+}
+
+static void content_map_clear(encoder_t* encoder) {
+  content_map_t* contents = &encoder->contents;
+  if (contents->count > 0) {
+    memset(contents->entries, 0, contents->capacity * sizeof(content_entry_t));
+    contents->count = 0;
+  }
+  encoder->dedup_bytes_saved = 0;
+}
+
+// Checks whether identical bytes have already been written somewhere suitably aligned, and if so points the entry's
+// address there instead. Otherwise records where the entry is about to be written.
+static bool content_dedup(encoder_t* encoder, const write_queue_entry_t* todo, uint32_t alignment) {
+  // only pointer-free data is the same everywhere it's written
+  uint32_t element_size;
+  if (todo->type == CRYSTALIZE_STRUCT) {
+    const schema_layout_t* layout = schema_get_layout(todo->schema);
+    if (!layout->is_plain) {
+      return false;
+    }
+    element_size = layout->size;
+  }
+  else {
+    element_size = type_get_size(todo->type);
+  }
+  const uint32_t size = todo->count * element_size;
+  if (size == 0) {
+    return false;
+  }
+
+  content_map_t* contents = &encoder->contents;
+  // keep the load factor at or below 1/2 so probe sequences stay short
+  if ((contents->count + 1) * 2 > contents->capacity && !content_map_grow(encoder, contents)) {
+    return false;
+  }
+  const uint32_t hash = fnv1a((const char*)todo->data, size);
+  const uint32_t mask = (uint32_t)contents->capacity - 1;
+  uint32_t slot = hash & mask;
+  while (contents->entries[slot].data != NULL) {
+    // compare the sources. plain structs can differ in their padding, which only means missing out on a match
+    const content_entry_t* entry = contents->entries + slot;
+    if (entry->hash == hash && entry->size == size && entry->to % alignment == 0 && memcmp(entry->data, todo->data, size) == 0) {
+      pointer_remap_set(encoder, todo->data, entry->to);
+      encoder->dedup_bytes_saved += size;
+      return true;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  content_entry_t* entry = contents->entries + slot;
+  entry->data = todo->data;
+  entry->hash = hash;
+  entry->size = size;
+  entry->to = (encoder->writer.cur + (alignment - 1)) & ~(alignment - 1);
+  ++contents->count;
+  return false;
+}
+
+// The value written into a pointer slot at pos for a pointer to dest: an offset relative to the slot, or an absolute
+// address when encoding for a preferred base address.
+static int64_t encoder_pointer_value(const encoder_t* encoder, uint32_t pos, uint32_t dest) {
+  if (encoder->base_address != 0) {
+    return (int64_t)(encoder->base_address + dest);
+  }
+  return (int64_t)dest - (int64_t)pos;
+}
+
+static int pointer_fixup_compare(const void* a, const void* b) {
+  const pointer_fixup_t* fixup_a = (const pointer_fixup_t*)a;
+  const pointer_fixup_t* fixup_b = (const pointer_fixup_t*)b;
+  if (fixup_a->pos < fixup_b->pos) {
+    return -1;
+  }
+  if (fixup_a->pos > fixup_b->pos) {
+    return 1;
+  }
+  return 0;
 }
 
-static const char* write_struct(encoder_t* encoder, const crystalize_schema_t* schema, const char* data) {
+// Puts the fixups in position order. They mostly already are, since slots are found in the order they're written.
+static void pointer_fixups_sort(pointer_fixup_list_t* fixups) {
+  for (int fixup_index = 1; fixup_index < fixups->count; ++fixup_index) {
+    if (fixups->entries[fixup_index].pos < fixups->entries[fixup_index - 1].pos) {
+      qsort(fixups->entries, fixups->count, sizeof(pointer_fixup_t), &pointer_fixup_compare);
+      return;
+    }
+  }
+}
+
+// Writes the start of a paged pointer table: the page count, a cleared bit per page for the decoder to mark the pages
+// it's fixed up, and where each page's run of the sorted positions ends.
+static void write_pointer_pages(encoder_t* encoder) {
   writer_t* writer = &encoder->writer;
-  const uint32_t struct_alignment = struct_get_alignment(schema);
+  const pointer_fixup_list_t* fixups = &encoder->pointer_fixups;
+  const uint32_t page_count = (encoder->pointer_table_offset + CRYSTALIZE_LAZY_PAGE_SIZE - 1) / CRYSTALIZE_LAZY_PAGE_SIZE;
+  writer_write_u32(writer, page_count);
+  writer_pad(writer, (page_count + 31) / 32 * sizeof(uint32_t));
+  int fixup_index = 0;
+  for (uint32_t page = 0; page < page_count; ++page) {
+    const uint32_t page_end = (page + 1) * CRYSTALIZE_LAZY_PAGE_SIZE;
+    while (fixup_index < fixups->count && fixups->entries[fixup_index].pos < page_end) {
+      ++fixup_index;
+    }
+    writer_write_u32(writer, (uint32_t)fixup_index);
+  }
+}
 
-  // align the start of the struct
-  writer_align(writer, struct_alignment);
-  data = ALIGN_PTR(const char, data, struct_alignment);
-  const char* data_start = data;
+static void convert_pointers_to_offsets(encoder_t* encoder) {
+  writer_t* writer = &encoder->writer;
+  pointer_fixup_list_t* fixups = &encoder->pointer_fixups;
+  if (encoder->compact_pointer_table || encoder->paged_pointer_table) {
+    pointer_fixups_sort(fixups);
+  }
+  if (encoder->paged_pointer_table) {
+    write_pointer_pages(encoder);
+  }
+  uint32_t prev_pos = 0;
+  for (int fixup_index = 0; fixup_index < fixups->count; ++fixup_index) {
+    const pointer_fixup_t* fixup = fixups->entries + fixup_index;
+    if (!encoder->inline_pointers) {
+      uint32_t dest = 0;
+      pointer_resolve(encoder, &encoder->ranges, fixup->target, &dest);
+      crystalize_assert(dest != 0, "failed find remap target for fixup pointer");
 
-  // write out each field
+      // apply the remap as an offset
+      const int64_t offset = encoder_pointer_value(encoder, fixup->pos, dest);
+      writer_patch(writer, fixup->pos, &offset, sizeof(int64_t));
+    }
+
+    if (encoder->compact_pointer_table) {
+      writer_write_varint(writer, fixup->pos - prev_pos);
+      prev_pos = fixup->pos;
+    }
+    else {
+      writer_write_u32(writer, fixup->pos);
+    }
+  }
+}
+
+// Clears all the per-pass state while keeping the allocations around.
+static void encoder_reset(encoder_t* encoder) {
+  encoder->todo_list.head = 0;
+  encoder->todo_list.count = 0;
+  encoder->pointer_fixups.count = 0;
+  if (encoder->pointer_remaps.count > 0) {
+    memset(encoder->pointer_remaps.entries, 0, encoder->pointer_remaps.capacity * sizeof(pointer_remap_t));
+    encoder->pointer_remaps.count = 0;
+  }
+  encoder->ranges.count = 0;
+  encoder->ranges.has_overlaps = false;
+  encoder->layout_ranges.count = 0;
+  encoder->layout_ranges.has_overlaps = false;
+  content_map_clear(encoder);
+}
+
+static void encoder_free(encoder_t* encoder) {
+  // release in reverse so an arena can hand back as much as possible
+  write_queue_free(encoder, &encoder->todo_list);
+  array_free(encoder, &encoder->contents.entries, &encoder->contents.count, &encoder->contents.capacity, sizeof(content_entry_t));
+  range_tree_free(encoder, &encoder->layout_ranges);
+  range_tree_free(encoder, &encoder->ranges);
+  array_free(encoder, &encoder->pointer_remaps.entries, &encoder->pointer_remaps.count, &encoder->pointer_remaps.capacity, sizeof(pointer_remap_t));
+  array_free(encoder, &encoder->pointer_fixups.entries, &encoder->pointer_fixups.count, &encoder->pointer_fixups.capacity, sizeof(pointer_fixup_t));
+  array_free(encoder, &encoder->schemas.entries, &encoder->schemas.count, &encoder->schemas.capacity, sizeof(crystalize_schema_t));
+}
+
+static void write_scalars(encoder_t* encoder, crystalize_type_t type, uint32_t count, const void* data) {
+  // NOTE: encoder_run() has already aligned the buffer
+  writer_write(&encoder->writer, data, count * type_get_size(type));
+}
+
+// Copies plain structs as a single block, then clears their padding so the output doesn't depend on whatever bytes
+// the source had there.
+static void copy_plain_structs(char* out, const schema_layout_t* layout, uint32_t count, const char* data) {
+  memcpy(out, data, count * layout->size);
+  if (layout->hole_count == 0) {
+    return;
+  }
+  for (uint32_t index = 0; index < count; ++index) {
+    char* element = out + index * layout->size;
+    for (uint32_t hole_index = 0; hole_index < layout->hole_count; ++hole_index) {
+      memset(element + layout->holes[hole_index].offset, 0, layout->holes[hole_index].size);
+    }
+  }
+}
+
+// Writes a struct into space already reserved at pos in the buffer. Pointers get fixed up and queued straight away,
+// unless a worker is collecting them into children, in which case nothing in the encoder is modified.
+static void write_struct_at(encoder_t* encoder, const crystalize_schema_t* schema, const char* data, uint32_t pos, pointer_child_list_t* children) {
+  const schema_layout_t* layout = schema_get_layout(schema);
+  char* out = writer_at(&encoder->writer, pos); // NULL when measuring
   for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
     const crystalize_schema_field_t* field = schema->fields + field_index;
+    const schema_field_layout_t* field_layout = layout->fields + field_index;
+    const char* field_data = data + field_layout->offset;
+    const uint32_t field_pos = pos + field_layout->offset;
 
-    // // align to the field's desired alignment
-    // const uint32_t field_alignment = field_get_alignment(field);
-    // writer_align(writer, field_alignment);
-    // data = ALIGN_PTR(const char, data, field_alignment);
+    if (schema_field_is_pointer(field)) {
+      const void* ptr_value = *(const void* const*)field_data;
+      if (ptr_value == NULL) {
+        // NULL pointer. yay. the reserved space is already zeroed
+        continue;
+      }
 
-    const bool is_scalar = field_is_scalar(field);
-    const bool is_pointer = field_is_pointer(field);
-    const bool is_pointer_counted = field_is_pointer_counted(field);
-    if (is_pointer) {
-      // align
-      writer_align(writer, alignof(void*));
-      data = ALIGN_PTR(const char, data, alignof(void*));
+      uint32_t target_count = 1;
+      if (schema_field_is_pointer_counted(field)) {
+        target_count = count_get_value_as_uint32((crystalize_type_t)field_layout->count_type, data + field_layout->count_offset);
+      }
+      if (children != NULL) {
+        if (array_grow_if_needed(encoder, &children->entries, &children->count, &children->capacity, sizeof(pointer_child_t), 128)) {
+          pointer_child_t* child = children->entries + children->count++;
+          child->schema = field_layout->struct_schema;
+          child->target = ptr_value;
+          child->pos = field_pos;
+          child->count = target_count;
+          child->type = (crystalize_type_t)field->type;
+        }
+        continue;
+      }
 
-      const void* ptr_value = *(const char**)data;
-      if (ptr_value == NULL) {
-        // NULL pointer. yay. just write out zeros and move on
-        writer_pad(writer, sizeof(void*));
-        data += sizeof(void*);
+      // the pointer gets written as an offset once everything has been laid out
+      pointer_fixup_add(encoder, field_pos, ptr_value);
+      if (encoder->inline_pointers && out != NULL) {
+        uint32_t dest = 0;
+        pointer_resolve(encoder, &encoder->layout_ranges, ptr_value, &dest);
+        crystalize_assert(dest != 0, "failed find remap target for pointer");
+        const int64_t offset = encoder_pointer_value(encoder, field_pos, dest);
+        memcpy(out + field_layout->offset, &offset, sizeof(int64_t));
       }
-      else {
-        // write out a pointer to be fixed up later
-        pointer_fixup_add(encoder, writer->cur);
-        writer_write(writer, &ptr_value, sizeof(void*));
-        data += sizeof(void*);
-
-        uint32_t target_count = 1;
-        if (is_pointer_counted) {
-          // lookup the field containing the count
-          const crystalize_schema_field_t* count_field = NULL;
-          const char* data_field = data_start;
-          for (uint32_t index = 0; index < schema->field_count; ++index) {
-            data_field = ALIGN_PTR(const char, data_field, field_get_alignment(schema->fields + index));
-            if (schema->fields[index].name_id == field->count_field_name_id) {
-              count_field = schema->fields + index;
-              break;
-            }
-            data_field += field_get_size(schema->fields + index);
-          }
-          crystalize_assert(count_field != NULL, "internal error: failed to find the referenced count field for a counted pointer");
-
-          // extract the count
-          target_count = field_get_value_as_uint32(count_field, data_field);
+      encoder_push_object(encoder, (crystalize_type_t)field->type, field_layout->struct_schema, target_count, ptr_value);
+    }
+    else if (field->type == CRYSTALIZE_STRUCT) {
+      const schema_layout_t* struct_layout = schema_get_layout(field_layout->struct_schema);
+      const uint32_t struct_size = struct_layout->size;
+      if (struct_layout->is_plain) {
+        if (out != NULL) {
+          copy_plain_structs(out + field_layout->offset, struct_layout, field->count, field_data);
         }
-        write_queue_push(&encoder->todo_list, field->type, crystalize_schema_get(field->struct_name_id, field->struct_version), target_count, ptr_value);
+        continue;
+      }
+      for (uint32_t index = 0; index < field->count; ++index) {
+        write_struct_at(encoder, field_layout->struct_schema, field_data + index * struct_size, field_pos + index * struct_size, children);
       }
     }
-    else {
-      // simple
-      if (is_scalar) {
-        // align to the scalar type
-        uint32_t field_alignment = type_get_alignment(field->type);
-        writer_align(writer, field_alignment);
-        data = ALIGN_PTR(const char, data, field_alignment);
-
-        // simple scalar type, just copy it in
-        uint32_t byte_size = field->count * type_get_size(field->type);
-        writer_write(writer, data, byte_size);
-        data += byte_size;
+    else if (out != NULL) {
+      // simple scalar type, just copy it in
+      memcpy(out + field_layout->offset, field_data, field_layout->size);
+    }
+  }
+}
+
+static void write_structs(encoder_t* encoder, const crystalize_schema_t* schema, uint32_t count, const char* data) {
+  // reserve zeroed space for all the structs up front so padding is deterministic and nothing reallocates the
+  // buffer while the fields are copied in
+  // NOTE: encoder_run() has already aligned the buffer
+  const schema_layout_t* layout = schema_get_layout(schema);
+  const uint32_t struct_size = layout->size;
+  const uint32_t pos = encoder->writer.cur;
+  if (layout->is_plain) {
+    // no pointers anywhere inside, so the whole array goes out as one block
+    writer_ensure(&encoder->writer, count * struct_size);
+    char* out = writer_at(&encoder->writer, pos);
+    if (out != NULL) {
+      copy_plain_structs(out, layout, count, data);
+    }
+    encoder->writer.cur += count * struct_size;
+    return;
+  }
+  writer_pad(&encoder->writer, count * struct_size);
+  for (uint32_t index = 0; index < count; ++index) {
+    write_struct_at(encoder, schema, data + index * struct_size, pos + index * struct_size, NULL);
+  }
+}
+
+// A level of the breadth-first walk. Everything in it is laid out serially, then written by the workers.
+typedef struct level_entry_t {
+  write_queue_entry_t todo;
+  uint32_t pos;
+  uint32_t element_size;
+} level_entry_t;
+
+typedef struct level_t {
+  level_entry_t* entries;
+  int count;
+  int capacity;
+} level_t;
+
+// A run of elements from one level entry.
+typedef struct work_item_t {
+  int entry;
+  uint32_t first;
+  uint32_t count;
+} work_item_t;
+
+typedef struct work_item_list_t {
+  work_item_t* entries;
+  int count;
+  int capacity;
+} work_item_list_t;
+
+typedef struct encode_worker_t {
+  encoder_t* encoder;
+  const level_t* level;
+  const work_item_t* items;
+  int item_count;
+  pointer_child_list_t children;
+  thread_t thread;
+} encode_worker_t;
+
+#define PARALLEL_CHUNK_SIZE (256 * 1024)
+#define PARALLEL_MIN_LEVEL_SIZE (512 * 1024)
+#define PARALLEL_MAX_THREADS 64
+
+static void encode_worker_run(void* arg) {
+  encode_worker_t* worker = (encode_worker_t*)arg;
+  encoder_t* encoder = worker->encoder;
+  for (int item_index = 0; item_index < worker->item_count; ++item_index) {
+    const work_item_t* item = worker->items + item_index;
+    const level_entry_t* entry = worker->level->entries + item->entry;
+    const uint32_t pos = entry->pos + item->first * entry->element_size;
+    const char* data = (const char*)entry->todo.data + item->first * entry->element_size;
+    char* out = writer_at(&encoder->writer, pos); // NULL when measuring
+    if (entry->todo.type != CRYSTALIZE_STRUCT) {
+      if (out != NULL) {
+        memcpy(out, data, item->count * entry->element_size);
+      }
+      continue;
+    }
+
+    const schema_layout_t* layout = schema_get_layout(entry->todo.schema);
+    if (layout->is_plain) {
+      if (out != NULL) {
+        copy_plain_structs(out, layout, item->count, data);
       }
-      else {
-        // recurse here
-        const crystalize_schema_t* field_schema = crystalize_schema_get(field->struct_name_id, field->struct_version);
-        crystalize_assert(field_schema != NULL, "failed to find field schema");
+      continue;
+    }
+    if (out != NULL) {
+      memset(out, 0, item->count * entry->element_size);
+    }
+    for (uint32_t index = 0; index < item->count; ++index) {
+      write_struct_at(encoder, entry->todo.schema, data + index * entry->element_size, pos + index * entry->element_size, &worker->children);
+    }
+  }
+}
 
-        // NOTE: write_struct() will do the alignment
-        data = write_struct(encoder, field_schema, data);
+// Splits the level into runs of elements and hands contiguous runs to each worker, so that reading the workers'
+// children back in order visits pointers in exactly the order the serial walk does.
+static int encode_workers_assign(encoder_t* encoder, const level_t* level, work_item_list_t* items, encode_worker_t* workers, uint64_t level_size) {
+  items->count = 0;
+  for (int entry_index = 0; entry_index < level->count; ++entry_index) {
+    const level_entry_t* entry = level->entries + entry_index;
+    const uint32_t chunk_count = MAX(1, PARALLEL_CHUNK_SIZE / MAX(entry->element_size, 1));
+    for (uint32_t first = 0; first < entry->todo.count; first += chunk_count) {
+      if (!array_grow_if_needed(encoder, &items->entries, &items->count, &items->capacity, sizeof(work_item_t), 128)) {
+        return 0;
       }
+      work_item_t* item = items->entries + items->count++;
+      item->entry = entry_index;
+      item->first = first;
+      item->count = MIN(chunk_count, entry->todo.count - first);
     }
   }
 
-  // pad out to the struct's alignment
-  writer_align(writer, struct_alignment);
-  data = ALIGN_PTR(const char, data, struct_alignment);
+  const int worker_count = (int)MIN((uint32_t)items->count, MIN(encoder->thread_count, PARALLEL_MAX_THREADS));
+  const uint64_t share = level_size / MAX(worker_count, 1);
+  int item_index = 0;
+  for (int worker_index = 0; worker_index < worker_count; ++worker_index) {
+    encode_worker_t* worker = workers + worker_index;
+    worker->encoder = encoder;
+    worker->level = level;
+    worker->items = items->entries + item_index;
+    worker->item_count = 0;
+    worker->children.count = 0;
 
-  return data;
+    // the last worker takes whatever is left
+    uint64_t size = 0;
+    while (item_index < items->count && (worker_index == worker_count - 1 || size < share)) {
+      const work_item_t* item = items->entries + item_index;
+      size += (uint64_t)item->count * level->entries[item->entry].element_size;
+      ++worker->item_count;
+      ++item_index;
+    }
+  }
+  return worker_count;
 }
 
-static void encoder_run(encoder_t* encoder) {
+// The same walk as encoder_run(), a whole level at a time. Each level is laid out serially, which fixes every offset,
+// then the workers fill in their slices of it and collect the pointers they find. Queueing those pointers in order
+// afterwards leaves the encoder exactly where the serial walk would, so the output doesn't depend on the thread count.
+static void encoder_run_parallel(encoder_t* encoder) {
   write_queue_t* todo_list = &encoder->todo_list;
-  while (todo_list->count > 0) {
-    write_queue_entry_t* todo = write_queue_first(todo_list);
-    const char* data = todo->data;
+  level_t level = {0};
+  work_item_list_t items = {0};
+  encode_worker_t workers[PARALLEL_MAX_THREADS];
+  memset(workers, 0, sizeof(workers));
 
-    pointer_remap_add(encoder, data, encoder->writer.cur);
+  while (todo_list->count > 0 && encoder->error == CRYSTALIZE_ERROR_NONE) {
+    // lay out the level
+    const int todo_count = todo_list->count;
+    uint64_t level_size = 0;
+    level.count = 0;
+    for (int todo_index = 0; todo_index < todo_count; ++todo_index) {
+      const write_queue_entry_t todo = write_queue_pop(todo_list);
+      const uint32_t alignment = todo.type == CRYSTALIZE_STRUCT ? schema_get_layout(todo.schema)->alignment : type_get_alignment(todo.type);
+      if (encoder->dedup_content && content_dedup(encoder, &todo, alignment)) {
+        continue;
+      }
+      writer_align(&encoder->writer, alignment);
+      pointer_remap_set(encoder, todo.data, encoder->writer.cur);
 
-    if (todo->type == CRYSTALIZE_STRUCT) {
-      for (uint32_t index = 0; index < todo->count; ++index) {
-        data = write_struct(encoder, todo->schema, data);
+      if (!array_grow_if_needed(encoder, &level.entries, &level.count, &level.capacity, sizeof(level_entry_t), 128)) {
+        break;
       }
+      level_entry_t* entry = level.entries + level.count++;
+      entry->todo = todo;
+      entry->pos = encoder->writer.cur;
+      entry->element_size = todo.type == CRYSTALIZE_STRUCT ? schema_get_layout(todo.schema)->size : type_get_size(todo.type);
+      const uint32_t size = todo.count * entry->element_size;
+      writer_ensure(&encoder->writer, size);
+      encoder->writer.cur += size;
+      level_size += size;
     }
-    else {
-      write_scalars(encoder, todo->type, todo->count, data);
+
+    // write it. small levels aren't worth starting threads for
+    int worker_count = encode_workers_assign(encoder, &level, &items, workers, level_size);
+    if (level_size < PARALLEL_MIN_LEVEL_SIZE && worker_count > 1) {
+      workers[0].item_count = items.count;
+      worker_count = 1;
     }
+    int started_count = 1;
+    for (int worker_index = 1; worker_index < worker_count; ++worker_index) {
+      if (!thread_start(&workers[worker_index].thread, &encode_worker_run, workers + worker_index)) {
+        break;
+      }
+      ++started_count;
+    }
+    if (worker_count > 0) {
+      encode_worker_run(workers + 0);
+    }
+    for (int worker_index = 1; worker_index < started_count; ++worker_index) {
+      thread_join(&workers[worker_index].thread);
+    }
+    for (int worker_index = started_count; worker_index < worker_count; ++worker_index) {
+      // couldn't get a thread, so do it here
+      encode_worker_run(workers + worker_index);
+    }
+
+    // fix up and queue everything the workers found, in order
+    for (int worker_index = 0; worker_index < worker_count; ++worker_index) {
+      const pointer_child_list_t* children = &workers[worker_index].children;
+      for (int child_index = 0; child_index < children->count; ++child_index) {
+        const pointer_child_t* child = children->entries + child_index;
+        pointer_fixup_add(encoder, child->pos, child->target);
+        encoder_push_object(encoder, child->type, child->schema, child->count, child->target);
+      }
+    }
+  }
 
-    write_queue_shift(todo_list);
+  for (int worker_index = PARALLEL_MAX_THREADS - 1; worker_index >= 0; --worker_index) {
+    pointer_child_list_t* children = &workers[worker_index].children;
+    array_free(encoder, &children->entries, &children->count, &children->capacity, sizeof(pointer_child_t));
   }
+  array_free(encoder, &items.entries, &items.count, &items.capacity, sizeof(work_item_t));
+  array_free(encoder, &level.entries, &level.count, &level.capacity, sizeof(level_entry_t));
 }
 
-void encoder_encode(const crystalize_schema_t* schema, const void* data, crystalize_encode_result_t* result) {
-  encoder_t encoder = {0};
+static void encoder_run(encoder_t* encoder) {
+  if (encoder->thread_count > 1 && encoder->scratch == NULL && !encoder->inline_pointers && !encoder->writer.measure) {
+    encoder_run_parallel(encoder);
+    return;
+  }
 
-  // gather up and count up all the unique schemas
-  gather_schemas(result, &encoder.schemas, schema);
-  if (result->error != CRYSTALIZE_ERROR_NONE) {
+  write_queue_t* todo_list = &encoder->todo_list;
+  while (todo_list->count > 0 && encoder->error == CRYSTALIZE_ERROR_NONE) {
+    // pop by value since writing the entry may push more entries and grow the queue
+    const write_queue_entry_t todo = write_queue_pop(todo_list);
+
+    // everything before this entry is final, so a streaming writer can hand it off
+    writer_flush(&encoder->writer, WRITER_FLUSH_SIZE);
+
+    const uint32_t alignment = todo.type == CRYSTALIZE_STRUCT ? schema_get_layout(todo.schema)->alignment : type_get_alignment(todo.type);
+    if (encoder->dedup_content && content_dedup(encoder, &todo, alignment)) {
+      continue;
+    }
+
+    // align before recording the remap so pointers land on the start of the data
+    writer_align(&encoder->writer, alignment);
+    pointer_remap_set(encoder, todo.data, encoder->writer.cur);
+
+    if (todo.type == CRYSTALIZE_STRUCT) {
+      write_structs(encoder, todo.schema, todo.count, (const char*)todo.data);
+    }
+    else {
+      write_scalars(encoder, todo.type, todo.count, todo.data);
+    }
+  }
+}
+
+// Writes the root directory followed by all of the roots. The roots go through the same walk, so anything they share
+// is written once. The directory entries are filled in once the roots have been laid out.
+static void encoder_write_roots(encoder_t* encoder) {
+  writer_t* writer = &encoder->writer;
+  writer_write_u32(writer, encoder->root_count);
+  writer_write_u32(writer, 0);
+  const uint32_t directory_pos = writer->cur;
+  writer_pad(writer, encoder->root_count * sizeof(file_root_entry_t));
+
+  for (uint32_t index = 0; index < encoder->root_count; ++index) {
+    const encoder_root_t* root = encoder->roots + index;
+    encoder_push_object(encoder, CRYSTALIZE_STRUCT, root->schema, 1, root->data);
+  }
+  encoder_run(encoder);
+  if (encoder->error != CRYSTALIZE_ERROR_NONE) {
     return;
   }
 
+  for (uint32_t index = 0; index < encoder->root_count; ++index) {
+    const encoder_root_t* root = encoder->roots + index;
+    file_root_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key = root->key;
+    entry.schema_name_id = root->schema->name_id;
+    entry.schema_version = root->schema->version;
+    pointer_resolve(encoder, &encoder->ranges, root->data, &entry.offset);
+    writer_patch(writer, directory_pos + index * sizeof(file_root_entry_t), &entry, sizeof(entry));
+  }
+}
+
+// Writes the whole file. When the writer is measuring, this only computes the final size.
+static void encoder_write(encoder_t* encoder, const crystalize_schema_t* schema, const void* data) {
+  writer_t* writer = &encoder->writer;
+
   // file header
-  writer_write_u8(&encoder.writer, 0x63);
-  writer_write_u8(&encoder.writer, 0x72);
-  writer_write_u8(&encoder.writer, 0x79);
-  writer_write_u8(&encoder.writer, 0x73);
-  writer_write_u32(&encoder.writer, CRYSTALIZE_FILE_VERSION);
-  writer_write_u32(&encoder.writer, 1); // endian
-  writer_write_u8(&encoder.writer, (uint8_t)sizeof(void*));
-  writer_align(&encoder.writer, 4);
-  const uint32_t header_data_start_offset = encoder.writer.cur;
-  writer_write_u32(&encoder.writer, 0); // offset to the start of the data buffer
-  const uint32_t pointer_table_start_offset = encoder.writer.cur;
-  writer_write_u32(&encoder.writer, 0); // offset to the start of the pointer fixup pointer_table
-  const uint32_t pointer_table_count_offset = encoder.writer.cur;
-  writer_write_u32(&encoder.writer, 0); // number of pointers in the pointer table
-  writer_write_u32(&encoder.writer, encoder.schemas.count);
+  writer_write_u8(writer, 0x63);
+  writer_write_u8(writer, 0x72);
+  writer_write_u8(writer, 0x79);
+  writer_write_u8(writer, 0x73);
+  const uint8_t flags = (encoder->roots != NULL ? CRYSTALIZE_FILE_FLAG_MULTI_ROOT : 0) | (encoder->base_address != 0 ? CRYSTALIZE_FILE_FLAG_BASED : 0) |
+                        (encoder->compact_pointer_table ? CRYSTALIZE_FILE_FLAG_COMPACT_POINTERS : 0) |
+                        (encoder->paged_pointer_table ? CRYSTALIZE_FILE_FLAG_PAGED_POINTERS : 0);
+  writer_write_u32(writer, flags != 0 ? CRYSTALIZE_FILE_VERSION : CRYSTALIZE_FILE_VERSION_PLAIN);
+  writer_write_u32(writer, 1); // endian
+  writer_write_u8(writer, (uint8_t)sizeof(void*));
+  writer_write_u8(writer, flags);
+  writer_align(writer, 4);
+  const uint32_t header_data_start_offset = writer->cur;
+  writer_write_u32(writer, encoder->data_offset); // offset to the start of the data buffer
+  const uint32_t pointer_table_start_offset = writer->cur;
+  writer_write_u32(writer, encoder->pointer_table_offset); // offset to the start of the pointer fixup pointer_table
+  const uint32_t pointer_table_count_offset = writer->cur;
+  writer_write_u32(writer, encoder->pointer_count); // number of pointers in the pointer table
+  writer_write_u32(writer, encoder->schemas.count);
+  if (flags != 0) {
+    writer_align(writer, alignof(uint64_t));
+    const uint64_t decoded_stamp = 0;
+    writer_write(writer, &decoded_stamp, sizeof(uint64_t));
+  }
+  if (encoder->base_address != 0) {
+    writer_align(writer, alignof(uint64_t));
+    writer_write(writer, &encoder->base_address, sizeof(uint64_t));
+  }
 
   // schemas
-  write_queue_push(&encoder.todo_list, CRYSTALIZE_STRUCT, &s_schema_schema, encoder.schemas.count, encoder.schemas.entries);
-  encoder_run(&encoder);
+  const crystalize_schema_t* schema_schema = crystalize_schema_get(s_schema_schema.name_id, s_schema_schema.version);
+  encoder_push_object(encoder, CRYSTALIZE_STRUCT, schema_schema, encoder->schemas.count, encoder->schemas.entries);
+  encoder_run(encoder);
 
   // write into the header the offset to the start of the data
-  uint32_t schema_alignment = struct_get_alignment(schema);
-  writer_align(&encoder.writer, schema_alignment);
-  memmove(encoder.writer.buf + header_data_start_offset, &encoder.writer.cur, sizeof(uint32_t));
+  writer_align(writer, encoder->roots != NULL ? alignof(file_root_entry_t) : schema_get_layout(schema)->alignment);
+  if (encoder->data_offset != writer->cur) {
+    encoder->data_offset = writer->cur;
+    writer_patch(writer, header_data_start_offset, &encoder->data_offset, sizeof(uint32_t));
+  }
 
   // data
-  write_queue_push(&encoder.todo_list, CRYSTALIZE_STRUCT, schema, 1, data);
-  encoder_run(&encoder);
+  if (encoder->roots != NULL) {
+    encoder_write_roots(encoder);
+  }
+  else {
+    encoder_push_object(encoder, CRYSTALIZE_STRUCT, schema, 1, data);
+    encoder_run(encoder);
+  }
+  if (encoder->error != CRYSTALIZE_ERROR_NONE) {
+    // ran out of scratch memory part way through so the remaps are incomplete
+    return;
+  }
 
   // fixup the pointers
-  writer_align(&encoder.writer, alignof(uint32_t));
-  memmove(encoder.writer.buf + pointer_table_start_offset, &encoder.writer.cur, sizeof(uint32_t));
-  memmove(encoder.writer.buf + pointer_table_count_offset, &encoder.pointer_fixups.count, sizeof(uint32_t));
-  convert_pointers_to_offsets(&encoder);
+  writer_align(writer, alignof(uint32_t));
+  if (encoder->pointer_table_offset != writer->cur) {
+    encoder->pointer_table_offset = writer->cur;
+    writer_patch(writer, pointer_table_start_offset, &encoder->pointer_table_offset, sizeof(uint32_t));
+  }
+  if (encoder->pointer_count != (uint32_t)encoder->pointer_fixups.count) {
+    encoder->pointer_count = (uint32_t)encoder->pointer_fixups.count;
+    writer_patch(writer, pointer_table_count_offset, &encoder->pointer_count, sizeof(uint32_t));
+  }
+  convert_pointers_to_offsets(encoder);
+}
+
+// Runs a measuring pass and returns the exact size of the encoded output.
+static uint32_t encoder_measure(encoder_t* encoder, const crystalize_schema_t* schema, const void* data) {
+  const writer_t writer = encoder->writer;
+  encoder->writer.buf = NULL;
+  encoder->writer.cur = 0;
+  encoder->writer.capacity = 0;
+  encoder->writer.measure = true;
+  encoder_write(encoder, schema, data);
+  const uint32_t size = encoder->writer.cur;
+  encoder->writer = writer;
+  return size;
+}
+
+// Encodes into a newly allocated buffer which is handed over to the result. The schemas must already be gathered.
+static void encoder_encode_to_result(encoder_t* encoder, const crystalize_schema_t* schema, const void* data, const crystalize_encode_options_t* options, crystalize_encode_result_t* result) {
+  encoder->dedup_content = options->dedup_content;
+  encoder->thread_count = options->thread_count;
+  encoder->base_address = options->base_address;
+  encoder->compact_pointer_table = options->compact_pointer_table && !options->paged_pointer_table;
+  encoder->paged_pointer_table = options->paged_pointer_table;
+  if (options->exact_size) {
+    // size everything up first so the output is allocated once and never copied
+    writer_reserve(&encoder->writer, encoder_measure(encoder, schema, data));
+    encoder_reset(encoder);
+  }
+  encoder_write(encoder, schema, data);
 
-  result->buf = encoder.writer.buf;
+  result->buf = encoder->writer.buf;
+  result->buf_size = encoder->writer.cur;
+  result->dedup_bytes_saved = encoder->dedup_bytes_saved;
+  memset(&encoder->writer, 0, sizeof(writer_t));
+}
+
+void encoder_encode(const crystalize_schema_t* schema, const void* data, const crystalize_encode_options_t* options, crystalize_encode_result_t* result) {
+  encoder_t encoder = {0};
+
+  // gather up and count up all the unique schemas
+  gather_schemas(&encoder, result, &encoder.schemas, schema);
+  if (result->error != CRYSTALIZE_ERROR_NONE) {
+    return;
+  }
+
+  encoder_encode_to_result(&encoder, schema, data, options, result);
+
+  // free the encoder
+  encoder_free(&encoder);
+}
+
+void encoder_encode_size(const crystalize_schema_t* schema, const void* data, crystalize_encode_result_t* result) {
+  encoder_t encoder = {0};
+
+  // gather up and count up all the unique schemas
+  gather_schemas(&encoder, result, &encoder.schemas, schema);
+  if (result->error != CRYSTALIZE_ERROR_NONE) {
+    return;
+  }
+
+  result->buf = NULL;
+  result->buf_size = encoder_measure(&encoder, schema, data);
+
+  // free the encoder
+  encoder_free(&encoder);
+}
+
+void encoder_encode_into(const crystalize_schema_t* schema, const void* data, char* buf, uint32_t buf_size, crystalize_arena_t* scratch, crystalize_encode_result_t* result) {
+  encoder_t encoder = {0};
+  encoder.scratch = scratch;
+  encoder.writer.buf = buf;
+  encoder.writer.capacity = buf_size;
+  encoder.writer.fixed = true;
+  const size_t scratch_used = scratch->used;
+
+  // gather up and count up all the unique schemas
+  gather_schemas(&encoder, result, &encoder.schemas, schema);
+  if (result->error == CRYSTALIZE_ERROR_NONE) {
+    encoder_write(&encoder, schema, data);
+    if (encoder.error != CRYSTALIZE_ERROR_NONE) {
+      result->error = encoder.error;
+    }
+    else if (encoder.writer.measure) {
+      // the buffer overflowed and the writer switched to measuring, so cur is the size that's needed
+      result->error = CRYSTALIZE_ERROR_BUFFER_TOO_SMALL;
+      result->buf_size = encoder.writer.cur;
+    }
+    else {
+      result->buf_size = encoder.writer.cur;
+    }
+  }
+
+  // all of the scratch memory goes back to the arena
+  encoder_free(&encoder);
+  scratch->used = scratch_used;
+}
+
+typedef struct schema_cache_entry_t {
+  const crystalize_schema_t* root;
+  schema_list_t schemas;
+} schema_cache_entry_t;
+
+typedef struct schema_cache_t {
+  schema_cache_entry_t* entries;
+  int count;
+  int capacity;
+} schema_cache_t;
+
+struct crystalize_encoder_t {
+  encoder_t encoder;
+  schema_cache_t schema_cache; // gathered schema lists by root schema
+};
+
+static void schema_cache_clear(crystalize_encoder_t* context) {
+  schema_cache_t* cache = &context->schema_cache;
+  for (int index = cache->count - 1; index >= 0; --index) {
+    schema_list_t* schemas = &cache->entries[index].schemas;
+    array_free(&context->encoder, &schemas->entries, &schemas->count, &schemas->capacity, sizeof(crystalize_schema_t));
+  }
+  cache->count = 0;
+}
+
+// Finds the gathered schemas for the given root, gathering and caching them the first time it's seen.
+static const schema_list_t* schema_cache_get(crystalize_encoder_t* context, const crystalize_schema_t* schema, crystalize_encode_result_t* result) {
+  // there are only ever a handful of root schemas per encoder, so a linear scan is plenty
+  schema_cache_t* cache = &context->schema_cache;
+  for (int index = 0; index < cache->count; ++index) {
+    if (cache->entries[index].root == schema) {
+      return &cache->entries[index].schemas;
+    }
+  }
+
+  schema_list_t schemas = {0};
+  gather_schemas(&context->encoder, result, &schemas, schema);
+  if (result->error != CRYSTALIZE_ERROR_NONE) {
+    array_free(&context->encoder, &schemas.entries, &schemas.count, &schemas.capacity, sizeof(crystalize_schema_t));
+    return NULL;
+  }
+
+  array_grow_if_needed(&context->encoder, &cache->entries, &cache->count, &cache->capacity, sizeof(schema_cache_entry_t), 8);
+  schema_cache_entry_t* entry = cache->entries + cache->count;
+  entry->root = schema;
+  entry->schemas = schemas;
+  ++cache->count;
+  return &entry->schemas;
+}
+
+crystalize_encoder_t* encoder_context_create(void) {
+  crystalize_encoder_t* context = (crystalize_encoder_t*)crystalize_alloc(sizeof(crystalize_encoder_t));
+  crystalize_assert(context != NULL, "allocation failed");
+  memset(context, 0, sizeof(crystalize_encoder_t));
+  return context;
+}
+
+void encoder_context_destroy(crystalize_encoder_t* context) {
+  schema_cache_clear(context);
+  encoder_dealloc(&context->encoder, context->schema_cache.entries, context->schema_cache.capacity * sizeof(schema_cache_entry_t));
+
+  // the encoder's schema list is borrowed from the cache
+  memset(&context->encoder.schemas, 0, sizeof(schema_list_t));
+  encoder_free(&context->encoder);
+  crystalize_free(context);
+}
+
+void encoder_context_reset(crystalize_encoder_t* context) {
+  schema_cache_clear(context);
+  memset(&context->encoder.schemas, 0, sizeof(schema_list_t));
+  encoder_reset(&context->encoder);
+  context->encoder.error = CRYSTALIZE_ERROR_NONE;
+}
+
+void encoder_context_encode(crystalize_encoder_t* context, const crystalize_schema_t* schema, const void* data, const crystalize_encode_options_t* options, crystalize_encode_result_t* result) {
+  encoder_t* encoder = &context->encoder;
+  const schema_list_t* schemas = schema_cache_get(context, schema, result);
+  if (schemas == NULL) {
+    return;
+  }
+
+  // borrow the cached list for the duration of the encode
+  encoder->schemas = *schemas;
+  encoder_encode_to_result(encoder, schema, data, options, result);
+  encoder_reset(encoder);
+}
+
+void encoder_encode_to_sink(const crystalize_schema_t* schema, const void* data, writer_sink_t sink, void* sink_ctx, crystalize_encode_result_t* result) {
+  encoder_t encoder = {0};
+
+  // gather up and count up all the unique schemas
+  gather_schemas(&encoder, result, &encoder.schemas, schema);
+  if (result->error != CRYSTALIZE_ERROR_NONE) {
+    return;
+  }
+
+  // the sizing pass lays everything out, so the header and every pointer are known before the first byte goes out
+  // and nothing already handed to the sink ever needs patching. keep its remaps, they're where the pointers land.
+  encoder_measure(&encoder, schema, data);
+  encoder.pointer_fixups.count = 0;
+  pointer_remap_clear_visited(&encoder);
+  encoder.layout_ranges = encoder.ranges;
+  memset(&encoder.ranges, 0, sizeof(range_tree_t));
+  encoder.inline_pointers = true;
+
+  encoder.writer.sink = sink;
+  encoder.writer.sink_ctx = sink_ctx;
+  encoder_write(&encoder, schema, data);
+  writer_flush(&encoder.writer, 0);
+
+  if (encoder.writer.failed) {
+    result->error = CRYSTALIZE_ERROR_WRITE_FAILED;
+  }
   result->buf_size = encoder.writer.cur;
 
+  // free the encoder
+  crystalize_free(encoder.writer.buf);
+  encoder_free(&encoder);
+}
+
+void encoder_encode_to_file(const crystalize_schema_t* schema, const void* data, int fd, const crystalize_encode_options_t* options, crystalize_encode_result_t* result) {
+  encoder_t encoder = {0};
+
+  // gather up and count up all the unique schemas
+  gather_schemas(&encoder, result, &encoder.schemas, schema);
+  if (result->error != CRYSTALIZE_ERROR_NONE) {
+    return;
+  }
+
+  // the buffer is a shared mapping of the file, so the output lands straight in the page cache
+  encoder.writer.grow = &mapped_file_grow;
+  encoder.writer.grow_ctx = &fd;
+  encoder.dedup_content = options->dedup_content;
+  encoder.thread_count = options->thread_count;
+  encoder.base_address = options->base_address;
+  encoder.compact_pointer_table = options->compact_pointer_table && !options->paged_pointer_table;
+  encoder.paged_pointer_table = options->paged_pointer_table;
+  if (options->exact_size) {
+    writer_reserve(&encoder.writer, encoder_measure(&encoder, schema, data));
+    encoder_reset(&encoder);
+  }
+  encoder_write(&encoder, schema, data);
+
+  result->buf_size = encoder.writer.cur;
+  result->dedup_bytes_saved = encoder.dedup_bytes_saved;
+  if (!mapped_file_finish(fd, encoder.writer.buf, encoder.writer.capacity, encoder.writer.cur) || encoder.writer.failed) {
+    result->error = CRYSTALIZE_ERROR_WRITE_FAILED;
+  }
+
+  // free the encoder
+  encoder_free(&encoder);
+}
+
+static int encoder_root_compare(const void* a, const void* b) {
+  const encoder_root_t* root_a = (const encoder_root_t*)a;
+  const encoder_root_t* root_b = (const encoder_root_t*)b;
+  if (root_a->key < root_b->key) {
+    return -1;
+  }
+  else if (root_a->key > root_b->key) {
+    return 1;
+  }
+  else {
+    return 0;
+  }
+}
+
+void encoder_encode_roots(const crystalize_root_t* roots, uint32_t root_count, const crystalize_encode_options_t* options, crystalize_encode_result_t* result) {
+  encoder_t encoder = {0};
+
+  // the directory is sorted by key so a root can be found with a binary search
+  encoder_root_t* sorted_roots = (encoder_root_t*)crystalize_alloc(MAX(root_count, 1) * sizeof(encoder_root_t));
+  crystalize_assert(sorted_roots != NULL, "allocation failed");
+  for (uint32_t index = 0; index < root_count; ++index) {
+    sorted_roots[index].key = roots[index].key;
+    sorted_roots[index].schema = crystalize_schema_get(roots[index].schema_name_id, roots[index].schema_version);
+    sorted_roots[index].data = roots[index].data;
+    crystalize_assert(sorted_roots[index].schema != NULL, "schema not found");
+  }
+  qsort(sorted_roots, root_count, sizeof(encoder_root_t), &encoder_root_compare);
+  for (uint32_t index = 1; index < root_count; ++index) {
+    if (sorted_roots[index - 1].key == sorted_roots[index].key) {
+      result->error = CRYSTALIZE_ERROR_ROOT_KEY_DUPLICATED;
+      crystalize_free(sorted_roots);
+      return;
+    }
+  }
+  encoder.roots = sorted_roots;
+  encoder.root_count = root_count;
+
+  // gather up and count up all the unique schemas from every root
+  for (uint32_t index = 0; index < root_count && result->error == CRYSTALIZE_ERROR_NONE; ++index) {
+    gather_schemas(&encoder, result, &encoder.schemas, sorted_roots[index].schema);
+  }
+  if (result->error == CRYSTALIZE_ERROR_NONE) {
+    encoder_encode_to_result(&encoder, NULL, NULL, options, result);
+  }
+
   // free the encoder
   encoder_free(&encoder);
+  crystalize_free(sorted_roots);
 }
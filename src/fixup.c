@@ -0,0 +1,577 @@
+#include <string.h>
+#include "config.h"
+#include "fixup.h"
+#include "thread.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FIXUP_X86_64 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define FIXUP_TARGET_AVX2
+#else
+#define FIXUP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define FIXUP_MIN_TASK_COUNT (64 * 1024) // fewer pointers than this per task isn't worth a thread
+#define FIXUP_MAX_TASKS 64
+#define FIXUP_COPY_BLOCK_SIZE (64 * 1024) // copied then fixed up while it's still in cache
+#define FIXUP_COPY_BATCH_SIZE 1024        // compact table entries decoded at a time when copying
+
+typedef struct fixup_tasks_t {
+  char* buf;
+  uint32_t buf_size;
+  const uint32_t* table;
+  uint32_t count;
+  uint64_t base_address;
+  uint32_t task_count;
+  bool ordered[FIXUP_MAX_TASKS];
+  crystalize_error_t errors[FIXUP_MAX_TASKS];
+} fixup_tasks_t;
+
+typedef struct fixup_thread_t {
+  crystalize_task_func_t func;
+  fixup_tasks_t* tasks;
+  uint32_t task_index;
+  thread_t thread;
+} fixup_thread_t;
+
+static fixup_impl_t s_fixup_impl = FIXUP_IMPL_SCALAR;
+
+// Each slot becomes buf + rel, where rel = value + (pos & pos_mask) + bias. For self-relative offsets pos_mask is all
+// ones and bias is 0, for a base address pos_mask is 0 and bias is -base_address.
+static crystalize_error_t fixup_apply_scalar(char* buf, uint32_t buf_size, const uint32_t* table, uint32_t count, uint64_t base_address) {
+  const int64_t pos_mask = base_address == 0 ? -1 : 0;
+  const int64_t bias = -(int64_t)base_address;
+  const uint32_t pos_limit = buf_size - sizeof(int64_t);
+  for (uint32_t index = 0; index < count; ++index) {
+    const uint32_t pos = table[index];
+    if (pos > pos_limit) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+    int64_t* slot = (int64_t*)(buf + pos);
+    const int64_t rel = *slot + ((int64_t)pos & pos_mask) + bias;
+    if ((uint64_t)rel >= buf_size) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+    *slot = (int64_t)(intptr_t)(buf + rel);
+  }
+  return CRYSTALIZE_ERROR_NONE;
+}
+
+#if defined(FIXUP_X86_64)
+
+// SSE2 has no gathers or 64-bit compares, so the slots are loaded one by one and the range checks are done on 32-bit
+// halves. Four table entries per iteration. A batch whose slots aren't ascending and apart is done by the scalar loop,
+// since loading them all before storing any would miss a slot that's fixed up twice.
+static crystalize_error_t fixup_apply_sse2(char* buf, uint32_t buf_size, const uint32_t* table, uint32_t count, uint64_t base_address) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi32(-1);
+  const __m128i sign = _mm_set1_epi32(INT32_MIN);
+  const __m128i slot_size = _mm_set1_epi32((int32_t)sizeof(int64_t));
+  const __m128i not_last = _mm_set_epi32(0, -1, -1, -1);
+  const __m128i pos_limit = _mm_set1_epi32((int32_t)((buf_size - (uint32_t)sizeof(int64_t)) ^ 0x80000000u));
+  const __m128i rel_limit = _mm_set1_epi32((int32_t)((buf_size - 1) ^ 0x80000000u));
+  const __m128i low_halves = _mm_set_epi32(0, -1, 0, -1);
+  const __m128i pos_mask = base_address == 0 ? ones : zero;
+  const __m128i bias = _mm_set1_epi64x(-(int64_t)base_address);
+  const __m128i buf_addr = _mm_set1_epi64x((int64_t)(intptr_t)buf);
+
+  uint32_t index = 0;
+  for (; index + 4 <= count; index += 4) {
+    // unsigned compares of the positions by flipping the sign bits. Each slot has to be in the buffer and end at or
+    // before the next one starts (the last lane has no next). If not, the scalar loop finds the bad one.
+    const __m128i pos = _mm_loadu_si128((const __m128i*)(table + index));
+    const __m128i pos_flipped = _mm_xor_si128(pos, sign);
+    const __m128i pos_end = _mm_add_epi32(pos_flipped, slot_size);
+    const __m128i pos_next = _mm_srli_si128(pos_flipped, 4);
+    const __m128i pos_bad = _mm_or_si128(_mm_cmpgt_epi32(pos_flipped, pos_limit), _mm_and_si128(_mm_cmpgt_epi32(pos_end, pos_next), not_last));
+    if (_mm_movemask_epi8(pos_bad) != 0) {
+      const crystalize_error_t error = fixup_apply_scalar(buf, buf_size, table + index, 4, base_address);
+      if (error != CRYSTALIZE_ERROR_NONE) {
+        return error;
+      }
+      continue;
+    }
+    const uint32_t pos0 = table[index + 0];
+    const uint32_t pos1 = table[index + 1];
+    const uint32_t pos2 = table[index + 2];
+    const uint32_t pos3 = table[index + 3];
+    const __m128i value01 = _mm_set_epi64x(*(const int64_t*)(buf + pos1), *(const int64_t*)(buf + pos0));
+    const __m128i value23 = _mm_set_epi64x(*(const int64_t*)(buf + pos3), *(const int64_t*)(buf + pos2));
+    const __m128i pos01 = _mm_and_si128(_mm_unpacklo_epi32(pos, zero), pos_mask);
+    const __m128i pos23 = _mm_and_si128(_mm_unpackhi_epi32(pos, zero), pos_mask);
+    const __m128i rel01 = _mm_add_epi64(_mm_add_epi64(value01, pos01), bias);
+    const __m128i rel23 = _mm_add_epi64(_mm_add_epi64(value23, pos23), bias);
+
+    // rel is inside the buffer when its high half is zero and its low half is at most buf_size - 1
+    const __m128i low_bad01 = _mm_cmpgt_epi32(_mm_xor_si128(rel01, sign), rel_limit);
+    const __m128i low_bad23 = _mm_cmpgt_epi32(_mm_xor_si128(rel23, sign), rel_limit);
+    const __m128i high_bad01 = _mm_xor_si128(_mm_cmpeq_epi32(rel01, zero), ones);
+    const __m128i high_bad23 = _mm_xor_si128(_mm_cmpeq_epi32(rel23, zero), ones);
+    const __m128i bad01 = _mm_or_si128(_mm_and_si128(low_bad01, low_halves), _mm_andnot_si128(low_halves, high_bad01));
+    const __m128i bad23 = _mm_or_si128(_mm_and_si128(low_bad23, low_halves), _mm_andnot_si128(low_halves, high_bad23));
+    if (_mm_movemask_epi8(_mm_or_si128(bad01, bad23)) != 0) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+
+    int64_t ptrs[4];
+    _mm_storeu_si128((__m128i*)(ptrs + 0), _mm_add_epi64(rel01, buf_addr));
+    _mm_storeu_si128((__m128i*)(ptrs + 2), _mm_add_epi64(rel23, buf_addr));
+    *(int64_t*)(buf + pos0) = ptrs[0];
+    *(int64_t*)(buf + pos1) = ptrs[1];
+    *(int64_t*)(buf + pos2) = ptrs[2];
+    *(int64_t*)(buf + pos3) = ptrs[3];
+  }
+  return fixup_apply_scalar(buf, buf_size, table + index, count - index, base_address);
+}
+
+// Gathers the slots four at a time. AVX2 has no scatter, so the stores are done one by one. The gather offsets are signed
+// 32-bit, so buffers over 2 GB use SSE2. Like SSE2, batches with overlapping or out of order slots are done by the scalar
+// loop.
+FIXUP_TARGET_AVX2
+static crystalize_error_t fixup_apply_avx2(char* buf, uint32_t buf_size, const uint32_t* table, uint32_t count, uint64_t base_address) {
+  if (buf_size > INT32_MAX) {
+    return fixup_apply_sse2(buf, buf_size, table, count, base_address);
+  }
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i pos_limit = _mm256_set1_epi64x((int64_t)buf_size - (int64_t)sizeof(int64_t));
+  const __m256i rel_limit = _mm256_set1_epi64x((int64_t)buf_size - 1);
+  const __m256i pos_mask = _mm256_set1_epi64x(base_address == 0 ? -1 : 0);
+  const __m256i bias = _mm256_set1_epi64x(-(int64_t)base_address);
+  const __m256i buf_addr = _mm256_set1_epi64x((int64_t)(intptr_t)buf);
+  const __m256i slot_size = _mm256_set1_epi32((int32_t)sizeof(int64_t));
+  const __m256i next_lane = _mm256_set_epi32(7, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i not_last = _mm256_set_epi32(0, -1, -1, -1, -1, -1, -1, -1);
+
+  // eight entries per iteration with a single branch for both halves' checks
+  uint32_t index = 0;
+  for (; index + 8 <= count; index += 8) {
+    const __m128i pos32_lo = _mm_loadu_si128((const __m128i*)(table + index));
+    const __m128i pos32_hi = _mm_loadu_si128((const __m128i*)(table + index + 4));
+    const __m256i pos_lo = _mm256_cvtepu32_epi64(pos32_lo);
+    const __m256i pos_hi = _mm256_cvtepu32_epi64(pos32_hi);
+    // in range positions are under 2 GB, so the overlap check can use signed compares. Either going wrong sends the
+    // batch to the scalar loop, which finds the bad one.
+    const __m256i pos32 = _mm256_loadu_si256((const __m256i*)(table + index));
+    const __m256i pos_next = _mm256_permutevar8x32_epi32(pos32, next_lane);
+    const __m256i pos_overlap = _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_add_epi32(pos32, slot_size), pos_next), not_last);
+    const __m256i pos_bad =
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi64(pos_lo, pos_limit), _mm256_cmpgt_epi64(pos_hi, pos_limit)), pos_overlap);
+    if (!_mm256_testz_si256(pos_bad, pos_bad)) {
+      const crystalize_error_t error = fixup_apply_scalar(buf, buf_size, table + index, 8, base_address);
+      if (error != CRYSTALIZE_ERROR_NONE) {
+        return error;
+      }
+      continue;
+    }
+    const __m256i value_lo = _mm256_i32gather_epi64((const long long*)buf, pos32_lo, 1);
+    const __m256i value_hi = _mm256_i32gather_epi64((const long long*)buf, pos32_hi, 1);
+    const __m256i rel_lo = _mm256_add_epi64(_mm256_add_epi64(value_lo, _mm256_and_si256(pos_lo, pos_mask)), bias);
+    const __m256i rel_hi = _mm256_add_epi64(_mm256_add_epi64(value_hi, _mm256_and_si256(pos_hi, pos_mask)), bias);
+    const __m256i bad_lo = _mm256_or_si256(_mm256_cmpgt_epi64(zero, rel_lo), _mm256_cmpgt_epi64(rel_lo, rel_limit));
+    const __m256i bad_hi = _mm256_or_si256(_mm256_cmpgt_epi64(zero, rel_hi), _mm256_cmpgt_epi64(rel_hi, rel_limit));
+    const __m256i bad = _mm256_or_si256(bad_lo, bad_hi);
+    if (!_mm256_testz_si256(bad, bad)) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+
+    int64_t ptrs[8];
+    _mm256_storeu_si256((__m256i*)(ptrs + 0), _mm256_add_epi64(rel_lo, buf_addr));
+    _mm256_storeu_si256((__m256i*)(ptrs + 4), _mm256_add_epi64(rel_hi, buf_addr));
+    for (uint32_t lane = 0; lane < 8; ++lane) {
+      *(int64_t*)(buf + table[index + lane]) = ptrs[lane];
+    }
+  }
+  return fixup_apply_scalar(buf, buf_size, table + index, count - index, base_address);
+}
+
+static bool fixup_cpu_has_avx2(void) {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  const bool osxsave = (info[2] & (1 << 27)) != 0;
+  if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) {
+    // the OS doesn't save the ymm registers
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
+void fixup_init(void) {
+  s_fixup_impl = FIXUP_IMPL_SCALAR;
+  for (int impl = FIXUP_IMPL_COUNT - 1; impl >= 0; --impl) {
+    if (fixup_impl_supported((fixup_impl_t)impl)) {
+      s_fixup_impl = (fixup_impl_t)impl;
+      break;
+    }
+  }
+}
+
+bool fixup_impl_supported(fixup_impl_t impl) {
+  switch (impl) {
+    case FIXUP_IMPL_SCALAR:
+      return true;
+#if defined(FIXUP_X86_64)
+    case FIXUP_IMPL_SSE2:
+      return true;
+    case FIXUP_IMPL_AVX2:
+      return fixup_cpu_has_avx2();
+#endif
+    default:
+      return false;
+  }
+}
+
+const char* fixup_impl_name(fixup_impl_t impl) {
+  switch (impl) {
+    case FIXUP_IMPL_SCALAR:
+      return "scalar";
+    case FIXUP_IMPL_SSE2:
+      return "sse2";
+    case FIXUP_IMPL_AVX2:
+      return "avx2";
+    default:
+      return "unknown";
+  }
+}
+
+crystalize_error_t fixup_apply(char* buf, uint32_t buf_size, const uint32_t* table, uint32_t count, uint64_t base_address) {
+  return fixup_apply_with(s_fixup_impl, buf, buf_size, table, count, base_address);
+}
+
+crystalize_error_t fixup_apply_with(fixup_impl_t impl, char* buf, uint32_t buf_size, const uint32_t* table, uint32_t count, uint64_t base_address) {
+  if (count == 0) {
+    return CRYSTALIZE_ERROR_NONE;
+  }
+  if (buf_size < sizeof(int64_t)) {
+    // not even room for one slot
+    return CRYSTALIZE_ERROR_POINTER_INVALID;
+  }
+  switch (impl) {
+#if defined(FIXUP_X86_64)
+    case FIXUP_IMPL_SSE2:
+      return fixup_apply_sse2(buf, buf_size, table, count, base_address);
+    case FIXUP_IMPL_AVX2:
+      return fixup_apply_avx2(buf, buf_size, table, count, base_address);
+#endif
+    default:
+      return fixup_apply_scalar(buf, buf_size, table, count, base_address);
+  }
+}
+
+crystalize_error_t fixup_check(const char* buf,
+                               uint32_t buf_size,
+                               const uint32_t* table,
+                               uint32_t count,
+                               uint64_t base_address,
+                               uint32_t slot_begin,
+                               uint32_t slot_end) {
+  if (count == 0) {
+    return CRYSTALIZE_ERROR_NONE;
+  }
+  if (buf_size < sizeof(int64_t)) {
+    return CRYSTALIZE_ERROR_POINTER_INVALID;
+  }
+  const int64_t pos_mask = base_address == 0 ? -1 : 0;
+  const int64_t bias = -(int64_t)base_address;
+  const uint32_t pos_limit = buf_size - sizeof(int64_t);
+  for (uint32_t index = 0; index < count; ++index) {
+    const uint32_t pos = table[index];
+    if (pos > pos_limit || pos < slot_begin || pos >= slot_end) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+    const int64_t rel = *(const int64_t*)(buf + pos) + ((int64_t)pos & pos_mask) + bias;
+    if ((uint64_t)rel >= buf_size) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+  }
+  return CRYSTALIZE_ERROR_NONE;
+}
+
+// Reads one varint delta of a compact table. Returns false if the table ends in the middle of it.
+static inline bool fixup_read_delta(const uint8_t** cur, const uint8_t* end, uint32_t* delta) {
+  // most deltas are a single byte
+  if (*cur >= end) {
+    return false;
+  }
+  uint32_t value = *(*cur)++;
+  if (value >= 0x80) {
+    value &= 0x7f;
+    for (uint32_t shift = 7;; shift += 7) {
+      if (*cur >= end || shift > 28) {
+        return false;
+      }
+      const uint8_t byte = *(*cur)++;
+      value |= (uint32_t)(byte & 0x7f) << shift;
+      if (byte < 0x80) {
+        break;
+      }
+    }
+  }
+  *delta = value;
+  return true;
+}
+
+crystalize_error_t fixup_apply_compact(char* buf, uint32_t buf_size, const uint8_t* table, uint32_t table_size, uint32_t count, uint64_t base_address) {
+  if (count == 0) {
+    return CRYSTALIZE_ERROR_NONE;
+  }
+  if (buf_size < sizeof(int64_t)) {
+    return CRYSTALIZE_ERROR_POINTER_INVALID;
+  }
+  const int64_t pos_mask = base_address == 0 ? -1 : 0;
+  const int64_t bias = -(int64_t)base_address;
+  const uint64_t pos_limit = buf_size - sizeof(int64_t);
+  const uint8_t* cur = table;
+  const uint8_t* end = table + table_size;
+  uint64_t pos = 0;
+  for (uint32_t index = 0; index < count; ++index) {
+    uint32_t delta;
+    if (!fixup_read_delta(&cur, end, &delta)) {
+      return CRYSTALIZE_ERROR_UNEXPECTED_EOF;
+    }
+    pos += delta;
+    if (pos > pos_limit) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+    int64_t* slot = (int64_t*)(buf + pos);
+    const int64_t rel = *slot + ((int64_t)pos & pos_mask) + bias;
+    if ((uint64_t)rel >= buf_size) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+    *slot = (int64_t)(intptr_t)(buf + rel);
+  }
+  return CRYSTALIZE_ERROR_NONE;
+}
+
+crystalize_error_t fixup_check_compact(const char* buf, uint32_t buf_size, const uint8_t* table, uint32_t table_size, uint32_t count, uint64_t base_address) {
+  if (count == 0) {
+    return CRYSTALIZE_ERROR_NONE;
+  }
+  if (buf_size < sizeof(int64_t)) {
+    return CRYSTALIZE_ERROR_POINTER_INVALID;
+  }
+  const int64_t pos_mask = base_address == 0 ? -1 : 0;
+  const int64_t bias = -(int64_t)base_address;
+  const uint64_t pos_limit = buf_size - sizeof(int64_t);
+  const uint8_t* cur = table;
+  const uint8_t* end = table + table_size;
+  uint64_t pos = 0;
+  for (uint32_t index = 0; index < count; ++index) {
+    uint32_t delta;
+    if (!fixup_read_delta(&cur, end, &delta)) {
+      return CRYSTALIZE_ERROR_UNEXPECTED_EOF;
+    }
+    pos += delta;
+    if (pos > pos_limit) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+    const int64_t rel = *(const int64_t*)(buf + pos) + ((int64_t)pos & pos_mask) + bias;
+    if ((uint64_t)rel >= buf_size) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+  }
+  return CRYSTALIZE_ERROR_NONE;
+}
+
+// Writes the slot at pos in dst as an address within dst, reading its value from src. For slots behind the copy, which
+// only a table that isn't in position order has.
+static bool fixup_copy_slot(char* dst, const char* src, uint32_t buf_size, uint32_t pos, uint64_t base_address) {
+  const int64_t pos_mask = base_address == 0 ? -1 : 0;
+  int64_t value;
+  memcpy(&value, src + pos, sizeof(int64_t));
+  const int64_t rel = value + ((int64_t)pos & pos_mask) - (int64_t)base_address;
+  if ((uint64_t)rel >= buf_size) {
+    return false;
+  }
+  *(int64_t*)(dst + pos) = (int64_t)(intptr_t)(dst + rel);
+  return true;
+}
+
+crystalize_error_t fixup_copy(char* dst, const char* src, uint32_t buf_size, uint32_t* copied, const uint32_t* table, uint32_t count, uint64_t base_address) {
+  if (count == 0) {
+    return CRYSTALIZE_ERROR_NONE;
+  }
+  if (buf_size < sizeof(int64_t)) {
+    return CRYSTALIZE_ERROR_POINTER_INVALID;
+  }
+  const uint32_t pos_limit = buf_size - sizeof(int64_t);
+  uint32_t index = 0;
+  while (index < count) {
+    if (table[index] > pos_limit) {
+      return CRYSTALIZE_ERROR_POINTER_INVALID;
+    }
+    if (table[index] < *copied) {
+      if (!fixup_copy_slot(dst, src, buf_size, table[index], base_address)) {
+        return CRYSTALIZE_ERROR_POINTER_INVALID;
+      }
+      ++index;
+      continue;
+    }
+
+    // take the run of slots that start in the next block, stretching it to cover the last one
+    const uint32_t block_begin = *copied;
+    uint64_t block_end = MIN((uint64_t)block_begin + FIXUP_COPY_BLOCK_SIZE, buf_size);
+    uint32_t end = index;
+    for (; end < count && table[end] >= block_begin && table[end] < block_end; ++end) {
+      if (table[end] > pos_limit) {
+        return CRYSTALIZE_ERROR_POINTER_INVALID;
+      }
+      block_end = MAX(block_end, (uint64_t)table[end] + sizeof(int64_t));
+    }
+
+    // and fix them up while the block is still in cache
+    memcpy(dst + block_begin, src + block_begin, (size_t)(block_end - block_begin));
+    *copied = (uint32_t)block_end;
+    const crystalize_error_t error = fixup_apply(dst, buf_size, table + index, end - index, base_address);
+    if (error != CRYSTALIZE_ERROR_NONE) {
+      return error;
+    }
+    index = end;
+  }
+  return CRYSTALIZE_ERROR_NONE;
+}
+
+crystalize_error_t fixup_copy_compact(char* dst,
+                                      const char* src,
+                                      uint32_t buf_size,
+                                      uint32_t* copied,
+                                      const uint8_t* table,
+                                      uint32_t table_size,
+                                      uint32_t count,
+                                      uint64_t base_address) {
+  // decode the deltas a batch at a time and copy those
+  uint32_t positions[FIXUP_COPY_BATCH_SIZE];
+  const uint8_t* cur = table;
+  const uint8_t* end = table + table_size;
+  uint64_t pos = 0;
+  for (uint32_t first = 0; first < count; first += FIXUP_COPY_BATCH_SIZE) {
+    const uint32_t batch_count = MIN(count - first, FIXUP_COPY_BATCH_SIZE);
+    for (uint32_t index = 0; index < batch_count; ++index) {
+      uint32_t delta;
+      if (!fixup_read_delta(&cur, end, &delta)) {
+        return CRYSTALIZE_ERROR_UNEXPECTED_EOF;
+      }
+      pos += delta;
+      if (pos > UINT32_MAX) {
+        return CRYSTALIZE_ERROR_POINTER_INVALID;
+      }
+      positions[index] = (uint32_t)pos;
+    }
+    const crystalize_error_t error = fixup_copy(dst, src, buf_size, copied, positions, batch_count, base_address);
+    if (error != CRYSTALIZE_ERROR_NONE) {
+      return error;
+    }
+  }
+  return CRYSTALIZE_ERROR_NONE;
+}
+
+static void fixup_task_range(const fixup_tasks_t* tasks, uint32_t task_index, uint32_t* first, uint32_t* last) {
+  *first = (uint32_t)((uint64_t)tasks->count * task_index / tasks->task_count);
+  *last = (uint32_t)((uint64_t)tasks->count * (task_index + 1) / tasks->task_count);
+}
+
+static void fixup_task_check(void* arg, uint32_t task_index) {
+  // each slot has to start past the end of the one before, including the last one in the range before, so no two
+  // ranges ever write the same bytes
+  fixup_tasks_t* tasks = (fixup_tasks_t*)arg;
+  uint32_t first, last;
+  fixup_task_range(tasks, task_index, &first, &last);
+  bool ordered = true;
+  for (uint32_t index = MAX(first, 1); index < last; ++index) {
+    ordered &= (uint64_t)tasks->table[index - 1] + sizeof(uint64_t) <= tasks->table[index];
+  }
+  tasks->ordered[task_index] = ordered;
+}
+
+static void fixup_task_run(void* arg, uint32_t task_index) {
+  fixup_tasks_t* tasks = (fixup_tasks_t*)arg;
+  uint32_t first, last;
+  fixup_task_range(tasks, task_index, &first, &last);
+  tasks->errors[task_index] = fixup_apply(tasks->buf, tasks->buf_size, tasks->table + first, last - first, tasks->base_address);
+}
+
+static void fixup_thread_run(void* arg) {
+  fixup_thread_t* thread = (fixup_thread_t*)arg;
+  thread->func(thread->tasks, thread->task_index);
+}
+
+static void fixup_tasks_run(fixup_tasks_t* tasks, crystalize_task_func_t func, crystalize_parallel_for_handler_t handler, void* handler_ctx) {
+  if (handler != NULL) {
+    handler(handler_ctx, func, tasks, tasks->task_count);
+    return;
+  }
+
+  // threads are started for this call and joined before it returns
+  fixup_thread_t threads[FIXUP_MAX_TASKS];
+  uint32_t started_count = 1;
+  for (uint32_t task_index = 1; task_index < tasks->task_count; ++task_index) {
+    threads[task_index].func = func;
+    threads[task_index].tasks = tasks;
+    threads[task_index].task_index = task_index;
+    if (!thread_start(&threads[task_index].thread, &fixup_thread_run, threads + task_index)) {
+      break;
+    }
+    ++started_count;
+  }
+  func(tasks, 0);
+  for (uint32_t task_index = 1; task_index < started_count; ++task_index) {
+    thread_join(&threads[task_index].thread);
+  }
+  for (uint32_t task_index = started_count; task_index < tasks->task_count; ++task_index) {
+    // couldn't get a thread, so do it here
+    func(tasks, task_index);
+  }
+}
+
+crystalize_error_t fixup_apply_parallel(char* buf,
+                                        uint32_t buf_size,
+                                        const uint32_t* table,
+                                        uint32_t count,
+                                        uint64_t base_address,
+                                        uint32_t thread_count,
+                                        crystalize_parallel_for_handler_t handler,
+                                        void* handler_ctx) {
+  const uint32_t task_count = MIN(MIN(thread_count, FIXUP_MAX_TASKS), count / FIXUP_MIN_TASK_COUNT);
+  if (task_count <= 1) {
+    return fixup_apply(buf, buf_size, table, count, base_address);
+  }
+
+  fixup_tasks_t tasks;
+  tasks.buf = buf;
+  tasks.buf_size = buf_size;
+  tasks.table = table;
+  tasks.count = count;
+  tasks.base_address = base_address;
+  tasks.task_count = task_count;
+
+  // the encoder writes the table in position order, but one that isn't could have two ranges fixing up the same slot at
+  // once, so that's done on this thread instead
+  fixup_tasks_run(&tasks, &fixup_task_check, handler, handler_ctx);
+  for (uint32_t task_index = 0; task_index < task_count; ++task_index) {
+    if (!tasks.ordered[task_index]) {
+      return fixup_apply(buf, buf_size, table, count, base_address);
+    }
+  }
+
+  fixup_tasks_run(&tasks, &fixup_task_run, handler, handler_ctx);
+  for (uint32_t task_index = 0; task_index < task_count; ++task_index) {
+    if (tasks.errors[task_index] != CRYSTALIZE_ERROR_NONE) {
+      return tasks.errors[task_index];
+    }
+  }
+  return CRYSTALIZE_ERROR_NONE;
+}
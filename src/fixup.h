@@ -0,0 +1,73 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "crystalize.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum fixup_impl_t {
+  FIXUP_IMPL_SCALAR,
+  FIXUP_IMPL_SSE2, // x86-64 only
+  FIXUP_IMPL_AVX2, // x86-64 only, picked when the CPU supports it
+  FIXUP_IMPL_COUNT,
+} fixup_impl_t;
+
+// Picks the fastest implementation the CPU supports. Called from crystalize_init().
+void fixup_init(void);
+
+bool fixup_impl_supported(fixup_impl_t impl);
+const char* fixup_impl_name(fixup_impl_t impl);
+
+// Rewrites the int64_t pointer slot at each position in the table into an address within buf. Slots hold an offset
+// relative to the slot, or when base_address isn't 0, an address for a buffer at base_address. Every slot and every
+// resulting address must be inside the buffer, otherwise the error is CRYSTALIZE_ERROR_POINTER_INVALID and the slots are
+// left partly rewritten.
+crystalize_error_t fixup_apply(char* buf, uint32_t buf_size, const uint32_t* table, uint32_t count, uint64_t base_address);
+crystalize_error_t fixup_apply_with(fixup_impl_t impl, char* buf, uint32_t buf_size, const uint32_t* table, uint32_t count, uint64_t base_address);
+
+// Checks everything fixup_apply() would without writing anything, and that every slot starts in [slot_begin, slot_end).
+crystalize_error_t fixup_check(const char* buf,
+                               uint32_t buf_size,
+                               const uint32_t* table,
+                               uint32_t count,
+                               uint64_t base_address,
+                               uint32_t slot_begin,
+                               uint32_t slot_end);
+
+// Same as fixup_apply() for a table of count varint deltas between ascending slot positions that's table_size bytes
+// long. The error is CRYSTALIZE_ERROR_UNEXPECTED_EOF if the table ends before count deltas.
+crystalize_error_t fixup_apply_compact(char* buf, uint32_t buf_size, const uint8_t* table, uint32_t table_size, uint32_t count, uint64_t base_address);
+crystalize_error_t fixup_check_compact(const char* buf, uint32_t buf_size, const uint8_t* table, uint32_t table_size, uint32_t count, uint64_t base_address);
+
+// Same as fixup_apply() but splits the table into up to thread_count contiguous ranges that are fixed up on threads
+// started for this call, or by the handler when there is one. A table whose slots aren't in ascending position order
+// is fixed up on the calling thread instead. The error is the first one in the earliest range that failed, which is
+// the one fixup_apply() would have returned.
+crystalize_error_t fixup_apply_parallel(char* buf,
+                                        uint32_t buf_size,
+                                        const uint32_t* table,
+                                        uint32_t count,
+                                        uint64_t base_address,
+                                        uint32_t thread_count,
+                                        crystalize_parallel_for_handler_t handler,
+                                        void* handler_ctx);
+
+// Copies from src to dst in a single pass, a block at a time, fixing up each block's slots as an address within dst
+// while it's still in cache, with the same checks as fixup_apply(). src isn't modified. Everything before *copied must
+// already be in dst; on return *copied is past the last slot, and the caller copies the rest. A table that isn't in
+// position order still works, the slots behind the copy are just written one at a time.
+crystalize_error_t fixup_copy(char* dst, const char* src, uint32_t buf_size, uint32_t* copied, const uint32_t* table, uint32_t count, uint64_t base_address);
+crystalize_error_t fixup_copy_compact(char* dst,
+                                      const char* src,
+                                      uint32_t buf_size,
+                                      uint32_t* copied,
+                                      const uint8_t* table,
+                                      uint32_t table_size,
+                                      uint32_t count,
+                                      uint64_t base_address);
+
+#ifdef __cplusplus
+}
+#endif
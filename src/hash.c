@@ -2,6 +2,8 @@
 
 #define FNV1A_PRIME 0x01000193ull
 #define FNV1A_SEED 0x811c9dc5ull
+#define FNV1A64_PRIME 0x00000100000001b3ull
+#define FNV1A64_SEED 0xcbf29ce484222325ull
 
 uint32_t fnv1a(const char* buf, size_t size) {
   return fnv1a_with_seed(buf, size, FNV1A_SEED);
@@ -16,3 +18,23 @@ uint32_t fnv1a_with_seed(const char* buf, size_t size, uint32_t seed) {
   }
   return hash;
 }
+
+uint64_t fnv1a64(const char* buf, size_t size) {
+  return fnv1a64_with_seed(buf, size, FNV1A64_SEED);
+}
+
+uint64_t fnv1a64_with_seed(const char* buf, size_t size, uint64_t seed) {
+  uint64_t hash = seed;
+  const uint8_t* cur = (const uint8_t*)buf;
+  const uint8_t* end = (const uint8_t*)buf + size;
+  for (; cur < end; ++cur) {
+    hash = (*cur ^ hash) * FNV1A64_PRIME;
+  }
+  return hash;
+}
+
+uint32_t hash_pointer(const void* ptr) {
+  // fibonacci hashing; the high bits are well mixed even for aligned addresses
+  const uint64_t value = (uint64_t)(uintptr_t)ptr;
+  return (uint32_t)((value * 0x9e3779b97f4a7c15ull) >> 32);
+}
@@ -4,3 +4,6 @@
 
 uint32_t fnv1a(const char* buf, size_t size);
 uint32_t fnv1a_with_seed(const char* buf, size_t size, uint32_t seed);
+uint64_t fnv1a64(const char* buf, size_t size);
+uint64_t fnv1a64_with_seed(const char* buf, size_t size, uint64_t seed);
+uint32_t hash_pointer(const void* ptr);
@@ -0,0 +1,173 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // mremap, MAP_POPULATE, MAP_FIXED_NOREPLACE
+#endif
+#include "mapped_file.h"
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+char* mapped_file_grow(void* ctx, char* buf, uint32_t old_capacity, uint32_t new_capacity) {
+  (void)ctx;
+  (void)buf;
+  (void)old_capacity;
+  (void)new_capacity;
+  return NULL;
+}
+
+bool mapped_file_finish(int fd, char* buf, uint32_t capacity, uint32_t size) {
+  (void)fd;
+  (void)buf;
+  (void)capacity;
+  (void)size;
+  return false;
+}
+
+char* mapped_file_map(int fd, void* address, bool populate, uint32_t* size) {
+  (void)fd;
+  (void)address;
+  (void)populate;
+  *size = 0;
+  return NULL;
+}
+
+void mapped_file_unmap(char* buf, uint32_t size) {
+  (void)buf;
+  (void)size;
+}
+
+void mapped_file_advise(char* buf, uint32_t offset, uint32_t size, mapped_file_advice_t advice) {
+  (void)buf;
+  (void)offset;
+  (void)size;
+  (void)advice;
+}
+
+uint64_t mapped_file_now_ns(void) {
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+}
+
+void mapped_file_page_faults(uint64_t* minor, uint64_t* major) {
+  *minor = 0;
+  *major = 0;
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+char* mapped_file_grow(void* ctx, char* buf, uint32_t old_capacity, uint32_t new_capacity) {
+  const int fd = *(const int*)ctx;
+  if (ftruncate(fd, (off_t)new_capacity) != 0) {
+    return NULL;
+  }
+
+  void* mapping;
+  if (buf == NULL) {
+    mapping = mmap(NULL, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  else {
+#if defined(__linux__)
+    // the kernel can usually extend the mapping in place, and otherwise moves the pages rather than copying them
+    mapping = mremap(buf, old_capacity, new_capacity, MREMAP_MAYMOVE);
+#else
+    // the contents live in the file, so nothing is lost by mapping it again. the old mapping is only dropped once the
+    // new one exists, so it's still intact if this fails
+    mapping = mmap(NULL, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping != MAP_FAILED) {
+      munmap(buf, old_capacity);
+    }
+#endif
+  }
+  return mapping == MAP_FAILED ? NULL : (char*)mapping;
+}
+
+bool mapped_file_finish(int fd, char* buf, uint32_t capacity, uint32_t size) {
+  bool ok = true;
+  if (buf != NULL) {
+    ok = munmap(buf, capacity) == 0;
+  }
+  return ftruncate(fd, (off_t)size) == 0 && ok;
+}
+
+char* mapped_file_map(int fd, void* address, bool populate, uint32_t* size) {
+  *size = 0;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0 || (uint64_t)info.st_size > UINT32_MAX) {
+    return NULL;
+  }
+
+  int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+  if (populate) {
+    flags |= MAP_POPULATE;
+  }
+#else
+  (void)populate;
+#endif
+  void* mapping = MAP_FAILED;
+  if (address != NULL && ((uintptr_t)address & ((uintptr_t)sysconf(_SC_PAGESIZE) - 1)) == 0) {
+#if defined(MAP_FIXED_NOREPLACE)
+    mapping = mmap(address, (size_t)info.st_size, PROT_READ | PROT_WRITE, flags | MAP_FIXED_NOREPLACE, fd, 0);
+#else
+    mapping = mmap(address, (size_t)info.st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+#endif
+    if (mapping != MAP_FAILED && mapping != address) {
+      // only a hint to kernels without MAP_FIXED_NOREPLACE, and it went elsewhere
+      munmap(mapping, (size_t)info.st_size);
+      mapping = MAP_FAILED;
+    }
+  }
+  if (mapping == MAP_FAILED) {
+    mapping = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  }
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+  *size = (uint32_t)info.st_size;
+  return (char*)mapping;
+}
+
+void mapped_file_unmap(char* buf, uint32_t size) {
+  if (buf != NULL) {
+    munmap(buf, size);
+  }
+}
+
+void mapped_file_advise(char* buf, uint32_t offset, uint32_t size, mapped_file_advice_t advice) {
+  const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = (uintptr_t)(buf + offset) & ~(page_size - 1);
+  const uintptr_t end = (uintptr_t)(buf + offset + size);
+  if (end <= begin) {
+    return;
+  }
+  // only a hint, so failures don't matter
+  (void)madvise((void*)begin, end - begin, advice == MAPPED_FILE_ADVICE_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_WILLNEED);
+}
+
+uint64_t mapped_file_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+void mapped_file_page_faults(uint64_t* minor, uint64_t* major) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    *minor = 0;
+    *major = 0;
+    return;
+  }
+  *minor = (uint64_t)usage.ru_minflt;
+  *major = (uint64_t)usage.ru_majflt;
+}
+
+#endif
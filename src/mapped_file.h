@@ -0,0 +1,28 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Grows a shared mapping of the file open on *(int*)ctx to new_capacity bytes, extending the file to match. buf is
+// the current mapping (NULL for none). Returns the new mapping or NULL on failure. Matches writer_grow_t.
+char* mapped_file_grow(void* ctx, char* buf, uint32_t old_capacity, uint32_t new_capacity);
+
+// Unmaps a mapping made by mapped_file_grow() and truncates the file down to the size that was actually written.
+bool mapped_file_finish(int fd, char* buf, uint32_t capacity, uint32_t size);
+
+typedef enum mapped_file_advice_t {
+  MAPPED_FILE_ADVICE_SEQUENTIAL, // the range is about to be read front to back
+  MAPPED_FILE_ADVICE_WILLNEED,   // the range is about to be used, so start reading it in now
+} mapped_file_advice_t;
+
+// Maps the whole file open on fd copy-on-write, so it can be decoded in place without touching the file. The mapping
+// goes at address if that's free, otherwise anywhere. populate prefaults all of it up front (Linux only). Returns NULL
+// on failure or if the file is empty or over 4 GB.
+char* mapped_file_map(int fd, void* address, bool populate, uint32_t* size);
+void mapped_file_unmap(char* buf, uint32_t size);
+
+// Passes a hint about part of a mapping on to the kernel. The range is widened out to whole pages.
+void mapped_file_advise(char* buf, uint32_t offset, uint32_t size, mapped_file_advice_t advice);
+
+// A monotonic clock and the process' page fault counts, for measuring loads.
+uint64_t mapped_file_now_ns(void);
+void mapped_file_page_faults(uint64_t* minor, uint64_t* major);
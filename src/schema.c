@@ -0,0 +1,206 @@
+#include <stdalign.h>
+#include <string.h>
+#include "config.h"
+#include "schema.h"
+
+#define ALIGN(x, align) (((x) + (align)-1) & (~((align)-1)))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+uint32_t type_get_alignment(crystalize_type_t type) {
+  switch (type) {
+    case CRYSTALIZE_BOOL:
+      return alignof(bool);
+    case CRYSTALIZE_CHAR:
+      return alignof(char);
+    case CRYSTALIZE_INT8:
+      return alignof(int8_t);
+    case CRYSTALIZE_INT16:
+      return alignof(int16_t);
+    case CRYSTALIZE_INT32:
+      return alignof(int32_t);
+    case CRYSTALIZE_INT64:
+      return alignof(int64_t);
+    case CRYSTALIZE_UINT8:
+      return alignof(uint8_t);
+    case CRYSTALIZE_UINT16:
+      return alignof(uint16_t);
+    case CRYSTALIZE_UINT32:
+      return alignof(uint32_t);
+    case CRYSTALIZE_UINT64:
+      return alignof(uint64_t);
+    case CRYSTALIZE_FLOAT:
+      return alignof(float);
+    case CRYSTALIZE_DOUBLE:
+      return alignof(double);
+    default:
+      crystalize_assert(false, "unknown field type");
+      return 0;
+  }
+}
+
+uint32_t type_get_size(crystalize_type_t type) {
+  switch (type) {
+    case CRYSTALIZE_BOOL:
+      return sizeof(bool);
+    case CRYSTALIZE_CHAR:
+      return sizeof(char);
+    case CRYSTALIZE_INT8:
+      return sizeof(int8_t);
+    case CRYSTALIZE_INT16:
+      return sizeof(int16_t);
+    case CRYSTALIZE_INT32:
+      return sizeof(int32_t);
+    case CRYSTALIZE_INT64:
+      return sizeof(int64_t);
+    case CRYSTALIZE_UINT8:
+      return sizeof(uint8_t);
+    case CRYSTALIZE_UINT16:
+      return sizeof(uint16_t);
+    case CRYSTALIZE_UINT32:
+      return sizeof(uint32_t);
+    case CRYSTALIZE_UINT64:
+      return sizeof(uint64_t);
+    case CRYSTALIZE_FLOAT:
+      return sizeof(float);
+    case CRYSTALIZE_DOUBLE:
+      return sizeof(double);
+    default:
+      crystalize_assert(false, "unknown field type");
+      return 0;
+  }
+}
+
+static void schema_layout_add_hole(schema_layout_t* layout, uint32_t* hole_capacity, uint32_t offset, uint32_t size) {
+  if (size == 0) {
+    return;
+  }
+  // merge with the previous hole when they touch (e.g. trailing padding of a nested struct followed by alignment)
+  if (layout->hole_count > 0) {
+    schema_hole_t* last = layout->holes + layout->hole_count - 1;
+    if (last->offset + last->size == offset) {
+      last->size += size;
+      return;
+    }
+  }
+  if (layout->hole_count >= *hole_capacity) {
+    const uint32_t old_capacity = *hole_capacity;
+    *hole_capacity = old_capacity > 0 ? old_capacity * 2 : 8;
+    layout->holes = (schema_hole_t*)crystalize_realloc(layout->holes, old_capacity * sizeof(schema_hole_t), *hole_capacity * sizeof(schema_hole_t));
+  }
+  layout->holes[layout->hole_count].offset = offset;
+  layout->holes[layout->hole_count].size = size;
+  ++layout->hole_count;
+}
+
+// Collects the padding of a plain struct, including the padding inside nested structs, in offset order.
+static void schema_layout_init_holes(schema_layout_t* layout, const crystalize_schema_t* schema) {
+  uint32_t hole_capacity = 0;
+  uint32_t end = 0;
+  for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
+    const crystalize_schema_field_t* field = schema->fields + field_index;
+    const schema_field_layout_t* field_layout = layout->fields + field_index;
+    schema_layout_add_hole(layout, &hole_capacity, end, field_layout->offset - end);
+    if (field->type == CRYSTALIZE_STRUCT) {
+      const schema_layout_t* struct_layout = schema_get_layout(field_layout->struct_schema);
+      for (uint32_t index = 0; index < field->count; ++index) {
+        const uint32_t element_offset = field_layout->offset + index * struct_layout->size;
+        for (uint32_t hole_index = 0; hole_index < struct_layout->hole_count; ++hole_index) {
+          const schema_hole_t* hole = struct_layout->holes + hole_index;
+          schema_layout_add_hole(layout, &hole_capacity, element_offset + hole->offset, hole->size);
+        }
+      }
+    }
+    end = field_layout->offset + field_layout->size;
+  }
+  schema_layout_add_hole(layout, &hole_capacity, end, layout->size - end);
+}
+
+crystalize_error_t schema_layout_init(schema_entry_t* entry, schema_resolve_t resolve, void* ctx) {
+  const crystalize_schema_t* schema = &entry->schema;
+  schema_layout_t* layout = &entry->layout;
+  layout->fields = (schema_field_layout_t*)crystalize_alloc(schema->field_count * sizeof(schema_field_layout_t));
+  crystalize_assert(layout->fields != NULL, "allocation failed");
+  layout->holes = NULL;
+  layout->hole_count = 0;
+  layout->is_plain = true;
+
+  // lay out the fields the same way the compiler lays out the equivalent C struct
+  uint32_t offset = 0;
+  uint32_t struct_alignment = 1;
+  for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
+    const crystalize_schema_field_t* field = schema->fields + field_index;
+    schema_field_layout_t* field_layout = layout->fields + field_index;
+    memset(field_layout, 0, sizeof(schema_field_layout_t));
+
+    if (field->type == CRYSTALIZE_STRUCT && schema_field_is_pointer(field) && field->struct_name_id == schema->name_id &&
+        field->struct_version == schema->version) {
+      // a pointer back to the struct itself
+      field_layout->struct_schema = schema;
+    }
+    else if (field->type == CRYSTALIZE_STRUCT) {
+      field_layout->struct_schema = resolve(ctx, field->struct_name_id, field->struct_version);
+      if (field_layout->struct_schema == NULL) {
+        schema_layout_free(layout);
+        return CRYSTALIZE_ERROR_SCHEMA_NOT_FOUND;
+      }
+    }
+
+    if (schema_field_is_pointer(field)) {
+      field_layout->alignment = alignof(void*);
+      field_layout->size = sizeof(void*);
+      layout->is_plain = false;
+    }
+    else if (field->type == CRYSTALIZE_STRUCT) {
+      const schema_layout_t* struct_layout = schema_get_layout(field_layout->struct_schema);
+      field_layout->alignment = struct_layout->alignment;
+      field_layout->size = struct_layout->size * field->count;
+      layout->is_plain = layout->is_plain && struct_layout->is_plain;
+    }
+    else {
+      field_layout->alignment = type_get_alignment((crystalize_type_t)field->type);
+      field_layout->size = type_get_size((crystalize_type_t)field->type) * field->count;
+    }
+
+    offset = ALIGN(offset, field_layout->alignment);
+    field_layout->offset = offset;
+    offset += field_layout->size;
+    struct_alignment = MAX(struct_alignment, field_layout->alignment);
+  }
+  layout->alignment = struct_alignment;
+  layout->size = ALIGN(offset, struct_alignment);
+
+  // resolve the count fields of counted pointers
+  for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
+    const crystalize_schema_field_t* field = schema->fields + field_index;
+    if (!schema_field_is_pointer_counted(field)) {
+      continue;
+    }
+    uint32_t count_index = 0;
+    while (count_index < schema->field_count && schema->fields[count_index].name_id != field->count_field_name_id) {
+      ++count_index;
+    }
+    if (count_index == schema->field_count) {
+      schema_layout_free(layout);
+      return CRYSTALIZE_ERROR_SCHEMA_COUNT_FIELD_NOT_FOUND;
+    }
+    layout->fields[field_index].count_offset = layout->fields[count_index].offset;
+    layout->fields[field_index].count_type = schema->fields[count_index].type;
+  }
+
+  if (layout->is_plain) {
+    schema_layout_init_holes(layout, schema);
+  }
+
+  return CRYSTALIZE_ERROR_NONE;
+}
+
+void schema_layout_free(schema_layout_t* layout) {
+  crystalize_free(layout->fields);
+  crystalize_free(layout->holes);
+  layout->fields = NULL;
+  layout->holes = NULL;
+  layout->hole_count = 0;
+  layout->is_plain = false;
+  layout->size = 0;
+  layout->alignment = 0;
+}
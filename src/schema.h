@@ -0,0 +1,56 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "crystalize.h"
+
+typedef struct schema_field_layout_t {
+  const crystalize_schema_t* struct_schema; // the resolved schema of the field (if type is struct)
+  uint32_t offset;                          // byte offset of the field from the start of the struct
+  uint32_t size;                            // byte size of the field (all elements if a fixed-size array)
+  uint32_t alignment;                       // the field's required alignment
+  uint32_t count_offset;                    // byte offset of the field providing the count (if counted pointer)
+  uint8_t count_type;                       // the type of the field providing the count (if counted pointer)
+} schema_field_layout_t;
+
+typedef struct schema_hole_t {
+  uint32_t offset; // byte offset of the padding from the start of the struct
+  uint32_t size;   // byte size of the padding
+} schema_hole_t;
+
+typedef struct schema_layout_t {
+  schema_field_layout_t* fields; // one entry per field of the schema
+  schema_hole_t* holes;          // the padding bytes within the struct (only if plain)
+  uint32_t hole_count;
+  uint32_t size;      // byte size of the struct (including trailing padding)
+  uint32_t alignment; // the struct's required alignment
+  bool is_plain;      // true if the struct (transitively) contains no pointers, so its memory is its encoding
+} schema_layout_t;
+
+// A schema along with its compiled layout. The schema must be the first member so the layout can be found from a
+// pointer to the schema.
+typedef struct schema_entry_t {
+  crystalize_schema_t schema;
+  schema_layout_t layout;
+} schema_entry_t;
+
+// Resolves a schema referenced by a struct field. The returned schema must be part of a schema_entry_t.
+typedef const crystalize_schema_t* (*schema_resolve_t)(void* ctx, uint32_t name_id, uint32_t version);
+
+uint32_t type_get_alignment(crystalize_type_t type);
+uint32_t type_get_size(crystalize_type_t type);
+
+// Computes the layout for the entry's schema. All referenced schemas must already have their layout computed.
+crystalize_error_t schema_layout_init(schema_entry_t* entry, schema_resolve_t resolve, void* ctx);
+void schema_layout_free(schema_layout_t* layout);
+
+static inline const schema_layout_t* schema_get_layout(const crystalize_schema_t* schema) {
+  return &((const schema_entry_t*)schema)->layout;
+}
+
+static inline bool schema_field_is_pointer(const crystalize_schema_field_t* field) {
+  return field->count == 0;
+}
+
+static inline bool schema_field_is_pointer_counted(const crystalize_schema_field_t* field) {
+  return field->count == 0 && field->count_field_name_id != 0;
+}
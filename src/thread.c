@@ -0,0 +1,74 @@
+#include "thread.h"
+
+#if defined(_WIN32)
+
+static DWORD WINAPI thread_main(LPVOID param) {
+  thread_t* thread = (thread_t*)param;
+  thread->func(thread->arg);
+  return 0;
+}
+
+bool thread_start(thread_t* thread, thread_func_t func, void* arg) {
+  thread->func = func;
+  thread->arg = arg;
+  thread->handle = CreateThread(NULL, 0, &thread_main, thread, 0, NULL);
+  return thread->handle != NULL;
+}
+
+void thread_join(thread_t* thread) {
+  WaitForSingleObject(thread->handle, INFINITE);
+  CloseHandle(thread->handle);
+}
+
+void mutex_init(mutex_t* mutex) {
+  InitializeSRWLock(&mutex->lock);
+}
+
+void mutex_destroy(mutex_t* mutex) {
+  // SRW locks don't hold any resources
+  (void)mutex;
+}
+
+void mutex_lock(mutex_t* mutex) {
+  AcquireSRWLockExclusive(&mutex->lock);
+}
+
+void mutex_unlock(mutex_t* mutex) {
+  ReleaseSRWLockExclusive(&mutex->lock);
+}
+
+#else
+
+static void* thread_main(void* param) {
+  thread_t* thread = (thread_t*)param;
+  thread->func(thread->arg);
+  return NULL;
+}
+
+bool thread_start(thread_t* thread, thread_func_t func, void* arg) {
+  thread->func = func;
+  thread->arg = arg;
+  return pthread_create(&thread->handle, NULL, &thread_main, thread) == 0;
+}
+
+void thread_join(thread_t* thread) {
+  pthread_join(thread->handle, NULL);
+}
+
+void mutex_init(mutex_t* mutex) {
+  pthread_mutex_init(&mutex->lock, NULL);
+}
+
+void mutex_destroy(mutex_t* mutex) {
+  pthread_mutex_destroy(&mutex->lock);
+}
+
+void mutex_lock(mutex_t* mutex) {
+  pthread_mutex_lock(&mutex->lock);
+}
+
+void mutex_unlock(mutex_t* mutex) {
+  pthread_mutex_unlock(&mutex->lock);
+}
+
+#endif
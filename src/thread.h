@@ -0,0 +1,36 @@
+#pragma once
+#include <stdbool.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef void (*thread_func_t)(void* arg);
+
+typedef struct thread_t {
+#if defined(_WIN32)
+  HANDLE handle;
+#else
+  pthread_t handle;
+#endif
+  thread_func_t func;
+  void* arg;
+} thread_t;
+
+typedef struct mutex_t {
+#if defined(_WIN32)
+  SRWLOCK lock;
+#else
+  pthread_mutex_t lock;
+#endif
+} mutex_t;
+
+// Starts running func(arg) on a new thread. The thread_t must stay put until thread_join().
+bool thread_start(thread_t* thread, thread_func_t func, void* arg);
+void thread_join(thread_t* thread);
+
+void mutex_init(mutex_t* mutex);
+void mutex_destroy(mutex_t* mutex);
+void mutex_lock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
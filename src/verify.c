@@ -0,0 +1,322 @@
+#include <string.h>
+#include "config.h"
+#include "crystalize.h"
+#include "encoder.h"
+#include "schema.h"
+#include "verify.h"
+
+#define SLOT_SIZE sizeof(int64_t)
+
+// A struct array with pointers in it, waiting to be walked.
+typedef struct verify_object_t {
+  const crystalize_schema_t* schema; // NULL for an empty visited slot
+  uint32_t offset;
+  uint32_t count;
+  uint32_t depth;
+} verify_object_t;
+
+typedef struct verifier_t {
+  const verify_file_t* file;
+  const crystalize_verify_options_t* options;
+  crystalize_error_t error;
+  uint64_t visit_bytes_left;
+
+  // a bit per pointer slot before the pointer table, set for each non-NULL pointer the walk finds
+  uint64_t* slots;
+  uint32_t slot_word_count;
+
+  // every struct array with pointers that's been queued. open addressed and never shrinks
+  verify_object_t* visited;
+  uint32_t visited_count;
+  uint32_t visited_capacity;
+
+  // the walk, breadth first so an object's depth is the fewest pointers it takes to reach it
+  verify_object_t* queue;
+  uint32_t queue_head;
+  uint32_t queue_count;
+  uint32_t queue_capacity;
+} verifier_t;
+
+static void verify_fail(verifier_t* verifier, crystalize_error_t error) {
+  if (verifier->error == CRYSTALIZE_ERROR_NONE) {
+    verifier->error = error;
+  }
+}
+
+static uint32_t verify_count_value(crystalize_type_t type, const char* data) {
+  switch (type) {
+    case CRYSTALIZE_INT8:
+      return (uint32_t)(*(const int8_t*)data);
+    case CRYSTALIZE_INT16:
+      return (uint32_t)(*(const int16_t*)data);
+    case CRYSTALIZE_INT32:
+      return (uint32_t)(*(const int32_t*)data);
+    case CRYSTALIZE_UINT8:
+      return (uint32_t)(*(const uint8_t*)data);
+    case CRYSTALIZE_UINT16:
+      return (uint32_t)(*(const uint16_t*)data);
+    case CRYSTALIZE_UINT32:
+      return *(const uint32_t*)data;
+    default:
+      return UINT32_MAX;
+  }
+}
+
+static uint32_t verify_object_hash(const verify_object_t* object) {
+  uint64_t hash = (uint64_t)(uintptr_t)object->schema;
+  hash = (hash ^ object->offset) * 0x9e3779b97f4a7c15ull;
+  hash = (hash ^ object->count) * 0x9e3779b97f4a7c15ull;
+  return (uint32_t)(hash >> 32);
+}
+
+// Adds the object to the visited set. Returns false if it was already there.
+static bool verify_visit(verifier_t* verifier, const verify_object_t* object) {
+  // keep the load factor at or below 1/2 so probe sequences stay short
+  if ((verifier->visited_count + 1) * 2 > verifier->visited_capacity) {
+    const uint32_t old_capacity = verifier->visited_capacity;
+    verify_object_t* old_entries = verifier->visited;
+    verifier->visited_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    verifier->visited = (verify_object_t*)crystalize_alloc(verifier->visited_capacity * sizeof(verify_object_t));
+    crystalize_assert(verifier->visited != NULL, "allocation failed");
+    memset(verifier->visited, 0, verifier->visited_capacity * sizeof(verify_object_t));
+    verifier->visited_count = 0;
+    for (uint32_t index = 0; index < old_capacity; ++index) {
+      if (old_entries[index].schema != NULL) {
+        verify_visit(verifier, old_entries + index);
+      }
+    }
+    crystalize_free(old_entries);
+  }
+
+  const uint32_t mask = verifier->visited_capacity - 1;
+  uint32_t slot = verify_object_hash(object) & mask;
+  while (verifier->visited[slot].schema != NULL) {
+    const verify_object_t* entry = verifier->visited + slot;
+    if (entry->schema == object->schema && entry->offset == object->offset && entry->count == object->count) {
+      return false;
+    }
+    slot = (slot + 1) & mask;
+  }
+  verifier->visited[slot] = *object;
+  ++verifier->visited_count;
+  return true;
+}
+
+static void verify_queue_push(verifier_t* verifier, const verify_object_t* object) {
+  if (verifier->queue_count == verifier->queue_capacity) {
+    const uint32_t new_capacity = verifier->queue_capacity == 0 ? 64 : verifier->queue_capacity * 2;
+    verifier->queue = (verify_object_t*)crystalize_realloc(
+        verifier->queue, verifier->queue_capacity * sizeof(verify_object_t), new_capacity * sizeof(verify_object_t));
+    crystalize_assert(verifier->queue != NULL, "allocation failed");
+    verifier->queue_capacity = new_capacity;
+  }
+  verifier->queue[verifier->queue_count++] = *object;
+}
+
+// Checks that count elements of the type fit at offset, then queues them if they're structs with pointers.
+static void verify_target(verifier_t* verifier, crystalize_type_t type, const crystalize_schema_t* schema, int64_t offset, uint32_t count, uint32_t depth) {
+  const verify_file_t* file = verifier->file;
+  if (count > verifier->options->max_count || depth > verifier->options->max_depth) {
+    verify_fail(verifier, CRYSTALIZE_ERROR_VERIFY_LIMIT_EXCEEDED);
+    return;
+  }
+  const schema_layout_t* layout = type == CRYSTALIZE_STRUCT ? schema_get_layout(schema) : NULL;
+  const uint32_t element_size = layout != NULL ? layout->size : type_get_size(type);
+  const uint32_t alignment = layout != NULL ? layout->alignment : type_get_alignment(type);
+  const uint64_t size = (uint64_t)count * element_size;
+  if (offset < file->data_begin || offset > file->data_end || size > file->data_end - (uint64_t)offset || offset % alignment != 0) {
+    verify_fail(verifier, CRYSTALIZE_ERROR_POINTER_INVALID);
+    return;
+  }
+  if (layout == NULL || layout->is_plain || count == 0) {
+    // nothing inside to follow
+    return;
+  }
+
+  verify_object_t object;
+  object.schema = schema;
+  object.offset = (uint32_t)offset;
+  object.count = count;
+  object.depth = depth;
+  if (!verify_visit(verifier, &object)) {
+    return;
+  }
+  if (size > verifier->visit_bytes_left) {
+    verify_fail(verifier, CRYSTALIZE_ERROR_VERIFY_LIMIT_EXCEEDED);
+    return;
+  }
+  verifier->visit_bytes_left -= size;
+  verify_queue_push(verifier, &object);
+}
+
+// Checks every pointer in one struct, including the ones in its embedded structs.
+static void verify_struct(verifier_t* verifier, const crystalize_schema_t* schema, uint32_t pos, uint32_t depth) {
+  const char* buf = verifier->file->buf;
+  const uint32_t data_end = verifier->file->data_end;
+  const schema_layout_t* layout = schema_get_layout(schema);
+  for (uint32_t field_index = 0; field_index < schema->field_count; ++field_index) {
+    const crystalize_schema_field_t* field = schema->fields + field_index;
+    const schema_field_layout_t* field_layout = layout->fields + field_index;
+    const uint32_t field_pos = pos + field_layout->offset;
+
+    if (schema_field_is_pointer(field)) {
+      int64_t value;
+      memcpy(&value, buf + field_pos, sizeof(int64_t));
+      if (value == 0) {
+        continue;
+      }
+      verifier->slots[field_pos / SLOT_SIZE / 64] |= 1ull << (field_pos / SLOT_SIZE % 64);
+
+      uint32_t count = 1;
+      if (schema_field_is_pointer_counted(field)) {
+        count = verify_count_value((crystalize_type_t)field_layout->count_type, buf + pos + field_layout->count_offset);
+      }
+      if (value < -(int64_t)data_end || value > (int64_t)data_end) {
+        verify_fail(verifier, CRYSTALIZE_ERROR_POINTER_INVALID);
+        return;
+      }
+      verify_target(verifier, (crystalize_type_t)field->type, field_layout->struct_schema, (int64_t)field_pos + value, count, depth + 1);
+    }
+    else if (field->type == CRYSTALIZE_STRUCT && !schema_get_layout(field_layout->struct_schema)->is_plain) {
+      const uint32_t struct_size = schema_get_layout(field_layout->struct_schema)->size;
+      for (uint32_t index = 0; index < field->count; ++index) {
+        verify_struct(verifier, field_layout->struct_schema, field_pos + index * struct_size, depth);
+      }
+    }
+  }
+}
+
+// Clears the slot's bit. The slot must have been found by the walk and not listed before.
+static bool verify_table_entry(verifier_t* verifier, uint32_t pos) {
+  if (pos >= verifier->file->data_end || pos % SLOT_SIZE != 0) {
+    return false;
+  }
+  uint64_t* word = verifier->slots + pos / SLOT_SIZE / 64;
+  const uint64_t bit = 1ull << (pos / SLOT_SIZE % 64);
+  if ((*word & bit) == 0) {
+    return false;
+  }
+  *word &= ~bit;
+  return true;
+}
+
+static bool verify_table_plain(verifier_t* verifier, const uint32_t* table, uint32_t table_size) {
+  const uint32_t count = verifier->file->pointer_count;
+  if (count > table_size / sizeof(uint32_t)) {
+    return false;
+  }
+  for (uint32_t index = 0; index < count; ++index) {
+    if (!verify_table_entry(verifier, table[index])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool verify_table_compact(verifier_t* verifier, const uint8_t* table, uint32_t table_size) {
+  const uint8_t* cur = table;
+  const uint8_t* end = table + table_size;
+  uint64_t pos = 0;
+  for (uint32_t index = 0; index < verifier->file->pointer_count; ++index) {
+    uint32_t delta = 0;
+    for (uint32_t shift = 0;; shift += 7) {
+      if (cur >= end || shift > 28) {
+        return false;
+      }
+      const uint8_t byte = *cur++;
+      delta |= (uint32_t)(byte & 0x7f) << shift;
+      if (byte < 0x80) {
+        break;
+      }
+    }
+    pos += delta;
+    if (pos > UINT32_MAX || !verify_table_entry(verifier, (uint32_t)pos)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The bitmap of fixed pages has to be clear, otherwise a lazy decode would take offsets for addresses.
+static bool verify_table_paged(verifier_t* verifier, const uint32_t* table, uint32_t table_size) {
+  const uint32_t count = verifier->file->pointer_count;
+  const uint32_t page_count = (uint32_t)(((uint64_t)verifier->file->data_end + CRYSTALIZE_LAZY_PAGE_SIZE - 1) / CRYSTALIZE_LAZY_PAGE_SIZE);
+  const uint32_t word_count = (page_count + 31) / 32;
+  if (sizeof(uint32_t) * (1 + (uint64_t)word_count + page_count + count) > table_size || table[0] != page_count) {
+    return false;
+  }
+  const uint32_t* fixed_pages = table + 1;
+  const uint32_t* page_ends = fixed_pages + word_count;
+  const uint32_t* positions = page_ends + page_count;
+  for (uint32_t word_index = 0; word_index < word_count; ++word_index) {
+    if (fixed_pages[word_index] != 0) {
+      return false;
+    }
+  }
+  uint32_t begin = 0;
+  for (uint32_t page = 0; page < page_count; ++page) {
+    const uint32_t end = page_ends[page];
+    if (end < begin || end > count) {
+      return false;
+    }
+    for (uint32_t index = begin; index < end; ++index) {
+      if (positions[index] / CRYSTALIZE_LAZY_PAGE_SIZE != page || !verify_table_entry(verifier, positions[index])) {
+        return false;
+      }
+    }
+    begin = end;
+  }
+  return begin == count;
+}
+
+crystalize_error_t verify_file(const verify_file_t* file, const crystalize_verify_options_t* options) {
+  verifier_t verifier;
+  memset(&verifier, 0, sizeof(verifier_t));
+  verifier.file = file;
+  verifier.options = options;
+  verifier.error = CRYSTALIZE_ERROR_NONE;
+  verifier.visit_bytes_left = options->max_visit_bytes != 0 ? options->max_visit_bytes : (uint64_t)file->buf_size * 4;
+  verifier.slot_word_count = (file->data_end / SLOT_SIZE + 63) / 64;
+  verifier.slots = (uint64_t*)crystalize_alloc((verifier.slot_word_count + 1) * sizeof(uint64_t));
+  crystalize_assert(verifier.slots != NULL, "allocation failed");
+  memset(verifier.slots, 0, (verifier.slot_word_count + 1) * sizeof(uint64_t));
+
+  for (uint32_t root_index = 0; root_index < file->root_count; ++root_index) {
+    const verify_root_t* root = file->roots + root_index;
+    verify_target(&verifier, CRYSTALIZE_STRUCT, root->schema, root->offset, root->count, 0);
+  }
+  while (verifier.queue_head < verifier.queue_count && verifier.error == CRYSTALIZE_ERROR_NONE) {
+    const verify_object_t object = verifier.queue[verifier.queue_head++];
+    const uint32_t struct_size = schema_get_layout(object.schema)->size;
+    for (uint32_t index = 0; index < object.count && verifier.error == CRYSTALIZE_ERROR_NONE; ++index) {
+      verify_struct(&verifier, object.schema, object.offset + index * struct_size, object.depth);
+    }
+  }
+
+  // every slot found has to be in the pointer table exactly once, and nothing else
+  if (verifier.error == CRYSTALIZE_ERROR_NONE) {
+    const char* table = file->buf + file->data_end;
+    const uint32_t table_size = file->buf_size - file->data_end;
+    bool table_ok;
+    if (file->flags & CRYSTALIZE_FILE_FLAG_PAGED_POINTERS) {
+      table_ok = verify_table_paged(&verifier, (const uint32_t*)table, table_size);
+    }
+    else if (file->flags & CRYSTALIZE_FILE_FLAG_COMPACT_POINTERS) {
+      table_ok = verify_table_compact(&verifier, (const uint8_t*)table, table_size);
+    }
+    else {
+      table_ok = verify_table_plain(&verifier, (const uint32_t*)table, table_size);
+    }
+    for (uint32_t word_index = 0; table_ok && word_index < verifier.slot_word_count; ++word_index) {
+      table_ok = verifier.slots[word_index] == 0;
+    }
+    if (!table_ok) {
+      verify_fail(&verifier, CRYSTALIZE_ERROR_POINTER_INVALID);
+    }
+  }
+
+  crystalize_free(verifier.queue);
+  crystalize_free(verifier.visited);
+  crystalize_free(verifier.slots);
+  return verifier.error;
+}
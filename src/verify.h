@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "crystalize.h"
+
+// A struct that the walk starts from, checked against a registered schema.
+typedef struct verify_root_t {
+  const crystalize_schema_t* schema;
+  uint32_t offset;
+  uint32_t count;
+} verify_root_t;
+
+// The parts of an encoded buffer that the walk needs. Objects must be in [data_begin, data_end), which is everything
+// from the schema table up to the pointer table. The pointer table runs to the end of the buffer.
+typedef struct verify_file_t {
+  const char* buf;
+  uint32_t buf_size;
+  uint32_t data_begin;
+  uint32_t data_end;
+  uint32_t flags; // CRYSTALIZE_FILE_FLAG_*, for the pointer table's format
+  uint32_t pointer_count;
+  const verify_root_t* roots;
+  uint32_t root_count;
+} verify_file_t;
+
+// Walks everything reachable from the roots, breadth first, checking that every pointer's target range lies inside the
+// data and is aligned for its type, and that the options' limits hold. The pointer slots found along the way must be
+// exactly the ones the pointer table lists. The buffer must hold offsets (not be decoded) and is never written to.
+crystalize_error_t verify_file(const verify_file_t* file, const crystalize_verify_options_t* options);
@@ -2,20 +2,79 @@
 #include "writer.h"
 #include "config.h"
 
+static void writer_resize(writer_t* writer, uint32_t capacity) {
+  if (writer->grow == NULL) {
+    writer->buf = (char*)crystalize_realloc(writer->buf, writer->capacity, capacity);
+    writer->capacity = capacity;
+    return;
+  }
+
+  char* buf = writer->grow(writer->grow_ctx, writer->buf, writer->capacity, capacity);
+  if (buf == NULL) {
+    // the old buffer is still intact, so the caller can release it
+    writer->failed = true;
+    writer->measure = true;
+    return;
+  }
+  writer->buf = buf;
+  writer->capacity = capacity;
+}
+
 void writer_ensure(writer_t* writer, uint32_t count) {
-  uint32_t new_cur = writer->cur + count;
-  if (new_cur > writer->capacity) {
-    // uint32_t old_capacity = writer->capacity;
-    writer->capacity = (new_cur + 1023) & ~1023;
-    writer->buf = (char*)crystalize_realloc(writer->buf, writer->capacity);
-    // memset(writer->buf + old_capacity, 0xcc, (writer->capacity - old_capacity));
+  uint32_t new_size = writer->cur - writer->base + count;
+  if (writer->measure) {
+    return;
+  }
+  if (new_size > writer->capacity && writer->fixed) {
+    writer->measure = true;
+    return;
+  }
+  if (new_size > writer->capacity) {
+    // grow geometrically so the total amount of copying stays linear in the output size
+    const uint32_t old_capacity = writer->capacity;
+    uint32_t new_capacity = old_capacity > 1024 ? old_capacity : 1024;
+    while (new_capacity < new_size) {
+      new_capacity = new_capacity > UINT32_MAX / 2 ? UINT32_MAX : new_capacity * 2;
+    }
+    writer_resize(writer, new_capacity);
+  }
+}
+
+void writer_flush(writer_t* writer, uint32_t min_size) {
+  const uint32_t size = writer->cur - writer->base;
+  if (writer->measure || writer->sink == NULL || size == 0 || size < min_size) {
+    return;
+  }
+  if (!writer->sink(writer->sink_ctx, writer->buf, size)) {
+    // nothing more can go out, so just keep counting
+    writer->failed = true;
+    writer->measure = true;
+  }
+  writer->base = writer->cur;
+}
+
+void writer_reserve(writer_t* writer, uint32_t capacity) {
+  if (writer->measure || capacity <= writer->capacity) {
+    return;
+  }
+  writer_resize(writer, capacity);
+}
+
+char* writer_at(writer_t* writer, uint32_t pos) {
+  return writer->measure ? NULL : writer->buf + (pos - writer->base);
+}
+
+void writer_patch(writer_t* writer, uint32_t pos, const void* data, uint32_t size) {
+  if (!writer->measure) {
+    crystalize_assert(pos >= writer->base, "cannot patch output that's already been flushed");
+    memmove(writer->buf + (pos - writer->base), data, size);
   }
 }
 
 void writer_pad(writer_t* writer, uint32_t count) {
   writer_ensure(writer, count);
-  for (uint32_t index = 0; index < count; ++index) {
-    writer->buf[writer->cur + index] = 0;
+  if (!writer->measure) {
+    memset(writer->buf + (writer->cur - writer->base), 0, count);
   }
   writer->cur += count;
 }
@@ -29,7 +88,9 @@ void writer_align(writer_t* writer, uint32_t alignment) {
 
 void writer_write(writer_t* writer, const void* data, uint32_t size) {
   writer_ensure(writer, size);
-  memmove(writer->buf + writer->cur, data, size);
+  if (!writer->measure) {
+    memmove(writer->buf + (writer->cur - writer->base), data, size);
+  }
   writer->cur += size;
 }
 
@@ -42,3 +103,14 @@ void writer_write_u32(writer_t* writer, uint32_t value) {
   writer_align(writer, 4);
   writer_write(writer, &value, 4);
 }
+
+void writer_write_varint(writer_t* writer, uint32_t value) {
+  uint8_t bytes[5];
+  uint32_t count = 0;
+  while (value >= 0x80) {
+    bytes[count++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  bytes[count++] = (uint8_t)value;
+  writer_write(writer, bytes, count);
+}
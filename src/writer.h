@@ -1,15 +1,37 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 
+// Receives finished output when streaming. Returns false if the data couldn't be written.
+typedef bool (*writer_sink_t)(void* ctx, const void* data, uint32_t size);
+
+// Moves the buffer to new_capacity bytes keeping its contents. Returns NULL if that isn't possible.
+typedef char* (*writer_grow_t)(void* ctx, char* buf, uint32_t old_capacity, uint32_t new_capacity);
+
 typedef struct writer_t {
   char* buf;
+  uint32_t base; // position in the output of buf[0]. only moves when flushing to a sink
   uint32_t cur;
   uint32_t capacity;
+  bool measure; // only track the size of what would be written (buf stays NULL)
+  bool fixed;   // buf is owned by the caller and can't grow. overflowing it switches to measuring
+  bool failed;  // the output couldn't be grown or flushed. the writer switches to measuring
+  writer_sink_t sink; // when set, writer_flush() hands everything before cur to the sink
+  void* sink_ctx;
+  writer_grow_t grow; // when set, replaces crystalize_realloc() for growing buf
+  void* grow_ctx;
 } writer_t;
 
 void writer_ensure(writer_t* writer, uint32_t count);
+void writer_flush(writer_t* writer, uint32_t min_size);
+void writer_reserve(writer_t* writer, uint32_t capacity);
+char* writer_at(writer_t* writer, uint32_t pos);
+void writer_patch(writer_t* writer, uint32_t pos, const void* data, uint32_t size);
 void writer_pad(writer_t* writer, uint32_t count);
 void writer_align(writer_t* writer, uint32_t alignment);
 void writer_write(writer_t* writer, const void* data, uint32_t size);
 void writer_write_u8(writer_t* writer, uint8_t value);
 void writer_write_u32(writer_t* writer, uint32_t value);
+
+// LEB128: 7 bits a byte, low bits first, with the top bit set on every byte but the last.
+void writer_write_varint(writer_t* writer, uint32_t value);